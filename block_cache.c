@@ -0,0 +1,470 @@
+/**
+ *  block_cache.c
+ *
+ *  Write-through cache of disk blocks with lock-free lookups, private to a
+ *  process or shared between all of the processes that use an image.
+ *
+ *  Each slot is a sequence lock: a reader copies the block without taking
+ *  any lock and checks afterwards that no change overlapped the copy.
+ *  Misses, fills and writes go through the slot's mutex.  All accesses to
+ *  the shared words are atomic, so a reader that races with a writer sees a
+ *  torn copy at worst, which it then throws away.  (On x86 these atomics
+ *  are plain loads and stores.)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "block_cache.h"
+
+/**
+ * Set up the locks and slots of a cache (all empty)
+ *
+ * @param cache Cache to set up
+ * @param shared 1 if the cache is in memory shared between processes
+ */
+static void block_cache_init(BLOCK_CACHE *cache, int shared)
+{
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  if(shared) {
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+  }
+
+  cache->shared = shared;
+  pthread_mutex_init(&cache->lock, &attr);
+  // Generation 0 is never current: it marks empty slots
+  cache->generation = 1;
+  cache->image_writes = 0;
+  for(int i = 0; i < N_BLOCKS; ++i) {
+    pthread_mutex_init(&cache->slot[i].lock, &attr);
+    cache->slot[i].seq = 0;
+    cache->slot[i].generation = 0;
+  }
+  pthread_mutexattr_destroy(&attr);
+}
+
+/**
+ * Allocate an empty cache, private to this process
+ *
+ * @return The cache; NULL if there is not enough memory
+ */
+BLOCK_CACHE *block_cache_create(void)
+{
+  BLOCK_CACHE *cache = malloc(sizeof(BLOCK_CACHE));
+  if(cache == NULL)
+    return(NULL);
+
+  cache->magic = 0;
+  block_cache_init(cache, 0);
+  return(cache);
+}
+
+/**
+ * Free a private cache (no thread may be using it)
+ *
+ * @param cache Cache returned by block_cache_create(); may be NULL
+ */
+void block_cache_destroy(BLOCK_CACHE *cache)
+{
+  if(cache == NULL)
+    return;
+  pthread_mutex_destroy(&cache->lock);
+  for(int i = 0; i < N_BLOCKS; ++i)
+    pthread_mutex_destroy(&cache->slot[i].lock);
+  free(cache);
+}
+
+/**
+ * Lock a mutex of the cache
+ *
+ * @param lock Mutex to lock
+ * @return 1 if the previous holder died while holding it (the caller must
+ *           repair what the mutex guards); 0 otherwise
+ */
+static int block_cache_mutex_lock(pthread_mutex_t *lock)
+{
+  if(pthread_mutex_lock(lock) == EOWNERDEAD) {
+    pthread_mutex_consistent(lock);
+    return(1);
+  }
+  return(0);
+}
+
+/**
+ * Name of the shared memory object for an image: a hash of the absolute
+ *  path of the image file
+ *
+ * @param image_name Name of the image file
+ * @param name Buffer of n bytes for the name
+ * @param n Size of the buffer
+ * @return 0 if success
+ *         -1 if the image file cannot be found
+ */
+static int block_cache_shared_name(char *image_name, char *name, int n)
+{
+  char path[PATH_MAX];
+  if(realpath(image_name, path) == NULL)
+    return(-1);
+
+  // 64-bit FNV-1a
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for(char *c = path; *c != 0; ++c) {
+    hash ^= (unsigned char) *c;
+    hash *= 0x100000001b3ULL;
+  }
+  snprintf(name, n, "/oufs-cache-%016llx", (unsigned long long) hash);
+  return(0);
+}
+
+/**
+ * Wait (for up to a second) until the process that created a shared cache
+ *  has sized it
+ *
+ * @param shm Open shared memory object
+ * @return 0 if it has the size of a cache
+ *         -1 if not
+ */
+static int block_cache_wait_for_size(int shm)
+{
+  struct stat st;
+  for(int i = 0; i < 1000; ++i) {
+    if(fstat(shm, &st) != 0)
+      return(-1);
+    if(st.st_size == sizeof(BLOCK_CACHE))
+      return(0);
+    if(st.st_size != 0)
+      // Made by a build with another disk geometry
+      return(-1);
+    usleep(1000);
+  }
+  return(-1);
+}
+
+/**
+ * Wait (for up to a second) until the process that created a shared cache
+ *  has set it up
+ *
+ * @param cache Mapped shared cache
+ * @return 0 if it is ready
+ *         -1 if not
+ */
+static int block_cache_wait_for_magic(BLOCK_CACHE *cache)
+{
+  for(int i = 0; i < 1000; ++i) {
+    if(__atomic_load_n(&cache->magic, __ATOMIC_ACQUIRE) == BLOCK_CACHE_MAGIC)
+      return(0);
+    usleep(1000);
+  }
+  return(-1);
+}
+
+/**
+ * Attach to the cache shared by the processes that use an image, creating
+ *  it if this is the first.  A cache that cannot be used (made by a build
+ *  with another disk geometry, or by a process that died while setting it
+ *  up) is removed, so that the next process starts a new one.
+ *
+ * @param image_name Name of the image file
+ * @return The cache; NULL if it cannot be used (use a private one instead)
+ */
+BLOCK_CACHE *block_cache_attach_shared(char *image_name)
+{
+  char name[64];
+  if(block_cache_shared_name(image_name, name, sizeof(name)) != 0)
+    return(NULL);
+
+  // Exactly one process creates (and sets up) the object
+  int created = 1;
+  int shm = shm_open(name, O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+  if(shm < 0 && errno == EEXIST) {
+    created = 0;
+    shm = shm_open(name, O_RDWR, S_IRUSR | S_IWUSR);
+  }
+  if(shm < 0)
+    return(NULL);
+
+  if(created ? ftruncate(shm, sizeof(BLOCK_CACHE)) != 0 : block_cache_wait_for_size(shm) != 0) {
+    shm_unlink(name);
+    close(shm);
+    return(NULL);
+  }
+  BLOCK_CACHE *cache = mmap(NULL, sizeof(BLOCK_CACHE), PROT_READ | PROT_WRITE, MAP_SHARED, shm, 0);
+  close(shm);
+  if(cache == MAP_FAILED) {
+    if(created)
+      shm_unlink(name);
+    return(NULL);
+  }
+
+  if(created) {
+    block_cache_init(cache, 1);
+    __atomic_store_n(&cache->magic, BLOCK_CACHE_MAGIC, __ATOMIC_RELEASE);
+  }else if(block_cache_wait_for_magic(cache) != 0) {
+    // The creator died while setting it up
+    munmap(cache, sizeof(BLOCK_CACHE));
+    shm_unlink(name);
+    return(NULL);
+  }
+  return(cache);
+}
+
+/**
+ * Detach from a shared cache.  The cache (and all that it holds) stays in
+ *  place for the next process.
+ *
+ * @param cache Cache returned by block_cache_attach_shared()
+ * @return 0 if success
+ *         -1 if error
+ */
+int block_cache_detach_shared(BLOCK_CACHE *cache)
+{
+  return(munmap(cache, sizeof(BLOCK_CACHE)));
+}
+
+/**
+ * Remove the shared cache of an image, if there is one.  Processes that
+ *  are attached to it keep using it; the next one starts a new cache.
+ *
+ * @param image_name Name of the image file
+ * @return 0 if success (or there was no cache)
+ *         -1 if error
+ */
+int block_cache_remove_shared(char *image_name)
+{
+  char name[64];
+  if(block_cache_shared_name(image_name, name, sizeof(name)) != 0)
+    // No image, so no cache that anyone can find
+    return(0);
+  if(shm_unlink(name) != 0 && errno != ENOENT)
+    return(-1);
+  return(0);
+}
+
+/**
+ * Make sure that a cache has seen every write to its image: if the image's
+ *  count of writes differs from the cache's, some were made without the
+ *  cache, and everything in it becomes stale.  Called before each lookup.
+ *
+ * @param cache Cache of the disk
+ * @param image_writes Count of writes kept in the image; NULL if there is
+ *          none (nothing is checked)
+ */
+void block_cache_check(BLOCK_CACHE *cache, const uint64_t *image_writes)
+{
+  if(image_writes == NULL ||
+     __atomic_load_n(image_writes, __ATOMIC_ACQUIRE) == __atomic_load_n(&cache->image_writes, __ATOMIC_ACQUIRE))
+    return;
+
+  // (The count may just be changing under a writer of this cache: look
+  //  again under the lock)
+  int died = block_cache_mutex_lock(&cache->lock);
+  uint64_t count = __atomic_load_n(image_writes, __ATOMIC_ACQUIRE);
+  if(died || count != cache->image_writes) {
+    __atomic_store_n(&cache->generation, cache->generation + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&cache->image_writes, count, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&cache->lock);
+}
+
+/**
+ * Count a write that has been made to the image through a cache (after the
+ *  block is in the image, before it is stored in the slot)
+ *
+ * @param cache Cache of the disk
+ * @param image_writes Count of writes kept in the image; NULL if there is
+ *          none
+ */
+void block_cache_count_write(BLOCK_CACHE *cache, uint64_t *image_writes)
+{
+  if(image_writes == NULL)
+    return;
+
+  int died = block_cache_mutex_lock(&cache->lock);
+  uint64_t count = __atomic_add_fetch(image_writes, 1, __ATOMIC_ACQ_REL);
+  if(died || count != cache->image_writes + 1)
+    // Some other write came in between: drop everything (the caller's
+    //  block too, which it stores with the generation it saw before)
+    __atomic_store_n(&cache->generation, cache->generation + 1, __ATOMIC_RELEASE);
+  __atomic_store_n(&cache->image_writes, count, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&cache->lock);
+}
+
+/**
+ * Current generation of a cache: slots filled in an older one are stale
+ *
+ * @param cache Cache of the disk
+ * @return The generation (never 0)
+ */
+uint64_t block_cache_generation(BLOCK_CACHE *cache)
+{
+  return(__atomic_load_n(&cache->generation, __ATOMIC_ACQUIRE));
+}
+
+/**
+ * Copy the words of a slot into a block buffer (which need not be
+ *  aligned)
+ *
+ * @param slot Slot to copy from
+ * @param block Buffer of BLOCK_SIZE bytes
+ */
+static void block_cache_copy_out(BLOCK_CACHE_SLOT *slot, void *block)
+{
+  unsigned char *buf = block;
+  for(int i = 0; i < BLOCK_CACHE_WORDS; ++i) {
+    uint64_t word = __atomic_load_n(&slot->data[i], __ATOMIC_ACQUIRE);
+    memcpy(buf + i * 8, &word, 8);
+  }
+}
+
+/**
+ * Look up a block without taking any lock
+ *
+ * @param cache Cache of the disk
+ * @param block_ref Block to look up
+ * @param block Buffer of BLOCK_SIZE bytes for the block
+ * @return 0 if the block was copied from the cache
+ *         -1 if it is not cached or is being changed (take the lock and
+ *            use block_cache_get_locked() instead)
+ */
+int block_cache_read(BLOCK_CACHE *cache, BLOCK_REFERENCE block_ref, void *block)
+{
+  BLOCK_CACHE_SLOT *slot = &cache->slot[block_ref];
+  uint64_t generation = block_cache_generation(cache);
+
+  uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+  if((seq & 1) || __atomic_load_n(&slot->generation, __ATOMIC_RELAXED) != generation)
+    return(-1);
+
+  block_cache_copy_out(slot, block);
+
+  // The copy counts only if no change began in the meantime (the acquire
+  //  loads of the words keep this load after them)
+  if(__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq)
+    return(-1);
+  return(0);
+}
+
+/**
+ * Mark a slot as changing: its sequence number becomes odd (the caller
+ *  holds the slot lock)
+ *
+ * @param slot Slot that is about to change
+ */
+static void block_cache_begin_change(BLOCK_CACHE_SLOT *slot)
+{
+  // (The release stores of the words that follow keep this store before
+  //  them)
+  __atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Mark a slot as stable again: its sequence number becomes even, and
+ *  differs from the one that readers saw before the change
+ *
+ * @param slot Slot that has changed
+ */
+static void block_cache_end_change(BLOCK_CACHE_SLOT *slot)
+{
+  __atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Lock the slot of a block (for a miss or a write)
+ *
+ * @param cache Cache of the disk
+ * @param block_ref Block whose slot to lock
+ */
+void block_cache_lock(BLOCK_CACHE *cache, BLOCK_REFERENCE block_ref)
+{
+  BLOCK_CACHE_SLOT *slot = &cache->slot[block_ref];
+
+  if(block_cache_mutex_lock(&slot->lock)) {
+    // The holder died (only possible for a shared cache), maybe between
+    //  writing the image and the slot, or halfway through the slot: drop
+    //  the slot
+    if(!(slot->seq & 1))
+      block_cache_begin_change(slot);
+    __atomic_store_n(&slot->generation, 0, __ATOMIC_RELEASE);
+    block_cache_end_change(slot);
+  }
+}
+
+/**
+ * Unlock the slot of a block
+ *
+ * @param cache Cache of the disk
+ * @param block_ref Block whose slot to unlock
+ */
+void block_cache_unlock(BLOCK_CACHE *cache, BLOCK_REFERENCE block_ref)
+{
+  pthread_mutex_unlock(&cache->slot[block_ref].lock);
+}
+
+/**
+ * Copy a block out of the cache (the caller holds the slot lock)
+ *
+ * @param cache Cache of the disk
+ * @param block_ref Block to look up
+ * @param block Buffer of BLOCK_SIZE bytes for the block
+ * @return 0 if the block was copied
+ *         -1 if it is not cached
+ */
+int block_cache_get_locked(BLOCK_CACHE *cache, BLOCK_REFERENCE block_ref, void *block)
+{
+  BLOCK_CACHE_SLOT *slot = &cache->slot[block_ref];
+
+  if(slot->generation != block_cache_generation(cache))
+    return(-1);
+  block_cache_copy_out(slot, block);
+  return(0);
+}
+
+/**
+ * Store a block in the cache (the caller holds the slot lock, and the
+ *  block is what the disk now holds)
+ *
+ * @param cache Cache of the disk
+ * @param block_ref Block to store
+ * @param block Buffer of BLOCK_SIZE bytes with the block
+ * @param generation Generation of the cache when the block was read from
+ *          (or written to) the disk
+ */
+void block_cache_put_locked(BLOCK_CACHE *cache, BLOCK_REFERENCE block_ref, const void *block,
+                            uint64_t generation)
+{
+  BLOCK_CACHE_SLOT *slot = &cache->slot[block_ref];
+  const unsigned char *buf = block;
+
+  block_cache_begin_change(slot);
+  for(int i = 0; i < BLOCK_CACHE_WORDS; ++i) {
+    uint64_t word;
+    memcpy(&word, buf + i * 8, 8);
+    __atomic_store_n(&slot->data[i], word, __ATOMIC_RELEASE);
+  }
+  __atomic_store_n(&slot->generation, generation, __ATOMIC_RELEASE);
+  block_cache_end_change(slot);
+}
+
+/**
+ * Forget a block (the caller holds the slot lock).  Used when the disk may
+ *  no longer hold what the cache does.
+ *
+ * @param cache Cache of the disk
+ * @param block_ref Block to forget
+ */
+void block_cache_invalidate_locked(BLOCK_CACHE *cache, BLOCK_REFERENCE block_ref)
+{
+  BLOCK_CACHE_SLOT *slot = &cache->slot[block_ref];
+
+  block_cache_begin_change(slot);
+  __atomic_store_n(&slot->generation, 0, __ATOMIC_RELEASE);
+  block_cache_end_change(slot);
+}
@@ -0,0 +1,78 @@
+#ifndef BLOCK_CACHE_H
+#define BLOCK_CACHE_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include "oufs.h"
+
+#if BLOCK_SIZE % 8 != 0
+#error "The block cache copies blocks in 8-byte words"
+#endif
+
+#define BLOCK_CACHE_WORDS (BLOCK_SIZE / 8)
+
+// Written last when a shared cache is set up (and never by a private one)
+#define BLOCK_CACHE_MAGIC 0x4f55465343414348ULL
+
+// Environment variable that turns on the cache shared between processes
+#define BLOCK_CACHE_SHARED_ENV "OUFS_SHARED_CACHE"
+
+// One cached block.  Readers never lock: they copy the data between two
+//  reads of seq and keep the copy only if seq was even and did not change.
+//  Anything that changes the slot holds lock and makes seq odd meanwhile.
+//  The copy is valid only while generation matches that of the cache.
+typedef struct
+{
+  pthread_mutex_t lock;
+  uint64_t seq;
+  uint64_t generation;
+  uint64_t data[BLOCK_CACHE_WORDS];
+} BLOCK_CACHE_SLOT;
+
+// Write-through cache of the blocks of a disk.  The disk is small enough
+//  for every block to have its own slot (slot i caches block i), so there
+//  is no hashing, eviction or freeing of entries while the cache is in use.
+//
+// A shared cache lives in a shared memory object named after the image,
+//  and is used by every process that attaches to the image with
+//  OUFS_SHARED_CACHE set.  All of its locks are process-shared and robust:
+//  a slot whose holder died is simply dropped (the image is always up to
+//  date).
+//
+// The image keeps a count of the block writes made to it by every process
+//  (see virtual_disk_attach()), and a cache knows how many of them it has
+//  seen.  Before each lookup the two are compared: if any write was made
+//  other than through this cache (by a process with its own cache, or with
+//  none), the whole cache is made stale by moving to a new generation.
+typedef struct block_cache
+{
+  uint64_t magic;
+  int shared;
+
+  // Guards image_writes and changes of generation
+  pthread_mutex_t lock;
+  uint64_t generation;
+  uint64_t image_writes;
+
+  BLOCK_CACHE_SLOT slot[N_BLOCKS];
+} BLOCK_CACHE;
+
+BLOCK_CACHE *block_cache_create(void);
+void block_cache_destroy(BLOCK_CACHE *cache);
+BLOCK_CACHE *block_cache_attach_shared(char *image_name);
+int block_cache_detach_shared(BLOCK_CACHE *cache);
+int block_cache_remove_shared(char *image_name);
+
+void block_cache_check(BLOCK_CACHE *cache, const uint64_t *image_writes);
+void block_cache_count_write(BLOCK_CACHE *cache, uint64_t *image_writes);
+
+uint64_t block_cache_generation(BLOCK_CACHE *cache);
+int block_cache_read(BLOCK_CACHE *cache, BLOCK_REFERENCE block_ref, void *block);
+void block_cache_lock(BLOCK_CACHE *cache, BLOCK_REFERENCE block_ref);
+void block_cache_unlock(BLOCK_CACHE *cache, BLOCK_REFERENCE block_ref);
+int block_cache_get_locked(BLOCK_CACHE *cache, BLOCK_REFERENCE block_ref, void *block);
+void block_cache_put_locked(BLOCK_CACHE *cache, BLOCK_REFERENCE block_ref, const void *block,
+                            uint64_t generation);
+void block_cache_invalidate_locked(BLOCK_CACHE *cache, BLOCK_REFERENCE block_ref);
+
+#endif
@@ -14,6 +14,8 @@
 
 #include <string.h>
 #include <limits.h>
+#include <stdint.h>
+#include <assert.h>
 
 
 // Implementation of min operator
@@ -63,6 +65,14 @@ typedef unsigned short INODE_REFERENCE;
 // Value used as an index when it does not refer to an inode
 #define UNALLOCATED_INODE (USHRT_MAX)
 
+// Byte counts and positions within files.  Signed, so that functions can
+//  still return -x for errors
+typedef int64_t FILE_OFFSET;
+
+// The same on the disk, but only 4-byte aligned so that inodes do not
+//  change the alignment (and so the layout) of a BLOCK
+typedef int64_t INODE_SIZE __attribute__((aligned(4)));
+
 // Number of bytes available for block data
 #define DATA_BLOCK_SIZE ((int)(BLOCK_SIZE-sizeof(int)))
 
@@ -72,8 +82,9 @@ typedef unsigned short INODE_REFERENCE;
 // The Inode for the root directory
 #define ROOT_DIRECTORY_INODE 0
 
-// Size of file/directory name
-#define FILE_NAME_SIZE ((int)(16 - sizeof(INODE_REFERENCE)))
+// Size of file/directory name (what is left of a 16-byte directory entry
+//  after the inode reference and the type byte)
+#define FILE_NAME_SIZE ((int)(16 - sizeof(INODE_REFERENCE) - sizeof(unsigned char)))
 
 /**********************************************************************/
 // Data block: storage for file contents (project 4!)
@@ -90,51 +101,103 @@ typedef enum {UNUSED_TYPE=0, DIRECTORY_TYPE, FILE_TYPE} INODE_TYPE;
 // Single inode
 typedef struct inode_s
 {
-  // Type of INODE
-  INODE_TYPE type;
+  // Type of INODE (an INODE_TYPE)
+  unsigned char type;
 
   // Number of directory references to this inode
   unsigned char n_references;
 
+  // INODE_FLAG_* bits
+  unsigned char flags;
+
   // Contents.  UNALLOCATED_BLOCK means that this entry is not used
   BLOCK_REFERENCE content;
 
+  // Last block of the contents (UNALLOCATED_BLOCK if there are none), so
+  //  that appending does not require walking the chain
+  BLOCK_REFERENCE tail;
+
   // File: size in bytes; Directory: number of directory entries
   //  (including . and ..)
-  unsigned int size;
+  INODE_SIZE size;
 } INODE;
 
+// The content chain may include blocks that are shared with another file
+//  (see oufs_reflink()); writes must copy them first
+#define INODE_FLAG_SHARED 0x01
+
+// The allocation state of the disk is split into N_ALLOC_SHARDS shards,
+//  one per inode block, so that threads that allocate in different shards
+//  never wait for each other.  Shard s owns the inodes of inode block s + 1
+//  and the ALLOC_SHARD_BLOCKS blocks from s * ALLOC_SHARD_BLOCKS on; which
+//  of them are allocated is kept in the spare bytes of that inode block
+#define N_ALLOC_SHARDS N_INODE_BLOCKS
+#define ALLOC_SHARD_BLOCKS (N_BLOCKS / N_ALLOC_SHARDS)
+
+// Most inodes that an inode block may hold (bits in an ALLOC_SHARD)
+#define ALLOC_SHARD_INODES 16
+
+#if N_BLOCKS % (8 * N_ALLOC_SHARDS) != 0
+#error "Every shard must own a whole number of bytes of blocks"
+#endif
+
+// Allocation state of one shard.  8 per byte: one per bit: 1 = allocated,
+//  0 = free.  The first block (or inode) of the shard is byte 0, bit 7;
+//  the second is byte 0, bit 6; the ninth is byte 1, bit 7
+typedef struct alloc_shard_s
+{
+  unsigned char block_allocated_flag[ALLOC_SHARD_BLOCKS >> 3];
+  unsigned char inode_allocated_flag[ALLOC_SHARD_INODES >> 3];
+} ALLOC_SHARD;
+
 // Number of inodes stored in each block
-#define N_INODES_PER_BLOCK ((int)(DATA_BLOCK_SIZE/sizeof(INODE)))
+#define N_INODES_PER_BLOCK ((int)((DATA_BLOCK_SIZE - sizeof(ALLOC_SHARD)) / sizeof(INODE)))
 
 // Total number of inodes in the file system
-// #define N_INODES (N_INODES_PER_BLOCK * N_INODE_BLOCKS)
-// Hack to deal with the fact that our inode allocation table is not 
-//   declared properly
-#define N_INODES (((N_INODES_PER_BLOCK * N_INODE_BLOCKS)>>3)<<3)
+#define N_INODES (N_INODES_PER_BLOCK * N_INODE_BLOCKS)
 
 // Block of inodes
 typedef struct inode_block_s
 {
   INODE inode[N_INODES_PER_BLOCK];
+
+  // Allocation state of the shard of this block
+  ALLOC_SHARD shard;
 } INODE_BLOCK;
 
+static_assert(N_INODES_PER_BLOCK <= ALLOC_SHARD_INODES, "ALLOC_SHARD_INODES is too small");
+
 
 /**********************************************************************/
 // Block 0
 #define MASTER_BLOCK_REFERENCE 0
 
+// Every formatted disk starts with this
+#define OUFS_MAGIC 0x5346554f
+
+// Version of the layout of the disk, recorded in the master block.
+//  Disks in any other layout must be formatted again (see oufs_mount()):
+//  1: the entries of a directory block are kept sorted by name
+//  2: directory entries record the type of their inode (FILE_NAME_SIZE is
+//     one byte shorter to make room for it)
+//  3: 64-bit file sizes in inodes, with a single-byte inode type
+//  4: blocks and inodes are allocated from shards kept in the inode blocks
+//     (bit maps instead of the free list and the master block's table)
+#define OUFS_FORMAT_VERSION 4
+
 typedef struct master_block_s
 {
-  // 8 inodes per byte: One inode per bit: 1 = allocated, 0 = free
-  // Inode 0 (zero) is byte 0, bit 7 
-  //       1        is byte 0, bit 6
-  //       8        is byte 1, bit 7
-  unsigned char inode_allocated_flag[N_INODES >> 3];
+  // OUFS_MAGIC, and the OUFS_FORMAT_VERSION that the disk was formatted in
+  unsigned int magic;
+  unsigned short format_version;
 
-  // Double-ended linked list representation for unallocated blocks
-  BLOCK_REFERENCE unallocated_front;
-  BLOCK_REFERENCE unallocated_end;
+  // (Which blocks and inodes are allocated is kept by the shards: see
+  //  ALLOC_SHARD)
+
+  // For each block: the number of references to it beyond the first (a
+  //  block of a reflinked file is referenced from more than one chain).
+  //  Chains share suffixes only: every block after a shared block is shared
+  unsigned char block_extra_references[N_BLOCKS];
 
 } MASTER_BLOCK;
 
@@ -145,6 +208,10 @@ typedef struct directory_entry_s
   // Name of file/directory
   char name[FILE_NAME_SIZE];
 
+  // Type of the referenced inode (an INODE_TYPE), so that a listing does
+  //  not have to read every child inode
+  unsigned char type;
+
   // UNALLOCATED_INODE if this directory entry is non-existent
   INODE_REFERENCE inode_reference;
 
@@ -181,16 +248,114 @@ typedef struct
 
 #define MAX_BLOCKS_IN_FILE 100
 
+// Read-ahead window for sequential readers (in blocks).  The window starts
+//  at the minimum and doubles with each refill while access stays sequential
+#define READ_AHEAD_MIN_BLOCKS 2
+#define READ_AHEAD_MAX_BLOCKS 32
+
+// Write buffer for files opened for "w" or "a": bytes are collected here
+//  and blocks are allocated only when it is flushed
+#define WRITE_BUFFER_BLOCKS 16
+#define WRITE_BUFFER_SIZE (WRITE_BUFFER_BLOCKS * DATA_BLOCK_SIZE)
+
+// Number of closed OUFILE structures (together with their buffers) that
+//  are kept for reuse by later opens
+#define OUFILE_POOL_SIZE 16
+
+// File system mount (defined in oufs_lib.h)
+typedef struct oufs_mount_s OUFS_MOUNT;
+
 typedef struct oufile_s
 {
+  // Mount through which the file was opened
+  OUFS_MOUNT *mount;
+
   INODE_REFERENCE inode_reference;
+  // 'r', 'w', 'a' or '+' (opened with "r+")
   char mode;
-  int offset;
+  FILE_OFFSET offset;
 
   // Cache for file content details.  Use of these is optional
+  //  (for files opened with "a", only the entry for the last block is
+  //  filled in)
   int n_data_blocks;
   BLOCK_REFERENCE block_reference_cache[MAX_BLOCKS_IN_FILE];
+
+  // Read-ahead state (files opened for "r" only)
+  FILE_OFFSET ra_next;  // Offset at which the next sequential read starts
+  int ra_window;        // Blocks to load on the next refill (0 = not sequential)
+  int ra_start;         // Index (within the file) of the first buffered block
+  int ra_count;         // Number of buffered blocks
+  BLOCK *ra_buffer;     // READ_AHEAD_MAX_BLOCKS blocks; allocated on first use
+
+  // Write buffer (files opened for "w" or "a"; scratch space for "r"/"r+")
+  int wb_count;                 // Number of buffered bytes
+  unsigned char *wb_buffer;     // WRITE_BUFFER_SIZE bytes; allocated on first use
+
+  // Next structure in the pool of closed files
+  struct oufile_s *next_free;
 } OUFILE;
 
+// A piece of file contents in place in the (mapped) disk image
+typedef struct ouspan_s
+{
+  const unsigned char *data;
+  int len;
+} OUSPAN;
+
+// Read-only view of a range of a file (see oufs_view()).  Data blocks are
+//  not adjacent in memory (each starts with its link), so there is one span
+//  per block
+typedef struct ouview_s
+{
+  OUFS_MOUNT *mount;
+  const BLOCK *disk;    // Mapped disk while the view is pinned; else NULL
+  int n_spans;
+  OUSPAN span[MAX_BLOCKS_IN_FILE];
+} OUVIEW;
+
+/**********************************************************************/
+// Directory iteration
+
+// Resumable position within a directory: the name of the last entry that
+//  was returned.  Directory entries are kept sorted, so a cookie remains
+//  meaningful across inserts/removals and across opendir() calls.
+typedef struct oudir_cookie_s
+{
+  char name[FILE_NAME_SIZE];
+} OUDIR_COOKIE;
+
+// One entry returned by oufs_readdir()
+typedef struct oudirent_s
+{
+  char name[FILE_NAME_SIZE];
+  INODE_REFERENCE inode_reference;
+  INODE_TYPE type;
+} OUDIRENT;
+
+// One entry returned by oufs_readdirplus(): the directory entry together
+//  with the attributes of the inode that it refers to
+typedef struct oudirent_plus_s
+{
+  char name[FILE_NAME_SIZE];
+  INODE_REFERENCE inode_reference;
+  INODE_TYPE type;
+  FILE_OFFSET size;
+  unsigned char n_references;
+} OUDIRENT_PLUS;
+
+typedef struct oudir_s
+{
+  OUFS_MOUNT *mount;
+  INODE_REFERENCE inode_reference;
+
+  // Number of valid entries and index of the next entry to return
+  int n_entries;
+  int position;
+
+  // The (single) directory block being iterated over
+  BLOCK block;
+} OUDIR;
+
 
 #endif
@@ -15,12 +15,14 @@ int main(int argc, char** argv) {
   oufs_get_environment(cwd, disk_name, pipe_name_base);
 
   // Open the virtual disk
-  virtual_disk_attach(disk_name, pipe_name_base);
+  OUFS_MOUNT *mnt = oufs_mount(disk_name, pipe_name_base);
+  if(mnt == NULL)
+    return(-1);
   if(argc == 1) {
       //  skeleton file here said usage: oufs_create .. I assume that is wrong
     fprintf(stderr, "Usage: oufs_append <file name>\n");
   }else{
-    OUFILE *fp = oufs_fopen(cwd, argv[1], "a");
+    OUFILE *fp = oufs_fopen(mnt, cwd, argv[1], "a");
     unsigned char buf[BUF_SIZE];
     if(fp != NULL) {
       int n;
@@ -33,7 +35,7 @@ int main(int argc, char** argv) {
   }
 
   // Clean up
-  virtual_disk_detach();
+  oufs_unmount(mnt);
   
   return(0);
 }
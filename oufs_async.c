@@ -0,0 +1,174 @@
+/**
+ *  oufs_async.c
+ *
+ *  Asynchronous operations on a mounted disk: requests are queued and run
+ *  by the threads of an engine, which call each request's done() function
+ *  when it is complete.  The submitting thread never waits for the disk.
+ */
+
+#include <stdlib.h>
+#include "oufs_lib_support.h"
+#include "oufs_async.h"
+
+/**
+ * Run one request (on an engine thread)
+ *
+ * @param mnt Mount of the virtual disk
+ * @param req Request to run; its results are filled in
+ */
+static void oufs_async_run(OUFS_MOUNT *mnt, OUFS_REQUEST *req)
+{
+  char local_name[MAX_PATH_LENGTH];
+
+  switch(req->op) {
+  case OUFS_ASYNC_OPEN:
+    req->fp = oufs_fopen(mnt, req->cwd, req->path, req->mode);
+    req->ret = (req->fp == NULL) ? -1 : 0;
+    break;
+  case OUFS_ASYNC_CLOSE:
+    req->ret = oufs_fclose(req->fp);
+    break;
+  case OUFS_ASYNC_READ:
+    req->ret = oufs_pread(req->fp, req->buf, req->len, req->offset);
+    break;
+  case OUFS_ASYNC_WRITE:
+    req->ret = oufs_pwrite(req->fp, req->buf, req->len, req->offset);
+    break;
+  case OUFS_ASYNC_MKDIR:
+    req->ret = oufs_mkdir(mnt, req->cwd, req->path);
+    break;
+  case OUFS_ASYNC_LOOKUP:
+    req->ret = oufs_find_file(mnt, req->cwd, req->path, &req->parent, &req->child, local_name);
+    break;
+  default:
+    req->ret = -1;
+  }
+}
+
+/**
+ * Body of each engine thread: run requests until the engine stops and the
+ *  queue is empty
+ *
+ * @param arg The engine
+ * @return NULL
+ */
+static void *oufs_async_worker(void *arg)
+{
+  OUFS_ASYNC *engine = arg;
+
+  while(1) {
+    pthread_mutex_lock(&engine->lock);
+    while(engine->head == NULL && !engine->stopping)
+      pthread_cond_wait(&engine->ready, &engine->lock);
+    OUFS_REQUEST *req = engine->head;
+    if(req == NULL) {
+      // Stopping, and nothing is left
+      pthread_mutex_unlock(&engine->lock);
+      return(NULL);
+    }
+    engine->head = req->next;
+    if(engine->head == NULL)
+      engine->tail = NULL;
+    pthread_mutex_unlock(&engine->lock);
+
+    oufs_async_run(engine->mount, req);
+    // Last use of req
+    req->done(req);
+  }
+}
+
+/**
+ * Start an engine for a mount
+ *
+ * @param mnt Mount of the virtual disk
+ * @param n_threads Number of threads that run requests (at least 1)
+ * @return The engine; NULL if error
+ */
+OUFS_ASYNC *oufs_async_start(OUFS_MOUNT *mnt, int n_threads)
+{
+  if(n_threads < 1)
+    return(NULL);
+
+  OUFS_ASYNC *engine = malloc(sizeof(OUFS_ASYNC));
+  if(engine == NULL)
+    return(NULL);
+  engine->threads = malloc(n_threads * sizeof(pthread_t));
+  if(engine->threads == NULL) {
+    free(engine);
+    return(NULL);
+  }
+
+  engine->mount = mnt;
+  pthread_mutex_init(&engine->lock, NULL);
+  pthread_cond_init(&engine->ready, NULL);
+  engine->head = engine->tail = NULL;
+  engine->stopping = 0;
+  engine->n_threads = 0;
+  for(int i = 0; i < n_threads; ++i) {
+    if(pthread_create(&engine->threads[i], NULL, oufs_async_worker, engine) != 0) {
+      fprintf(stderr, "oufs_async_start(): only %d threads\n", i);
+      break;
+    }
+    ++engine->n_threads;
+  }
+  if(engine->n_threads == 0) {
+    oufs_async_stop(engine);
+    return(NULL);
+  }
+  return(engine);
+}
+
+/**
+ * Queue a request.  Its done() function is called once it is complete;
+ *  until then, the request must stay in place.
+ *
+ * @param engine Engine returned by oufs_async_start()
+ * @param req Request, with op, its arguments and done filled in
+ * @return 0 if success
+ *         -1 if the engine is stopping (done() will not be called)
+ */
+int oufs_async_submit(OUFS_ASYNC *engine, OUFS_REQUEST *req)
+{
+  req->next = NULL;
+  pthread_mutex_lock(&engine->lock);
+  if(engine->stopping) {
+    pthread_mutex_unlock(&engine->lock);
+    return(-1);
+  }
+  if(engine->tail == NULL)
+    engine->head = req;
+  else
+    engine->tail->next = req;
+  engine->tail = req;
+  pthread_cond_signal(&engine->ready);
+  pthread_mutex_unlock(&engine->lock);
+  return(0);
+}
+
+/**
+ * Stop an engine: the requests already queued are completed first.  Must
+ *  not be called from a done() function.
+ *
+ * @param engine Engine returned by oufs_async_start()
+ * @return 0 if success
+ *         -1 if error
+ */
+int oufs_async_stop(OUFS_ASYNC *engine)
+{
+  if(engine == NULL)
+    return(-1);
+
+  pthread_mutex_lock(&engine->lock);
+  engine->stopping = 1;
+  pthread_cond_broadcast(&engine->ready);
+  pthread_mutex_unlock(&engine->lock);
+
+  for(int i = 0; i < engine->n_threads; ++i)
+    pthread_join(engine->threads[i], NULL);
+
+  pthread_cond_destroy(&engine->ready);
+  pthread_mutex_destroy(&engine->lock);
+  free(engine->threads);
+  free(engine);
+  return(0);
+}
@@ -0,0 +1,80 @@
+#ifndef OUFS_ASYNC_H
+#define OUFS_ASYNC_H
+
+#include <pthread.h>
+
+#ifdef __cplusplus
+// (The library is C: its functions are also used from oufs_async.hpp)
+extern "C" {
+#endif
+
+#include "oufs_lib.h"
+
+// Operations that can be submitted to an engine
+typedef enum
+{
+  OUFS_ASYNC_OPEN,
+  OUFS_ASYNC_CLOSE,
+  OUFS_ASYNC_READ,
+  OUFS_ASYNC_WRITE,
+  OUFS_ASYNC_MKDIR,
+  OUFS_ASYNC_LOOKUP,
+} OUFS_ASYNC_OP;
+
+// One operation in flight.  The caller owns the request and must keep it
+//  in place until done() has been called; done() is the engine's last use
+//  of it, so it may free or reuse the request (or resume a coroutine that
+//  holds it).
+typedef struct oufs_request_s
+{
+  OUFS_ASYNC_OP op;
+
+  // Arguments (only those of op are used)
+  char cwd[MAX_PATH_LENGTH];
+  char path[MAX_PATH_LENGTH];
+  char mode[4];
+  OUFILE *fp;
+  unsigned char *buf;
+  FILE_OFFSET len;
+  FILE_OFFSET offset;
+
+  // Results: ret is what the library call returned (for OPEN, 0 if a file
+  //  was opened; for LOOKUP, the status of oufs_find_file()).  OPEN sets
+  //  fp; LOOKUP sets parent and child
+  FILE_OFFSET ret;
+  INODE_REFERENCE parent;
+  INODE_REFERENCE child;
+
+  // Called (on an engine thread) once the operation is complete
+  void (*done)(struct oufs_request_s *req);
+  void *user;
+
+  // Queue of the engine
+  struct oufs_request_s *next;
+} OUFS_REQUEST;
+
+// Runs requests on a few threads of its own: those threads are the only
+//  ones that wait for the disk
+typedef struct
+{
+  OUFS_MOUNT *mount;
+
+  pthread_mutex_t lock;
+  pthread_cond_t ready;
+  OUFS_REQUEST *head;
+  OUFS_REQUEST *tail;
+  int stopping;
+
+  int n_threads;
+  pthread_t *threads;
+} OUFS_ASYNC;
+
+OUFS_ASYNC *oufs_async_start(OUFS_MOUNT *mnt, int n_threads);
+int oufs_async_submit(OUFS_ASYNC *engine, OUFS_REQUEST *req);
+int oufs_async_stop(OUFS_ASYNC *engine);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,169 @@
+/**
+ *  oufs_async.hpp
+ *
+ *  C++20 coroutine interface to the asynchronous operations of
+ *  oufs_async.h.  Each function returns an awaitable; co_await submits the
+ *  request to the engine and suspends the coroutine, which resumes (on an
+ *  engine thread) with the result once the request is complete:
+ *
+ *    OUFILE *fp = co_await oufs::open(engine, "/", "log", "a");
+ *    FILE_OFFSET n = co_await oufs::read(engine, fp, buf, len, 0);
+ *
+ *  As with the C interface, an OUFILE is used by one operation at a time.
+ *  Requires -std=c++20; link with the library and -pthread.
+ */
+#ifndef OUFS_ASYNC_HPP
+#define OUFS_ASYNC_HPP
+
+#include <coroutine>
+#include <cstring>
+#include "oufs_async.h"
+
+namespace oufs {
+
+// A request that is submitted when awaited; await_resume() gives
+//  Result(request) once it is complete
+template<typename Result>
+class Operation
+{
+public:
+  explicit Operation(OUFS_ASYNC *engine) : engine_(engine)
+  {
+    std::memset(&req_, 0, sizeof(req_));
+    req_.done = &Operation::complete;
+  }
+
+  OUFS_REQUEST &request() { return req_; }
+
+  bool await_ready() const noexcept { return false; }
+
+  // Suspend unless the engine refuses the request (then resume at once,
+  //  with ret set to -1)
+  bool await_suspend(std::coroutine_handle<> handle) noexcept
+  {
+    req_.user = handle.address();
+    if(oufs_async_submit(engine_, &req_) != 0) {
+      req_.ret = -1;
+      if(req_.op == OUFS_ASYNC_OPEN)
+        req_.fp = nullptr;
+      req_.child = UNALLOCATED_INODE;
+      return false;
+    }
+    return true;
+  }
+
+  Result await_resume() noexcept { return Result(req_); }
+
+private:
+  static void complete(OUFS_REQUEST *req)
+  {
+    std::coroutine_handle<>::from_address(req->user).resume();
+  }
+
+  OUFS_ASYNC *engine_;
+  OUFS_REQUEST req_;
+};
+
+// Results of the operations
+struct Status
+{
+  FILE_OFFSET value;
+  explicit Status(const OUFS_REQUEST &req) : value(req.ret) {}
+  operator FILE_OFFSET() const { return value; }
+};
+
+struct File
+{
+  OUFILE *value;
+  explicit File(const OUFS_REQUEST &req) : value(req.fp) {}
+  operator OUFILE *() const { return value; }
+};
+
+struct Inode
+{
+  INODE_REFERENCE value;
+  explicit Inode(const OUFS_REQUEST &req) : value(req.ret < -1 ? UNALLOCATED_INODE : req.child) {}
+  operator INODE_REFERENCE() const { return value; }
+};
+
+namespace detail {
+
+inline void copy_path(char *dst, const char *src)
+{
+  std::strncpy(dst, src, MAX_PATH_LENGTH - 1);
+  dst[MAX_PATH_LENGTH - 1] = 0;
+}
+
+}
+
+// Open a file (see oufs_fopen()); gives nullptr if error
+inline Operation<File> open(OUFS_ASYNC *engine, const char *cwd, const char *path, const char *mode)
+{
+  Operation<File> op(engine);
+  op.request().op = OUFS_ASYNC_OPEN;
+  detail::copy_path(op.request().cwd, cwd);
+  detail::copy_path(op.request().path, path);
+  std::strncpy(op.request().mode, mode, sizeof(op.request().mode) - 1);
+  return op;
+}
+
+// Close a file (see oufs_fclose())
+inline Operation<Status> close(OUFS_ASYNC *engine, OUFILE *fp)
+{
+  Operation<Status> op(engine);
+  op.request().op = OUFS_ASYNC_CLOSE;
+  op.request().fp = fp;
+  return op;
+}
+
+// Read at an offset (see oufs_pread()); gives the number of bytes read
+inline Operation<Status> read(OUFS_ASYNC *engine, OUFILE *fp, unsigned char *buf,
+                              FILE_OFFSET len, FILE_OFFSET offset)
+{
+  Operation<Status> op(engine);
+  op.request().op = OUFS_ASYNC_READ;
+  op.request().fp = fp;
+  op.request().buf = buf;
+  op.request().len = len;
+  op.request().offset = offset;
+  return op;
+}
+
+// Write at an offset (see oufs_pwrite(): the file must be open "r+"); gives
+//  the number of bytes written
+inline Operation<Status> write(OUFS_ASYNC *engine, OUFILE *fp, unsigned char *buf,
+                               FILE_OFFSET len, FILE_OFFSET offset)
+{
+  Operation<Status> op(engine);
+  op.request().op = OUFS_ASYNC_WRITE;
+  op.request().fp = fp;
+  op.request().buf = buf;
+  op.request().len = len;
+  op.request().offset = offset;
+  return op;
+}
+
+// Make a directory (see oufs_mkdir()); gives 0 if success
+inline Operation<Status> mkdir(OUFS_ASYNC *engine, const char *cwd, const char *path)
+{
+  Operation<Status> op(engine);
+  op.request().op = OUFS_ASYNC_MKDIR;
+  detail::copy_path(op.request().cwd, cwd);
+  detail::copy_path(op.request().path, path);
+  return op;
+}
+
+// Find the inode of a path (see oufs_find_file()); gives UNALLOCATED_INODE
+//  if there is none
+inline Operation<Inode> lookup(OUFS_ASYNC *engine, const char *cwd, const char *path)
+{
+  Operation<Inode> op(engine);
+  op.request().op = OUFS_ASYNC_LOOKUP;
+  detail::copy_path(op.request().cwd, cwd);
+  detail::copy_path(op.request().path, path);
+  return op;
+}
+
+}
+
+#endif
@@ -0,0 +1,116 @@
+/**
+Print files of the OU File System one after another (as oufs_cat does), with
+all of them read at once through the coroutine interface of oufs_async.hpp:
+
+  oufs_async_cat <file name> ...
+
+Each file is read by a coroutine of its own, which waits for its open, reads
+and close on the engine's threads; the files are then printed in the order
+in which they were given.  (Also the example of oufs_async.hpp.)
+
+CS3113
+
+*/
+
+#include <coroutine>
+#include <cstdio>
+#include <latch>
+#include <vector>
+
+#include "oufs_async.hpp"
+#include "virtual_disk.h"
+
+// Threads of the engine: the only ones that wait for the disk
+#define ASYNC_CAT_THREADS 4
+
+// Coroutine that starts at once and frees itself when it is done
+struct Detached
+{
+  struct promise_type
+  {
+    Detached get_return_object() { return {}; }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() {}
+  };
+};
+
+// One file to print
+struct CatFile
+{
+  const char *path;
+  std::vector<unsigned char> data;
+  int ok = 0;
+};
+
+/**
+ * Read a whole file into memory
+ *
+ * @param engine Engine that runs the operations
+ * @param cwd Absolute path for the current working directory
+ * @param file File to read (data and ok are set)
+ * @param done Counted down once the file has been read (or has failed)
+ */
+static Detached cat_read(OUFS_ASYNC *engine, const char *cwd, CatFile *file, std::latch *done)
+{
+  OUFILE *fp = co_await oufs::open(engine, cwd, file->path, "r");
+  if(fp != nullptr) {
+    unsigned char buf[BLOCK_SIZE * 4];
+    FILE_OFFSET n;
+    while((n = co_await oufs::read(engine, fp, buf, sizeof(buf), file->data.size())) > 0)
+      file->data.insert(file->data.end(), buf, buf + n);
+    file->ok = (n == 0);
+    co_await oufs::close(engine, fp);
+  }
+  done->count_down();
+}
+
+int main(int argc, char** argv) {
+  // Fetch the key environment vars
+  char cwd[MAX_PATH_LENGTH];
+  char disk_name[MAX_PATH_LENGTH];
+  char pipe_name_base[MAX_PATH_LENGTH];
+
+  oufs_get_environment(cwd, disk_name, pipe_name_base);
+
+  // Check arguments
+  if(argc < 2) {
+    fprintf(stderr, "Usage: oufs_async_cat <file name> ...\n");
+    return(-1);
+  }
+
+  // Open the virtual disk
+  OUFS_MOUNT *mnt = oufs_mount(disk_name, pipe_name_base);
+  if(mnt == NULL)
+    return(-1);
+  OUFS_ASYNC *engine = oufs_async_start(mnt, ASYNC_CAT_THREADS);
+  if(engine == NULL) {
+    oufs_unmount(mnt);
+    return(-1);
+  }
+
+  // Start every read, then wait for all of them
+  std::vector<CatFile> files(argc - 1);
+  std::latch done(argc - 1);
+  for(int i = 1; i < argc; ++i) {
+    files[i - 1].path = argv[i];
+    cat_read(engine, cwd, &files[i - 1], &done);
+  }
+  done.wait();
+
+  int ret = 0;
+  for(CatFile &file : files) {
+    if(!file.ok) {
+      fprintf(stderr, "Unable to read %s\n", file.path);
+      ret = -1;
+    }
+    fwrite(file.data.data(), 1, file.data.size(), stdout);
+  }
+
+  // Clean up
+  oufs_async_stop(engine);
+  oufs_unmount(mnt);
+
+  return(ret);
+}
@@ -0,0 +1,671 @@
+/**
+Measure the throughput of the OU File System library:
+
+  oufs_bench <benchmark> [<repetitions>]
+
+The benchmarks (run oufs_bench with no arguments for the list) work on a
+scratch file or directory that they remove again, on the disk given by
+OUFS_DISK; a freshly formatted disk is best.  Each one is repeated
+<repetitions> times (default: BENCH_REPETITIONS) and reports MB/s (or
+operations per second) for each of its cases.  The data that is read back
+is checked as well.  Benchmarks of the tools run them from the directory
+that holds oufs_bench, once per BENCH_TOOL_DIVISOR repetitions.
+
+Exits with -1 if anything fails.
+
+CS3113
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "oufs_lib.h"
+#include "oufs_tree.h"
+#include "oufs_walk.h"
+#include "virtual_disk.h"
+
+#define BENCH_REPETITIONS 200
+
+// Largest file that the disk can hold
+#define BENCH_FILE_SIZE ((FILE_OFFSET) MAX_BLOCKS_IN_FILE * DATA_BLOCK_SIZE)
+
+// Size of the file that the copy benchmark copies (the copy must fit as
+//  well), and the buffer through which oufs_copy used to stage it
+#define BENCH_COPY_SIZE ((FILE_OFFSET) 50 * DATA_BLOCK_SIZE)
+#define BENCH_COPY_BUFFER 1000
+
+// Shape of the scratch tree: directories, files in each, and file size
+//  (a copy of the whole tree must fit on the disk too)
+#define BENCH_TREE_DIRS 4
+#define BENCH_TREE_FILES 5
+#define BENCH_TREE_FILE_SIZE ((FILE_OFFSET) 2 * DATA_BLOCK_SIZE)
+#define BENCH_TREE_SIZE ((FILE_OFFSET) BENCH_TREE_DIRS * BENCH_TREE_FILES * BENCH_TREE_FILE_SIZE)
+
+// Files and directories in the scratch tree, its root included
+#define BENCH_TREE_ENTRIES (1 + BENCH_TREE_DIRS * (1 + BENCH_TREE_FILES))
+
+// Largest number of threads of the tree benchmarks
+#define BENCH_MAX_THREADS 4
+
+// Starting a tool costs far more than a call of the library
+#define BENCH_TOOL_DIVISOR 20
+
+// Bytes per call of the scattered reads and writes, and the distance
+//  between the offsets of consecutive calls (prime, so not block-aligned)
+#define BENCH_CHUNK 1000
+#define BENCH_STRIDE 7919
+
+// One benchmark
+typedef struct
+{
+  char *name;
+  char *description;
+  int (*run)(OUFS_MOUNT *mnt, int repetitions);
+} BENCHMARK;
+
+// What a walk of the scratch tree found
+typedef struct
+{
+  int n_entries;
+  FILE_OFFSET n_bytes;
+} BENCH_WALK_TOTALS;
+
+// Directory that holds the tools
+static char bench_tool_dir[MAX_PATH_LENGTH];
+
+/**
+ * Time since some fixed point
+ *
+ * @return Seconds
+ */
+static double bench_now()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return(now.tv_sec + now.tv_nsec / 1e9);
+}
+
+/**
+ * Print one result line
+ *
+ * @param what Case that was measured
+ * @param bytes Bytes moved (over all repetitions)
+ * @param seconds Time that it took
+ */
+static void bench_report(char *what, double bytes, double seconds)
+{
+  printf("%-32s %10.3f s %10.2f MB/s\n", what, seconds,
+         seconds > 0 ? bytes / seconds / 1e6 : 0.0);
+}
+
+/**
+ * Print one result line, for a benchmark that counts operations
+ *
+ * @param what Case that was measured
+ * @param ops Operations done (over all repetitions)
+ * @param seconds Time that it took
+ */
+static void bench_report_ops(char *what, double ops, double seconds)
+{
+  printf("%-32s %10.3f s %10.0f ops/s\n", what, seconds, seconds > 0 ? ops / seconds : 0.0);
+}
+
+/**
+ * Fill a buffer with bytes that depend on their position
+ *
+ * @param data Buffer
+ * @param len Number of bytes
+ * @param seed Changes the bytes
+ */
+static void bench_fill(unsigned char *data, FILE_OFFSET len, int seed)
+{
+  for(FILE_OFFSET i = 0; i < len; ++i)
+    data[i] = (i * 7 + seed) ^ (i >> 8);
+}
+
+/**
+ * Write a whole file through oufs_fwrite(), buf_size bytes at a time
+ *
+ * @param mnt Mount of the virtual disk
+ * @param path Absolute path of the file (created or truncated)
+ * @param data Contents
+ * @param len Size of the file
+ * @param buf_size Bytes per call
+ * @return 0 if success
+ *         -x if error
+ */
+static int bench_write_file(OUFS_MOUNT *mnt, char *path, unsigned char *data, FILE_OFFSET len,
+                            FILE_OFFSET buf_size)
+{
+  OUFILE *fp = oufs_fopen(mnt, "/", path, "w");
+  if(fp == NULL)
+    return(-1);
+  int ret = 0;
+  for(FILE_OFFSET done = 0; done < len && ret == 0; done += buf_size) {
+    FILE_OFFSET n = MIN(buf_size, len - done);
+    if(oufs_fwrite(fp, data + done, n) != n)
+      ret = -2;
+  }
+  if(oufs_fclose(fp) != 0)
+    ret = -3;
+  return(ret);
+}
+
+/**
+ * Read a whole file through oufs_fread(), buf_size bytes at a time
+ *
+ * @param mnt Mount of the virtual disk
+ * @param path Absolute path of the file
+ * @param data Filled in with the contents
+ * @param len Size of data
+ * @param buf_size Bytes per call
+ * @return Size of the file
+ *         -x if error
+ */
+static FILE_OFFSET bench_read_file(OUFS_MOUNT *mnt, char *path, unsigned char *data, FILE_OFFSET len,
+                                   FILE_OFFSET buf_size)
+{
+  OUFILE *fp = oufs_fopen(mnt, "/", path, "r");
+  if(fp == NULL)
+    return(-1);
+  FILE_OFFSET done = 0;
+  FILE_OFFSET n;
+  while(done < len && (n = oufs_fread(fp, data + done, MIN(buf_size, len - done))) > 0)
+    done += n;
+  oufs_fclose(fp);
+  return(done);
+}
+
+/**
+ * oufs_fwrite() and oufs_fread() of a file of the largest size, with
+ *  buffers of several sizes (a buffer of 1 byte shows the cost per call)
+ *
+ * @param mnt Mount of the virtual disk
+ * @param repetitions Number of times that each case is repeated
+ * @return 0 if success
+ *         -x if error
+ */
+static int bench_io(OUFS_MOUNT *mnt, int repetitions)
+{
+  static unsigned char data[BENCH_FILE_SIZE];
+  static unsigned char back[BENCH_FILE_SIZE];
+  FILE_OFFSET buf_sizes[] = {1, 16, 100, DATA_BLOCK_SIZE, 1000, 4096, BENCH_FILE_SIZE};
+  char what[64];
+  int ret = 0;
+
+  bench_fill(data, BENCH_FILE_SIZE, 1);
+  for(int s = 0; s < sizeof(buf_sizes) / sizeof(buf_sizes[0]) && ret == 0; ++s) {
+    double start = bench_now();
+    for(int r = 0; r < repetitions && ret == 0; ++r)
+      ret = bench_write_file(mnt, "/bench", data, BENCH_FILE_SIZE, buf_sizes[s]);
+    sprintf(what, "fwrite, %lld-byte buffer", (long long) buf_sizes[s]);
+    bench_report(what, (double) BENCH_FILE_SIZE * repetitions, bench_now() - start);
+
+    start = bench_now();
+    for(int r = 0; r < repetitions && ret == 0; ++r) {
+      if(bench_read_file(mnt, "/bench", back, BENCH_FILE_SIZE, buf_sizes[s]) != BENCH_FILE_SIZE ||
+         memcmp(back, data, BENCH_FILE_SIZE) != 0)
+        ret = -4;
+    }
+    sprintf(what, "fread, %lld-byte buffer", (long long) buf_sizes[s]);
+    bench_report(what, (double) BENCH_FILE_SIZE * repetitions, bench_now() - start);
+  }
+  oufs_remove(mnt, "/", "/bench");
+  return(ret);
+}
+
+/**
+ * oufs_pwrite() and oufs_pread() at scattered offsets within a file of the
+ *  largest size, BENCH_CHUNK bytes at a time
+ *
+ * @param mnt Mount of the virtual disk
+ * @param repetitions Number of passes over the file
+ * @return 0 if success
+ *         -x if error
+ */
+static int bench_large(OUFS_MOUNT *mnt, int repetitions)
+{
+  static unsigned char data[BENCH_FILE_SIZE];
+  unsigned char buf[BENCH_CHUNK];
+  int n_chunks = BENCH_FILE_SIZE / BENCH_CHUNK;
+  int ret = 0;
+
+  bench_fill(data, BENCH_FILE_SIZE, 2);
+  if(bench_write_file(mnt, "/bench", data, BENCH_FILE_SIZE, BENCH_FILE_SIZE) != 0)
+    return(-1);
+  OUFILE *fp = oufs_fopen(mnt, "/", "/bench", "r+");
+  if(fp == NULL) {
+    oufs_remove(mnt, "/", "/bench");
+    return(-2);
+  }
+
+  // Chunk i of a pass starts at (i * BENCH_STRIDE) % size: every byte
+  //  offset within a block is used, in no particular order
+  double start = bench_now();
+  for(int r = 0; r < repetitions && ret == 0; ++r) {
+    for(int i = 0; i < n_chunks && ret == 0; ++i) {
+      FILE_OFFSET offset = ((FILE_OFFSET) i * BENCH_STRIDE) % (BENCH_FILE_SIZE - BENCH_CHUNK);
+      if(oufs_pwrite(fp, data + offset, BENCH_CHUNK, offset) != BENCH_CHUNK)
+        ret = -3;
+    }
+  }
+  bench_report("pwrite, scattered", (double) n_chunks * BENCH_CHUNK * repetitions, bench_now() - start);
+
+  start = bench_now();
+  for(int r = 0; r < repetitions && ret == 0; ++r) {
+    for(int i = 0; i < n_chunks && ret == 0; ++i) {
+      FILE_OFFSET offset = ((FILE_OFFSET) i * BENCH_STRIDE) % (BENCH_FILE_SIZE - BENCH_CHUNK);
+      if(oufs_pread(fp, buf, BENCH_CHUNK, offset) != BENCH_CHUNK ||
+         memcmp(buf, data + offset, BENCH_CHUNK) != 0)
+        ret = -4;
+    }
+  }
+  bench_report("pread, scattered", (double) n_chunks * BENCH_CHUNK * repetitions, bench_now() - start);
+
+  if(oufs_fclose(fp) != 0 && ret == 0)
+    ret = -5;
+  oufs_remove(mnt, "/", "/bench");
+  return(ret);
+}
+
+/**
+ * Copy one file to another inside the image, either through a user buffer
+ *  (oufs_fread()/oufs_fwrite()) or with oufs_copy_file_range()
+ *
+ * @param mnt Mount of the virtual disk
+ * @param src Absolute path of the file to copy
+ * @param dst Absolute path of the copy (created or truncated)
+ * @param buffered 1 to copy through a buffer of BENCH_COPY_BUFFER bytes
+ * @return Number of bytes copied
+ *         -x if error
+ */
+static FILE_OFFSET bench_copy_file(OUFS_MOUNT *mnt, char *src, char *dst, int buffered)
+{
+  unsigned char buf[BENCH_COPY_BUFFER];
+  FILE_OFFSET done = 0;
+  FILE_OFFSET n;
+
+  OUFILE *fp_in = oufs_fopen(mnt, "/", src, "r");
+  if(fp_in == NULL)
+    return(-1);
+  OUFILE *fp_out = oufs_fopen(mnt, "/", dst, "w");
+  if(fp_out == NULL) {
+    oufs_fclose(fp_in);
+    return(-1);
+  }
+  if(buffered) {
+    while((n = oufs_fread(fp_in, buf, sizeof(buf))) > 0 && oufs_fwrite(fp_out, buf, n) == n)
+      done += n;
+  }else{
+    while((n = oufs_copy_file_range(fp_in, fp_out, BENCH_COPY_SIZE)) > 0)
+      done += n;
+  }
+  oufs_fclose(fp_in);
+  if(oufs_fclose(fp_out) != 0 || n < 0)
+    return(-2);
+  return(done);
+}
+
+/**
+ * Copy a file inside the image through a user buffer, as oufs_copy used
+ *  to, and with oufs_copy_file_range()
+ *
+ * @param mnt Mount of the virtual disk
+ * @param repetitions Number of times that each case is repeated
+ * @return 0 if success
+ *         -x if error
+ */
+static int bench_copy(OUFS_MOUNT *mnt, int repetitions)
+{
+  static unsigned char data[BENCH_COPY_SIZE];
+  static unsigned char back[BENCH_COPY_SIZE];
+  char *cases[] = {"copy, oufs_fread/oufs_fwrite", "copy, oufs_copy_file_range"};
+  int ret = 0;
+
+  bench_fill(data, BENCH_COPY_SIZE, 3);
+  if(bench_write_file(mnt, "/bench", data, BENCH_COPY_SIZE, BENCH_COPY_SIZE) != 0)
+    return(-1);
+  for(int c = 0; c < 2 && ret == 0; ++c) {
+    double start = bench_now();
+    for(int r = 0; r < repetitions && ret == 0; ++r) {
+      if(bench_copy_file(mnt, "/bench", "/bench_copy", c == 0) != BENCH_COPY_SIZE)
+        ret = -2;
+    }
+    bench_report(cases[c], (double) BENCH_COPY_SIZE * repetitions, bench_now() - start);
+    if(ret == 0 && (bench_read_file(mnt, "/bench_copy", back, BENCH_COPY_SIZE, BENCH_COPY_SIZE) !=
+                    BENCH_COPY_SIZE || memcmp(back, data, BENCH_COPY_SIZE) != 0))
+      ret = -3;
+  }
+  oufs_remove(mnt, "/", "/bench_copy");
+  oufs_remove(mnt, "/", "/bench");
+  return(ret);
+}
+
+/**
+ * Make the scratch tree: BENCH_TREE_DIRS directories d0, d1, ... of
+ *  BENCH_TREE_FILES files f0, f1, ... each
+ *
+ * @param mnt Mount of the virtual disk
+ * @param root Absolute path of the tree (must not exist)
+ * @param data Contents of every file (BENCH_TREE_FILE_SIZE bytes)
+ * @return 0 if success
+ *         -x if error
+ */
+static int bench_make_tree(OUFS_MOUNT *mnt, char *root, unsigned char *data)
+{
+  char path[MAX_PATH_LENGTH];
+
+  if(oufs_mkdir(mnt, "/", root) != 0)
+    return(-1);
+  for(int d = 0; d < BENCH_TREE_DIRS; ++d) {
+    snprintf(path, MAX_PATH_LENGTH, "%s/d%d", root, d);
+    if(oufs_mkdir(mnt, "/", path) != 0)
+      return(-1);
+    for(int f = 0; f < BENCH_TREE_FILES; ++f) {
+      snprintf(path, MAX_PATH_LENGTH, "%s/d%d/f%d", root, d, f);
+      if(bench_write_file(mnt, path, data, BENCH_TREE_FILE_SIZE, BENCH_TREE_FILE_SIZE) != 0)
+        return(-2);
+    }
+  }
+  return(0);
+}
+
+/**
+ * Run one of the tools, with its output going to /dev/null
+ *
+ * @param args Name of the tool and its arguments
+ * @return 0 if the tool succeeded
+ *         -x if error
+ */
+static int bench_run_tool(char *args)
+{
+  char command[3 * MAX_PATH_LENGTH];
+  snprintf(command, sizeof(command), "%s/%s > /dev/null 2>&1", bench_tool_dir, args);
+  return(system(command) == 0 ? 0 : -1);
+}
+
+/**
+ * oufs_export of the scratch tree as a tar archive, against oufs_cat of
+ *  each of its files (one process per file)
+ *
+ * @param mnt Mount of the virtual disk
+ * @param repetitions Number of times that each case is repeated (divided
+ *          by BENCH_TOOL_DIVISOR)
+ * @return 0 if success
+ *         -x if error
+ */
+static int bench_export(OUFS_MOUNT *mnt, int repetitions)
+{
+  static unsigned char data[BENCH_TREE_FILE_SIZE];
+  unsigned char back[BENCH_TREE_FILE_SIZE + 1];
+  char args[2 * MAX_PATH_LENGTH];
+  char host_dir[] = "/tmp/oufs_bench_XXXXXX";
+  int ret = 0;
+
+  repetitions = (repetitions + BENCH_TOOL_DIVISOR - 1) / BENCH_TOOL_DIVISOR;
+  bench_fill(data, BENCH_TREE_FILE_SIZE, 4);
+  if(bench_make_tree(mnt, "/bench_tree", data) != 0)
+    ret = -1;
+
+  // Once into a host directory, to check what comes out
+  if(ret == 0 && mkdtemp(host_dir) == NULL)
+    ret = -2;
+  if(ret == 0) {
+    snprintf(args, sizeof(args), "oufs_export /bench_tree %s/out", host_dir);
+    if(bench_run_tool(args) != 0)
+      ret = -3;
+    for(int i = 0; ret == 0 && i < BENCH_TREE_DIRS * BENCH_TREE_FILES; ++i) {
+      snprintf(args, sizeof(args), "%s/out/d%d/f%d", host_dir, i / BENCH_TREE_FILES,
+               i % BENCH_TREE_FILES);
+      FILE *fp = fopen(args, "r");
+      if(fp == NULL || fread(back, 1, sizeof(back), fp) != BENCH_TREE_FILE_SIZE ||
+         memcmp(back, data, BENCH_TREE_FILE_SIZE) != 0)
+        ret = -4;
+      if(fp != NULL)
+        fclose(fp);
+    }
+    snprintf(args, sizeof(args), "rm -rf %s", host_dir);
+    if(system(args) != 0 && ret == 0)
+      ret = -5;
+  }
+
+  if(ret == 0) {
+    double start = bench_now();
+    for(int r = 0; r < repetitions && ret == 0; ++r)
+      ret = bench_run_tool("oufs_export /bench_tree");
+    bench_report("oufs_export, tar", (double) BENCH_TREE_SIZE * repetitions, bench_now() - start);
+  }
+  if(ret == 0) {
+    double start = bench_now();
+    for(int r = 0; r < repetitions && ret == 0; ++r) {
+      for(int i = 0; i < BENCH_TREE_DIRS * BENCH_TREE_FILES && ret == 0; ++i) {
+        snprintf(args, sizeof(args), "oufs_cat /bench_tree/d%d/f%d", i / BENCH_TREE_FILES,
+                 i % BENCH_TREE_FILES);
+        ret = bench_run_tool(args);
+      }
+    }
+    bench_report("oufs_cat, one per file", (double) BENCH_TREE_SIZE * repetitions,
+                 bench_now() - start);
+  }
+
+  oufs_remove_tree(mnt, "/", "/bench_tree", 1);
+  return(ret);
+}
+
+/**
+ * oufs_copy_tree() and oufs_remove_tree() of the scratch tree, with 1, 2,
+ *  ... BENCH_MAX_THREADS threads (one operation per file or directory)
+ *
+ * @param mnt Mount of the virtual disk
+ * @param repetitions Number of times that each case is repeated
+ * @return 0 if success
+ *         -x if error
+ */
+static int bench_tree(OUFS_MOUNT *mnt, int repetitions)
+{
+  static unsigned char data[BENCH_TREE_FILE_SIZE];
+  unsigned char back[BENCH_TREE_FILE_SIZE];
+  char what[64];
+  int ret = 0;
+
+  bench_fill(data, BENCH_TREE_FILE_SIZE, 5);
+  if(bench_make_tree(mnt, "/bench_tree", data) != 0)
+    ret = -1;
+  for(int n_threads = 1; n_threads <= BENCH_MAX_THREADS && ret == 0; n_threads *= 2) {
+    double copy_time = 0;
+    double remove_time = 0;
+    for(int r = 0; r < repetitions && ret == 0; ++r) {
+      double start = bench_now();
+      if(oufs_copy_tree(mnt, "/", "/bench_tree", "/bench_copy", n_threads) != 0)
+        ret = -2;
+      copy_time += bench_now() - start;
+      if(ret == 0 && (bench_read_file(mnt, "/bench_copy/d1/f1", back, BENCH_TREE_FILE_SIZE,
+                                      BENCH_TREE_FILE_SIZE) != BENCH_TREE_FILE_SIZE ||
+                      memcmp(back, data, BENCH_TREE_FILE_SIZE) != 0))
+        ret = -3;
+      start = bench_now();
+      if(oufs_remove_tree(mnt, "/", "/bench_copy", n_threads) != 0 && ret == 0)
+        ret = -4;
+      remove_time += bench_now() - start;
+    }
+    sprintf(what, "copy tree, %d threads", n_threads);
+    bench_report_ops(what, (double) BENCH_TREE_ENTRIES * repetitions, copy_time);
+    sprintf(what, "remove tree, %d threads", n_threads);
+    bench_report_ops(what, (double) BENCH_TREE_ENTRIES * repetitions, remove_time);
+  }
+  oufs_remove_tree(mnt, "/", "/bench_tree", 1);
+  return(ret);
+}
+
+/**
+ * Walk a directory one entry at a time with oufs_readdirplus(), as
+ *  oufs_ls would (the starting point is not counted)
+ *
+ * @param mnt Mount of the virtual disk
+ * @param path Absolute path of the directory
+ * @param totals Counts of the entries and of the bytes of the files
+ * @return 0 if success
+ *         -x if error
+ */
+static int bench_list_tree(OUFS_MOUNT *mnt, char *path, BENCH_WALK_TOTALS *totals)
+{
+  OUDIRENT_PLUS entries[N_DIRECTORY_ENTRIES_PER_BLOCK];
+  char child[MAX_PATH_LENGTH];
+
+  OUDIR *dp = oufs_opendir(mnt, "/", path);
+  if(dp == NULL)
+    return(-1);
+  int n = oufs_readdirplus(dp, entries, N_DIRECTORY_ENTRIES_PER_BLOCK);
+  oufs_closedir(dp);
+  if(n < 0)
+    return(-2);
+  int ret = 0;
+  for(int i = 0; i < n && ret == 0; ++i) {
+    if(strcmp(entries[i].name, ".") == 0 || strcmp(entries[i].name, "..") == 0)
+      continue;
+    ++totals->n_entries;
+    if(entries[i].type == DIRECTORY_TYPE) {
+      snprintf(child, MAX_PATH_LENGTH, "%s/%s", path, entries[i].name);
+      ret = bench_list_tree(mnt, child, totals);
+    }else{
+      totals->n_bytes += entries[i].size;
+    }
+  }
+  return(ret);
+}
+
+/**
+ * Count an entry reached by oufs_walk() (on any of its threads)
+ *
+ * @param entry The file or directory
+ * @param user The BENCH_WALK_TOTALS
+ */
+static void bench_walk_visit(OUFS_WALK_ENTRY *entry, void *user)
+{
+  BENCH_WALK_TOTALS *totals = user;
+  __atomic_add_fetch(&totals->n_entries, 1, __ATOMIC_RELAXED);
+  if(entry->inode.type == FILE_TYPE && entry->first)
+    __atomic_add_fetch(&totals->n_bytes, entry->inode.size, __ATOMIC_RELAXED);
+}
+
+/**
+ * Space used by the scratch tree, as oufs_du finds it: a walk with
+ *  oufs_readdirplus() one directory at a time, against oufs_walk() with
+ *  1, 2, ... BENCH_MAX_THREADS threads (one operation per file or
+ *  directory)
+ *
+ * @param mnt Mount of the virtual disk
+ * @param repetitions Number of times that each case is repeated
+ * @return 0 if success
+ *         -x if error
+ */
+static int bench_walk(OUFS_MOUNT *mnt, int repetitions)
+{
+  static unsigned char data[BENCH_TREE_FILE_SIZE];
+  BENCH_WALK_TOTALS totals;
+  char what[64];
+  int ret = 0;
+
+  bench_fill(data, BENCH_TREE_FILE_SIZE, 6);
+  if(bench_make_tree(mnt, "/bench_tree", data) != 0)
+    ret = -1;
+
+  double start = bench_now();
+  for(int r = 0; r < repetitions && ret == 0; ++r) {
+    // The starting point counts, as in a walk
+    totals.n_entries = 1;
+    totals.n_bytes = 0;
+    if(bench_list_tree(mnt, "/bench_tree", &totals) != 0 ||
+       totals.n_entries != BENCH_TREE_ENTRIES || totals.n_bytes != BENCH_TREE_SIZE)
+      ret = -2;
+  }
+  bench_report_ops("oufs_readdirplus, by directory", (double) BENCH_TREE_ENTRIES * repetitions,
+                   bench_now() - start);
+
+  for(int n_threads = 1; n_threads <= BENCH_MAX_THREADS && ret == 0; n_threads *= 2) {
+    start = bench_now();
+    for(int r = 0; r < repetitions && ret == 0; ++r) {
+      totals.n_entries = 0;
+      totals.n_bytes = 0;
+      if(oufs_walk(mnt, "/", "/bench_tree", n_threads, bench_walk_visit, &totals) != 0 ||
+         totals.n_entries != BENCH_TREE_ENTRIES || totals.n_bytes != BENCH_TREE_SIZE)
+        ret = -3;
+    }
+    sprintf(what, "oufs_walk, %d threads", n_threads);
+    bench_report_ops(what, (double) BENCH_TREE_ENTRIES * repetitions, bench_now() - start);
+  }
+  oufs_remove_tree(mnt, "/", "/bench_tree", 1);
+  return(ret);
+}
+
+// Every benchmark, in the order in which "all" runs them
+static BENCHMARK benchmarks[] = {
+  {"io", "oufs_fwrite/oufs_fread with buffers of several sizes", bench_io},
+  {"large", "oufs_pwrite/oufs_pread at scattered offsets of the largest file", bench_large},
+  {"copy", "copy inside the image, through a buffer and with oufs_copy_file_range", bench_copy},
+  {"export", "oufs_export of a tree, against oufs_cat of each of its files", bench_export},
+  {"tree", "oufs_copy_tree/oufs_remove_tree of a tree with 1, 2 and 4 threads", bench_tree},
+  {"walk", "space used by a tree: by directory, and oufs_walk with 1, 2 and 4 threads", bench_walk},
+};
+
+#define N_BENCHMARKS ((int)(sizeof(benchmarks) / sizeof(benchmarks[0])))
+
+int main(int argc, char** argv) {
+  // Fetch the key environment vars
+  char cwd[MAX_PATH_LENGTH];
+  char disk_name[MAX_PATH_LENGTH];
+  char pipe_name_base[MAX_PATH_LENGTH];
+
+  oufs_get_environment(cwd, disk_name, pipe_name_base);
+
+  // The tools are next to oufs_bench
+  char *slash = strrchr(argv[0], '/');
+  if(slash == NULL)
+    strcpy(bench_tool_dir, ".");
+  else
+    snprintf(bench_tool_dir, MAX_PATH_LENGTH, "%.*s", (int)(slash - argv[0]), argv[0]);
+
+  // Check arguments
+  int repetitions = (argc > 2) ? atoi(argv[2]) : BENCH_REPETITIONS;
+  if(argc < 2 || argc > 3 || repetitions <= 0) {
+    fprintf(stderr, "Usage: oufs_bench <benchmark> [<repetitions>]\n");
+    fprintf(stderr, "  all\t\tevery benchmark below\n");
+    for(int i = 0; i < N_BENCHMARKS; ++i)
+      fprintf(stderr, "  %s\t\t%s\n", benchmarks[i].name, benchmarks[i].description);
+    return(-1);
+  }
+
+  int found = 0;
+  for(int i = 0; i < N_BENCHMARKS; ++i)
+    found |= (strcmp(argv[1], "all") == 0 || strcmp(argv[1], benchmarks[i].name) == 0);
+  if(!found) {
+    fprintf(stderr, "oufs_bench: unknown benchmark %s\n", argv[1]);
+    return(-1);
+  }
+
+  // Open the virtual disk
+  OUFS_MOUNT *mnt = oufs_mount(disk_name, pipe_name_base);
+  if(mnt == NULL)
+    return(-1);
+  mnt->debug = 0;
+
+  int ret = 0;
+  for(int i = 0; i < N_BENCHMARKS; ++i) {
+    if(strcmp(argv[1], "all") != 0 && strcmp(argv[1], benchmarks[i].name) != 0)
+      continue;
+    printf("%s:\n", benchmarks[i].name);
+    if(benchmarks[i].run(mnt, repetitions) != 0) {
+      fprintf(stderr, "oufs_bench: %s failed\n", benchmarks[i].name);
+      ret = -1;
+    }
+  }
+
+  // Clean up
+  oufs_unmount(mnt);
+
+  return(ret);
+}
@@ -11,8 +11,6 @@
 #include "oufs_lib.h"
 #include "virtual_disk.h"
 
-#define BUF_SIZE 1000
-
 int main(int argc, char** argv) {
     // Fetch the key environment vars
     char cwd[MAX_PATH_LENGTH];
@@ -22,21 +20,20 @@ int main(int argc, char** argv) {
     oufs_get_environment(cwd, disk_name, pipe_name_base);
     
     // Open the virtual disk
-    virtual_disk_attach(disk_name, pipe_name_base);
+    OUFS_MOUNT *mnt = oufs_mount(disk_name, pipe_name_base);
+    if(mnt == NULL)
+      return(-1);
     
     // Check parameters
     if(argc != 2) {
         fprintf(stderr, "Usage: oufs_cat <file name>\n");
     }else{
-        OUFILE *fp = oufs_fopen(cwd, argv[1], "r");
-        unsigned char buf[BUF_SIZE];
+        OUFILE *fp = oufs_fopen(mnt, cwd, argv[1], "r");
         if(fp != NULL) {
             // Successfully opened the file for reading
-            int n;
-            // Loop until the contents of the file are all printed to STDOUT
-            while((n = oufs_fread(fp, buf, BUF_SIZE)) != 0) {
-                write(1, buf, n);
-            }
+            // Loop until the contents of the file are all sent to STDOUT
+            while(oufs_sendfile(fp, 1, INT_MAX) > 0)
+                ;
             
             // Clean up
             oufs_fclose(fp);
@@ -44,7 +41,7 @@ int main(int argc, char** argv) {
     }
     
     // Clean up
-    virtual_disk_detach();
+    oufs_unmount(mnt);
     
     return(0);
 }
@@ -2,6 +2,7 @@
 #include <string.h>
 
 #include "oufs_lib.h" 
+#include "oufs_tree.h"
 #include "virtual_disk.h"
 
 int main(int argc, char** argv) {
@@ -13,19 +14,25 @@ int main(int argc, char** argv) {
   oufs_get_environment(cwd, disk_name, pipe_name_base);
 
   // Open the virtual disk
-  virtual_disk_attach(disk_name, pipe_name_base);
-  if(argc != 3) {
-    fprintf(stderr, "Usage: oufs_copy <source file name> <destination file name>\n");
+  OUFS_MOUNT *mnt = oufs_mount(disk_name, pipe_name_base);
+  if(mnt == NULL)
+    return(-1);
+  int ret = 0;
+  if(argc == 4 && strcmp(argv[1], "-r") == 0) {
+    // Directories too, with everything in them
+    if(oufs_copy_tree(mnt, cwd, argv[2], argv[3], 0) != 0)
+      ret = -1;
+  }else if(argc != 3) {
+    fprintf(stderr, "Usage: oufs_copy [-r] <source file name> <destination file name>\n");
+    oufs_unmount(mnt);
     return(-1);
   }else{
-    OUFILE *fp_in = oufs_fopen(cwd, argv[1], "r");
-    OUFILE *fp_out = oufs_fopen(cwd, argv[2], "w");
-    unsigned char buf[1000];
+    OUFILE *fp_in = oufs_fopen(mnt, cwd, argv[1], "r");
+    OUFILE *fp_out = oufs_fopen(mnt, cwd, argv[2], "w");
     if(fp_in != NULL && fp_out != NULL) {
-      int n;
-      while((n = oufs_fread(fp_in, buf, 1000)) != 0) {
-	oufs_fwrite(fp_out, buf, n);
-      }
+      // Copy block-to-block inside the image
+      while(oufs_copy_file_range(fp_in, fp_out, INT_MAX) > 0)
+	;
     
       oufs_fclose(fp_in);
       oufs_fclose(fp_out);
@@ -33,7 +40,7 @@ int main(int argc, char** argv) {
   }
 
   // Clean up
-  virtual_disk_detach();
+  oufs_unmount(mnt);
   
-  return(0);
+  return(ret);
 }
@@ -15,11 +15,13 @@ int main(int argc, char** argv) {
   oufs_get_environment(cwd, disk_name, pipe_name_base);
 
   // Open the virtual disk
-  virtual_disk_attach(disk_name, pipe_name_base);
+  OUFS_MOUNT *mnt = oufs_mount(disk_name, pipe_name_base);
+  if(mnt == NULL)
+    return(-1);
   if(argc == 1) {
     fprintf(stderr, "Usage: oufs_create <file name>\n");
   }else{
-    OUFILE *fp = oufs_fopen(cwd, argv[1], "w");
+    OUFILE *fp = oufs_fopen(mnt, cwd, argv[1], "w");
     unsigned char buf[BUF_SIZE];
     if(fp != NULL) {
       int n;
@@ -32,7 +34,7 @@ int main(int argc, char** argv) {
   }
 
   // Clean up
-  virtual_disk_detach();
+  oufs_unmount(mnt);
   
   return(0);
 }
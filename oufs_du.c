@@ -0,0 +1,104 @@
+/**
+Report the disk space used by a tree of the OU File System (as du(1) does):
+the bytes of the blocks used by each directory and everything below it,
+subdirectories before the directories that hold them.  A file with several
+names is counted once.
+
+  oufs_du [-s] [<path>]
+
+  -s: only report the total for <path>
+
+CS3113
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "oufs_lib.h"
+#include "oufs_walk.h"
+#include "virtual_disk.h"
+
+// Usage, by directory id (see OUFS_WALK_ENTRY)
+typedef struct
+{
+  char path[N_INODES][MAX_PATH_LENGTH];
+  int parent_id[N_INODES];
+  FILE_OFFSET blocks[N_INODES];
+  int n_directories;
+
+  // Starting point, if it is a file
+  FILE_OFFSET file_blocks;
+  int is_file;
+} DU;
+
+/**
+ * Count the blocks of an entry (called by the walk)
+ *
+ * @param entry Entry that the walk has reached
+ * @param user The DU totals
+ */
+static void du_visit(OUFS_WALK_ENTRY *entry, void *user)
+{
+  DU *du = user;
+
+  if(!entry->first)
+    return;
+  if(entry->inode.type == DIRECTORY_TYPE) {
+    // Each id is only ever handed to one thread
+    strcpy(du->path[entry->id], entry->path);
+    du->parent_id[entry->id] = entry->parent_id;
+    __atomic_add_fetch(&du->blocks[entry->id], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&du->n_directories, 1, __ATOMIC_RELAXED);
+  }else{
+    FILE_OFFSET blocks = (entry->inode.size + DATA_BLOCK_SIZE - 1) / DATA_BLOCK_SIZE;
+    if(entry->parent_id >= 0) {
+      __atomic_add_fetch(&du->blocks[entry->parent_id], blocks, __ATOMIC_RELAXED);
+    }else{
+      du->file_blocks = blocks;
+      du->is_file = 1;
+    }
+  }
+}
+
+int main(int argc, char** argv) {
+  // Fetch the key environment vars
+  char cwd[MAX_PATH_LENGTH];
+  char disk_name[MAX_PATH_LENGTH];
+  char pipe_name_base[MAX_PATH_LENGTH];
+
+  oufs_get_environment(cwd, disk_name, pipe_name_base);
+
+  // Check arguments
+  int summary = (argc > 1 && strcmp(argv[1], "-s") == 0);
+  if(argc > 2 + summary) {
+    fprintf(stderr, "Usage: oufs_du [-s] [<path>]\n");
+    return(-1);
+  }
+  char *path = (argc == 2 + summary) ? argv[1 + summary] : ".";
+
+  // Open the virtual disk
+  OUFS_MOUNT *mnt = oufs_mount(disk_name, pipe_name_base);
+  if(mnt == NULL)
+    return(-1);
+
+  static DU du;
+  int ret = oufs_walk(mnt, cwd, path, 0, du_visit, &du);
+
+  // Ids follow the walk, breadth first: each subdirectory's total is final
+  //  before it is added to its parent's
+  if(du.is_file) {
+    printf("%lld\t%s\n", (long long) du.file_blocks * BLOCK_SIZE, path);
+  }
+  for(int id = du.n_directories - 1; id >= 0; --id) {
+    if(du.parent_id[id] >= 0)
+      du.blocks[du.parent_id[id]] += du.blocks[id];
+    if(!summary || id == 0)
+      printf("%lld\t%s\n", (long long) du.blocks[id] * BLOCK_SIZE, du.path[id]);
+  }
+
+  // Clean up
+  oufs_unmount(mnt);
+
+  return(ret == 0 ? 0 : -1);
+}
@@ -0,0 +1,533 @@
+/**
+Copy a directory tree of the OU File System out of the image in one pass:
+as a tar archive on STDOUT, or into a host directory.
+
+  oufs_export [<directory> [<host directory>]]
+
+The tree is walked first; the files are then read in order of their inodes
+(so the inode blocks, and mostly the data blocks too, are read in order)
+and written out through a large buffer.  Further names of a file that has
+several links become hard links.
+
+CS3113
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <errno.h>
+
+#include "oufs_lib.h"
+#include "virtual_disk.h"
+
+#define TAR_BLOCK_SIZE 512
+#define TAR_RECORD_SIZE (20 * TAR_BLOCK_SIZE)
+
+// Largest file that the image can hold
+#define MAX_FILE_SIZE ((FILE_OFFSET) MAX_BLOCKS_IN_FILE * DATA_BLOCK_SIZE)
+
+// Output is written in pieces of (at most) this size
+#define OUT_BUFFER_SIZE (64 * 1024)
+
+// One directory or file of the tree
+typedef struct
+{
+  // Path relative to the directory being exported
+  char path[MAX_PATH_LENGTH];
+  INODE_REFERENCE inode_reference;
+  FILE_OFFSET size;
+} EXPORT_ENTRY;
+
+// A growing array of entries
+typedef struct
+{
+  EXPORT_ENTRY *entry;
+  int n;
+  int capacity;
+} EXPORT_LIST;
+
+// State of an export
+typedef struct
+{
+  OUFS_MOUNT *mnt;
+  char cwd[MAX_PATH_LENGTH];
+  char root[MAX_PATH_LENGTH];
+
+  // Destination: a host directory, or (if NULL) a tar archive on out_fd
+  char *host_dir;
+  int out_fd;
+  unsigned char *out;
+  int out_count;
+  long long out_total;
+
+  int n_errors;
+} EXPORT;
+
+/**
+ * Add an entry to a list
+ *
+ * @param list List
+ * @return The new (uninitialized) entry; NULL if there is not enough
+ *         memory
+ */
+static EXPORT_ENTRY *export_add(EXPORT_LIST *list)
+{
+  if(list->n == list->capacity) {
+    int capacity = (list->capacity == 0) ? 64 : 2 * list->capacity;
+    EXPORT_ENTRY *entry = realloc(list->entry, capacity * sizeof(EXPORT_ENTRY));
+    if(entry == NULL)
+      return(NULL);
+    list->entry = entry;
+    list->capacity = capacity;
+  }
+  return(&list->entry[list->n++]);
+}
+
+/**
+ * Path in the image of an entry of the tree
+ *
+ * @param ex Export
+ * @param path Buffer of MAX_PATH_LENGTH bytes for the path
+ * @param rel Path relative to the directory being exported ("" for the
+ *          directory itself)
+ * @return 0 if success
+ *         -1 if the path is too long
+ */
+static int export_image_path(EXPORT *ex, char *path, char *rel)
+{
+  int n;
+  if(rel[0] == 0)
+    n = snprintf(path, MAX_PATH_LENGTH, "%s", ex->root);
+  else if(ex->root[0] == 0)
+    n = snprintf(path, MAX_PATH_LENGTH, "%s", rel);
+  else
+    n = snprintf(path, MAX_PATH_LENGTH, "%s/%s", ex->root, rel);
+  return((n < 0 || n >= MAX_PATH_LENGTH) ? -1 : 0);
+}
+
+/**
+ * Walk the tree breadth first, listing its directories (each before what it
+ *  contains) and its files
+ *
+ * @param ex Export
+ * @param dirs List for the directories (holds the root on entry)
+ * @param files List for the files
+ * @return 0 if success
+ *         -x if error
+ */
+static int export_walk(EXPORT *ex, EXPORT_LIST *dirs, EXPORT_LIST *files)
+{
+  OUDIRENT_PLUS entries[N_DIRECTORY_ENTRIES_PER_BLOCK];
+
+  // dirs grows while it is walked
+  for(int d = 0; d < dirs->n; ++d) {
+    char path[MAX_PATH_LENGTH];
+    char dir[MAX_PATH_LENGTH];
+    strcpy(dir, dirs->entry[d].path);
+    if(export_image_path(ex, path, dir) != 0)
+      return(-1);
+    OUDIR *dp = oufs_opendir(ex->mnt, ex->cwd, path);
+    if(dp == NULL) {
+      fprintf(stderr, "Unable to open directory %s\n", path);
+      return(-2);
+    }
+
+    int n;
+    while((n = oufs_readdirplus(dp, entries, N_DIRECTORY_ENTRIES_PER_BLOCK)) > 0) {
+      for(int i = 0; i < n; ++i) {
+        if(strcmp(entries[i].name, ".") == 0 || strcmp(entries[i].name, "..") == 0)
+          continue;
+
+        char rel[MAX_PATH_LENGTH];
+        int len;
+        if(dir[0] == 0)
+          len = snprintf(rel, MAX_PATH_LENGTH, "%s", entries[i].name);
+        else
+          len = snprintf(rel, MAX_PATH_LENGTH, "%s/%s", dir, entries[i].name);
+        if(len >= MAX_PATH_LENGTH) {
+          fprintf(stderr, "Name too long: %s/%s\n", dir, entries[i].name);
+          ++ex->n_errors;
+          continue;
+        }
+
+        EXPORT_ENTRY *e = export_add(entries[i].type == DIRECTORY_TYPE ? dirs : files);
+        if(e == NULL) {
+          oufs_closedir(dp);
+          return(-3);
+        }
+        strcpy(e->path, rel);
+        e->inode_reference = entries[i].inode_reference;
+        e->size = entries[i].size;
+      }
+    }
+    oufs_closedir(dp);
+  }
+  return(0);
+}
+
+/**
+ * Order of files: by inode (then by path, so that the first name of a file
+ *  is always the same)
+ */
+static int export_compare(const void *a, const void *b)
+{
+  const EXPORT_ENTRY *x = a;
+  const EXPORT_ENTRY *y = b;
+  if(x->inode_reference != y->inode_reference)
+    return((x->inode_reference < y->inode_reference) ? -1 : 1);
+  return(strcmp(x->path, y->path));
+}
+
+/**
+ * Write all of a buffer to a host file
+ *
+ * @param fd Descriptor of the file
+ * @param buf Buffer
+ * @param len Number of bytes
+ * @return 0 if success
+ *         -1 if error
+ */
+static int export_write_all(int fd, unsigned char *buf, int len)
+{
+  int done = 0;
+  while(done < len) {
+    ssize_t n = write(fd, buf + done, len - done);
+    if(n < 0) {
+      if(errno == EINTR)
+        continue;
+      perror("write");
+      return(-1);
+    }
+    done += n;
+  }
+  return(0);
+}
+
+/**
+ * Write out everything in the output buffer
+ *
+ * @param ex Export
+ * @return 0 if success
+ *         -1 if error
+ */
+static int export_flush(EXPORT *ex)
+{
+  int ret = export_write_all(ex->out_fd, ex->out, ex->out_count);
+  ex->out_count = 0;
+  return(ret);
+}
+
+/**
+ * Make room for n bytes in the output buffer
+ *
+ * @param ex Export
+ * @param n Number of bytes (at most OUT_BUFFER_SIZE)
+ * @return Where the bytes go; NULL if error
+ */
+static unsigned char *export_reserve(EXPORT *ex, int n)
+{
+  if(ex->out_count + n > OUT_BUFFER_SIZE && export_flush(ex) != 0)
+    return(NULL);
+  return(ex->out + ex->out_count);
+}
+
+/**
+ * Add zero bytes to the archive, up to a multiple of a size
+ *
+ * @param ex Export
+ * @param size Size to pad to
+ * @return 0 if success
+ *         -1 if error
+ */
+static int export_pad(EXPORT *ex, int size)
+{
+  int n = (size - ex->out_total % size) % size;
+  unsigned char *p = export_reserve(ex, n);
+  if(p == NULL)
+    return(-1);
+  memset(p, 0, n);
+  ex->out_count += n;
+  ex->out_total += n;
+  return(0);
+}
+
+/**
+ * Fill in a (ustar) header
+ *
+ * @param h Block of TAR_BLOCK_SIZE bytes for the header
+ * @param path Name of the entry
+ * @param type Type flag ('0' file, '1' hard link, '5' directory)
+ * @param size Size of the data that follows
+ * @param link_name Target of a hard link (or NULL)
+ * @return 0 if success
+ *         -1 if the name does not fit in a header
+ */
+static int export_fill_header(unsigned char *h, char *path, char type, FILE_OFFSET size,
+                              char *link_name)
+{
+  char name[MAX_PATH_LENGTH + 1];
+  snprintf(name, sizeof(name), (type == '5') ? "%s/" : "%s", path);
+
+  // Long names are split at a / into prefix and name
+  char *prefix = "";
+  char *base = name;
+  if(strlen(name) > 100) {
+    char *slash = strchr(name + strlen(name) - 101, '/');
+    if(slash == NULL || slash - name > 155)
+      return(-1);
+    *slash = 0;
+    prefix = name;
+    base = slash + 1;
+  }
+
+  if(link_name != NULL && strlen(link_name) > 100)
+    return(-1);
+
+  memset(h, 0, TAR_BLOCK_SIZE);
+  char *c = (char *) h;
+  strncpy(c, base, 100);
+  snprintf(c + 100, 8, "%07o", (type == '5') ? 0755 : 0644);
+  snprintf(c + 108, 8, "%07o", 0);
+  snprintf(c + 116, 8, "%07o", 0);
+  snprintf(c + 124, 12, "%011llo", (unsigned long long) size);
+  snprintf(c + 136, 12, "%011llo", (unsigned long long) time(NULL));
+  c[156] = type;
+  if(link_name != NULL)
+    strncpy(c + 157, link_name, 100);
+  memcpy(c + 257, "ustar", 6);
+  memcpy(c + 263, "00", 2);
+  strncpy(c + 345, prefix, 155);
+
+  // Checksum: of the header with the checksum field as spaces
+  memset(c + 148, ' ', 8);
+  unsigned int sum = 0;
+  for(int i = 0; i < TAR_BLOCK_SIZE; ++i)
+    sum += h[i];
+  snprintf(c + 148, 8, "%06o", sum);
+  return(0);
+}
+
+/**
+ * Add a header (with no data after it) to the archive
+ *
+ * @param ex Export
+ * @param path Name of the entry
+ * @param type Type flag ('1' hard link, '5' directory)
+ * @param link_name Target of a hard link (or NULL)
+ * @return 0 if success
+ *         -1 if the name does not fit in a header
+ *         -2 if error
+ */
+static int export_tar_header(EXPORT *ex, char *path, char type, char *link_name)
+{
+  unsigned char *h = export_reserve(ex, TAR_BLOCK_SIZE);
+  if(h == NULL)
+    return(-2);
+  if(export_fill_header(h, path, type, 0, link_name) != 0)
+    return(-1);
+  ex->out_count += TAR_BLOCK_SIZE;
+  ex->out_total += TAR_BLOCK_SIZE;
+  return(0);
+}
+
+/**
+ * Read the whole of a file of the tree
+ *
+ * @param ex Export
+ * @param e File
+ * @param buf Buffer of at least MAX_FILE_SIZE bytes
+ * @return Number of bytes read (the size of the file)
+ *         -x if error
+ */
+static FILE_OFFSET export_read(EXPORT *ex, EXPORT_ENTRY *e, unsigned char *buf)
+{
+  char path[MAX_PATH_LENGTH];
+  if(export_image_path(ex, path, e->path) != 0)
+    return(-1);
+  OUFILE *fp = oufs_fopen(ex->mnt, ex->cwd, path, "r");
+  if(fp == NULL)
+    return(-2);
+
+  // The file is read with read-ahead; one call would do, but the size
+  //  listed may be out of date
+  FILE_OFFSET total = 0;
+  FILE_OFFSET n;
+  while(total < MAX_FILE_SIZE && (n = oufs_fread(fp, buf + total, MAX_FILE_SIZE - total)) > 0)
+    total += n;
+  oufs_fclose(fp);
+  return(total);
+}
+
+/**
+ * Add a file to the archive
+ *
+ * @param ex Export
+ * @param e File
+ * @param first First name of the same file (already in the archive), or
+ *          NULL
+ * @return 0 if success
+ *         -x if error
+ */
+static int export_tar_file(EXPORT *ex, EXPORT_ENTRY *e, EXPORT_ENTRY *first)
+{
+  if(first != NULL)
+    return(export_tar_header(ex, e->path, '1', first->path));
+
+  // Read straight into the output buffer, after the header (which is
+  //  filled in once the size is known)
+  unsigned char *h = export_reserve(ex, TAR_BLOCK_SIZE + MAX_FILE_SIZE);
+  if(h == NULL)
+    return(-2);
+  FILE_OFFSET n = export_read(ex, e, h + TAR_BLOCK_SIZE);
+  if(n < 0)
+    return(-3);
+  if(export_fill_header(h, e->path, '0', n, NULL) != 0)
+    return(-1);
+  ex->out_count += TAR_BLOCK_SIZE + n;
+  ex->out_total += TAR_BLOCK_SIZE + n;
+  return(export_pad(ex, TAR_BLOCK_SIZE));
+}
+
+/**
+ * Copy a file into the host directory
+ *
+ * @param ex Export
+ * @param e File
+ * @param first First name of the same file (already copied), or NULL
+ * @return 0 if success
+ *         -x if error
+ */
+static int export_host_file(EXPORT *ex, EXPORT_ENTRY *e, EXPORT_ENTRY *first)
+{
+  char host_path[PATH_MAX];
+  snprintf(host_path, PATH_MAX, "%s/%s", ex->host_dir, e->path);
+  unlink(host_path);
+
+  if(first != NULL) {
+    char first_path[PATH_MAX];
+    snprintf(first_path, PATH_MAX, "%s/%s", ex->host_dir, first->path);
+    if(link(first_path, host_path) == 0)
+      return(0);
+    // (Otherwise, a copy)
+  }
+
+  FILE_OFFSET n = export_read(ex, e, ex->out);
+  if(n < 0)
+    return(-1);
+  int fd = open(host_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(fd < 0) {
+    fprintf(stderr, "Unable to create %s\n", host_path);
+    return(-3);
+  }
+  // One write of the whole file
+  int ret = export_write_all(fd, ex->out, n);
+  if(close(fd) != 0)
+    ret = -4;
+  return(ret);
+}
+
+int main(int argc, char** argv) {
+  // Fetch the key environment vars
+  EXPORT ex;
+  char disk_name[MAX_PATH_LENGTH];
+  char pipe_name_base[MAX_PATH_LENGTH];
+
+  oufs_get_environment(ex.cwd, disk_name, pipe_name_base);
+
+  // Check arguments
+  if(argc > 3) {
+    fprintf(stderr, "Usage: oufs_export [<directory> [<host directory>]]\n");
+    return(-1);
+  }
+  snprintf(ex.root, MAX_PATH_LENGTH, "%s", (argc >= 2) ? argv[1] : "");
+  ex.host_dir = (argc == 3) ? argv[2] : NULL;
+  ex.out_fd = 1;
+  ex.out_count = 0;
+  ex.out_total = 0;
+  ex.n_errors = 0;
+  ex.out = malloc(OUT_BUFFER_SIZE);
+  if(ex.out == NULL)
+    return(-1);
+  if(ex.host_dir != NULL && mkdir(ex.host_dir, 0755) != 0 && errno != EEXIST) {
+    fprintf(stderr, "Unable to make directory %s\n", ex.host_dir);
+    return(-1);
+  }
+
+  // Open the virtual disk
+  ex.mnt = oufs_mount(disk_name, pipe_name_base);
+  if(ex.mnt == NULL)
+    return(-1);
+
+  // The whole tree first
+  EXPORT_LIST dirs = {NULL, 0, 0};
+  EXPORT_LIST files = {NULL, 0, 0};
+  EXPORT_ENTRY *root = export_add(&dirs);
+  int ret = (root == NULL) ? -1 : 0;
+  if(root != NULL) {
+    root->path[0] = 0;
+    ret = export_walk(&ex, &dirs, &files);
+  }
+  if(ret == 0)
+    qsort(files.entry, files.n, sizeof(EXPORT_ENTRY), export_compare);
+
+  // Directories (not the root itself), then the files by inode
+  for(int i = 1; ret == 0 && i < dirs.n; ++i) {
+    if(ex.host_dir == NULL) {
+      int r = export_tar_header(&ex, dirs.entry[i].path, '5', NULL);
+      if(r == -1) {
+        fprintf(stderr, "Name too long: %s\n", dirs.entry[i].path);
+        ++ex.n_errors;
+      }else if(r != 0) {
+        ret = -1;
+      }
+    }else{
+      char host_path[PATH_MAX];
+      snprintf(host_path, PATH_MAX, "%s/%s", ex.host_dir, dirs.entry[i].path);
+      if(mkdir(host_path, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Unable to make directory %s\n", host_path);
+        ++ex.n_errors;
+      }
+    }
+  }
+  int first = 0;
+  for(int i = 0; ret == 0 && i < files.n; ++i) {
+    // Names of the same file are next to each other: all but the first
+    //  become links to the first
+    if(files.entry[i].inode_reference != files.entry[first].inode_reference)
+      first = i;
+    EXPORT_ENTRY *link_to = (first == i) ? NULL : &files.entry[first];
+    int r = (ex.host_dir == NULL) ? export_tar_file(&ex, &files.entry[i], link_to)
+                                  : export_host_file(&ex, &files.entry[i], link_to);
+    if(r != 0) {
+      fprintf(stderr, "Unable to export %s\n", files.entry[i].path);
+      ++ex.n_errors;
+      if(r == -2)
+        ret = -1;
+    }
+  }
+
+  // End of the archive: two zero blocks, and whole records
+  if(ret == 0 && ex.host_dir == NULL) {
+    unsigned char *p = export_reserve(&ex, 2 * TAR_BLOCK_SIZE);
+    if(p != NULL) {
+      memset(p, 0, 2 * TAR_BLOCK_SIZE);
+      ex.out_count += 2 * TAR_BLOCK_SIZE;
+      ex.out_total += 2 * TAR_BLOCK_SIZE;
+    }
+    if(p == NULL || export_pad(&ex, TAR_RECORD_SIZE) != 0 || export_flush(&ex) != 0)
+      ret = -1;
+  }
+
+  fprintf(stderr, "Exported %d directories and %d files (%d errors)\n",
+          dirs.n - 1, files.n, ex.n_errors);
+
+  // Clean up
+  oufs_unmount(ex.mnt);
+  free(dirs.entry);
+  free(files.entry);
+  free(ex.out);
+
+  return((ret == 0 && ex.n_errors == 0) ? 0 : -1);
+}
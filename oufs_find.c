@@ -0,0 +1,117 @@
+/**
+Search a tree of the OU File System (as find(1) does), printing the path of
+every file and directory that matches all of the tests:
+
+  oufs_find [<path>] [-name <glob>] [-type f|d] [-size [+|-]<bytes>]
+
+  -name: the name matches a shell pattern (fnmatch(3))
+  -type: f for files, d for directories
+  -size: exactly, more than (+) or less than (-) that many bytes
+
+The tree is walked breadth first by several threads, so paths are printed in
+no particular order.
+
+CS3113
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fnmatch.h>
+
+#include "oufs_lib.h"
+#include "oufs_walk.h"
+#include "virtual_disk.h"
+
+// Tests to apply
+typedef struct
+{
+  char *name;
+  int type;
+  FILE_OFFSET size;
+  int size_compare;
+} FIND;
+
+/**
+ * Print an entry if it passes the tests (called by the walk)
+ *
+ * @param entry Entry that the walk has reached
+ * @param user The FIND tests
+ */
+static void find_visit(OUFS_WALK_ENTRY *entry, void *user)
+{
+  FIND *find = user;
+
+  if(find->type != UNUSED_TYPE && entry->inode.type != find->type)
+    return;
+  if(find->size_compare != 0 || find->size >= 0) {
+    FILE_OFFSET diff = entry->inode.size - find->size;
+    if((find->size_compare == 0 && diff != 0) ||
+       (find->size_compare > 0 && diff <= 0) ||
+       (find->size_compare < 0 && diff >= 0))
+      return;
+  }
+  if(find->name != NULL) {
+    char *base = strrchr(entry->path, '/');
+    base = (base == NULL || base[1] == 0) ? entry->path : base + 1;
+    if(fnmatch(find->name, base, 0) != 0)
+      return;
+  }
+  // (One call per line, so that the lines of different threads do not mix)
+  printf("%s\n", entry->path);
+}
+
+int main(int argc, char** argv) {
+  // Fetch the key environment vars
+  char cwd[MAX_PATH_LENGTH];
+  char disk_name[MAX_PATH_LENGTH];
+  char pipe_name_base[MAX_PATH_LENGTH];
+
+  oufs_get_environment(cwd, disk_name, pipe_name_base);
+
+  // Check arguments
+  FIND find;
+  find.name = NULL;
+  find.type = UNUSED_TYPE;
+  find.size = -1;
+  find.size_compare = 0;
+  char *path = ".";
+  int i = 1;
+  if(i < argc && argv[i][0] != '-')
+    path = argv[i++];
+  for(; i < argc; i += 2) {
+    if(i + 1 == argc) {
+      break;
+    }else if(strcmp(argv[i], "-name") == 0) {
+      find.name = argv[i + 1];
+    }else if(strcmp(argv[i], "-type") == 0 && strcmp(argv[i + 1], "f") == 0) {
+      find.type = FILE_TYPE;
+    }else if(strcmp(argv[i], "-type") == 0 && strcmp(argv[i + 1], "d") == 0) {
+      find.type = DIRECTORY_TYPE;
+    }else if(strcmp(argv[i], "-size") == 0) {
+      char *number = argv[i + 1];
+      if(number[0] == '+' || number[0] == '-')
+        find.size_compare = (*number++ == '+') ? 1 : -1;
+      find.size = atoll(number);
+    }else{
+      break;
+    }
+  }
+  if(i != argc) {
+    fprintf(stderr, "Usage: oufs_find [<path>] [-name <glob>] [-type f|d] [-size [+|-]<bytes>]\n");
+    return(-1);
+  }
+
+  // Open the virtual disk
+  OUFS_MOUNT *mnt = oufs_mount(disk_name, pipe_name_base);
+  if(mnt == NULL)
+    return(-1);
+
+  int ret = oufs_walk(mnt, cwd, path, 0, find_visit, &find);
+
+  // Clean up
+  oufs_unmount(mnt);
+
+  return(ret == 0 ? 0 : -1);
+}
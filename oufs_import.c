@@ -0,0 +1,600 @@
+/**
+Copy a host directory tree, or the contents of a tar archive, into the OU
+File System in one pass.
+
+  oufs_import <host directory> [<directory>]
+  oufs_import <tar file> [<directory>]
+  oufs_import - [<directory>]          (tar archive on STDIN)
+
+Directories are made as they are met; the files are read (from the host)
+and written (to the image) by a few threads at once, each file with a
+single write of its whole contents.  Anything that is neither a directory
+nor a regular file (or, in an archive, a hard link) is skipped.
+
+CS3113
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <dirent.h>
+#include <pthread.h>
+
+#include "oufs_lib.h"
+#include "oufs_lib_support.h"
+#include "virtual_disk.h"
+
+#define IMPORT_THREADS 4
+#define TAR_BLOCK_SIZE 512
+
+// Largest file that the image can hold
+#define MAX_FILE_SIZE ((FILE_OFFSET) MAX_BLOCKS_IN_FILE * DATA_BLOCK_SIZE)
+
+// A file to write to the image
+typedef struct import_job_s
+{
+  char path[MAX_PATH_LENGTH];
+
+  // Either the host file to read it from, or its contents
+  char *host_path;
+  unsigned char *data;
+  FILE_OFFSET size;
+
+  // Or, for a hard link, the path of the file that it links to
+  char *link_to;
+
+  struct import_job_s *next;
+} IMPORT_JOB;
+
+// State of an import: a queue of files for the threads that write them
+typedef struct
+{
+  OUFS_MOUNT *mnt;
+  char cwd[MAX_PATH_LENGTH];
+
+  pthread_mutex_t lock;
+  pthread_cond_t ready;
+  IMPORT_JOB *head;
+  IMPORT_JOB *tail;
+  int finished;
+
+  // Hard links, made once all of the files have been written
+  IMPORT_JOB *links;
+
+  int n_directories;
+  int n_files;
+  int n_errors;
+} IMPORT;
+
+/**
+ * Count an error (from any thread)
+ *
+ * @param im Import
+ */
+static void import_error(IMPORT *im)
+{
+  pthread_mutex_lock(&im->lock);
+  ++im->n_errors;
+  pthread_mutex_unlock(&im->lock);
+}
+
+/**
+ * Join a directory and a name into a path
+ *
+ * @param path Buffer of MAX_PATH_LENGTH bytes for the path
+ * @param dir Directory ("" for the current one)
+ * @param name Name within the directory
+ * @return 0 if success
+ *         -1 if the path is too long
+ */
+static int import_join(char *path, char *dir, char *name)
+{
+  int n;
+  if(dir[0] == 0)
+    n = snprintf(path, MAX_PATH_LENGTH, "%s", name);
+  else
+    n = snprintf(path, MAX_PATH_LENGTH, "%s/%s", dir, name);
+  return((n < 0 || n >= MAX_PATH_LENGTH) ? -1 : 0);
+}
+
+/**
+ * Make a directory in the image, and any of its parents that are missing
+ *
+ * @param im Import
+ * @param path Path of the directory
+ * @return 0 if success (or if it already exists)
+ *         -x if error
+ */
+static int import_make_directories(IMPORT *im, char *path)
+{
+  char prefix[MAX_PATH_LENGTH];
+  INODE_REFERENCE parent;
+  INODE_REFERENCE child;
+  char local_name[MAX_PATH_LENGTH];
+
+  strncpy(prefix, path, MAX_PATH_LENGTH - 1);
+  prefix[MAX_PATH_LENGTH - 1] = 0;
+
+  // Each prefix that ends just before a / (and then the whole path)
+  for(int i = 1; ; ++i) {
+    if(prefix[i] != '/' && prefix[i] != 0)
+      continue;
+    char c = prefix[i];
+    prefix[i] = 0;
+    int ret = oufs_find_file(im->mnt, im->cwd, prefix, &parent, &child, local_name);
+    if(ret < -1) {
+      return(-1);
+    }else if(child == UNALLOCATED_INODE) {
+      if(oufs_mkdir(im->mnt, im->cwd, prefix) != 0) {
+        fprintf(stderr, "Unable to make directory %s\n", prefix);
+        return(-2);
+      }
+      ++im->n_directories;
+    }
+    prefix[i] = c;
+    if(c == 0)
+      return(0);
+  }
+}
+
+/**
+ * Queue a file for the writing threads
+ *
+ * @param im Import
+ * @param job File to write (allocated with malloc(); freed once written)
+ */
+static void import_queue(IMPORT *im, IMPORT_JOB *job)
+{
+  job->next = NULL;
+  pthread_mutex_lock(&im->lock);
+  if(im->tail == NULL)
+    im->head = job;
+  else
+    im->tail->next = job;
+  im->tail = job;
+  ++im->n_files;
+  pthread_cond_signal(&im->ready);
+  pthread_mutex_unlock(&im->lock);
+}
+
+/**
+ * Read the whole of a host file into memory
+ *
+ * @param job File (host_path is read; data and size are set)
+ * @return 0 if success
+ *         -x if error
+ */
+static int import_read_host_file(IMPORT_JOB *job)
+{
+  FILE *fp = fopen(job->host_path, "rb");
+  if(fp == NULL) {
+    fprintf(stderr, "Unable to open %s\n", job->host_path);
+    return(-1);
+  }
+  job->data = malloc(job->size > 0 ? job->size : 1);
+  if(job->data == NULL) {
+    fclose(fp);
+    return(-2);
+  }
+  job->size = fread(job->data, 1, job->size, fp);
+  fclose(fp);
+  return(0);
+}
+
+/**
+ * Write one file to the image
+ *
+ * @param im Import
+ * @param job File to write
+ * @return 0 if success
+ *         -x if error
+ */
+static int import_write(IMPORT *im, IMPORT_JOB *job)
+{
+  if(job->host_path != NULL && import_read_host_file(job) != 0)
+    return(-1);
+
+  OUFILE *fp = oufs_fopen(im->mnt, im->cwd, job->path, "w");
+  if(fp == NULL) {
+    fprintf(stderr, "Unable to create %s\n", job->path);
+    return(-2);
+  }
+  // One write of the whole file: its blocks are allocated in batches
+  FILE_OFFSET n = (job->size > 0) ? oufs_fwrite(fp, job->data, job->size) : 0;
+  if(oufs_fclose(fp) != 0 || n != job->size) {
+    fprintf(stderr, "Unable to write %s\n", job->path);
+    return(-3);
+  }
+  return(0);
+}
+
+/**
+ * Body of each writing thread: write files until the queue is empty and
+ *  nothing more will be queued
+ *
+ * @param arg The import
+ * @return NULL
+ */
+static void *import_worker(void *arg)
+{
+  IMPORT *im = arg;
+
+  while(1) {
+    pthread_mutex_lock(&im->lock);
+    while(im->head == NULL && !im->finished)
+      pthread_cond_wait(&im->ready, &im->lock);
+    IMPORT_JOB *job = im->head;
+    if(job == NULL) {
+      pthread_mutex_unlock(&im->lock);
+      return(NULL);
+    }
+    im->head = job->next;
+    if(im->head == NULL)
+      im->tail = NULL;
+    pthread_mutex_unlock(&im->lock);
+
+    if(import_write(im, job) != 0)
+      import_error(im);
+    free(job->host_path);
+    free(job->data);
+    free(job);
+  }
+}
+
+/**
+ * Import a host directory (recursively) into a directory of the image
+ *  (which exists)
+ *
+ * @param im Import
+ * @param host_dir Path of the host directory
+ * @param dir Path of the directory in the image
+ * @return 0 if success
+ *         -x if error
+ */
+static int import_directory(IMPORT *im, char *host_dir, char *dir)
+{
+  DIR *dp = opendir(host_dir);
+  if(dp == NULL) {
+    fprintf(stderr, "Unable to open %s\n", host_dir);
+    return(-1);
+  }
+
+  struct dirent *entry;
+  while((entry = readdir(dp)) != NULL) {
+    if(strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+      continue;
+
+    char host_path[PATH_MAX];
+    char path[MAX_PATH_LENGTH];
+    struct stat st;
+    snprintf(host_path, PATH_MAX, "%s/%s", host_dir, entry->d_name);
+    if(strlen(entry->d_name) >= FILE_NAME_SIZE || import_join(path, dir, entry->d_name) != 0) {
+      fprintf(stderr, "Name too long: %s\n", host_path);
+      import_error(im);
+      continue;
+    }
+    if(lstat(host_path, &st) != 0) {
+      import_error(im);
+      continue;
+    }
+
+    if(S_ISDIR(st.st_mode)) {
+      if(oufs_mkdir(im->mnt, im->cwd, path) != 0) {
+        fprintf(stderr, "Unable to make directory %s\n", path);
+        import_error(im);
+        continue;
+      }
+      ++im->n_directories;
+      if(import_directory(im, host_path, path) != 0)
+        import_error(im);
+    }else if(S_ISREG(st.st_mode)) {
+      IMPORT_JOB *job = calloc(1, sizeof(IMPORT_JOB));
+      if(job == NULL || (job->host_path = strdup(host_path)) == NULL) {
+        free(job);
+        closedir(dp);
+        return(-2);
+      }
+      strcpy(job->path, path);
+      // Known up front: anything beyond what the image can hold is dropped
+      job->size = st.st_size;
+      if(job->size > MAX_FILE_SIZE) {
+        fprintf(stderr, "Too large (truncated): %s\n", host_path);
+        job->size = MAX_FILE_SIZE;
+        import_error(im);
+      }
+      import_queue(im, job);
+    }else{
+      fprintf(stderr, "Skipped (not a file or directory): %s\n", host_path);
+    }
+  }
+  closedir(dp);
+  return(0);
+}
+
+/**
+ * Check that every component of a path fits in a directory entry
+ *
+ * @param path Path (relative, with no trailing /)
+ * @return 0 if success
+ *         -1 if a component is too long
+ */
+static int import_check_names(char *path)
+{
+  while(1) {
+    char *slash = strchr(path, '/');
+    size_t len = (slash == NULL) ? strlen(path) : (size_t) (slash - path);
+    if(len >= FILE_NAME_SIZE)
+      return(-1);
+    if(slash == NULL)
+      return(0);
+    path = slash + 1;
+  }
+}
+
+/**
+ * Read exactly n bytes (or discard them, if buf is NULL) from a stream
+ *
+ * @param fp Stream
+ * @param buf Buffer of n bytes, or NULL
+ * @param n Number of bytes
+ * @return 0 if success
+ *         -1 if the stream ends first
+ */
+static int import_read_exact(FILE *fp, unsigned char *buf, FILE_OFFSET n)
+{
+  unsigned char skip[TAR_BLOCK_SIZE];
+  while(n > 0) {
+    size_t len = (buf == NULL) ? MIN(n, TAR_BLOCK_SIZE) : n;
+    size_t got = fread(buf == NULL ? skip : buf, 1, len, fp);
+    if(got == 0)
+      return(-1);
+    if(buf != NULL)
+      buf += got;
+    n -= got;
+  }
+  return(0);
+}
+
+/**
+ * Value of an octal field of a tar header
+ *
+ * @param field The field
+ * @param len Length of the field
+ * @return The value
+ */
+static FILE_OFFSET import_tar_number(char *field, int len)
+{
+  FILE_OFFSET value = 0;
+  for(int i = 0; i < len && field[i] >= '0' && field[i] <= '7'; ++i)
+    value = value * 8 + (field[i] - '0');
+  return(value);
+}
+
+/**
+ * Import a tar archive (ustar, with GNU long names) into a directory of
+ *  the image (which exists)
+ *
+ * @param im Import
+ * @param fp Stream of the archive
+ * @param dir Path of the directory in the image
+ * @return 0 if success
+ *         -x if error
+ */
+static int import_tar(IMPORT *im, FILE *fp, char *dir)
+{
+  unsigned char header[TAR_BLOCK_SIZE];
+  char long_name[MAX_PATH_LENGTH];
+  long_name[0] = 0;
+
+  while(import_read_exact(fp, header, TAR_BLOCK_SIZE) == 0) {
+    char *h = (char *) header;
+    if(h[0] == 0)
+      // End of the archive
+      return(0);
+
+    // Name: prefix (ustar) and name, or the preceding GNU long name
+    // (too long for the image if it does not fit in a path, or any part of
+    //  it in a directory entry, but checked later)
+    char name[TAR_BLOCK_SIZE];
+    if(long_name[0] != 0) {
+      strcpy(name, long_name);
+      long_name[0] = 0;
+    }else if(strncmp(h + 257, "ustar", 5) == 0 && h[345] != 0) {
+      snprintf(name, TAR_BLOCK_SIZE, "%.155s/%.100s", h + 345, h);
+    }else{
+      snprintf(name, TAR_BLOCK_SIZE, "%.100s", h);
+    }
+    FILE_OFFSET size = import_tar_number(h + 124, 12);
+    FILE_OFFSET padded = (size + TAR_BLOCK_SIZE - 1) / TAR_BLOCK_SIZE * TAR_BLOCK_SIZE;
+    char type = h[156];
+
+    // Relative to dir: no leading ./ or /, nor trailing /
+    char *local = name;
+    while(local[0] == '/' || (local[0] == '.' && local[1] == '/'))
+      local += (local[0] == '/') ? 1 : 2;
+    int len = strlen(local);
+    while(len > 0 && local[len - 1] == '/')
+      local[--len] = 0;
+    char path[MAX_PATH_LENGTH];
+    int bad_path = (len == 0) ? 0 : (import_check_names(local) != 0 || import_join(path, dir, local) != 0);
+
+    if(type == 'L') {
+      // GNU long name of the next entry
+      unsigned char *buf = malloc(size + 1);
+      if(buf == NULL || import_read_exact(fp, buf, size) != 0 ||
+         import_read_exact(fp, NULL, padded - size) != 0) {
+        free(buf);
+        return(-1);
+      }
+      buf[size] = 0;
+      snprintf(long_name, MAX_PATH_LENGTH, "%s", (char *) buf);
+      free(buf);
+      continue;
+    }
+
+    if(bad_path != 0) {
+      fprintf(stderr, "Name too long: %s\n", name);
+      import_error(im);
+      type = 0;
+    }
+
+    if(type == '5') {
+      // Directory
+      if(len > 0 && import_make_directories(im, path) != 0)
+        import_error(im);
+      if(import_read_exact(fp, NULL, padded) != 0)
+        return(-1);
+    }else if((type == '0' || type == '\0' || type == '7') && bad_path == 0 && len > 0) {
+      // Regular file: its parent may not have had an entry of its own
+      char *slash = strrchr(path, '/');
+      if(slash != NULL) {
+        *slash = 0;
+        if(import_make_directories(im, path) != 0)
+          import_error(im);
+        *slash = '/';
+      }
+
+      IMPORT_JOB *job = calloc(1, sizeof(IMPORT_JOB));
+      if(job == NULL)
+        return(-1);
+      strcpy(job->path, path);
+      job->size = MIN(size, MAX_FILE_SIZE);
+      job->data = malloc(job->size > 0 ? job->size : 1);
+      if(job->data == NULL || import_read_exact(fp, job->data, job->size) != 0 ||
+         import_read_exact(fp, NULL, padded - job->size) != 0) {
+        free(job->data);
+        free(job);
+        return(-1);
+      }
+      if(job->size < size) {
+        fprintf(stderr, "Too large (truncated): %s\n", name);
+        import_error(im);
+      }
+      import_queue(im, job);
+    }else if(type == '1' && bad_path == 0 && len > 0) {
+      // Hard link (to an earlier file of the archive)
+      char target[TAR_BLOCK_SIZE];
+      snprintf(target, TAR_BLOCK_SIZE, "%.100s", h + 157);
+      char *local_target = target;
+      while(local_target[0] == '/' || (local_target[0] == '.' && local_target[1] == '/'))
+        local_target += (local_target[0] == '/') ? 1 : 2;
+
+      IMPORT_JOB *job = calloc(1, sizeof(IMPORT_JOB));
+      if(job == NULL || (job->link_to = malloc(MAX_PATH_LENGTH)) == NULL) {
+        free(job);
+        return(-1);
+      }
+      strcpy(job->path, path);
+      if(import_join(job->link_to, dir, local_target) != 0) {
+        fprintf(stderr, "Name too long: %s\n", target);
+        import_error(im);
+        free(job->link_to);
+        free(job);
+      }else{
+        job->next = im->links;
+        im->links = job;
+      }
+      if(import_read_exact(fp, NULL, padded) != 0)
+        return(-1);
+    }else{
+      // Symbolic links, devices, extended headers, ...
+      if(type != 'x' && type != 'g' && bad_path == 0)
+        fprintf(stderr, "Skipped (not a file or directory): %s\n", name);
+      if(import_read_exact(fp, NULL, padded) != 0)
+        return(-1);
+    }
+  }
+  // The stream ended without the end-of-archive blocks
+  return(0);
+}
+
+int main(int argc, char** argv) {
+  // Fetch the key environment vars
+  IMPORT im;
+  char disk_name[MAX_PATH_LENGTH];
+  char pipe_name_base[MAX_PATH_LENGTH];
+
+  oufs_get_environment(im.cwd, disk_name, pipe_name_base);
+
+  // Check arguments
+  if(argc != 2 && argc != 3) {
+    fprintf(stderr, "Usage: oufs_import <host directory | tar file | -> [<directory>]\n");
+    return(-1);
+  }
+  char *dir = (argc == 3) ? argv[2] : "";
+
+  // What kind of source is it?
+  struct stat st;
+  FILE *tar = NULL;
+  if(strcmp(argv[1], "-") == 0) {
+    tar = stdin;
+  }else if(stat(argv[1], &st) != 0) {
+    fprintf(stderr, "Unable to open %s\n", argv[1]);
+    return(-1);
+  }else if(!S_ISDIR(st.st_mode) && (tar = fopen(argv[1], "rb")) == NULL) {
+    fprintf(stderr, "Unable to open %s\n", argv[1]);
+    return(-1);
+  }
+
+  // Open the virtual disk
+  im.mnt = oufs_mount(disk_name, pipe_name_base);
+  if(im.mnt == NULL)
+    return(-1);
+
+  pthread_mutex_init(&im.lock, NULL);
+  pthread_cond_init(&im.ready, NULL);
+  im.head = im.tail = NULL;
+  im.finished = 0;
+  im.links = NULL;
+  im.n_directories = im.n_files = im.n_errors = 0;
+
+  pthread_t threads[IMPORT_THREADS];
+  for(int i = 0; i < IMPORT_THREADS; ++i)
+    pthread_create(&threads[i], NULL, import_worker, &im);
+
+  // Walk the source (making directories) while the threads write the files
+  int ret = 0;
+  if(dir[0] != 0 && import_make_directories(&im, dir) != 0)
+    ret = -1;
+  else if(tar != NULL)
+    ret = import_tar(&im, tar, dir);
+  else
+    ret = import_directory(&im, argv[1], dir);
+  if(ret != 0)
+    import_error(&im);
+
+  pthread_mutex_lock(&im.lock);
+  im.finished = 1;
+  pthread_cond_broadcast(&im.ready);
+  pthread_mutex_unlock(&im.lock);
+  for(int i = 0; i < IMPORT_THREADS; ++i)
+    pthread_join(threads[i], NULL);
+
+  // The files that the links refer to are all there now
+  int n_links = 0;
+  while(im.links != NULL) {
+    IMPORT_JOB *job = im.links;
+    im.links = job->next;
+    if(oufs_link(im.mnt, im.cwd, job->link_to, job->path) != 0) {
+      fprintf(stderr, "Unable to link %s to %s\n", job->path, job->link_to);
+      ++im.n_errors;
+    }else{
+      ++n_links;
+    }
+    free(job->link_to);
+    free(job);
+  }
+
+  fprintf(stderr, "Imported %d directories, %d files and %d links (%d errors)\n",
+          im.n_directories, im.n_files, n_links, im.n_errors);
+
+  // Clean up
+  pthread_cond_destroy(&im.ready);
+  pthread_mutex_destroy(&im.lock);
+  oufs_unmount(im.mnt);
+  if(tar != NULL && tar != stdin)
+    fclose(tar);
+
+  return(im.n_errors == 0 ? 0 : -1);
+}
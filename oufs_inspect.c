@@ -30,7 +30,8 @@ int main(int argc, char** argv) {
   oufs_get_environment(cwd, disk_name, pipe_name_base);
 
   // Connect to the virtual disk
-  if(virtual_disk_attach(disk_name, pipe_name_base) != 0) {
+  OUFS_MOUNT *mnt = oufs_mount(disk_name, pipe_name_base);
+  if(mnt == NULL) {
     return(-1);
   }
 
@@ -42,16 +43,34 @@ int main(int argc, char** argv) {
     if(strncmp(argv[1], "-master", 8) == 0) {
       // Master record
       BLOCK block;
-      if(virtual_disk_read_block(0, &block) != 0) {
+      if(virtual_disk_read_block(mnt->disk, 0, &block) != 0) {
 	fprintf(stderr, "Error reading master block\n");
       }else{
 	// Block read: report state
-	printf("Inode table:\n");
-	for(int i = 0; i < N_INODES >> 3; ++i) {
-	  printf("%02x\n", block.content.master.inode_allocated_flag[i]);
+	printf("Layout version: %d\n", block.content.master.format_version);
+	for(int shard = 0; shard < N_ALLOC_SHARDS; ++shard) {
+	  BLOCK inode_block;
+	  if(oufs_read_inode_block(mnt, shard, &inode_block) != 0) {
+	    fprintf(stderr, "Error reading inode block %d\n", shard + 1);
+	    continue;
+	  }
+	  ALLOC_SHARD *state = &inode_block.content.inodes.shard;
+	  printf("Shard %d: blocks", shard);
+	  for(int i = 0; i < sizeof(state->block_allocated_flag); ++i)
+	    printf(" %02x", state->block_allocated_flag[i]);
+	  printf(" inodes");
+	  for(int i = 0; i < sizeof(state->inode_allocated_flag); ++i)
+	    printf(" %02x", state->inode_allocated_flag[i]);
+	  printf("\n");
+	}
+	int free_blocks, free_inodes;
+	if(oufs_count_free(mnt, &free_blocks, &free_inodes) == 0)
+	  printf("Free: %d blocks, %d inodes\n", free_blocks, free_inodes);
+	printf("Shared blocks:\n");
+	for(int i = 0; i < N_BLOCKS; ++i) {
+	  if(block.content.master.block_extra_references[i] > 0)
+	    printf("%d: +%d\n", i, block.content.master.block_extra_references[i]);
 	}
-	printf("Unallocated front: %d\n", block.content.master.unallocated_front);
-	printf("Unallocated end: %d\n", block.content.master.unallocated_end);
       }
 
     }else if(strncmp(argv[1], "-help", 6) == 0) {
@@ -76,7 +95,7 @@ int main(int argc, char** argv) {
 	  fprintf(stderr, "Inode index out of range (%s)\n", argv[2]);
 	}else{
 	  INODE inode;
-	  oufs_read_inode_by_reference(index, &inode);
+	  oufs_read_inode_by_reference(mnt, index, &inode);
 
 	  printf("Inode: %d\n", index);
 	  printf("Type: ");
@@ -94,7 +113,9 @@ int main(int argc, char** argv) {
 	    }
 	  printf("Nreferences: %d\n", inode.n_references);
 	  printf("Content block: %d\n", inode.content);
-	  printf("Size: %d\n", inode.size);
+	  printf("Tail block: %d\n", inode.tail);
+	  printf("Shared: %s\n", (inode.flags & INODE_FLAG_SHARED) ? "yes" : "no");
+	  printf("Size: %lld\n", (long long) inode.size);
 	}
       }else{
 	fprintf(stderr, "Unknown argument (-inode %s)\n", argv[2]);
@@ -112,7 +133,7 @@ int main(int argc, char** argv) {
 	  // success
 	  BLOCK block;
 	  // Read the block
-	  virtual_disk_read_block(index, &block);
+	  virtual_disk_read_block(mnt->disk, index, &block);
 
 	  // display block data
 	  printf("Directory at block %d:\n", index);
@@ -137,7 +158,7 @@ int main(int argc, char** argv) {
 	}else{
 	  // Success
 	  BLOCK block;
-	  virtual_disk_read_block(index, &block);
+	  virtual_disk_read_block(mnt->disk, index, &block);
 	  printf("Block %d:\n", index);
 	  printf("Next block: %d\n", block.next_block);
 	}
@@ -156,7 +177,7 @@ int main(int argc, char** argv) {
 	  BLOCK block;
 
 	  // Get the spcified block
-	  virtual_disk_read_block(index, &block);
+	  virtual_disk_read_block(mnt->disk, index, &block);
 	  printf("Raw data at block %d:\n", index);
 	  for(int i = 0; i < DATA_BLOCK_SIZE; ++i) {
 	    if(block.content.data.data[i] >= ' ' && block.content.data.data[i] <= '~')
@@ -173,6 +194,6 @@ int main(int argc, char** argv) {
   }
 
   // All done: detach from the disk
-  virtual_disk_detach();
+  oufs_unmount(mnt);
 }
 
@@ -6,13 +6,13 @@
  *
  */
 
+#include <errno.h>
+#include <sys/uio.h>
+
 #include "oufs_lib.h"
 #include "oufs_lib_support.h"
 #include "virtual_disk.h"
 
-// Yes ... a global variable
-int debug = 1;
-
 // Translate inode types to descriptive strings
 const char *INODE_TYPE_NAME[] = {"UNUSED", "DIRECTORY", "FILE"};
 
@@ -62,6 +62,99 @@ void oufs_get_environment(char *cwd, char *disk_name,
     
 }
 
+/**
+ * Attach to a virtual disk, whatever it holds (see oufs_mount())
+ *
+ * @param disk_name File name of the virtual disk
+ * @param pipe_name_base Base name of the named pipes (not used)
+ * @return Pointer to a new mount if success
+ *         NULL if error
+ */
+static OUFS_MOUNT *oufs_attach(char *disk_name, char *pipe_name_base)
+{
+    OUFS_MOUNT *mnt = malloc(sizeof(OUFS_MOUNT));
+    if(mnt == NULL)
+        return(NULL);
+
+    mnt->disk = virtual_disk_attach(disk_name, pipe_name_base);
+    if(mnt->disk == NULL) {
+        free(mnt);
+        return(NULL);
+    }
+    mnt->debug = 1;
+    mnt->file_pool = NULL;
+    mnt->file_pool_count = 0;
+    pthread_mutex_init(&mnt->pool_lock, NULL);
+    for(int i = 0; i < N_INODES; ++i)
+        pthread_rwlock_init(&mnt->inode_lock[i], NULL);
+    pthread_mutex_init(&mnt->master_lock, NULL);
+    for(int i = 0; i < N_INODE_BLOCKS; ++i)
+        pthread_mutex_init(&mnt->inode_block_lock[i], NULL);
+    return(mnt);
+}
+
+/**
+ * Attach to a virtual disk.  Everything the library knows about the disk
+ *  (the storage, handle pool, debugging flag and locks)
+ *  lives in the returned mount, so any number of disks may be mounted at
+ *  once, and any number of threads may share a mount.
+ *
+ * Disks that were not formatted in the current layout (OUFS_MAGIC and
+ *  OUFS_FORMAT_VERSION in the master block) are refused: older layouts
+ *  are not converted, so such disks must be formatted again.
+ *
+ * @param disk_name File name of the virtual disk
+ * @param pipe_name_base Base name of the named pipes (not used)
+ * @return Pointer to a new mount if success
+ *         NULL if error
+ */
+OUFS_MOUNT *oufs_mount(char *disk_name, char *pipe_name_base)
+{
+    OUFS_MOUNT *mnt = oufs_attach(disk_name, pipe_name_base);
+    if(mnt == NULL)
+        return(NULL);
+
+    BLOCK master;
+    if(virtual_disk_read_block(mnt->disk, MASTER_BLOCK_REFERENCE, &master) != 0) {
+        oufs_unmount(mnt);
+        return(NULL);
+    }
+    if(master.content.master.magic != OUFS_MAGIC ||
+       master.content.master.format_version != OUFS_FORMAT_VERSION) {
+        fprintf(stderr, "oufs_mount(): %s is not in the current layout (version %d); format it again\n",
+                disk_name, OUFS_FORMAT_VERSION);
+        oufs_unmount(mnt);
+        return(NULL);
+    }
+    return(mnt);
+}
+
+/**
+ * Detach from a mounted virtual disk and free the mount.  All files and
+ *  directories opened through the mount must already be closed (and no
+ *  other thread may still be using it).
+ *
+ * @param mnt Mount returned by oufs_mount()
+ * @return 0 if success
+ *         -x if error
+ */
+int oufs_unmount(OUFS_MOUNT *mnt)
+{
+    oufs_release_handles(mnt);
+    int ret = 0;
+    if(virtual_disk_detach(mnt->disk) != 0)
+        ret = -1;
+
+    pthread_mutex_destroy(&mnt->pool_lock);
+    for(int i = 0; i < N_INODES; ++i)
+        pthread_rwlock_destroy(&mnt->inode_lock[i]);
+    pthread_mutex_destroy(&mnt->master_lock);
+    for(int i = 0; i < N_INODE_BLOCKS; ++i)
+        pthread_mutex_destroy(&mnt->inode_block_lock[i]);
+    free(mnt);
+    return(ret);
+}
+
 /**
  * Completely format the virtual disk (including creation of the space).
  *
@@ -69,8 +162,9 @@ void oufs_get_environment(char *cwd, char *disk_name,
  *  detaches after the format is complete.
  *
  * - Zero out all blocks on the disk.
- * - Initialize the master block: mark inode 0 as allocated and initialize
- *    the linked list of free blocks
+ * - Initialize the master block: record the layout version
+ * - Initialize the allocation shards: the master block, the inode blocks,
+ *    the root directory block and inode 0 are allocated
  * - Initialize root directory inode
  * - Initialize the root directory in block ROOT_DIRECTORY_BLOCK
  *
@@ -81,8 +175,12 @@ void oufs_get_environment(char *cwd, char *disk_name,
 
 int oufs_format_disk(char  *virtual_disk_name, char *pipe_name_base)
 {
-    // Attach to the virtual disk
-    if(virtual_disk_attach(virtual_disk_name, pipe_name_base) != 0) {
+    // Nothing cached for the old contents is worth keeping
+    virtual_disk_remove_shared_cache(virtual_disk_name);
+
+    // Attach to the virtual disk (whatever it holds now)
+    OUFS_MOUNT *mnt = oufs_attach(virtual_disk_name, pipe_name_base);
+    if(mnt == NULL) {
         return(-1);
     }
     
@@ -91,7 +189,7 @@ int oufs_format_disk(char  *virtual_disk_name, char *pipe_name_base)
     // Zero out the block
     memset(&block, 0, BLOCK_SIZE);
     for(BLOCK_REFERENCE i = 0; i < N_BLOCKS; ++i) {
-        if(virtual_disk_write_block(i, &block) < 0) {
+        if(virtual_disk_write_block(mnt->disk, i, &block) < 0) {
             return(-2);
         }
     }
@@ -99,12 +197,26 @@ int oufs_format_disk(char  *virtual_disk_name, char *pipe_name_base)
     //////////////////////////////
     // Master block
     block.next_block = UNALLOCATED_BLOCK;
-    block.content.master.inode_allocated_flag[0] = 0x80;
-    // configure front and end references
-    block.content.master.unallocated_front = N_INODE_BLOCKS+2; // this will be block #6
-    block.content.master.unallocated_end = N_BLOCKS-1;    // will be block # 127
+    block.content.master.magic = OUFS_MAGIC;
+    block.content.master.format_version = OUFS_FORMAT_VERSION;
     // write master block to virtual disk
-    if (virtual_disk_write_block(0, &block)<0)
+    if (virtual_disk_write_block(mnt->disk, 0, &block)<0)
+    {
+        return -2;
+    }
+    
+    //  clear block again
+    memset(&block, 0, BLOCK_SIZE);
+    
+    //////////////////////////////
+    // Allocation shard of the first inode block: blocks 0 ... ROOT_DIRECTORY_BLOCK
+    //  and the root inode are in use
+    for (int i = 0; i <= ROOT_DIRECTORY_BLOCK; i++)
+    {
+        block.content.inodes.shard.block_allocated_flag[i / 8] |= 1 << (7 - i % 8);
+    }
+    block.content.inodes.shard.inode_allocated_flag[0] = 0x80;
+    if (virtual_disk_write_block(mnt->disk, 1, &block)<0)
     {
         return -2;
     }
@@ -120,112 +232,205 @@ int oufs_format_disk(char  *virtual_disk_name, char *pipe_name_base)
                                    ROOT_DIRECTORY_INODE, ROOT_DIRECTORY_INODE);
     
     // Write the results to the disk
-    if(oufs_write_inode_by_reference(0, &inode) != 0)
+    if(oufs_write_inode_by_reference(mnt, 0, &inode) != 0)
     {
         return(-3);
     }
     
     // write the directory block to disk
-    if (virtual_disk_write_block(ROOT_DIRECTORY_BLOCK, &block)<0)
+    if (virtual_disk_write_block(mnt->disk, ROOT_DIRECTORY_BLOCK, &block)<0)
     {
         return -2;
     }
     
-    //////////////////////////////
-    // All other blocks are free blocks
-    // for loop to initialize linked list of free blocks
-    for (BLOCK_REFERENCE i=6; i<N_BLOCKS; i++)
-    {
-        memset(&block, 0, BLOCK_SIZE);
-        if (i == 127)
-        {
-            block.next_block = UNALLOCATED_BLOCK;
-        }
-        else
-            block.next_block = i+1;
-        // Write each block to the virtual disk
-        if (virtual_disk_write_block(i, &block)<0)
-        {
-            return -2;
-        }
-    }
     // Done
-    virtual_disk_detach();
+    oufs_unmount(mnt);
     
     return(0);
 }
 
-/*
- * Compare two inodes for sorting, handling the
- *  cases where the inodes are not valid
+/**
+ * Set up an OUDIR iterator over an already-loaded directory
  *
- * @param e1 Pointer to a directory entry
- * @param e2 Pointer to a directory entry
- * @return -1 if e1 comes before e2 (or if e1 is the only valid one)
- * @return  0 if equal (or if both are invalid)
- * @return  1 if e1 comes after e2 (or if e2 is the only valid one)
+ * @param mnt Mount of the virtual disk
+ * @param dp Iterator to initialize
+ * @param inode_reference Inode reference of the directory
+ * @param inode Pointer to the loaded directory inode
+ * @param block Pointer to the loaded directory block
+ */
+static void oufs_init_dir(OUFS_MOUNT *mnt, OUDIR *dp, INODE_REFERENCE inode_reference,
+                          INODE *inode, BLOCK *block)
+{
+    dp->mount = mnt;
+    dp->inode_reference = inode_reference;
+    dp->n_entries = MIN((int)inode->size, N_DIRECTORY_ENTRIES_PER_BLOCK);
+    dp->position = 0;
+    memcpy(&dp->block, block, sizeof(BLOCK));
+}
+
+/**
+ * Open a directory for iteration
  *
- * Note: this function is useful for qsort()
+ * @param mnt Mount of the virtual disk
+ * @param cwd Absolute path representing the current working directory
+ * @param path Absolute or relative path to the directory
+ * @return Pointer to a new OUDIR structure positioned at the first entry
+ *         NULL if error (including if path is not a directory)
  */
-static int inode_compare_to(const void *d1, const void *d2)
+OUDIR* oufs_opendir(OUFS_MOUNT *mnt, char *cwd, char *path)
 {
-    // Type casting from generic to DIRECTORY_ENTRY*
-    DIRECTORY_ENTRY* e1 = (DIRECTORY_ENTRY*) d1;
-    DIRECTORY_ENTRY* e2 = (DIRECTORY_ENTRY*) d2;
-
-    // if e1 comes before e2 or if e1 is only valid one
-    int e1valid = 1;
-    int e2valid = 1;
-    if (e1->inode_reference == UNALLOCATED_INODE)
-        e1valid = 0;
-    if (e2->inode_reference == UNALLOCATED_INODE)
-        e2valid = 0;
-    
-    if (e1valid)
-    {
-        if (e2valid)
-        {
-            // both valid. compare e1 and e2
-            if (strcmp(e1->name, e2->name) < 0)
-            {
-                return -1;
-            }
-            else if (strcmp(e1->name, e2->name) > 0)
-            {
-                return 1;
-            }
-            else return 0;
-        }
-        else    // e1 is valid, e2 is invalid
-        {
-            return -1;
-        }
+    INODE_REFERENCE parent;
+    INODE_REFERENCE child;
+    INODE inode;
+    BLOCK block;
+
+    if(oufs_find_file(mnt, cwd, path, &parent, &child, NULL) != 0 ||
+       child == UNALLOCATED_INODE) {
+        return(NULL);
     }
-    else    // e1 is invalid
-    {
-        if (e2valid)    // e1 invalid, e2 valid
-        {
-            return 1;
-        }
-        else        // both invalid
-        {
-            return 0;
-        }
+    // Take a consistent snapshot of the entries
+    pthread_rwlock_rdlock(&mnt->inode_lock[child]);
+    int ret = oufs_read_inode_by_reference(mnt, child, &inode);
+    if(ret == 0 && inode.type == DIRECTORY_TYPE)
+        ret = virtual_disk_read_block(mnt->disk, inode.content, &block);
+    pthread_rwlock_unlock(&mnt->inode_lock[child]);
+    if(ret != 0) {
+        return(NULL);
+    }
+    if(inode.type != DIRECTORY_TYPE) {
+        fprintf(stderr, "oufs_opendir(): not a directory\n");
+        return(NULL);
+    }
+
+    OUDIR *dp = malloc(sizeof(OUDIR));
+    if(dp == NULL) {
+        return(NULL);
+    }
+    oufs_init_dir(mnt, dp, child, &inode, &block);
+    return(dp);
+}
+
+/**
+ * Fetch the next entry (in sorted order) from an open directory
+ *
+ * @param dp Pointer to the OUDIR structure
+ * @param entry Filled in with the name, inode reference and type of the entry
+ * @return 1 if an entry was returned
+ *         0 if there are no more entries
+ */
+int oufs_readdir(OUDIR *dp, OUDIRENT *entry)
+{
+    if(dp->position >= dp->n_entries) {
+        return(0);
+    }
+    DIRECTORY_ENTRY *e = &dp->block.content.directory.entry[dp->position++];
+    strncpy(entry->name, e->name, FILE_NAME_SIZE);
+    entry->inode_reference = e->inode_reference;
+    entry->type = e->type;
+    return(1);
+}
+
+/**
+ * Fetch the next group of entries from an open directory, together with the
+ *  type, size and reference count of each entry's inode.  The child inodes
+ *  are read in bulk: one read per distinct inode block rather than one per
+ *  child.
+ *
+ * @param dp Pointer to the OUDIR structure
+ * @param entries Array in which to place the entries
+ * @param max_entries Capacity of entries (N_DIRECTORY_ENTRIES_PER_BLOCK is
+ *          always enough for a whole directory)
+ * @return The number of entries placed in the array (0 at the end)
+ *         -x if an error
+ */
+int oufs_readdirplus(OUDIR *dp, OUDIRENT_PLUS *entries, int max_entries)
+{
+    OUFS_MOUNT *mnt = dp->mount;
+    INODE_REFERENCE refs[N_DIRECTORY_ENTRIES_PER_BLOCK];
+    INODE inodes[N_DIRECTORY_ENTRIES_PER_BLOCK];
+    OUDIRENT entry;
+    int n = 0;
+
+    while(n < max_entries && n < N_DIRECTORY_ENTRIES_PER_BLOCK &&
+          oufs_readdir(dp, &entry) > 0) {
+        strncpy(entries[n].name, entry.name, FILE_NAME_SIZE);
+        entries[n].inode_reference = refs[n] = entry.inode_reference;
+        ++n;
+    }
+
+    if(oufs_read_inodes_by_reference(mnt, refs, inodes, n) != 0) {
+        return(-1);
+    }
+    for(int i = 0; i < n; ++i) {
+        entries[i].type = inodes[i].type;
+        entries[i].size = inodes[i].size;
+        entries[i].n_references = inodes[i].n_references;
+    }
+    return(n);
+}
+
+/**
+ * Report the current position of a directory iterator as a cookie.  The
+ *  cookie may be handed to oufs_seekdir() on this or any later OUDIR for
+ *  the same directory to continue after the last returned entry.
+ *
+ * @param dp Pointer to the OUDIR structure
+ * @param cookie Filled in with the current position
+ */
+void oufs_telldir(OUDIR *dp, OUDIR_COOKIE *cookie)
+{
+    memset(cookie, 0, sizeof(OUDIR_COOKIE));
+    if(dp->position > 0) {
+        strncpy(cookie->name,
+                dp->block.content.directory.entry[dp->position-1].name,
+                FILE_NAME_SIZE);
+    }
+}
+
+/**
+ * Move a directory iterator to just after the entry named by a cookie.
+ *  An empty cookie rewinds to the first entry.
+ *
+ * @param dp Pointer to the OUDIR structure
+ * @param cookie Position previously returned by oufs_telldir()
+ */
+void oufs_seekdir(OUDIR *dp, OUDIR_COOKIE *cookie)
+{
+    int found;
+
+    if(cookie->name[0] == 0) {
+        dp->position = 0;
+        return;
+    }
+    // Entries are sorted: the next entry is the first one after the name
+    dp->position = oufs_directory_search(&dp->block, dp->n_entries,
+                                         cookie->name, &found);
+    if(found) {
+        dp->position++;
     }
 }
 
+/**
+ * Close a directory iterator
+ *
+ * @param dp Pointer to the OUDIR structure
+ */
+void oufs_closedir(OUDIR *dp)
+{
+    free(dp);
+}
 
 /**
  * Print out the specified file (if it exists) or the contents of the
  *   specified directory (if it exists)
  *
  * If a directory is listed, then the valid contents are printed in sorted order
- *   (as defined by strcmp()), one per line.  We know that a directory entry is
- *   valid if the inode_reference is not UNALLOCATED_INODE.
- *   Hint: qsort() will do the sort for you.  You just have to provide a compareTo()
- *   function (just like in Java!)
+ *   (as defined by strcmp()), one per line.  Directory blocks are kept sorted
+ *   on insertion and removal, so the first inode.size entries are streamed
+ *   out directly (no sort is needed here).
  *   Note: if an entry is a directory itself, then its name must be followed by "/"
  *
+ * @param mnt Mount of the virtual disk
  * @param cwd Absolute path representing the current working directory
  * @param path Absolute or relative path to the file/directory
  * @return 0 if success
@@ -233,50 +438,49 @@ static int inode_compare_to(const void *d1, const void *d2)
  *
  */
 
-int oufs_list(char *cwd, char *path)
+int oufs_list(OUFS_MOUNT *mnt, char *cwd, char *path)
 {
     INODE_REFERENCE parent;
     INODE_REFERENCE child;
     
     // Look up the inodes for the parent and child
-    int ret = oufs_find_file(cwd, path, &parent, &child, NULL);
+    int ret = oufs_find_file(mnt, cwd, path, &parent, &child, NULL);
     
     // Did we find the specified file?
     if(ret == 0 && child != UNALLOCATED_INODE) {
         // Element found: read the inode
         INODE inode;
-        if(oufs_read_inode_by_reference(child, &inode) != 0) {
+        BLOCK b;
+        memset(&b, 0, sizeof(BLOCK));
+        pthread_rwlock_rdlock(&mnt->inode_lock[child]);
+        if(oufs_read_inode_by_reference(mnt, child, &inode) != 0) {
+            pthread_rwlock_unlock(&mnt->inode_lock[child]);
             return(-1);
         }
-        if(debug)
+        virtual_disk_read_block(mnt->disk, inode.content, &b);
+        pthread_rwlock_unlock(&mnt->inode_lock[child]);
+        if(mnt->debug)
             fprintf(stderr, "\tDEBUG: Child found (type=%s).\n",  INODE_TYPE_NAME[inode.type]);
         
-        BLOCK b;
-        memset(&b, 0, sizeof(BLOCK));
-        virtual_disk_read_block(inode.content, &b);
         // Have the child inode
         // check if it is a directory or a file inode
         if (inode.type == DIRECTORY_TYPE)
         {
-            // Don't need pointer below?? According to TA
-            qsort(b.content.directory.entry, N_DIRECTORY_ENTRIES_PER_BLOCK, sizeof(b.content.directory.entry[0]), inode_compare_to);
-            for (int i = 0; i < N_DIRECTORY_ENTRIES_PER_BLOCK; i++)
+            // Entries are already sorted; each entry records its own type,
+            //  so no child inodes need to be read to decide on the '/'
+            OUDIR dir;
+            OUDIRENT entry;
+            oufs_init_dir(mnt, &dir, child, &inode, &b);
+            while (oufs_readdir(&dir, &entry) > 0)
             {
-                // May be holes in the directory. So must check whole list. Not just inode.size many
-                if (b.content.directory.entry[i].inode_reference != UNALLOCATED_INODE)
+                if (entry.type == DIRECTORY_TYPE)
                 {
-                    // check if the entry is a directory and if so, add a '/' to the end
-                    oufs_read_inode_by_reference(b.content.directory.entry[i].inode_reference, &inode);
-                    if (inode.type == DIRECTORY_TYPE)
-                    {
-                        // add a slash to the directory name
-                        printf("%s/\n", b.content.directory.entry[i].name);
-                    }
-                    else
-                    {
-                        printf("%s\n", b.content.directory.entry[i].name);
-                    }
-                    
+                    // add a slash to the directory name
+                    printf("%s/\n", entry.name);
+                }
+                else
+                {
+                    printf("%s\n", entry.name);
                 }
             }
         }
@@ -295,7 +499,7 @@ int oufs_list(char *cwd, char *path)
     {
         // Did not find the specified file/directory
         fprintf(stderr, "Not found\n");
-        if(debug)
+        if(mnt->debug)
             fprintf(stderr, "\tDEBUG: (%d)\n", ret);
     }
     // Done: return the status from the search
@@ -314,13 +518,14 @@ int oufs_list(char *cwd, char *path)
  *  - the parent must have space for the new directory
  *  - the child must not exist
  *
+ * @param mnt Mount of the virtual disk
  * @param cwd Absolute path representing the current working directory
  * @param path Absolute or relative path to the file/directory
  * @return 0 if success
  *         -x if error
  *
  */
-int oufs_mkdir(char *cwd, char *path)
+int oufs_mkdir(OUFS_MOUNT *mnt, char *cwd, char *path)
 {
     INODE_REFERENCE parent;
     INODE_REFERENCE child;
@@ -330,49 +535,104 @@ int oufs_mkdir(char *cwd, char *path)
     int ret;
     
     // Attempt to find the specified directory
-    if((ret = oufs_find_file(cwd, path, &parent, &child, local_name)) < -1) {
-        if(debug)
+    if((ret = oufs_find_file(mnt, cwd, path, &parent, &child, local_name)) < -1) {
+        if(mnt->debug)
             fprintf(stderr, "oufs_mkdir(): ret = %d\n", ret);
         return(-1);
     };
     
     fprintf(stderr, "\nlocal_name is  = %s\n", local_name);
+    // The name must not already be in use
+    if (child != UNALLOCATED_INODE)
+    {
+        fprintf(stderr, "oufs_mkdir(): %s already exists\n", local_name);
+        return (-4);
+    }
+
+    // Entries of the parent change: hold its directory lock throughout
+    pthread_rwlock_wrlock(&mnt->inode_lock[parent]);
+
     // parent inode and block
     INODE parentinode;
-    oufs_read_inode_by_reference(parent, &parentinode);
+    oufs_read_inode_by_reference(mnt, parent, &parentinode);
     
     BLOCK pblock;
-    virtual_disk_read_block(parentinode.content, &pblock);
+    virtual_disk_read_block(mnt->disk, parentinode.content, &pblock);
     
+    // (Another thread may have removed the parent or created the name
+    //  since the lookup)
+    int found = 0;
+    if (parentinode.type == DIRECTORY_TYPE)
+        oufs_directory_search(&pblock, parentinode.size, local_name, &found);
+    if (parentinode.type != DIRECTORY_TYPE || found)
+    {
+        fprintf(stderr, "oufs_mkdir(): %s already exists\n", local_name);
+        pthread_rwlock_unlock(&mnt->inode_lock[parent]);
+        return (-4);
+    }
+    // no space to store directory
+    if (parentinode.size >= N_DIRECTORY_ENTRIES_PER_BLOCK)
+    {
+        fprintf(stderr, "No space in directory to store new entry");
+        pthread_rwlock_unlock(&mnt->inode_lock[parent]);
+        return (-2);
+    }
     
-    // add to parent directory and increment size
-    
-    // add it to first AVAILABLE ENTRY
-    for (int i=2; i<N_DIRECTORY_ENTRIES_PER_BLOCK; i++)
+    fprintf(stderr, "allocating directory on inode: %d\n", parent);
+    child = oufs_allocate_new_directory(mnt, parent);
+    if (child == UNALLOCATED_INODE)
     {
-        if (pblock.content.directory.entry[i].inode_reference == UNALLOCATED_INODE)
-        {
-            fprintf(stderr, "allocating directory on inode: %d\n", parent);
-            child = oufs_allocate_new_directory(parent);
-            if (child == UNALLOCATED_INODE)
-            {
-                fprintf(stderr, "oufs_mkdir(): got UNALLOCATED_INODE calling allocate_new_dir");
-                return (-3);
-            }
-            pblock.content.directory.entry[i].inode_reference =  child;// insert new inode ref
-            // FIXME: this name is not copying correctly
-            
-            strcpy(pblock.content.directory.entry[i].name, local_name);
-            parentinode.size++;
-            // write parent directory block and inode back to disk
-            virtual_disk_write_block(parentinode.content, &pblock);
-            oufs_write_inode_by_reference(parent, &parentinode);
-            return 0;
-        }
+        fprintf(stderr, "oufs_mkdir(): got UNALLOCATED_INODE calling allocate_new_dir");
+        pthread_rwlock_unlock(&mnt->inode_lock[parent]);
+        return (-3);
+    }
+    // add to parent directory (in sorted position) and increment size
+    if (oufs_directory_insert(&pblock, parentinode.size, local_name, child, DIRECTORY_TYPE) < 0)
+    {
+        pthread_rwlock_unlock(&mnt->inode_lock[parent]);
+        return (-2);
+    }
+    parentinode.size++;
+    // write parent directory block and inode back to disk
+    virtual_disk_write_block(mnt->disk, parentinode.content, &pblock);
+    oufs_write_inode_by_reference(mnt, parent, &parentinode);
+    pthread_rwlock_unlock(&mnt->inode_lock[parent]);
+    return 0;
+}
+
+/**
+ * Lock a directory and one of its entries for a change to both (parent
+ *  first).  The child is only locked once the parent is known to still hold
+ *  local_name -> child: a stale reference from an earlier lookup may by now
+ *  be any inode, and locking it out of order could deadlock.
+ *
+ * @param mnt Mount of the virtual disk
+ * @param parent Inode reference of the directory
+ * @param local_name Name of the entry within the directory
+ * @param child Inode reference that the entry is expected to have
+ * @return 0 if success (both locked for writing)
+ *         -1 if the entry no longer refers to child (nothing locked)
+ */
+int oufs_lock_entry(OUFS_MOUNT *mnt, INODE_REFERENCE parent, char *local_name,
+                    INODE_REFERENCE child)
+{
+    INODE inode;
+    BLOCK block;
+    int found = 0;
+    int i = 0;
+
+    pthread_rwlock_wrlock(&mnt->inode_lock[parent]);
+    if(oufs_read_inode_by_reference(mnt, parent, &inode) == 0 &&
+       inode.type == DIRECTORY_TYPE &&
+       virtual_disk_read_block(mnt->disk, inode.content, &block) == 0) {
+        i = oufs_directory_search(&block, inode.size, local_name, &found);
     }
-    // no space to store directory if it hits this point
-    fprintf(stderr, "No space in directory to store new entry");
-    return (-2);
+    if(!found || block.content.directory.entry[i].inode_reference != child) {
+        pthread_rwlock_unlock(&mnt->inode_lock[parent]);
+        return(-1);
+    }
+    pthread_rwlock_wrlock(&mnt->inode_lock[child]);
+    return(0);
 }
 
 /**
@@ -383,20 +643,21 @@ int oufs_mkdir(char *cwd, char *path)
  *  - The directory must not be . or ..
  *  - The directory must not be /
  *
+ * @param mnt Mount of the virtual disk
  * @param cwd Absolute path representing the current working directory
  * @param path Abslute or relative path to the file/directory
  * @return 0 if success
  *         -x if error
  *
  */
-int oufs_rmdir(char *cwd, char *path)
+int oufs_rmdir(OUFS_MOUNT *mnt, char *cwd, char *path)
 {
     INODE_REFERENCE parent;
     INODE_REFERENCE child;
     char local_name[MAX_PATH_LENGTH];
     
     // Try to find the inode of the child
-    int result = oufs_find_file(cwd, path, &parent, &child, local_name);
+    int result = oufs_find_file(mnt, cwd, path, &parent, &child, local_name);
     if(result < -1) {
         return(-4);
     }
@@ -406,83 +667,242 @@ int oufs_rmdir(char *cwd, char *path)
     }
     // TODO: Will be error for: name does not exist, if its not a directory, if name is . or .., and if not an empty directory
     
+    // check to make sure name is not . or .. (nor /): the child would then
+    //  be the parent or above it, and the locks below would be taken out of
+    //  order
+    if (child == parent)
+        return -2;
+    if (strcmp(local_name, ".") == 0)
+        return -2;
+    if (strcmp(local_name, "..") == 0)
+        return -2;
+
+    // Parent directory first, then the directory being removed
+    if (oufs_lock_entry(mnt, parent, local_name, child) != 0)
+        return -1;
+
     INODE pnode;
-    oufs_read_inode_by_reference(parent, &pnode);
+    oufs_read_inode_by_reference(mnt, parent, &pnode);
     // error if type isn't directory type
     INODE cnode;
-    oufs_read_inode_by_reference(child, &cnode);
+    oufs_read_inode_by_reference(mnt, child, &cnode);
+    int ret = 0;
+    BLOCK childdirectory;
     if (cnode.type != DIRECTORY_TYPE)
     {
-        return -2;
+        ret = -2;
     }
-    
-    BLOCK childdirectory;
-    virtual_disk_read_block(cnode.content, &childdirectory);
-    int count = 0;
-    for (int i=0; i<N_DIRECTORY_ENTRIES_PER_BLOCK; i++)
+    else
     {
-        if (childdirectory.content.directory.entry[i].inode_reference != UNALLOCATED_INODE)
+        virtual_disk_read_block(mnt->disk, cnode.content, &childdirectory);
+        int count = 0;
+        for (int i=0; i<N_DIRECTORY_ENTRIES_PER_BLOCK; i++)
+        {
+            if (childdirectory.content.directory.entry[i].inode_reference != UNALLOCATED_INODE)
+            {
+                count++;
+            }
+        }
+        if (count > 2)
         {
-            count++;
+            fprintf(stderr, "trying to remove non-empty directory\n");
+            ret = -3;
         }
     }
-    if (count > 2)
-    {
-        fprintf(stderr, "trying to remove non-empty directory\n");
-        return -3;
-    }
-    // check to make sure name is not . or ..
-    if (strcmp(local_name, ".") == 0)
-        return -2;
-    if (strcmp(local_name, "..") == 0)
-        return -2;
     
     BLOCK directory;
-    virtual_disk_read_block(pnode.content, &directory);
+    virtual_disk_read_block(mnt->disk, pnode.content, &directory);
 
-    for (int i=0; i<N_DIRECTORY_ENTRIES_PER_BLOCK; i++)
+    // Remove the entry, keeping the remaining entries sorted.  (It must still
+    //  be the directory that was looked up before the locks were taken.)
+    if (ret == 0 && oufs_directory_delete(&directory, pnode.size, local_name) != child)
     {
-        fprintf(stderr, "checking directory entry %d:%s\n", i, directory.content.directory.entry[i].name);
-        if (strcmp(directory.content.directory.entry[i].name, local_name) == 0)
-        {
-            directory.content.directory.entry[i].inode_reference = UNALLOCATED_INODE;
-            pnode.size--;
-            break;
-        }
+        ret = -1;
     }
-    BLOCK master;
-    virtual_disk_read_block(MASTER_BLOCK_REFERENCE, &master);
-    // change bit in master block's inode allocation table
-    int byte = child / 8;
-    int bit = 7 - (child % 8);
-    fprintf(stderr, "byte %d bit %d\n", byte, bit);
-    master.content.master.inode_allocated_flag[byte] = master.content.master.inode_allocated_flag[byte] ^ (1<<bit);
-    
+    if (ret != 0)
+    {
+        pthread_rwlock_unlock(&mnt->inode_lock[child]);
+        pthread_rwlock_unlock(&mnt->inode_lock[parent]);
+        return ret;
+    }
+    pnode.size--;
     
-    //if(cnode.size==2)
-    //    cnode.type= UNUSED_TYPE;
+    // The inode is no longer a directory
+    INODE freed = cnode;
+    oufs_set_inode(&cnode, UNUSED_TYPE, 0, UNALLOCATED_BLOCK, 0);
     
     //write blocks back to disk
     
-    oufs_write_inode_by_reference(child, &cnode);
-    virtual_disk_write_block(cnode.content, &childdirectory);
-    oufs_deallocate_block(&master, cnode.content);
-    virtual_disk_write_block(MASTER_BLOCK_REFERENCE, &master);
-    virtual_disk_write_block(pnode.content, &directory);
-    oufs_write_inode_by_reference(parent, &pnode);
-    
+    virtual_disk_write_block(mnt->disk, pnode.content, &directory);
+    oufs_write_inode_by_reference(mnt, parent, &pnode);
+    oufs_write_inode_by_reference(mnt, child, &cnode);
+
+    // Free the inode and its block last (see oufs_remove())
+    if (oufs_deallocate_batch(mnt, &freed, &child, 1, NULL, 0) != 0)
+    {
+        ret = -4;
+    }
     
+    pthread_rwlock_unlock(&mnt->inode_lock[child]);
+    pthread_rwlock_unlock(&mnt->inode_lock[parent]);
     
-    // Success
-    return(0);
+    return(ret);
 }
 
 
 /*********************************************************************/
 // Project 4
+/**
+ * Walk the content chain of a file and record every block reference in the
+ *  block reference cache
+ *
+ * @param fp OUFILE pointer
+ * @param inode Pointer to the loaded inode of the file
+ * @return 0 if success
+ *         -x if error
+ */
+static int oufs_fill_block_cache(OUFILE *fp, INODE *inode)
+{
+    OUFS_MOUNT *mnt = fp->mount;
+    BLOCK block;
+    int count = 0;
+    BLOCK_REFERENCE b = inode->content;
+
+    while (b != UNALLOCATED_BLOCK && count < MAX_BLOCKS_IN_FILE)
+    {
+        fp->block_reference_cache[count++] = b;
+        if (virtual_disk_read_block(mnt->disk, b, &block) != 0)
+        {
+            return (-1);
+        }
+        b = block.next_block;
+    }
+    fp->n_data_blocks = count;
+    return (0);
+}
+
+/**
+ * Bring the block reference cache of a handle up to date before it
+ *  appends, in case the file has been changed through another handle (for
+ *  instance, by another thread appending to it).  A w or a handle only needs
+ *  the tail; an r+ handle addresses every block through the cache, so it
+ *  reads the whole chain again
+ *
+ * @param fp OUFILE pointer
+ * @param inode Pointer to the loaded inode of the file
+ * @return 0 if success
+ *         -x if error
+ */
+static int oufs_sync_append_cache(OUFILE *fp, INODE *inode)
+{
+    int n = (inode->size + DATA_BLOCK_SIZE - 1) / DATA_BLOCK_SIZE;
+
+    if (n == fp->n_data_blocks && (n == 0 || fp->block_reference_cache[n - 1] == inode->tail))
+        return (0);
+    // As for a fresh "r+" or "a" handle
+    if (fp->mode == '+' || (inode->flags & INODE_FLAG_SHARED))
+        return (oufs_fill_block_cache(fp, inode));
+    fp->n_data_blocks = n;
+    if (n > 0)
+        fp->block_reference_cache[n - 1] = inode->tail;
+    return (0);
+}
+
+/**
+ * Get an OUFILE structure for a file that is being opened.  Structures
+ *  (and the buffers that they have allocated) are reused from the pool of
+ *  closed files when possible, so in steady state opening a file does not
+ *  allocate memory.
+ *
+ * @param mnt Mount through which the file is opened
+ * @return Pointer to an OUFILE with empty read-ahead and write buffers
+ *         NULL if out of memory
+ */
+static OUFILE *oufs_get_handle(OUFS_MOUNT *mnt)
+{
+    pthread_mutex_lock(&mnt->pool_lock);
+    OUFILE *fp = mnt->file_pool;
+    if (fp != NULL)
+    {
+        mnt->file_pool = fp->next_free;
+        --mnt->file_pool_count;
+    }
+    pthread_mutex_unlock(&mnt->pool_lock);
+    if (fp == NULL)
+    {
+        fp = malloc(sizeof(OUFILE));
+        if (fp == NULL)
+        {
+            return (NULL);
+        }
+        fp->ra_buffer = NULL;
+        fp->wb_buffer = NULL;
+    }
+    fp->mount = mnt;
+    fp->next_free = NULL;
+    // No read-ahead until a sequential reader shows up
+    fp->ra_next = 0;
+    fp->ra_window = 0;
+    fp->ra_start = 0;
+    fp->ra_count = 0;
+    // Nothing buffered for writing yet
+    fp->wb_count = 0;
+    return (fp);
+}
+
+/**
+ * Return an OUFILE structure that is no longer used.  It is kept (with its
+ *  buffers) for the next open, unless the pool is already full.
+ *
+ * @param fp Pointer to the OUFILE structure
+ */
+static void oufs_put_handle(OUFILE *fp)
+{
+    OUFS_MOUNT *mnt = fp->mount;
+    fp->inode_reference = UNALLOCATED_INODE;
+    pthread_mutex_lock(&mnt->pool_lock);
+    if (mnt->file_pool_count < OUFILE_POOL_SIZE)
+    {
+        fp->next_free = mnt->file_pool;
+        mnt->file_pool = fp;
+        ++mnt->file_pool_count;
+        fp = NULL;
+    }
+    pthread_mutex_unlock(&mnt->pool_lock);
+    if (fp != NULL)
+    {
+        free(fp->ra_buffer);
+        free(fp->wb_buffer);
+        free(fp);
+    }
+}
+
+/**
+ * Free the pool of closed OUFILE structures of a mount (this is also done
+ *  by oufs_unmount())
+ *
+ * @param mnt Mount
+ */
+void oufs_release_handles(OUFS_MOUNT *mnt)
+{
+    pthread_mutex_lock(&mnt->pool_lock);
+    while (mnt->file_pool != NULL)
+    {
+        OUFILE *fp = mnt->file_pool;
+        mnt->file_pool = fp->next_free;
+        free(fp->ra_buffer);
+        free(fp->wb_buffer);
+        free(fp);
+    }
+    mnt->file_pool_count = 0;
+    pthread_mutex_unlock(&mnt->pool_lock);
+}
+
 /**
  * Open a file
  * - mode = "r": the file must exist; offset is set to 0
+ * - mode = "r+": as "r", but the file may also be written in place
+ *                 (oufs_fwrite()/oufs_pwrite() at any offset up to size)
  * - mode = "w": the file may or may not exist;
  *                 - if it does not exist, it is created 
  *                 - if it does exist, then the file is truncated
@@ -492,14 +912,16 @@ int oufs_rmdir(char *cwd, char *path)
  *                 - if it does not exist, it is created 
  *                 offset = size
  *
+ * @param mnt Mount of the virtual disk
  * @param cwd Absolute path for the current working directory
  * @param path Relative or absolute path for the file in question
- * @param mode String: one of "r", "w" or "a"
- *                 (note: only the first character matters here)
+ * @param mode String: one of "r", "r+", "w" or "a"
+ *                 (note: only the first character matters here, except
+ *                  for the + of "r+")
  * @return Pointer to a new OUFILE structure if success
  *         NULL if error
  */
-OUFILE* oufs_fopen(char *cwd, char *path, char *mode)
+OUFILE* oufs_fopen(OUFS_MOUNT *mnt, char *cwd, char *path, char *mode)
 {
   INODE_REFERENCE parent;
   INODE_REFERENCE child;
@@ -514,8 +936,8 @@ OUFILE* oufs_fopen(char *cwd, char *path, char *mode)
   };
 
   // Try to find the inode of the child
-  if((ret = oufs_find_file(cwd, path, &parent, &child, local_name)) < -1) {
-    if(debug)
+  if((ret = oufs_find_file(mnt, cwd, path, &parent, &child, local_name)) < -1) {
+    if(mnt->debug)
       fprintf(stderr, "oufs_fopen(%d)\n", ret);
     return(NULL);
   }
@@ -526,7 +948,11 @@ OUFILE* oufs_fopen(char *cwd, char *path, char *mode)
   }
 
   // TODO
-    OUFILE *file = malloc(sizeof(OUFILE));
+    OUFILE *file = oufs_get_handle(mnt);
+    if (file == NULL)
+    {
+        return (NULL);
+    }
     
     ////// READ ///////
     if (mode[0] == 'r')
@@ -535,62 +961,56 @@ OUFILE* oufs_fopen(char *cwd, char *path, char *mode)
         if (child == UNALLOCATED_INODE)
         {
             fprintf(stderr, "oufs_fopen() Child not found for mode 'r'\n");
+            oufs_put_handle(file);
             return (NULL);
         }
-        oufs_read_inode_by_reference(child, &inode);
+        pthread_rwlock_rdlock(&mnt->inode_lock[child]);
+        oufs_read_inode_by_reference(mnt, child, &inode);
         // Walk down the linked list of blocks (while loop, read content of inode - assuming it exists) increment counter. Put those block references in the cache array
-        if (inode.type == DIRECTORY_TYPE)
+        if (inode.type != FILE_TYPE || oufs_fill_block_cache(file, &inode) != 0)
         {
+            pthread_rwlock_unlock(&mnt->inode_lock[child]);
+            oufs_put_handle(file);
             return NULL;
         }
-        int count = 0;
-        BLOCK_REFERENCE b;
-        b = inode.content;
-        BLOCK *c = malloc(BLOCK_SIZE);
-        virtual_disk_read_block(b, c);
-        while (b != UNALLOCATED_BLOCK)
-        {
-            file->block_reference_cache[count] = b;
-            count++;
-            virtual_disk_read_block(b, c);
-            b = c->next_block;
-        }
+        pthread_rwlock_unlock(&mnt->inode_lock[child]);
         file->offset = 0;
-        file->n_data_blocks = count;
         file->inode_reference = child;
-        file->mode = 'r';
+        // '+' marks a file opened with "r+" (read and update in place)
+        file->mode = (mode[1] == '+') ? '+' : 'r';
         //fprintf(stderr, "inside fopen for read: n_data_blocks = %d\n", file->n_data_blocks);
 
-        //////
+        return (file);
     }
-    //// WRITE /////////
-    else if (mode[0]=='w')
+
+    // w and a: File does not exist. Create file.
+    if (child == UNALLOCATED_INODE)
     {
-        // File does not exist. Create file.
+        child = oufs_create_file(mnt, parent, local_name);
+        fprintf(stderr, "INSIDE FOPEN '%c': child is is %d\n", mode[0], child);
+        // (Another thread may have created it since the lookup)
+        if (child == UNALLOCATED_INODE)
+            oufs_find_file(mnt, cwd, path, &parent, &child, local_name);
         if (child == UNALLOCATED_INODE)
         {
-            child = oufs_create_file(parent, local_name);
-            fprintf(stderr, "INSIDE FOPEN 'w': child is is %d\n", child);
-            if (child == UNALLOCATED_INODE)
-            {
-                return (NULL);
-            }
-            oufs_read_inode_by_reference(child, &inode);
-            //file->inode_reference = child;
-            // inode is now the inode for new file
-            
+            fprintf(stderr, "child == UNALLOCATED_INODE after create_file() \n");
+            oufs_put_handle(file);
+            return (NULL);
         }
-        else // File exists. Truncate (steps to that)
+    }
+
+    //// WRITE /////////
+    if (mode[0]=='w')
+    {
+        // Truncate (steps to that)
+        pthread_rwlock_wrlock(&mnt->inode_lock[child]);
+        oufs_read_inode_by_reference(mnt, child, &inode);
+        // deallocate blocks of file
+        if (inode.type != FILE_TYPE || oufs_deallocate_blocks(mnt, &inode) < 0)
         {
-            oufs_read_inode_by_reference(child, &inode);
-            // deallocate blocks of file
-            if (inode.type == DIRECTORY_TYPE)
-            {
-                return NULL;
-            }
-            if (oufs_deallocate_blocks(&inode) < 0)
-                return (NULL);
-            
+            pthread_rwlock_unlock(&mnt->inode_lock[child]);
+            oufs_put_handle(file);
+            return (NULL);
         }
         // below things apply to 'w' for both prexisting and non preexisting files
         file->n_data_blocks = 0;
@@ -599,49 +1019,40 @@ OUFILE* oufs_fopen(char *cwd, char *path, char *mode)
         inode.size = 0;   // should be done in create_file I think
         file->mode = 'w';
         // write back to disk for setting size (create file should've done it already for no prev file)
-        oufs_write_inode_by_reference(child, &inode);
+        oufs_write_inode_by_reference(mnt, child, &inode);
+        pthread_rwlock_unlock(&mnt->inode_lock[child]);
         
     }
     ///// APPEND ////////
     else    // mode is 'a'  APPEND
     {
-        //fprintf(stderr, "INSIDE FOPEN 'A': local_name is %s\n", local_name);
-        // if file doesn't exist
-        if (child == UNALLOCATED_INODE)
+        pthread_rwlock_rdlock(&mnt->inode_lock[child]);
+        oufs_read_inode_by_reference(mnt, child, &inode);
+        if (inode.type != FILE_TYPE)
         {
-            // File does not exist. Create it.
-            child = oufs_create_file(parent, local_name);
-            if (child == UNALLOCATED_INODE)
-            {
-                fprintf(stderr, "child == UNALLOCATED_INODE after create_file() \n");
-                return (NULL);
-            }
-
-            oufs_read_inode_by_reference(child, &inode);
-            file->offset = 0;
-            file->n_data_blocks = 0;
-            
+            pthread_rwlock_unlock(&mnt->inode_lock[child]);
+            oufs_put_handle(file);
+            return NULL;
         }
-        else        // File does exist
+        file->offset = inode.size;
+        // Appends only ever touch the last block, which the inode records:
+        //  no need to walk the chain.  Only the last cache entry is filled in.
+        //  (A shared chain may have to be copied, which takes all of it.)
+        file->n_data_blocks = (inode.size + DATA_BLOCK_SIZE - 1) / DATA_BLOCK_SIZE;
+        if (inode.flags & INODE_FLAG_SHARED)
         {
-            
-            oufs_read_inode_by_reference(child, &inode);
-            file->offset = inode.size;
-            // Walk down the linked list of blocks (while loop, read content of inode - assuming it exists) increment counter. Put those block references in the cache array
-            int count = 0;
-            BLOCK_REFERENCE b;
-            b = inode.content;
-            BLOCK *c = malloc(BLOCK_SIZE);
-            
-            while (b != UNALLOCATED_BLOCK)
+            if (oufs_fill_block_cache(file, &inode) != 0)
             {
-                file->block_reference_cache[count] = b;
-                count++;
-                virtual_disk_read_block(b, c);
-                b = c->next_block;
+                pthread_rwlock_unlock(&mnt->inode_lock[child]);
+                oufs_put_handle(file);
+                return NULL;
             }
-            file->n_data_blocks = count;
         }
+        else if (file->n_data_blocks > 0)
+        {
+            file->block_reference_cache[file->n_data_blocks - 1] = inode.tail;
+        }
+        pthread_rwlock_unlock(&mnt->inode_lock[child]);
         // for both conditions (pre-existing or non file)
         file->inode_reference = child;
         file->mode = 'a';
@@ -653,424 +1064,1144 @@ OUFILE* oufs_fopen(char *cwd, char *path, char *mode)
 
 /**
  *  Close a file
- *   Deallocates the OUFILE structure
+ *   Flushes any buffered writes and returns the OUFILE structure to the pool
  *
  * @param fp Pointer to the OUFILE structure
+ * @return 0 if success
+ *         -x if the buffered writes could not be flushed
  */
      
-void oufs_fclose(OUFILE *fp) {
-  fp->inode_reference = UNALLOCATED_INODE;
-  free(fp);
+int oufs_fclose(OUFILE *fp) {
+  int ret = oufs_fflush(fp);
+  oufs_put_handle(fp);
+  return(ret);
+}
+
+
+
+/**
+ * Make the first blocks of a reflinked file its own before they are
+ *  modified (copy on write).
+ * - Chains share suffixes only, so everything from the first shared block
+ *     up to block last is copied (not just block last); the copy of block
+ *     last links back into the shared rest of the chain
+ * - The copies are allocated in one pass (and freed again if anything
+ *     fails) and written in batches; the block
+ *     reference cache and inode->content/tail are updated, but the inode is
+ *     not written back to the disk
+ * - The cache must be complete (for "a" handles of shared files, it is)
+ *
+ * - The caller holds master_lock (see oufs_unshare_blocks())
+ *
+ * @param fp OUFILE pointer
+ * @param inode Pointer to the loaded inode of the file
+ * @param last Index (within the file) of the last block that must be unshared
+ * @return The number of blocks that were copied
+ *         -x if an error
+ */
+static int oufs_copy_shared_blocks(OUFILE *fp, INODE *inode, int last)
+{
+  OUFS_MOUNT *mnt = fp->mount;
+  BLOCK master;
+  if(virtual_disk_read_block(mnt->disk, MASTER_BLOCK_REFERENCE, &master) != 0)
+    return(-1);
+  unsigned char *extra = master.content.master.block_extra_references;
+
+  // Blocks before the first shared one already belong to this file alone
+  int first = 0;
+  while(first <= last && extra[fp->block_reference_cache[first]] == 0)
+    ++first;
+  if(first > last)
+    return(0);
+
+  int n = last - first + 1;
+  BLOCK_REFERENCE rest = (last + 1 < fp->n_data_blocks) ?
+    fp->block_reference_cache[last + 1] : UNALLOCATED_BLOCK;
+  if(rest != UNALLOCATED_BLOCK && extra[rest] == UCHAR_MAX) {
+    fprintf(stderr, "oufs_unshare_blocks(): too many references\n");
+    return(-3);
+  }
+  BLOCK_REFERENCE refs[MAX_BLOCKS_IN_FILE];
+  ALLOC_MASK mask;
+  memset(&mask, 0, sizeof(mask));
+  int got = oufs_allocate_blocks(mnt, refs, n);
+  if(got != n) {
+    fprintf(stderr, "oufs_unshare_blocks(): no space to copy shared blocks\n");
+    for(int i = 0; i < got; ++i)
+      oufs_mark_block(&mask, refs[i]);
+    oufs_free_marked(mnt, &mask);
+    return(-2);
+  }
+
+  // Copy; the original of the last copy keeps its link to the rest
+  int ret = 0;
+  BLOCK blocks[WRITE_BUFFER_BLOCKS];
+  for(int i = 0; i < n && ret == 0; i += WRITE_BUFFER_BLOCKS) {
+    int batch = MIN(n - i, WRITE_BUFFER_BLOCKS);
+    if(virtual_disk_read_blocks(mnt->disk, &fp->block_reference_cache[first + i], batch, blocks) != 0) {
+      ret = -1;
+      break;
+    }
+    for(int j = 0; j < batch; ++j)
+      blocks[j].next_block = (i + j + 1 < n) ? refs[i + j + 1] : rest;
+    if(virtual_disk_write_blocks(mnt->disk, &refs[i], batch, blocks) != 0)
+      ret = -1;
+  }
+
+  // Point this file at the copies
+  if(ret == 0 && first > 0) {
+    BLOCK block;
+    BLOCK_REFERENCE prev = fp->block_reference_cache[first - 1];
+    if(virtual_disk_read_block(mnt->disk, prev, &block) != 0) {
+      ret = -1;
+    }else{
+      block.next_block = refs[0];
+      if(virtual_disk_write_block(mnt->disk, prev, &block) != 0)
+        ret = -1;
+    }
+  }
+  if(ret == 0) {
+    if(rest != UNALLOCATED_BLOCK)
+      ++extra[rest];
+    --extra[fp->block_reference_cache[first]];
+    if(virtual_disk_write_block(mnt->disk, MASTER_BLOCK_REFERENCE, &master) != 0)
+      ret = -1;
+  }
+  if(ret != 0) {
+    // The copies are not used after all
+    for(int i = 0; i < n; ++i)
+      oufs_mark_block(&mask, refs[i]);
+    oufs_free_marked(mnt, &mask);
+    return(ret);
+  }
+
+  if(first == 0)
+    inode->content = refs[0];
+  memcpy(&fp->block_reference_cache[first], refs, n * sizeof(BLOCK_REFERENCE));
+  if(last == fp->n_data_blocks - 1)
+    inode->tail = refs[n - 1];
+  return(n);
+}
+
+/**
+ * Make the first blocks of a reflinked file its own before they are
+ *  modified; see oufs_copy_shared_blocks().  The reference counts of the
+ *  shared blocks are only examined and changed under master_lock (a clone
+ *  may be unsharing the same blocks at the same time).
+ *
+ * @param fp OUFILE pointer
+ * @param inode Pointer to the loaded inode of the file
+ * @param last Index (within the file) of the last block that must be unshared
+ * @return The number of blocks that were copied
+ *         -x if an error
+ */
+static int oufs_unshare_blocks(OUFILE *fp, INODE *inode, int last)
+{
+  OUFS_MOUNT *mnt = fp->mount;
+  if(!(inode->flags & INODE_FLAG_SHARED))
+    return(0);
+
+  pthread_mutex_lock(&mnt->master_lock);
+  int ret = oufs_copy_shared_blocks(fp, inode, last);
+  pthread_mutex_unlock(&mnt->master_lock);
+  return(ret);
+}
+
+/**
+ * Append bytes to the end of an open file's content chain.
+ * - The last block is found through the block reference cache (for "a"
+ *     handles, the only entry that is filled in) and is filled first
+ * - All further blocks that are needed are allocated in one pass (up to
+ *     MAX_BLOCKS_IN_FILE for the file), linked in memory and written in
+ *     batches of WRITE_BUFFER_BLOCKS; runs of adjacent blocks go to the
+ *     disk as single requests.  Every block is written exactly once.  Each
+ *     batch of blocks takes one read-modify-write of the calling thread's
+ *     allocation shard (see oufs_allocate_blocks())
+ * - A last block that is shared with a reflink clone is copied first
+ * - inode->size is updated, but the inode is not written back to the disk
+ * - The caller holds the inode lock of the file (exclusively)
+ *
+ * @param fp OUFILE pointer
+ * @param inode Pointer to the loaded inode of the file
+ * @param buf Character buffer of bytes to write
+ * @param len Number of bytes to write
+ * @return The number of appended bytes
+ *         -x if an error
+ */
+static FILE_OFFSET oufs_append_bytes(OUFILE *fp, INODE *inode, unsigned char * buf, FILE_OFFSET len)
+{
+  OUFS_MOUNT *mnt = fp->mount;
+  BLOCK tail;
+  BLOCK_REFERENCE tail_reference = UNALLOCATED_BLOCK;
+  int tail_dirty = 0;
+
+  // Compute the first free byte within the last block.  A file whose size is
+  //  an exact multiple of DATA_BLOCK_SIZE has a completely full last block.
+  int used_bytes_in_last_block = inode->size % DATA_BLOCK_SIZE;
+  if(used_bytes_in_last_block == 0 && inode->size > 0)
+    used_bytes_in_last_block = DATA_BLOCK_SIZE;
+  FILE_OFFSET len_written = 0;
+
+  // The file may not grow beyond MAX_BLOCKS_IN_FILE blocks
+  len = MIN(len, (FILE_OFFSET) MAX_BLOCKS_IN_FILE * DATA_BLOCK_SIZE - inode->size);
+  if(len <= 0)
+    return(0);
+
+  // Fill the rest of the last block
+  if(fp->n_data_blocks > 0) {
+    if(oufs_unshare_blocks(fp, inode, fp->n_data_blocks - 1) < 0)
+      return(-2);
+    tail_reference = fp->block_reference_cache[fp->n_data_blocks - 1];
+    int n = MIN(len, DATA_BLOCK_SIZE - used_bytes_in_last_block);
+    if(n > 0) {
+      if(virtual_disk_read_block(mnt->disk, tail_reference, &tail) != 0)
+        return(-2);
+      memcpy(tail.content.data.data + used_bytes_in_last_block, buf, n);
+      len_written = n;
+      tail_dirty = 1;
+    }
+  }
+
+  // Allocate everything else in one batch
+  BLOCK_REFERENCE refs[MAX_BLOCKS_IN_FILE];
+  int n_new = (len - len_written + DATA_BLOCK_SIZE - 1) / DATA_BLOCK_SIZE;
+  if(n_new > 0) {
+    n_new = oufs_allocate_blocks(mnt, refs, n_new);
+    // Out of space: only keep what fits in the blocks we did get
+    len = MIN(len, len_written + n_new * DATA_BLOCK_SIZE);
+  }
+
+  // Link the old last block (or the inode) to the new chain
+  if(n_new > 0) {
+    inode->tail = refs[n_new - 1];
+    if(tail_reference == UNALLOCATED_BLOCK) {
+      inode->content = refs[0];
+    }else{
+      if(!tail_dirty && virtual_disk_read_block(mnt->disk, tail_reference, &tail) != 0)
+        return(-2);
+      tail.next_block = refs[0];
+      tail_dirty = 1;
+    }
+  }
+  if(tail_dirty)
+    virtual_disk_write_block(mnt->disk, tail_reference, &tail);
+
+  // Build and write the new blocks
+  BLOCK blocks[WRITE_BUFFER_BLOCKS];
+  for(int i = 0; i < n_new; i += WRITE_BUFFER_BLOCKS) {
+    int batch = MIN(n_new - i, WRITE_BUFFER_BLOCKS);
+    for(int j = 0; j < batch; ++j) {
+      int n = MIN(len - len_written, DATA_BLOCK_SIZE);
+      memset(&blocks[j], 0, sizeof(BLOCK));
+      memcpy(blocks[j].content.data.data, buf + len_written, n);
+      blocks[j].next_block = (i + j + 1 < n_new) ? refs[i + j + 1] : UNALLOCATED_BLOCK;
+      len_written += n;
+      fp->block_reference_cache[fp->n_data_blocks++] = refs[i + j];
+    }
+    if(virtual_disk_write_blocks(mnt->disk, &refs[i], batch, blocks) != 0)
+      return(-2);
+  }
+
+  inode->size += len_written;
+  return(len_written);
+}
+
+/**
+ * Write any buffered bytes of a file opened for w or a to the disk.
+ *  Blocks for the buffered bytes are allocated only now (delayed
+ *  allocation), all at once, and the inode is written once.
+ *
+ * @param fp OUFILE pointer
+ * @return 0 if success (or nothing to do)
+ *         -x if an error (including the disk or file filling up, in which
+ *            case the bytes that did not fit are dropped)
+ */
+int oufs_fflush(OUFILE *fp)
+{
+  OUFS_MOUNT *mnt = fp->mount;
+  if(fp->wb_count == 0)
+    return(0);
+
+  INODE inode;
+  pthread_rwlock_wrlock(&mnt->inode_lock[fp->inode_reference]);
+  if(oufs_read_inode_by_reference(mnt, fp->inode_reference, &inode) != 0) {
+    pthread_rwlock_unlock(&mnt->inode_lock[fp->inode_reference]);
+    return(-1);
+  }
+
+  int count = fp->wb_count;
+  FILE_OFFSET len_written = -1;
+  if(oufs_sync_append_cache(fp, &inode) == 0)
+    len_written = oufs_append_bytes(fp, &inode, fp->wb_buffer, count);
+  fp->wb_count = 0;
+  if(len_written >= 0) {
+    // inode size has changed. write it to disk
+    oufs_write_inode_by_reference(mnt, fp->inode_reference, &inode);
+  }
+  pthread_rwlock_unlock(&mnt->inode_lock[fp->inode_reference]);
+  if(len_written < 0)
+    return(len_written);
+
+  // (Other handles may have appended too)
+  fp->offset = inode.size;
+  if(len_written < count) {
+    fprintf(stderr, "oufs_fflush(): no space for %lld bytes\n", (long long)(count - len_written));
+    return(-2);
+  }
+  return(0);
+}
+
+/*
+ * Write bytes to an open file.
+ * - w/a: bytes are collected in a per-file write buffer; data blocks are
+ *     allocated and written when it is flushed
+ * - Allocate new data blocks, as necessary
+ * - Can allocate up to MAX_BLOCKS_IN_FILE, at which point, no more bytes may be written
+ * - w/a: file offset will always match file size; both will be updated as bytes are written
+ * - r+: bytes are written at the file offset (overwriting existing bytes and
+ *       extending the file as needed); the offset is advanced
+ *
+ * @param fp OUFILE pointer (must be opened for w, a or r+)
+ * @param buf Character buffer of bytes to write
+ * @param len Number of bytes to write
+ * @return The number of written bytes
+ *          0 if file is full and no more bytes can be written
+ *         -x if an error
+ * 
+ */
+FILE_OFFSET oufs_fwrite(OUFILE *fp, unsigned char * buf, FILE_OFFSET len)
+{
+  OUFS_MOUNT *mnt = fp->mount;
+  if(fp->mode == 'r') {
+    fprintf(stderr, "Can't write to read-only file");
+    return(0);
+  }
+  if(mnt->debug)
+    fprintf(stderr, "-------\noufs_fwrite(%lld)\n", (long long) len);
+
+  if(fp->mode == '+') {
+    // In-place update at the current offset
+    FILE_OFFSET ret = oufs_pwrite(fp, buf, len, fp->offset);
+    if(ret > 0)
+      fp->offset += ret;
+    return(ret);
+  }
+
+  // The file may not grow beyond MAX_BLOCKS_IN_FILE blocks
+  len = MIN(len, (FILE_OFFSET) MAX_BLOCKS_IN_FILE * DATA_BLOCK_SIZE - fp->offset);
+  if(len <= 0)
+    return(0);
+
+  if(fp->wb_buffer == NULL) {
+    fp->wb_buffer = malloc(WRITE_BUFFER_SIZE);
+    if(fp->wb_buffer == NULL)
+      return(-1);
+  }
+
+  // Bytes only go into the write buffer; the disk is touched when the
+  //  buffer fills up, on oufs_fflush() or on oufs_fclose()
+  FILE_OFFSET len_written = 0;
+  while(len_written < len) {
+    FILE_OFFSET n = MIN(len - len_written, WRITE_BUFFER_SIZE - fp->wb_count);
+    memcpy(fp->wb_buffer + fp->wb_count, buf + len_written, n);
+    fp->wb_count += n;
+    fp->offset += n;
+    len_written += n;
+
+    if(fp->wb_count == WRITE_BUFFER_SIZE && oufs_fflush(fp) != 0)
+      return(-2);
+  }
+
+  // Done
+  return(len_written);
+}
+
+// Bodies of the public functions, called with the inode locks held
+static FILE_OFFSET oufs_read_at(OUFILE *fp, unsigned char * buf, FILE_OFFSET len, FILE_OFFSET offset);
+static FILE_OFFSET oufs_write_at(OUFILE *fp, unsigned char * buf, FILE_OFFSET len, FILE_OFFSET offset);
+static int oufs_resize(OUFILE *fp, FILE_OFFSET new_size);
+static int oufs_unlink_file(OUFS_MOUNT *mnt, INODE_REFERENCE parent, char *local_name,
+                            INODE_REFERENCE child);
+
+/*
+ * Body of oufs_copy_file_range(), called with the inode locks of both files
+ *  held (src shared, dst exclusive)
+ *
+ * @param src OUFILE pointer (opened for r or r+)
+ * @param dst OUFILE pointer (opened for w or a; nothing buffered)
+ * @param len Number of bytes to copy at max
+ * @return The number of bytes copied
+ *         -x if an error
+ */
+static FILE_OFFSET oufs_copy_range(OUFILE *src, OUFILE *dst, FILE_OFFSET len)
+{
+  OUFS_MOUNT *mnt = src->mount;
+  INODE src_inode;
+  INODE dst_inode;
+  if(oufs_read_inode_by_reference(mnt, src->inode_reference, &src_inode) != 0 ||
+     oufs_read_inode_by_reference(mnt, dst->inode_reference, &dst_inode) != 0) {
+    return(-1);
+  }
+  if(oufs_sync_append_cache(dst, &dst_inode) != 0)
+    return(-1);
+  len = MIN(len, src_inode.size - src->offset);
+  len = MIN(len, (FILE_OFFSET) MAX_BLOCKS_IN_FILE * DATA_BLOCK_SIZE - dst_inode.size);
+  if(len <= 0)
+    return(0);
+
+  FILE_OFFSET len_copied = 0;
+
+  if(src->offset % DATA_BLOCK_SIZE != 0 || dst_inode.size % DATA_BLOCK_SIZE != 0) {
+    // Unaligned: stage through a buffer
+    unsigned char buf[WRITE_BUFFER_SIZE];
+    while(len_copied < len) {
+      FILE_OFFSET n = oufs_read_at(src, buf, MIN(len - len_copied, WRITE_BUFFER_SIZE),
+                                   src->offset + len_copied);
+      if(n <= 0)
+        break;
+      FILE_OFFSET m = oufs_append_bytes(dst, &dst_inode, buf, n);
+      if(m > 0)
+        len_copied += m;
+      if(m < n)
+        break;
+    }
+
+  }else{
+    // Aligned: whole blocks
+    int first = src->offset / DATA_BLOCK_SIZE;
+    int n_blocks = (len + DATA_BLOCK_SIZE - 1) / DATA_BLOCK_SIZE;
+    n_blocks = MIN(n_blocks, src->n_data_blocks - first);
+
+    // The destination's last block is about to change
+    if(oufs_unshare_blocks(dst, &dst_inode, dst->n_data_blocks - 1) < 0)
+      return(-2);
+
+    BLOCK_REFERENCE refs[MAX_BLOCKS_IN_FILE];
+    n_blocks = oufs_allocate_blocks(mnt, refs, n_blocks);
+    len = MIN(len, (FILE_OFFSET) n_blocks * DATA_BLOCK_SIZE);
+    if(n_blocks == 0)
+      return(0);
+
+    // Hook the new chain onto the destination's (full) last block
+    if(dst->n_data_blocks == 0) {
+      dst_inode.content = refs[0];
+    }else{
+      BLOCK tail;
+      BLOCK_REFERENCE tail_reference = dst->block_reference_cache[dst->n_data_blocks - 1];
+      if(virtual_disk_read_block(mnt->disk, tail_reference, &tail) != 0)
+        return(-2);
+      tail.next_block = refs[0];
+      virtual_disk_write_block(mnt->disk, tail_reference, &tail);
+    }
+
+    BLOCK blocks[WRITE_BUFFER_BLOCKS];
+    for(int i = 0; i < n_blocks; i += WRITE_BUFFER_BLOCKS) {
+      int batch = MIN(n_blocks - i, WRITE_BUFFER_BLOCKS);
+      if(virtual_disk_read_blocks(mnt->disk, &src->block_reference_cache[first + i], batch, blocks) != 0)
+        return(-2);
+      for(int j = 0; j < batch; ++j) {
+        blocks[j].next_block = (i + j + 1 < n_blocks) ? refs[i + j + 1] : UNALLOCATED_BLOCK;
+        dst->block_reference_cache[dst->n_data_blocks++] = refs[i + j];
+      }
+      if(i + batch == n_blocks && len % DATA_BLOCK_SIZE != 0) {
+        // Do not carry over source bytes past the end of the copy
+        int used = len % DATA_BLOCK_SIZE;
+        memset(blocks[batch - 1].content.data.data + used, 0, DATA_BLOCK_SIZE - used);
+      }
+      if(virtual_disk_write_blocks(mnt->disk, &refs[i], batch, blocks) != 0)
+        return(-2);
+    }
+
+    dst_inode.tail = refs[n_blocks - 1];
+    dst_inode.size += len;
+    len_copied = len;
+  }
+
+  oufs_write_inode_by_reference(mnt, dst->inode_reference, &dst_inode);
+  src->offset += len_copied;
+  dst->offset = dst_inode.size;
+  return(len_copied);
 }
 
+/*
+ * Copy bytes from one open file to the end of another, inside the image.
+ * - Fast path (the source offset and the destination size are both
+ *     multiples of DATA_BLOCK_SIZE, e.g. a fresh "w" destination): source
+ *     blocks are read in batches (runs of adjacent blocks as single
+ *     requests), relinked in memory and written as the destination's new
+ *     blocks, which are all allocated up front in one pass; no bytes are
+ *     copied through a user buffer
+ * - Otherwise, bytes are staged through a buffer of WRITE_BUFFER_SIZE
+ * - Both offsets are advanced
+ * - Holds the inode locks of both files (the source shared)
+ *
+ * @param src OUFILE pointer (must be opened for r or r+)
+ * @param dst OUFILE pointer (must be opened for w or a; a different file)
+ * @param len Number of bytes to copy at max
+ * @return The number of bytes copied
+ *         0 if src is at its end (or dst is full)
+ *         -x if an error
+ */
+FILE_OFFSET oufs_copy_file_range(OUFILE *src, OUFILE *dst, FILE_OFFSET len)
+{
+  OUFS_MOUNT *mnt = src->mount;
+  if((src->mode != 'r' && src->mode != '+') ||
+     (dst->mode != 'w' && dst->mode != 'a') || dst->mount != mnt ||
+     src->inode_reference == dst->inode_reference) {
+    fprintf(stderr, "oufs_copy_file_range(): bad file modes or mounts\n");
+    return(-1);
+  }
+
+  // Anything still buffered goes first
+  if(oufs_fflush(dst) != 0)
+    return(-2);
+
+  // Source shared, destination exclusive; the lower inode reference first
+  pthread_rwlock_t *src_lock = &mnt->inode_lock[src->inode_reference];
+  pthread_rwlock_t *dst_lock = &mnt->inode_lock[dst->inode_reference];
+  if(src->inode_reference < dst->inode_reference) {
+    pthread_rwlock_rdlock(src_lock);
+    pthread_rwlock_wrlock(dst_lock);
+  }else{
+    pthread_rwlock_wrlock(dst_lock);
+    pthread_rwlock_rdlock(src_lock);
+  }
+  FILE_OFFSET ret = oufs_copy_range(src, dst, len);
+  pthread_rwlock_unlock(dst_lock);
+  pthread_rwlock_unlock(src_lock);
+  return(ret);
+}
+
+/*
+ * Change the size of an open file.
+ * - Shrinking: the block that holds the new last byte becomes the tail and
+ *     all blocks after it are freed at once, as listed by the block
+ *     reference cache (blocks shared with a reflink clone only lose a
+ *     reference)
+ * - Growing: the file is extended with zero bytes (up to MAX_BLOCKS_IN_FILE
+ *     blocks)
+ * - For files opened with w or a, the offset follows the new size; for r+,
+ *     the offset is not changed
+ * - Holds the inode lock of the file (exclusively)
+ *
+ * @param fp OUFILE pointer (must be opened for w, a or r+)
+ * @param new_size New size of the file in bytes
+ * @return 0 if success
+ *         -x if error
+ */
+int oufs_ftruncate(OUFILE *fp, FILE_OFFSET new_size)
+{
+  OUFS_MOUNT *mnt = fp->mount;
+  if(fp->mode == 'r') {
+    fprintf(stderr, "Can't truncate a read-only file\n");
+    return(-1);
+  }
+  if(new_size < 0 || new_size > (FILE_OFFSET) MAX_BLOCKS_IN_FILE * DATA_BLOCK_SIZE) {
+    return(-3);
+  }
+
+  // Buffered bytes belong to the file before it is resized
+  if(oufs_fflush(fp) != 0)
+    return(-2);
+
+  pthread_rwlock_wrlock(&mnt->inode_lock[fp->inode_reference]);
+  int ret = oufs_resize(fp, new_size);
+  pthread_rwlock_unlock(&mnt->inode_lock[fp->inode_reference]);
+  return(ret);
+}
+
+/*
+ * Body of oufs_ftruncate(), called with the inode lock of the file held
+ *  (exclusively) and nothing buffered
+ *
+ * @param fp OUFILE pointer (opened for w, a or r+)
+ * @param new_size New size of the file in bytes
+ * @return 0 if success
+ *         -x if error
+ */
+static int oufs_resize(OUFILE *fp, FILE_OFFSET new_size)
+{
+  OUFS_MOUNT *mnt = fp->mount;
+  INODE inode;
+  if(oufs_read_inode_by_reference(mnt, fp->inode_reference, &inode) != 0) {
+    return(-1);
+  }
+  // The file may have been extended or shrunk through another handle
+  if(oufs_sync_append_cache(fp, &inode) != 0)
+    return(-1);
+
+  if(new_size < inode.size) {
+    int keep = (new_size + DATA_BLOCK_SIZE - 1) / DATA_BLOCK_SIZE;
+
+    if(keep < fp->n_data_blocks) {
+      // "a" handles only know their last block (and the cache of a "w"
+      //  handle is stale if the file was also appended to elsewhere)
+      if(fp->mode != '+' && oufs_fill_block_cache(fp, &inode) != 0)
+        return(-1);
+      // The new tail is about to change
+      if(keep > 0 && oufs_unshare_blocks(fp, &inode, keep - 1) < 0)
+        return(-2);
+
+      BLOCK_REFERENCE first_freed = fp->block_reference_cache[keep];
+
+      if(keep == 0) {
+        inode.content = UNALLOCATED_BLOCK;
+        inode.tail = UNALLOCATED_BLOCK;
+      }else{
+        // Cut the chain after the new tail
+        BLOCK block;
+        BLOCK_REFERENCE new_tail = fp->block_reference_cache[keep - 1];
+        if(virtual_disk_read_block(mnt->disk, new_tail, &block) != 0)
+          return(-1);
+        block.next_block = UNALLOCATED_BLOCK;
+        if(virtual_disk_write_block(mnt->disk, new_tail, &block) != 0)
+          return(-1);
+        inode.tail = new_tail;
+      }
+
+      // The cache lists the cut-off blocks: no need to walk them
+      ALLOC_MASK mask;
+      memset(&mask, 0, sizeof(mask));
+      if(inode.flags & INODE_FLAG_SHARED) {
+        if(oufs_release_chain(mnt, &mask, first_freed) < 0)
+          return(-2);
+      }else{
+        for(int i = keep; i < fp->n_data_blocks; ++i)
+          oufs_mark_block(&mask, fp->block_reference_cache[i]);
+      }
+      if(oufs_free_marked(mnt, &mask) != 0)
+        return(-1);
+      fp->n_data_blocks = keep;
+    }
+    inode.size = new_size;
+
+  }else if(new_size > inode.size) {
+    // Extend with zeros
+    unsigned char zeros[DATA_BLOCK_SIZE];
+    memset(zeros, 0, sizeof(zeros));
+    while(inode.size < new_size) {
+      FILE_OFFSET n = oufs_append_bytes(fp, &inode, zeros, MIN(new_size - inode.size, DATA_BLOCK_SIZE));
+      if(n <= 0) {
+        oufs_write_inode_by_reference(mnt, fp->inode_reference, &inode);
+        return(-4);
+      }
+    }
+  }
+
+  oufs_write_inode_by_reference(mnt, fp->inode_reference, &inode);
+  if(fp->mode != '+')
+    fp->offset = inode.size;
+  return(0);
+}
+
+/*
+ * Write bytes at a specified offset within a file opened for "r+".
+ * - Bytes within the current file are overwritten in place.  The block
+ *     holding any offset is found through the block reference cache, so
+ *     positioning costs no chain walk; a block that is completely
+ *     overwritten is not read first
+ * - Blocks shared with a reflink clone are copied before being overwritten
+ * - Bytes past the end of the file are appended (as with oufs_fwrite())
+ * - The file offset is not changed
+ * - Holds the inode lock of the file (exclusively)
+ *
+ * @param fp OUFILE pointer (must be opened for r+)
+ * @param buf Character buffer of bytes to write
+ * @param len Number of bytes to write
+ * @param offset Position in the file of the first byte (at most the file size)
+ * @return The number of written bytes
+ *         -x if an error
+ */
+FILE_OFFSET oufs_pwrite(OUFILE *fp, unsigned char * buf, FILE_OFFSET len, FILE_OFFSET offset)
+{
+  OUFS_MOUNT *mnt = fp->mount;
+  if(fp->mode != '+') {
+    fprintf(stderr, "oufs_pwrite(): file must be opened for r+\n");
+    return(-1);
+  }
+
+  pthread_rwlock_wrlock(&mnt->inode_lock[fp->inode_reference]);
+  FILE_OFFSET ret = oufs_write_at(fp, buf, len, offset);
+  pthread_rwlock_unlock(&mnt->inode_lock[fp->inode_reference]);
+  return(ret);
+}
+
+/*
+ * Body of oufs_pwrite(), called with the inode lock of the file held
+ *  (exclusively)
+ *
+ * @param fp OUFILE pointer (opened for r+)
+ * @param buf Character buffer of bytes to write
+ * @param len Number of bytes to write
+ * @param offset Position in the file of the first byte
+ * @return The number of written bytes
+ *         -x if an error
+ */
+static FILE_OFFSET oufs_write_at(OUFILE *fp, unsigned char * buf, FILE_OFFSET len, FILE_OFFSET offset)
+{
+  OUFS_MOUNT *mnt = fp->mount;
+  INODE inode;
+  BLOCK block;
+  if(oufs_read_inode_by_reference(mnt, fp->inode_reference, &inode) != 0) {
+    return(-1);
+  }
+  if(offset < 0 || offset > inode.size) {
+    fprintf(stderr, "oufs_pwrite(): offset beyond end of file\n");
+    return(-3);
+  }
+  if(len <= 0)
+    return(0);
+  // The file may have been extended or shrunk through another handle
+  if(oufs_sync_append_cache(fp, &inode) != 0)
+    return(-2);
+
+  // Overwrite the part that lies within the current file
+  FILE_OFFSET len_written = 0;
+  FILE_OFFSET overwrite = MIN(len, inode.size - offset);
+
+  // Blocks shared with a reflink clone get their own copies first
+  if(overwrite > 0) {
+    int ret = oufs_unshare_blocks(fp, &inode, (offset + overwrite - 1) / DATA_BLOCK_SIZE);
+    if(ret < 0)
+      return(-2);
+    if(ret > 0)
+      oufs_write_inode_by_reference(mnt, fp->inode_reference, &inode);
+  }
+  while(len_written < overwrite) {
+    // (offset + len_written stays within the file: no overflow)
+    int current_block = (offset + len_written) / DATA_BLOCK_SIZE;
+    int byte_offset_in_block = (offset + len_written) % DATA_BLOCK_SIZE;
+    int n = MIN(overwrite - len_written, DATA_BLOCK_SIZE - byte_offset_in_block);
+    BLOCK_REFERENCE ref = fp->block_reference_cache[current_block];
+
+    if(n == DATA_BLOCK_SIZE) {
+      // Whole block: its link is known from the cache, so skip the read
+      block.next_block = (current_block + 1 < fp->n_data_blocks) ?
+        fp->block_reference_cache[current_block + 1] : UNALLOCATED_BLOCK;
+    }else if(virtual_disk_read_block(mnt->disk, ref, &block) != 0) {
+      return(-2);
+    }
+    memcpy(block.content.data.data + byte_offset_in_block, buf + len_written, n);
+    if(virtual_disk_write_block(mnt->disk, ref, &block) != 0)
+      return(-2);
+    len_written += n;
+  }
+
+  // Extend the file with the rest
+  if(len_written < len) {
+    FILE_OFFSET ret = oufs_append_bytes(fp, &inode, buf + len_written, len - len_written);
+    if(ret < 0)
+      return(ret);
+    len_written += ret;
+    oufs_write_inode_by_reference(mnt, fp->inode_reference, &inode);
+  }
+
+  return(len_written);
+}
+
+
+/*
+ * Read a sequence of bytes from an open file.
+ * - offset is the current position within the file, and will never be larger than size
+ * - offset will be updated with each read operation
+ *
+ * @param fp OUFILE pointer (must be opened for r or r+)
+ * @param buf Character buffer to place the bytes into
+ * @param len Number of bytes to read at max
+ * @return The number of bytes read
+ *         0 if offset is at size
+ *         -x if an error
+ * 
+ */
+
+FILE_OFFSET oufs_fread(OUFILE *fp, unsigned char * buf, FILE_OFFSET len)
+{
+  OUFS_MOUNT *mnt = fp->mount;
+  if(mnt->debug)
+    fprintf(stderr, "\n-------\noufs_fread(%lld)\n", (long long) len);
+
+  FILE_OFFSET len_read = oufs_pread(fp, buf, len, fp->offset);
+  if(len_read > 0)
+    fp->offset += len_read;
+
+  // Done
+  return(len_read);
+}
+
+/*
+ * Fetch one data block of an open file.
+ * - For a sequential reader of a file opened with "r", the block comes from
+ *     the read-ahead buffer.  On a miss the buffer is refilled with the next
+ *     ra_window blocks (contiguous blocks are read with one request), the
+ *     backend is asked to start loading the window after that, and the
+ *     window doubles (up to READ_AHEAD_MAX_BLOCKS)
+ * - Otherwise, the block is read directly into block
+ *
+ * @param fp OUFILE pointer
+ * @param index Index of the block within the file (< fp->n_data_blocks)
+ * @param block Buffer that may be used to hold the block
+ * @return Pointer to the loaded block
+ *         NULL if an error
+ */
+static BLOCK *oufs_get_file_block(OUFILE *fp, int index, BLOCK *block)
+{
+  OUFS_MOUNT *mnt = fp->mount;
+  if(fp->mode == 'r' && fp->ra_window > 0) {
+    // Hit?
+    if(index >= fp->ra_start && index < fp->ra_start + fp->ra_count)
+      return(&fp->ra_buffer[index - fp->ra_start]);
+
+    if(fp->ra_buffer == NULL) {
+      fp->ra_buffer = malloc(READ_AHEAD_MAX_BLOCKS * sizeof(BLOCK));
+      if(fp->ra_buffer == NULL)
+        return(NULL);
+    }
+
+    // Refill with the window starting at this block
+    int n = MIN(fp->ra_window, fp->n_data_blocks - index);
+    if(virtual_disk_read_blocks(mnt->disk, &fp->block_reference_cache[index], n, fp->ra_buffer) != 0) {
+      fp->ra_count = 0;
+      return(NULL);
+    }
+    fp->ra_start = index;
+    fp->ra_count = n;
+
+    // Grow the window, and let the next one load in the background
+    fp->ra_window = MIN(fp->ra_window * 2, READ_AHEAD_MAX_BLOCKS);
+    int m = MIN(fp->ra_window, fp->n_data_blocks - (index + n));
+    if(m > 0)
+      virtual_disk_prefetch_blocks(mnt->disk, &fp->block_reference_cache[index + n], m);
+
+    return(&fp->ra_buffer[0]);
+  }
+
+  if(virtual_disk_read_block(mnt->disk, fp->block_reference_cache[index], block) != 0)
+    return(NULL);
+  return(block);
+}
+
+/*
+ * Read a sequence of bytes from a specified offset within an open file.
+ * - The block holding any offset is found through the block reference
+ *     cache, so a read costs one block read per block touched (no chain
+ *     walk from the start of the file)
+ * - The file offset is not changed
+ * - Holds the inode lock of the file shared: readers of a file do not wait
+ *     for each other
+ *
+ * @param fp OUFILE pointer (must be opened for r or r+)
+ * @param buf Character buffer to place the bytes into
+ * @param len Number of bytes to read at max
+ * @param offset Position in the file of the first byte to read
+ * @return The number of bytes read
+ *         0 if offset is at (or beyond) size
+ *         -x if an error
+ */
+FILE_OFFSET oufs_pread(OUFILE *fp, unsigned char * buf, FILE_OFFSET len, FILE_OFFSET offset)
+{
+  OUFS_MOUNT *mnt = fp->mount;
+  // Check open mode
+  if(fp->mode != 'r' && fp->mode != '+') {
+    fprintf(stderr, "Can't read from a write-only file");
+    return(0);
+  }
+
+  pthread_rwlock_rdlock(&mnt->inode_lock[fp->inode_reference]);
+  FILE_OFFSET ret = oufs_read_at(fp, buf, len, offset);
+  pthread_rwlock_unlock(&mnt->inode_lock[fp->inode_reference]);
+  return(ret);
+}
+
+/*
+ * Body of oufs_pread(), called with the inode lock of the file held
+ *
+ * @param fp OUFILE pointer (opened for r or r+)
+ * @param buf Character buffer to place the bytes into
+ * @param len Number of bytes to read at max
+ * @param offset Position in the file of the first byte to read
+ * @return The number of bytes read
+ *         -x if an error
+ */
+static FILE_OFFSET oufs_read_at(OUFILE *fp, unsigned char * buf, FILE_OFFSET len, FILE_OFFSET offset)
+{
+  OUFS_MOUNT *mnt = fp->mount;
+  INODE inode;
+  BLOCK block;
+  if(oufs_read_inode_by_reference(mnt, fp->inode_reference, &inode) != 0) {
+    return(-1);
+  }
+  if(offset < 0)
+    return(-3);
+
+  FILE_OFFSET len_read = 0;
+  len = MIN(len, inode.size - offset);
+
+  // Sequential access (this read starts where the last one ended) turns on
+  //  read-ahead; any other access turns it off
+  if(fp->mode == 'r') {
+    if(offset != fp->ra_next)
+      fp->ra_window = 0;
+    else if(fp->ra_window == 0)
+      fp->ra_window = READ_AHEAD_MIN_BLOCKS;
+  }
+
+  // Copy whole spans: the rest of the first block, then full blocks, then
+  //  the head of the last block
+  while(len_read < len) {
+    int current_block = (offset + len_read) / DATA_BLOCK_SIZE;
+    int byte_offset_in_block = (offset + len_read) % DATA_BLOCK_SIZE;
+    BLOCK *b = NULL;
+    if(current_block < fp->n_data_blocks)
+      b = oufs_get_file_block(fp, current_block, &block);
+    if(b == NULL) {
+      // no more blocks left to grab
+      fprintf(stderr, "no blocks remaining in file. returning len_read = %lld\n", (long long) len_read);
+      break;
+    }
+    int n = MIN(len - len_read, DATA_BLOCK_SIZE - byte_offset_in_block);
+    memcpy(buf + len_read, b->content.data.data + byte_offset_in_block, n);
+    len_read += n;
+  }
+  if(len > 0)
+    fp->ra_next = offset + len_read;
 
+  // Done
+  return(len_read);
+}
 
 /*
- * Write bytes to an open file.
- * - Allocate new data blocks, as necessary
- * - Can allocate up to MAX_BLOCKS_IN_FILE, at which point, no more bytes may be written
- * - file offset will always match file size; both will be updated as bytes are written
+ * Map a range of an open file for reading without copying.
+ * - The spans point straight into the mapped disk image, in file order:
+ *     one span per data block touched by the range
+ * - The mapping stays valid until oufs_release_view(); the bytes are
+ *     read-only and reflect later writes to the file's blocks
+ * - The offset of the file is not changed
+ * - Bytes appended through another handle after this one was opened are
+ *     not mapped (as with oufs_pread())
  *
- * @param fp OUFILE pointer (must be opened for w or a)
- * @param buf Character buffer of bytes to write
- * @param len Number of bytes to write
- * @return The number of written bytes
- *          0 if file is full and no more bytes can be written
- *         -x if an error
- * 
+ * @param fp OUFILE pointer (must be opened for r or r+)
+ * @param offset Position in the file of the first byte
+ * @param len Number of bytes to map at max
+ * @param view View to fill in
+ * @return The number of bytes covered by the spans
+ *         0 if offset is at size
+ *         -x if an error (-4: the disk image cannot be mapped; use
+ *            oufs_pread() instead)
  */
-int oufs_fwrite(OUFILE *fp, unsigned char * buf, int len)
+FILE_OFFSET oufs_view(OUFILE *fp, FILE_OFFSET offset, FILE_OFFSET len, OUVIEW *view)
 {
-  if(fp->mode == 'r') {
-    fprintf(stderr, "Can't write to read-only file");
-    return(0);
+  OUFS_MOUNT *mnt = fp->mount;
+  view->mount = mnt;
+  view->disk = NULL;
+  view->n_spans = 0;
+
+  if(fp->mode != 'r' && fp->mode != '+') {
+    fprintf(stderr, "oufs_view(): file must be opened for r or r+\n");
+    return(-1);
   }
-  if(debug)
-    fprintf(stderr, "-------\noufs_fwrite(%d)\n", len);
-    
+
   INODE inode;
-  BLOCK block;
-  if(oufs_read_inode_by_reference(fp->inode_reference, &inode) != 0) {
+  pthread_rwlock_rdlock(&mnt->inode_lock[fp->inode_reference]);
+  int ret = oufs_read_inode_by_reference(mnt, fp->inode_reference, &inode);
+  pthread_rwlock_unlock(&mnt->inode_lock[fp->inode_reference]);
+  if(ret != 0) {
     return(-1);
   }
+  if(offset < 0 || offset > inode.size)
+    return(-3);
+  len = MIN(len, inode.size - offset);
+  // Only blocks that the handle's reference cache lists can be mapped (as
+  //  in oufs_read_at(); the file may have grown through another handle)
+  len = MIN(len, (FILE_OFFSET) fp->n_data_blocks * DATA_BLOCK_SIZE - offset);
+  if(len <= 0)
+    return(0);
 
-  // Compute the index for the last block in the file + the first free byte within the block
-  
-  int current_blocks = (fp->offset + DATA_BLOCK_SIZE - 1) / DATA_BLOCK_SIZE;
-  int used_bytes_in_last_block = fp->offset % DATA_BLOCK_SIZE;
-  int free_bytes_in_last_block = DATA_BLOCK_SIZE - used_bytes_in_last_block;
-  int len_written = 0;
+  const BLOCK *disk = virtual_disk_map(mnt->disk);
+  if(disk == NULL)
+    return(-4);
+  view->disk = disk;
 
-  // TODO
-    // do this check whre the inode is loaded.
-    
-    //if(inode.size + len > (DATA_BLOCK_SIZE * MAX_BLOCKS_IN_FILE))
-    //{
-    //    return 0;
-    //}
-    
-    // while we have more bytes to write, allocate new block, copy in some number of bytes ( either bytes left to copy or bytes left to get to end of block - whichever is less)
-    
-    int bytes_left_to_write = 0;
-    BLOCK master;
-    virtual_disk_read_block(MASTER_BLOCK_REFERENCE, &master);
-    //fprintf(stderr, "top of fwrite. current_blocks ==   %d\n", current_blocks);
-    //fprintf(stderr, "top of fwrite. free_bytes_in_last_block ==   %d\n", free_bytes_in_last_block);
-    //fprintf(stderr, "fp->inode_reference ==   %d\n", fp->inode_reference);
-    //fprintf(stderr, "initial fp->offset ==   %d\n", fp->offset);
-    
-     // TODO: ???? I believe I have to handle inode sizes of 0 seperately CHECK THIS
-     if ((current_blocks == 0) && (len > 0))
-     {
-         BLOCK_REFERENCE startref;
-         //BLOCK startblock;
-         BLOCK *startblock = malloc(BLOCK_SIZE);
-         startref = oufs_allocate_new_block(&master, startblock);
-         //fprintf(stderr, "startref ==   %d\n", startref);
-         inode.content = startref;
-         virtual_disk_write_block(MASTER_BLOCK_REFERENCE, &master);
-         //fprintf(stderr, "wrote master block\n");
-         // TODO: do i need to write the block that i just alloated to disk?
-         virtual_disk_write_block(startref, startblock);
-         //fprintf(stderr, "wrote to disk(startref, &masterblock");
-         // TODO: check if this free() should be here
-         //free(startblock);
-         fp->n_data_blocks = 1;
-         fp->block_reference_cache[0] = startref;
-         //fprintf(stderr, "end of first loop where current_blocks == 0. n_data_blocks =  %d\n", fp->n_data_blocks);
-     }
-    
-    BLOCK_REFERENCE currBlock;
-    BLOCK tempBlock;
-    currBlock = inode.content;
-    // currBlock is reference to initial block connected to inode
-    // Loop to get the refrence of the last block in the chain of blocks connected to the file. Storing it in currBlock.
-    while (1)
-    {
-        virtual_disk_read_block(currBlock, &tempBlock);
-        if (tempBlock.next_block != UNALLOCATED_BLOCK)
-        {
-            currBlock = tempBlock.next_block;
-        }
-        else
-            break;
+  FILE_OFFSET len_mapped = 0;
+  while(len_mapped < len) {
+    int current_block = (offset + len_mapped) / DATA_BLOCK_SIZE;
+    int byte_offset_in_block = (offset + len_mapped) % DATA_BLOCK_SIZE;
+    OUSPAN *span = &view->span[view->n_spans++];
+
+    span->data = disk[fp->block_reference_cache[current_block]].content.data.data
+      + byte_offset_in_block;
+    span->len = MIN(len - len_mapped, DATA_BLOCK_SIZE - byte_offset_in_block);
+    len_mapped += span->len;
+  }
+  return(len_mapped);
+}
+
+/*
+ * Release a view made by oufs_view(): its spans may no longer be used.
+ *
+ * @param view View to release (releasing an empty view does nothing)
+ */
+void oufs_release_view(OUVIEW *view)
+{
+  OUFS_MOUNT *mnt = view->mount;
+  if(view->disk != NULL)
+    virtual_disk_unmap(mnt->disk);
+  view->disk = NULL;
+  view->n_spans = 0;
+}
+
+/*
+ * Write a vector of buffers to a host file descriptor completely
+ *  (resuming after short writes and interrupted calls)
+ *
+ * @param fd Host file descriptor
+ * @param iov Buffers (modified as they are consumed)
+ * @param n_iov Number of buffers
+ * @return The number of bytes written; -1 if an error
+ */
+static ssize_t oufs_writev_all(int fd, struct iovec *iov, int n_iov)
+{
+  ssize_t total = 0;
+
+  while(n_iov > 0) {
+    ssize_t n = writev(fd, iov, n_iov);
+    if(n < 0) {
+      if(errno == EINTR)
+        continue;
+      return(-1);
     }
-    if (currBlock == UNALLOCATED_BLOCK)
-        return -2;
-    virtual_disk_read_block(currBlock, &block);
-    //fprintf(stderr, "before for loop. inode.content =  %d\n", inode.content);
-    BLOCK_REFERENCE new;
-    BLOCK * newBlock = malloc(BLOCK_SIZE);
-    memset(newBlock, 0, BLOCK_SIZE);
-    
-    //fprintf(stderr, "FWRITE: before while loop, inode.size == %d\n", inode.size);
-    while(len_written < len)
-    {
-    
-    /*     TODO: check to see if need to add check towards end of this loop to see if allocating a
-     *     newblock would put it over the 100 limit. If so, fild out how best to break. (tricky)
-     */
-        
-        
-        // check to make sure we haven't added the maximum number of blocks yet
-        //if (fp->n_data_blocks > MAX_BLOCKS_IN_FILE)
-        //{
-        //    fprintf(stderr, "in fwrite loop: Hit 100 blocks in fp. breaking");
-            // TODO: check if possibly return 0 here????
-         //   break;
-        //}
-        bytes_left_to_write = len - len_written;
-        
-        //if (fp->n_data_blocks < )
-        //fprintf(stderr, "Top of for loop byes_left_to_write ==   %d\n", bytes_left_to_write);
-        
-        // fewer bytes of space available in last block than need to be written
-        if (free_bytes_in_last_block < bytes_left_to_write)
-        {
-                                        /*
-            memcpy(block.content.data.data+used_bytes_in_last_block, buf, free_bytes_in_last_block);
-            //memcpy(block.content.data.data[used_bytes_in_last_block], &buf[len_written], free_bytes_in_last_block);
-            buf += free_bytes_in_last_block;
-            len_written += free_bytes_in_last_block;
-            fp->offset += free_bytes_in_last_block;
-            inode.size += free_bytes_in_last_block;
-            
-            virtual_disk_write_block(currBlock, &block);
-                                         */
-            virtual_disk_read_block(MASTER_BLOCK_REFERENCE, &master);
-            for (int i=used_bytes_in_last_block; i<DATA_BLOCK_SIZE; i++)
-            {
-                
-                block.content.data.data[i] = buf[len_written];
-                len_written++;
-                fp->offset++;
-                inode.size++;
-                //fprintf(stderr, "fwrite: block.data[%d] = buf[%d] = %c\n", i, len_written, buf[len_written]);
-                //debug print statement
-                //fprintf(stderr, "len_written ==  %d\n", len_written);
-            }
-            virtual_disk_write_block(currBlock, &block);
-            // check to see if number of blocks <= 100
-            // allocate new block
-            // TODO: check that this is assigning correctly. May be staying the same each time due to the function creating its own block_ref and assigning it to new with = operator
-            
-            // TODO: see if need to be using malloc for newBlock to be returned correctly
-            new = oufs_allocate_new_block(&master, newBlock);
-            
-            //fprintf(stderr, "new == %d\n", new);
-            // TODO: check that this shouldn't return 0 or something
-            if (new == UNALLOCATED_BLOCK)
-                return -2;
-            // write master block back to disk - changed its unallocated_front
-            virtual_disk_write_block(MASTER_BLOCK_REFERENCE, &master);
-            //fprintf(stderr, "block.next_block pointed to %d BEFORE adding new one to end\n", block.next_block);
-            block.next_block = new;
-            //fprintf(stderr, "block.next_block now points to %d AFTER adding new one to end\n", block.next_block);
-            //TODO: check if i need to use malloc for block or not
-            virtual_disk_write_block(currBlock, &block);
-            virtual_disk_write_block(new, newBlock);
-            
-            // recalculations for next loop:
-            current_blocks = (fp->offset + DATA_BLOCK_SIZE - 1) / DATA_BLOCK_SIZE;
-            used_bytes_in_last_block = fp->offset % DATA_BLOCK_SIZE;
-            // free bytes should reset to 252
-            free_bytes_in_last_block = DATA_BLOCK_SIZE - used_bytes_in_last_block;
-            
-            fp->n_data_blocks++;
-            //TODO: check that this is right. Not subtracting 1 due to setting next one in chain to the new BLOCK_REF
-            fp->block_reference_cache[current_blocks] = new;
-            
-            //TODO: currBLOCK is not changing correctly around here somewhere.
-            // FIXME: fix this!
-            //fprintf(stderr, "\tcurrBlock BEFORE shift to be new(reference): %d\n ", currBlock);
-            //TODO: this is showing up as 6 everytime???
-            currBlock = new;
-            //fprintf(stderr, "\tcurrBlock AFTER shift to be new(reference): %d\n ", currBlock);
-            //memcpy(&currBlock, &new, sizeof(BLOCK_REFERENCE));
-            //TODO: check that this copy works
-            //fprintf(stderr, "\tBefore memcpy to shift block to be newBlock: block.next_block is %d\n", block.next_block);
-            memset(&block, 0, BLOCK_SIZE);
-            memcpy(&block, newBlock, BLOCK_SIZE);
-            // After memcpy
-            //fprintf(stderr, "\tAfter memcpy to shift block to be newBlock: block.next_block is %d\n", block.next_block);
-            //block = newBlock;
-            memset(newBlock, 0, BLOCK_SIZE);
-        }
-        else    // whats left to write will fit in free space left in last block
-        {
-                                                    /*
-            memcpy(block.content.data.data+used_bytes_in_last_block, buf, bytes_left_to_write);
-            //memcpy(block.content.data.data[used_bytes_in_last_block], &buf[len_written], free_bytes_in_last_block);
-            buf += bytes_left_to_write;
-            len_written += bytes_left_to_write;
-            fp->offset += bytes_left_to_write;
-            inode.size += bytes_left_to_write;
-                                                     */
-            
-            for (int i=used_bytes_in_last_block; i<(used_bytes_in_last_block + bytes_left_to_write); i++)
-            {
-                // TODO: check. changed below line from block.content.data.data[i] = buf[i-used_bytes_in_last_block];
-                block.content.data.data[i] = buf[len_written];
-                len_written++;
-                fp->offset++;
-                inode.size++;
-                //fprintf(stderr, "fwrite: block.data[%d] = buf[%d] = %c\n", i, len_written, buf[len_written]);
-                //fprintf(stderr, "FWRITE: block will hold data, inode.size == %d\n", inode.size);
-                //fprintf(stderr, "FWRITE: Loops #%d bytes left to write = %d\n", i, bytes_left_to_write);
-            }
-            
-            virtual_disk_write_block(currBlock, &block);
-        }
+    total += n;
+    // Skip what has been written
+    while(n_iov > 0 && n >= (ssize_t) iov->iov_len) {
+      n -= iov->iov_len;
+      ++iov;
+      --n_iov;
     }
-    if (debug)
-    {
-        //fprintf(stderr, "end of fwrite: fp->offset is %d\n", fp->offset);
-        // number of data_blocks is 0 before an attempted write. one should be allocated first.
-        //fprintf(stderr, "end of fwrite: fp->n_data_blocks is %d\n", fp->n_data_blocks);
-        //fprintf(stderr, "end of fwrite: inode.size is %d\n", inode.size);
-        //fprintf(stderr, "end of fwrite: len_written is %d\n", len_written);
-    }
-    //inode size has changed. write it to disk
-    oufs_write_inode_by_reference(fp->inode_reference, &inode);
-  // Done
-  return(len_written);
+    if(n_iov > 0) {
+      iov->iov_base = (char *) iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+  return(total);
 }
 
-
 /*
- * Read a sequence of bytes from an open file.
- * - offset is the current position within the file, and will never be larger than size
- * - offset will be updated with each read operation
+ * Send bytes of an open file to a host file descriptor, starting at the
+ *  file offset.
+ * - The data blocks are handed to the kernel where they sit in the mapped
+ *     disk image, with a single writev() (the file data are not copied
+ *     into a user buffer)
+ * - If the disk image cannot be mapped, the bytes are read with
+ *     oufs_pread() in batches of WRITE_BUFFER_SIZE and written from there
+ * - The offset is advanced by the number of bytes sent
  *
- * @param fp OUFILE pointer (must be opened for r)
- * @param buf Character buffer to place the bytes into
- * @param len Number of bytes to read at max
- * @return The number of bytes read
+ * @param fp OUFILE pointer (must be opened for r or r+)
+ * @param out_fd Host file descriptor to write to
+ * @param len Number of bytes to send at max
+ * @return The number of bytes sent
  *         0 if offset is at size
  *         -x if an error
- * 
  */
+FILE_OFFSET oufs_sendfile(OUFILE *fp, int out_fd, FILE_OFFSET len)
+{
+  OUVIEW view;
+  struct iovec iov[MAX_BLOCKS_IN_FILE];
+  FILE_OFFSET len_sent;
+
+  FILE_OFFSET n = oufs_view(fp, fp->offset, len, &view);
+  if(n == -4) {
+    // No mapping: go through the (otherwise unused) write buffer, which
+    //  stays with the handle
+    if(fp->wb_buffer == NULL && (fp->wb_buffer = malloc(WRITE_BUFFER_SIZE)) == NULL)
+      return(-2);
+    len_sent = 0;
+    while(len_sent < len) {
+      FILE_OFFSET m = oufs_pread(fp, fp->wb_buffer, MIN(len - len_sent, WRITE_BUFFER_SIZE),
+                                 fp->offset + len_sent);
+      if(m <= 0)
+        break;
+      iov[0].iov_base = fp->wb_buffer;
+      iov[0].iov_len = m;
+      if(oufs_writev_all(out_fd, iov, 1) < 0)
+        return(-3);
+      len_sent += m;
+    }
+
+  }else if(n <= 0) {
+    return(n);
+
+  }else{
+    for(int i = 0; i < view.n_spans; ++i) {
+      iov[i].iov_base = (void *) view.span[i].data;
+      iov[i].iov_len = view.span[i].len;
+    }
+    len_sent = oufs_writev_all(out_fd, iov, view.n_spans);
+    oufs_release_view(&view);
+    if(len_sent < 0)
+      return(-3);
+  }
 
-int oufs_fread(OUFILE *fp, unsigned char * buf, int len)
+  fp->offset += len_sent;
+  return(len_sent);
+}
+
+/*
+ * Move the offset of a file opened for r or r+
+ *
+ * @param fp OUFILE pointer
+ * @param offset New offset, relative to whence
+ * @param whence SEEK_SET, SEEK_CUR or SEEK_END
+ * @return 0 if success
+ *         -x if error (including a resulting offset outside of 0 ... size)
+ */
+int oufs_fseek(OUFILE *fp, FILE_OFFSET offset, int whence)
 {
-  // Check open mode
-  if(fp->mode != 'r') {
-    fprintf(stderr, "Can't read from a write-only file");
-    return(0);
+  OUFS_MOUNT *mnt = fp->mount;
+  if(fp->mode != 'r' && fp->mode != '+') {
+    fprintf(stderr, "oufs_fseek(): offset of a w/a file is always its size\n");
+    return(-1);
   }
-  if(debug)
-    fprintf(stderr, "\n-------\noufs_fread(%d)\n", len);
-    
+
   INODE inode;
-  BLOCK block;
-  if(oufs_read_inode_by_reference(fp->inode_reference, &inode) != 0) {
-    return(-1);
+  pthread_rwlock_rdlock(&mnt->inode_lock[fp->inode_reference]);
+  int ret = oufs_read_inode_by_reference(mnt, fp->inode_reference, &inode);
+  pthread_rwlock_unlock(&mnt->inode_lock[fp->inode_reference]);
+  if(ret != 0) {
+    return(-2);
   }
-      
-  // Compute the current block and offset within the block
-  int current_block = fp->offset / DATA_BLOCK_SIZE;
-  int byte_offset_in_block = fp->offset % DATA_BLOCK_SIZE;
-  int len_read = 0;
-  int end_of_file = inode.size;
-  len = MIN(len, end_of_file - fp->offset);
-  int len_left = len;
 
-  // TODO
-    // TODO: check if this should be here or later, or both??
-    
-    //fprintf(stderr, "inside fread()\n");
-    //fprintf(stderr, "inside fread(): fp->offset == %d\n", fp->offset);
-    //fprintf(stderr, "inside fread(): inode.size == %d\n", inode.size);
-    //fprintf(stderr, "inside fread(): current_block == %d\n", current_block);
-    //fprintf(stderr, "inside fread(): fp->inode_reference is %d\n", fp->inode_reference);
-    if (fp->offset == inode.size)
-    {
-        fprintf(stderr, "in fread(): At end of file\n");
-        return 0;
-    }
-    // read len bytes from the file (len is min of len, other thing)
-    
-    // read first data block from inode
-    BLOCK_REFERENCE currentRef = inode.content;
-    //fprintf(stderr, "inside fread(): Initial Block_reference is %d\n", currentRef);
-    if (currentRef == UNALLOCATED_BLOCK)
-        return -2;
-   
-    // get correct block in chain of blocks
-    
-    if (current_block > 0)
-    {
-        // TODO: check this. adding 1 to current_block to make sure iterates correct num times
-        for (int i=0; i<(current_block+1); i++)
-        {
-            virtual_disk_read_block(currentRef, &block);
-            
-            currentRef = block.next_block;
-        }
-    }
-    else      // current_block == 0
-    {
-        virtual_disk_read_block(currentRef, &block);
-        currentRef = block.next_block;
-    }
-                         
-    // test this do-while loop.
-                            /*
-    int thisBlock = 0;
-    do
-    {
-        virtual_disk_read_block(currentRef, &block);
-        currentRef = block.next_block;
-        thisBlock++;
-    }
-    while (thisBlock < current_block);
-                             */
-    
-    // Cases: 1)block_size contains all the bytes needed to read len bytes. Or 2)len is bigger than block_size - byte_offset_in_block
-    // now I have the correct data block in block
-    //unsigned char * placeholder = NULL;
-    //*placeholder = *buf;
-    while (len_read < len)
-    {
-        // if whats left to write will fit inside whats left of the last block
-        if (len_left <= (DATA_BLOCK_SIZE - byte_offset_in_block))
-        {
-            // read all remaining bytes in len_left
-            int start = byte_offset_in_block;
-            int finish = byte_offset_in_block + len_left;
-            
-            
-            
-                                /*
-            memcpy(buf, block.content.data.data+byte_offset_in_block, len_left);
-            buf += len_left;
-            len_read += len_left;
-            fp->offset += len_left;
-            len_left -= len_left;
-            
-            fprintf(stderr, "in fread(): after memcpy, len_read is %d, len is %d\n", len_read, len);
-                                 */
-            
-            for (int i=start; i<finish; i++)
-            {
-                //changed below from buf[len - len_left]
-                // TODO: make sure can copy this over this way. Might have to do strcpy or something
-                buf[len_read] = block.content.data.data[i];
-                //fprintf(stderr, "inside fread: wrote to buf[%d] = %c\n", len_read, block.content.data.data[i]);
-                len_left--;
-                len_read++;
-                fp->offset++;
-            }
-            
-            
-        }
-        else        // Not enough space in block. We will have to grab the next block
-        {
-            
-                                        /*
-            
-            memcpy(buf, block.content.data.data+byte_offset_in_block, (DATA_BLOCK_SIZE - byte_offset_in_block));
-            buf += (DATA_BLOCK_SIZE - byte_offset_in_block);
-            len_read += (DATA_BLOCK_SIZE - byte_offset_in_block);
-            fp->offset += (DATA_BLOCK_SIZE - byte_offset_in_block);
-            len_left -= (DATA_BLOCK_SIZE - byte_offset_in_block);
-                                         */
-            
-            
-            for (int i=byte_offset_in_block; i<DATA_BLOCK_SIZE; i++)
-            {
-                // this should start at 0 for buff and in correct place in block  for block
-                buf[len_read] = block.content.data.data[i];
-                len_left--;
-                len_read++;
-                fp->offset++;
-                //fprintf(stderr, "byte offset in block = %d\n", byte_offset_in_block);
-                //fprintf(stderr, "buf[%d] = block.data[%d] = %c\n", len_read, i, block.content.data.data[i]);
-                //fprintf(stderr, "len_left is %d\n", len_left);
-                //fprintf(stderr, "len_read is %d\n", len_read);
-            }
-            
-            
-            // might chek to make  sure currentRef isn't UNALLOCATED_BLOCK but shouldn't be if len and such numbers are correct
-            // move to next block
-            // currentRef is already pointing to block.next_block from earlier loop
-            if (currentRef == UNALLOCATED_BLOCK)
-            {
-                // nore more blocks left to  grab
-                fprintf(stderr, "no blocks remaining in file. returning len_read = %d\n", len_read);
-                return (len_read);
-            }
-            virtual_disk_read_block(currentRef, &block);
-            currentRef = block.next_block;
-            //fprintf(stderr, "**** BLOCK %d ****\n", currentRef);
-        }
-        // recalculate things that I use for next loop
-        byte_offset_in_block = fp->offset % DATA_BLOCK_SIZE;
-    }
-    
-  // Done
-    //fprintf(stderr, "Made it to end of fread(): returning %d\n", len_read);
-  return(len_read);
+  // The base lies within 0 ... size, so only an offset that would leave that
+  //  range needs to be rejected; checking it before adding cannot overflow
+  FILE_OFFSET base;
+  switch(whence) {
+  case SEEK_SET:
+    base = 0;
+    break;
+  case SEEK_CUR:
+    base = fp->offset;
+    break;
+  case SEEK_END:
+    base = inode.size;
+    break;
+  default:
+    return(-3);
+  }
+  if(offset < -base || offset > inode.size - base) {
+    return(-4);
+  }
+
+  fp->offset = base + offset;
+  return(0);
+}
+
+/*
+ * Report the offset of an open file
+ *
+ * @param fp OUFILE pointer
+ * @return The current offset
+ */
+FILE_OFFSET oufs_ftell(OUFILE *fp)
+{
+  return(fp->offset);
 }
 
 
@@ -1082,6 +2213,7 @@ int oufs_fread(OUFILE *fp, unsigned char * buf, int len)
  * - Decrement inode.n_references
  * - If n_references == 0, then deallocate the contents and the inode
  *
+ * @param mnt Mount of the virtual disk
  * @param cwd Absolute path for the current working directory
  * @param path Absolute or relative path of the file to be removed
  * @return 0 if success
@@ -1089,17 +2221,15 @@ int oufs_fread(OUFILE *fp, unsigned char * buf, int len)
  *
  */
 
-int oufs_remove(char *cwd, char *path)
+int oufs_remove(OUFS_MOUNT *mnt, char *cwd, char *path)
 {
   INODE_REFERENCE parent;
   INODE_REFERENCE child;
   char local_name[MAX_PATH_LENGTH];
   INODE inode;
-  INODE inode_parent;
-  BLOCK block;
 
   // Try to find the inode of the child
-  if(oufs_find_file(cwd, path, &parent, &child, local_name) < -1) {
+  if(oufs_find_file(mnt, cwd, path, &parent, &child, local_name) < -1) {
     return(-3);
   };
   
@@ -1108,7 +2238,7 @@ int oufs_remove(char *cwd, char *path)
     return(-1);
   }
   // Get the inode
-  if(oufs_read_inode_by_reference(child, &inode) != 0) {
+  if(oufs_read_inode_by_reference(mnt, child, &inode) != 0) {
     return(-4);
   }
 
@@ -1119,48 +2249,81 @@ int oufs_remove(char *cwd, char *path)
     return(-2);
   }
 
-  // TODO
-    // Read parent into inode_parent
-    if(oufs_read_inode_by_reference(parent, &inode_parent) != 0) {
-        return(-4);
-    }
-    // read parent directory to block
-    virtual_disk_read_block(inode_parent.content, &block);
-    
-    for (int i=0; i<N_DIRECTORY_ENTRIES_PER_BLOCK; i++)
-    {
-        if (block.content.directory.entry[i].inode_reference == child)
-        {
-            strcpy(block.content.directory.entry[i].name, "");
-            block.content.directory.entry[i].inode_reference = UNALLOCATED_INODE;
-            inode.n_references--;
-            inode_parent.size--;
-            break;
-        }
-    }
-    fprintf(stderr, "REMOVE: inode.n_references = %d\n", inode.n_references);
-    if (inode.n_references == 0)
-    {
-        if (oufs_deallocate_blocks(&inode) < 0)
-        {
-            return -2;
-        }
-        BLOCK master;
-        virtual_disk_read_block(MASTER_BLOCK_REFERENCE, &master);
-        // deallocate inode in inode allocation table in master block
-        int byte = child / 8;
-        int bit = 7 - (child%8);
-        master.content.master.inode_allocated_flag[byte] = (master.content.master.inode_allocated_flag[byte] ^ (1<<bit) );
-        virtual_disk_write_block(MASTER_BLOCK_REFERENCE, &master);
-        
-    }
-    virtual_disk_write_block(inode_parent.content, &block);
-    oufs_write_inode_by_reference(parent, &inode_parent);
-    oufs_write_inode_by_reference(child, &inode);
-        
-  // Success
-  return(0);
-};
+  return(oufs_unlink_file(mnt, parent, local_name, child));
+}
+
+/**
+ * Remove one name of a file from its directory, and free the file (its
+ *  inode and its blocks) if that was its last name
+ *
+ * @param mnt Mount of the virtual disk
+ * @param parent Directory that holds the name
+ * @param local_name The name
+ * @param child File that the name must still refer to
+ * @return 0 if success
+ *         -x if error
+ */
+static int oufs_unlink_file(OUFS_MOUNT *mnt, INODE_REFERENCE parent, char *local_name,
+                          INODE_REFERENCE child)
+{
+  INODE inode;
+  INODE inode_parent;
+  BLOCK block;
+
+  // The parent's entries change, then the file: lock both, in that order
+  if (oufs_lock_entry(mnt, parent, local_name, child) != 0)
+  {
+    fprintf(stderr, "File not found\n");
+    return(-1);
+  }
+
+  // Read parent into inode_parent (and the file again: it may have
+  //  changed since the lookup)
+  if(oufs_read_inode_by_reference(mnt, parent, &inode_parent) != 0 ||
+     oufs_read_inode_by_reference(mnt, child, &inode) != 0) {
+    pthread_rwlock_unlock(&mnt->inode_lock[child]);
+    pthread_rwlock_unlock(&mnt->inode_lock[parent]);
+    return(-4);
+  }
+  // read parent directory to block
+  virtual_disk_read_block(mnt->disk, inode_parent.content, &block);
+
+  // Remove this name (not just any entry that refers to the inode: there
+  //  may be other hard links within the same directory).  It must still
+  //  refer to the file that was looked up
+  if (oufs_directory_delete(&block, inode_parent.size, local_name) != child)
+  {
+    fprintf(stderr, "File not found\n");
+    pthread_rwlock_unlock(&mnt->inode_lock[child]);
+    pthread_rwlock_unlock(&mnt->inode_lock[parent]);
+    return(-1);
+  }
+  inode.n_references--;
+  inode_parent.size--;
+  fprintf(stderr, "REMOVE: inode.n_references = %d\n", inode.n_references);
+  INODE freed = inode;
+  if (inode.n_references == 0)
+  {
+    // The inode no longer refers to its blocks
+    oufs_set_inode(&inode, UNUSED_TYPE, 0, UNALLOCATED_BLOCK, 0);
+  }
+  virtual_disk_write_block(mnt->disk, inode_parent.content, &block);
+  oufs_write_inode_by_reference(mnt, parent, &inode_parent);
+  oufs_write_inode_by_reference(mnt, child, &inode);
+
+  // Only now may the inode and its blocks be handed out again: once its
+  //  bit is clear, another thread can allocate the inode and write it,
+  //  and the inode lock does not keep that thread out
+  int ret = 0;
+  if (freed.n_references == 0 && oufs_deallocate_batch(mnt, &freed, &child, 1, NULL, 0) != 0)
+  {
+    ret = -2;
+  }
+  pthread_rwlock_unlock(&mnt->inode_lock[child]);
+  pthread_rwlock_unlock(&mnt->inode_lock[parent]);
+
+  return(ret);
+}
 
 
 /**
@@ -1170,6 +2333,7 @@ int oufs_remove(char *cwd, char *path)
  * - Add the new directory entry
  * - Increment inode.n_references
  *
+ * @param mnt Mount of the virtual disk
  * @param cwd Absolute path for the current working directory
  * @param path_src Absolute or relative path of the existing file to be linked
  * @param path_dst Absolute or relative path of the new file inode to be linked
@@ -1177,7 +2341,7 @@ int oufs_remove(char *cwd, char *path)
  *         -x if error
  * 
  */
-int oufs_link(char *cwd, char *path_src, char *path_dst)
+int oufs_link(OUFS_MOUNT *mnt, char *cwd, char *path_src, char *path_dst)
 {
   INODE_REFERENCE parent_src;
   INODE_REFERENCE child_src;
@@ -1190,10 +2354,10 @@ int oufs_link(char *cwd, char *path_src, char *path_dst)
   BLOCK block;
 
   // Try to find the inodes
-  if(oufs_find_file(cwd, path_src, &parent_src, &child_src, local_name_bogus) < -1) {
+  if(oufs_find_file(mnt, cwd, path_src, &parent_src, &child_src, local_name_bogus) < -1) {
     return(-5);
   }
-  if(oufs_find_file(cwd, path_dst, &parent_dst, &child_dst, local_name) < -1) {
+  if(oufs_find_file(mnt, cwd, path_dst, &parent_dst, &child_dst, local_name) < -1) {
     return(-6);
   }
 
@@ -1214,7 +2378,7 @@ int oufs_link(char *cwd, char *path_src, char *path_dst)
   }
 
   // Get the inode of the dst parent
-  if(oufs_read_inode_by_reference(parent_dst, &inode_dst) != 0) {
+  if(oufs_read_inode_by_reference(mnt, parent_dst, &inode_dst) != 0) {
     return(-7);
   }
 
@@ -1229,38 +2393,175 @@ int oufs_link(char *cwd, char *path_src, char *path_dst)
 
 
   // TODO
-    // Get the inode of the src parent
-    if(oufs_read_inode_by_reference(parent_dst, &inode_dst) != 0) {
-        return(-7);
-    }
-    if(oufs_read_inode_by_reference(child_src, &inode_src) != 0) {
+    if(oufs_read_inode_by_reference(mnt, child_src, &inode_src) != 0) {
         return(-7);
     }
+    // (Checked before any lock is taken: a directory would be locked out of
+    //  order)
     if (inode_src.type == DIRECTORY_TYPE)
         return -2;
-    // Read content
-    virtual_disk_read_block(inode_dst.content, &block);
-    for (int i=0; i<N_DIRECTORY_ENTRIES_PER_BLOCK; i++)
+
+    // The destination directory's entries change, then the file
+    pthread_rwlock_wrlock(&mnt->inode_lock[parent_dst]);
+    pthread_rwlock_wrlock(&mnt->inode_lock[child_src]);
+    int ret = 0;
+    // Get both inodes again: they may have changed since the lookup
+    if(oufs_read_inode_by_reference(mnt, parent_dst, &inode_dst) != 0 ||
+       oufs_read_inode_by_reference(mnt, child_src, &inode_src) != 0) {
+        ret = -7;
+    }else if(inode_dst.type != DIRECTORY_TYPE || inode_src.type != FILE_TYPE) {
+        ret = -2;
+    }else{
+        // Read content
+        virtual_disk_read_block(mnt->disk, inode_dst.content, &block);
+        // Add the new name in sorted position
+        ret = oufs_directory_insert(&block, inode_dst.size, local_name, child_src, inode_src.type);
+        if (ret == -2)
+            ret = -3;
+        else if (ret < 0)
+            ret = -4;
+        else
+            ret = 0;
+    }
+    if (ret == 0)
     {
-        if (block.content.directory.entry[i].inode_reference == UNALLOCATED_INODE)
-        {
-            block.content.directory.entry[i].inode_reference = child_src;
-            strcpy(block.content.directory.entry[i].name, local_name);
-            inode_dst.size++;
-            //INODE inode_child_dst;
-            inode_src.n_references++;
-            //void oufs_set_inode(*inode_child_dest, INODE_TYPE type, int n_references, BLOCK_REFERENCE content, int size)
-            break;
-        }
+        inode_dst.size++;
+        inode_src.n_references++;
+        // write block and both inodes back to disk
+        virtual_disk_write_block(mnt->disk, inode_dst.content, &block);
+        oufs_write_inode_by_reference(mnt, parent_dst, &inode_dst);
+        oufs_write_inode_by_reference(mnt, child_src, &inode_src);
     }
-    // write block and both inodes back to disk
-    virtual_disk_write_block(inode_dst.content, &block);
-    oufs_write_inode_by_reference(parent_dst, &inode_dst);
-    oufs_write_inode_by_reference(child_src, &inode_src);
+    pthread_rwlock_unlock(&mnt->inode_lock[child_src]);
+    pthread_rwlock_unlock(&mnt->inode_lock[parent_dst]);
     
     
-    // SUCCESS
-    return 0;
+    // SUCCESS (or the error)
+    return ret;
 }
 
+/**
+ * Create a copy-on-write clone of a file
+ *
+ * - The new file gets its own inode, but the content chain of the source
+ *     is shared: only the first block gains a reference, so cloning takes
+ *     constant time and space however large the file is
+ * - Both inodes are marked INODE_FLAG_SHARED.  A later write to either file
+ *     copies the shared blocks from the start of the chain up to the
+ *     modified block; the rest stays shared
+ *
+ * @param mnt Mount of the virtual disk
+ * @param cwd Absolute path for the current working directory
+ * @param path_src Absolute or relative path of the existing file to be cloned
+ * @param path_dst Absolute or relative path of the new file
+ * @return 0 if success
+ *         -x if error
+ */
+int oufs_reflink(OUFS_MOUNT *mnt, char *cwd, char *path_src, char *path_dst)
+{
+  INODE_REFERENCE parent_src;
+  INODE_REFERENCE child_src;
+  INODE_REFERENCE parent_dst;
+  INODE_REFERENCE child_dst;
+  char local_name[MAX_PATH_LENGTH];
+  char local_name_bogus[MAX_PATH_LENGTH];
+  INODE inode_src;
+  INODE inode_dst;
+  BLOCK master;
+
+  // Try to find the inodes
+  if(oufs_find_file(mnt, cwd, path_src, &parent_src, &child_src, local_name_bogus) < -1) {
+    return(-5);
+  }
+  if(oufs_find_file(mnt, cwd, path_dst, &parent_dst, &child_dst, local_name) < -1) {
+    return(-6);
+  }
+
+  // SRC must exist and be a file
+  if(child_src == UNALLOCATED_INODE) {
+    fprintf(stderr, "Source not found\n");
+    return(-1);
+  }
+  if(oufs_read_inode_by_reference(mnt, child_src, &inode_src) != 0) {
+    return(-7);
+  }
+  if(inode_src.type != FILE_TYPE) {
+    fprintf(stderr, "Source must be a file.\n");
+    return(-2);
+  }
+
+  // DST must not exist, but its parent must exist
+  if(parent_dst == UNALLOCATED_INODE) {
+    fprintf(stderr, "Destination parent does not exist.\n");
+    return(-2);
+  }
+  if(child_dst != UNALLOCATED_INODE) {
+    fprintf(stderr, "Destination already exists.\n");
+    return(-3);
+  }
+
+  if(inode_src.content != UNALLOCATED_BLOCK) {
+    pthread_mutex_lock(&mnt->master_lock);
+    int ret = virtual_disk_read_block(mnt->disk, MASTER_BLOCK_REFERENCE, &master);
+    pthread_mutex_unlock(&mnt->master_lock);
+    if(ret != 0)
+      return(-7);
+    if(master.content.master.block_extra_references[inode_src.content] == UCHAR_MAX) {
+      fprintf(stderr, "Too many clones of the source.\n");
+      return(-4);
+    }
+  }
+
+  // New (empty) file in the destination directory
+  child_dst = oufs_create_file(mnt, parent_dst, local_name);
+  if(child_dst == UNALLOCATED_INODE) {
+    return(-4);
+  }
+
+  // Both files change: the lower inode reference first
+  INODE_REFERENCE first = MIN(child_src, child_dst);
+  INODE_REFERENCE second = (first == child_src) ? child_dst : child_src;
+  pthread_rwlock_wrlock(&mnt->inode_lock[first]);
+  pthread_rwlock_wrlock(&mnt->inode_lock[second]);
+
+  // (The source may have changed since it was first read)
+  int ret = 0;
+  if(oufs_read_inode_by_reference(mnt, child_src, &inode_src) != 0 ||
+     oufs_read_inode_by_reference(mnt, child_dst, &inode_dst) != 0) {
+    ret = -7;
+  }else if(inode_src.content != UNALLOCATED_BLOCK) {
+    // Share the chain: one more reference to its first block
+    pthread_mutex_lock(&mnt->master_lock);
+    if(virtual_disk_read_block(mnt->disk, MASTER_BLOCK_REFERENCE, &master) != 0) {
+      ret = -7;
+    }else if(master.content.master.block_extra_references[inode_src.content] == UCHAR_MAX) {
+      fprintf(stderr, "Too many clones of the source.\n");
+      ret = -4;
+    }else{
+      ++master.content.master.block_extra_references[inode_src.content];
+      virtual_disk_write_block(mnt->disk, MASTER_BLOCK_REFERENCE, &master);
+    }
+    pthread_mutex_unlock(&mnt->master_lock);
+    if(ret == 0) {
+      inode_src.flags |= INODE_FLAG_SHARED;
+      oufs_write_inode_by_reference(mnt, child_src, &inode_src);
+    }
+  }
 
+  if(ret == 0) {
+    inode_dst.content = inode_src.content;
+    inode_dst.tail = inode_src.tail;
+    inode_dst.size = inode_src.size;
+    inode_dst.flags = inode_src.flags;
+    oufs_write_inode_by_reference(mnt, child_dst, &inode_dst);
+  }
+  pthread_rwlock_unlock(&mnt->inode_lock[second]);
+  pthread_rwlock_unlock(&mnt->inode_lock[first]);
+
+  // The new file must not outlive a failed clone
+  if(ret != 0)
+    oufs_unlink_file(mnt, parent_dst, local_name, child_dst);
+
+  // SUCCESS (or the error)
+  return(ret);
+}
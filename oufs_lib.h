@@ -1,25 +1,84 @@
 #ifndef OUFS_LIB_H
 #define OUFS_LIB_H
+#include <pthread.h>
 #include "oufs.h"
+#include "storage.h"
 
 #define MAX_PATH_LENGTH 200
 
+// A mounted virtual disk: all of the state of the library for one disk.
+//  Different mounts share nothing, so one process may use many disks.
+//  Any number of threads may use a mount at once (each OUFILE or OUDIR,
+//  though, by one thread at a time)
+struct oufs_mount_s
+{
+  STORAGE *disk;
+
+  // Print debugging information to stderr
+  int debug;
+
+  // Closed OUFILE structures kept for reuse (linked through next_free)
+  OUFILE *file_pool;
+  int file_pool_count;
+  pthread_mutex_t pool_lock;
+
+  // Locks, always taken in this order:
+  //  - inode_lock: one per inode.  For a file, guards its contents and
+  //     size (shared for reads, exclusive for changes); for a directory, its
+  //     entries.  Directories are locked before the files or directories
+  //     within them; two files, by increasing inode reference
+  //  - master_lock: every read-modify-write of the master block (the
+  //     reference counts of shared blocks; ordinary allocations and frees
+  //     do not take it)
+  //  - inode_block_lock: one per inode block, around each
+  //     read-modify-write of the block (reads take no lock: a block is
+  //     always read whole).  It is also the lock of the allocation shard
+  //     that the block holds (see ALLOC_SHARD)
+  pthread_rwlock_t inode_lock[N_INODES];
+  pthread_mutex_t master_lock;
+  pthread_mutex_t inode_block_lock[N_INODE_BLOCKS];
+};
+
 // PROVIDED
 void oufs_get_environment(char *cwd, char *disk_name, char *pipe_name_base);
 
+// Mounting
+OUFS_MOUNT *oufs_mount(char *disk_name, char *pipe_name_base);
+int oufs_unmount(OUFS_MOUNT *mnt);
+
 // PROJECT 3: to implement
 int oufs_format_disk(char  *virtual_disk_name, char *pipe_name_base);
-int oufs_mkdir(char *cwd, char *path);
-int oufs_list(char *cwd, char *path);
-int oufs_rmdir(char *cwd, char *path);
+int oufs_mkdir(OUFS_MOUNT *mnt, char *cwd, char *path);
+int oufs_list(OUFS_MOUNT *mnt, char *cwd, char *path);
+int oufs_rmdir(OUFS_MOUNT *mnt, char *cwd, char *path);
 
 // PROJECT 4: to implement
-OUFILE* oufs_fopen(char *cwd, char *path, char *mode);
-void oufs_fclose(OUFILE *fp);
-int oufs_fwrite(OUFILE *fp, unsigned char * buf, int len);
-int oufs_fread(OUFILE *fp, unsigned char * buf, int len);
-int oufs_remove(char *cwd, char *path);
-int oufs_link(char *cwd, char *path_src, char *path_dst);
+OUFILE* oufs_fopen(OUFS_MOUNT *mnt, char *cwd, char *path, char *mode);
+int oufs_fclose(OUFILE *fp);
+void oufs_release_handles(OUFS_MOUNT *mnt);
+int oufs_fflush(OUFILE *fp);
+FILE_OFFSET oufs_fwrite(OUFILE *fp, unsigned char * buf, FILE_OFFSET len);
+FILE_OFFSET oufs_fread(OUFILE *fp, unsigned char * buf, FILE_OFFSET len);
+FILE_OFFSET oufs_pread(OUFILE *fp, unsigned char * buf, FILE_OFFSET len, FILE_OFFSET offset);
+FILE_OFFSET oufs_pwrite(OUFILE *fp, unsigned char * buf, FILE_OFFSET len, FILE_OFFSET offset);
+int oufs_fseek(OUFILE *fp, FILE_OFFSET offset, int whence);
+FILE_OFFSET oufs_ftell(OUFILE *fp);
+int oufs_ftruncate(OUFILE *fp, FILE_OFFSET new_size);
+FILE_OFFSET oufs_copy_file_range(OUFILE *src, OUFILE *dst, FILE_OFFSET len);
+FILE_OFFSET oufs_view(OUFILE *fp, FILE_OFFSET offset, FILE_OFFSET len, OUVIEW *view);
+void oufs_release_view(OUVIEW *view);
+FILE_OFFSET oufs_sendfile(OUFILE *fp, int out_fd, FILE_OFFSET len);
+int oufs_remove(OUFS_MOUNT *mnt, char *cwd, char *path);
+int oufs_link(OUFS_MOUNT *mnt, char *cwd, char *path_src, char *path_dst);
+int oufs_reflink(OUFS_MOUNT *mnt, char *cwd, char *path_src, char *path_dst);
+
+// Directory iteration
+OUDIR* oufs_opendir(OUFS_MOUNT *mnt, char *cwd, char *path);
+int oufs_readdir(OUDIR *dp, OUDIRENT *entry);
+int oufs_readdirplus(OUDIR *dp, OUDIRENT_PLUS *entries, int max_entries);
+void oufs_telldir(OUDIR *dp, OUDIR_COOKIE *cookie);
+void oufs_seekdir(OUDIR *dp, OUDIR_COOKIE *cookie);
+void oufs_closedir(OUDIR *dp);
 
 #endif
 
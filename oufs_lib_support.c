@@ -11,78 +11,182 @@
 #include "virtual_disk.h"
 #include "oufs_lib_support.h"
 
-extern int debug;
 
 /**
- * Deallocate a single block.
- * - Modify the in-memory copy of the master block
- * - Add the specified block to THE END of the free block linked list
- * - Modify the disk copy of the deallocated block: next_block points to
- *     UNALLOCATED_BLOCK
+ * Mark a block to be freed (see oufs_free_marked())
  *
+ * @param mask Blocks and inodes to be freed
+ * @param block_reference Reference to the block
+ */
+void oufs_mark_block(ALLOC_MASK *mask, BLOCK_REFERENCE block_reference)
+{
+    int bit = block_reference % ALLOC_SHARD_BLOCKS;
+    mask->shard[block_reference / ALLOC_SHARD_BLOCKS].block_allocated_flag[bit / 8] |= 1 << (7 - bit % 8);
+}
+
+/**
+ * Mark an inode to be freed (see oufs_free_marked())
  *
- * @param master_block Pointer to a loaded master block.  Changes to the MB will
- *           be made here, but not written to disk
- *
- * @param block_reference Reference to the block that is being deallocated
+ * @param mask Blocks and inodes to be freed
+ * @param i Inode reference
+ */
+void oufs_mark_inode(ALLOC_MASK *mask, INODE_REFERENCE i)
+{
+    int bit = i % N_INODES_PER_BLOCK;
+    mask->shard[i / N_INODES_PER_BLOCK].inode_allocated_flag[bit / 8] |= 1 << (7 - bit % 8);
+}
+
+/**
+ * Deallocate a chain of blocks.
+ * - The blocks from first up to last are marked in the mask (to be freed
+ *     by oufs_free_marked()); nothing is written
+ * - The chain is walked to find them, so every block but the last is read
+ *     (from the cache, for any recently used file)
  *
+ * @param mnt Mount of the virtual disk
+ * @param mask Blocks and inodes to be freed
+ * @param first Reference to the first block of the chain
+ * @param last Reference to the last block of the chain
+ * @return The number of blocks that were marked
+ *         -x if error
  */
-int oufs_deallocate_block(BLOCK *master_block, BLOCK_REFERENCE block_reference)
+int oufs_deallocate_chain(OUFS_MOUNT *mnt, ALLOC_MASK *mask, BLOCK_REFERENCE first,
+                          BLOCK_REFERENCE last)
 {
-    BLOCK b;
-    
-    if(master_block->content.master.unallocated_front == UNALLOCATED_BLOCK) {
-        // No blocks on the free list.  Both pointers point to this block now
-        master_block->content.master.unallocated_front = master_block->content.master.unallocated_end =
-        block_reference;
-        //fprintf(stderr, "Resetting master unallocated end and front to point to newly empty block.\n");
-        
-    }else{
-        BLOCK prevEndBlock;
-        BLOCK_REFERENCE prevEnd;
-        prevEnd = master_block->content.master.unallocated_end;
-        if(virtual_disk_read_block(prevEnd, &prevEndBlock) != 0) {
-            fprintf(stderr, "deallocate_block: error reading old end block\n");
+    BLOCK_REFERENCE refs[N_BLOCKS];
+    BLOCK block;
+    int count = 0;
+
+    if(mnt->debug)
+        fprintf(stderr, "\tDEBUG: deallocating blocks %d ... %d\n", first, last);
+    for(BLOCK_REFERENCE b = first; b != UNALLOCATED_BLOCK; b = block.next_block) {
+        if(b >= N_BLOCKS || count == N_BLOCKS) {
+            fprintf(stderr, "deallocate_chain: broken chain at block %d\n", b);
             return(-1);
         }
-        
-        fprintf(stderr, "inside oufs_deallocate_block: deallocating block_reference %d\n", block_reference);
-        prevEndBlock.next_block = block_reference;
-        
-        if(virtual_disk_write_block(prevEnd, &prevEndBlock) != 0) {
-            //fprintf(stderr, "deallocate_block: error writing old end block\n");
+        refs[count++] = b;
+        if(b == last)
+            break;
+        if(virtual_disk_read_block(mnt->disk, b, &block) != 0) {
+            fprintf(stderr, "deallocate_chain: error reading block %d\n", b);
             return(-1);
         }
-        
-        master_block->content.master.unallocated_end = block_reference;
-        
-        //fprintf(stderr, "Resetting master unallocated end to point to newly empty block.\n");
     }
-    
-    //add block back to unallocated block list
-    
-    // Update the new end block
-    if(virtual_disk_read_block(block_reference, &b) != 0) {
-        fprintf(stderr, "deallocate_block: error reading new end block\n");
+
+    // Only a whole chain is marked
+    for(int i = 0; i < count; ++i)
+        oufs_mark_block(mask, refs[i]);
+    return(count);
+}
+
+/**
+ * Drop one reference to a chain of blocks that may be shared with other
+ *  files (see oufs_reflink()).
+ * - If the first block is still referenced from elsewhere, it only loses a
+ *     reference
+ * - Otherwise the blocks are walked up to the first one that is also
+ *     referenced from elsewhere (which loses a reference) or to the end of
+ *     the chain; the walked blocks are marked in the mask (to be freed by
+ *     oufs_free_marked())
+ * - The reference counts are read and written under master_lock
+ *
+ * @param mnt Mount of the virtual disk
+ * @param mask Blocks and inodes to be freed
+ * @param first Reference to the first block of the chain
+ * @return The number of blocks that were marked
+ *         -x if error
+ */
+int oufs_release_chain(OUFS_MOUNT *mnt, ALLOC_MASK *mask, BLOCK_REFERENCE first)
+{
+    BLOCK_REFERENCE refs[N_BLOCKS];
+    BLOCK master_block;
+    BLOCK block;
+    int count = 0;
+    int ret = 0;
+
+    if(first == UNALLOCATED_BLOCK)
+        return(0);
+
+    pthread_mutex_lock(&mnt->master_lock);
+    if(virtual_disk_read_block(mnt->disk, MASTER_BLOCK_REFERENCE, &master_block) != 0) {
+        pthread_mutex_unlock(&mnt->master_lock);
         return(-1);
     }
-    
-    // Change the new end block to point to nowhere
-    b.next_block = UNALLOCATED_BLOCK;
-    for (int i=0; i<N_DIRECTORY_ENTRIES_PER_BLOCK; i++)
-    {
-        b.content.directory.entry[i].inode_reference = UNALLOCATED_INODE;
+    unsigned char *extra = master_block.content.master.block_extra_references;
+
+    if(extra[first] > 0) {
+        --extra[first];
+    }else{
+        for(BLOCK_REFERENCE b = first; ret == 0; ) {
+            if(b >= N_BLOCKS || count == N_BLOCKS ||
+               virtual_disk_read_block(mnt->disk, b, &block) != 0) {
+                ret = -1;
+                break;
+            }
+            refs[count++] = b;
+            BLOCK_REFERENCE next = block.next_block;
+            if(next == UNALLOCATED_BLOCK)
+                break;
+            if(extra[next] > 0) {
+                // The rest belongs to another file as well: end our part here
+                --extra[next];
+                block.next_block = UNALLOCATED_BLOCK;
+                if(virtual_disk_write_block(mnt->disk, b, &block) != 0)
+                    ret = -1;
+                break;
+            }
+            b = next;
+        }
     }
-    
-    // Write the block back
-    if(virtual_disk_write_block(block_reference, &b) != 0) {
-        fprintf(stderr, "deallocate_block: error writing new end block\n");
-        return(-1);
+    if(ret == 0 && virtual_disk_write_block(mnt->disk, MASTER_BLOCK_REFERENCE, &master_block) != 0)
+        ret = -1;
+    pthread_mutex_unlock(&mnt->master_lock);
+    if(ret != 0)
+        return(-2);
+
+    for(int i = 0; i < count; ++i)
+        oufs_mark_block(mask, refs[i]);
+    return(count);
+}
+
+/**
+ * Free the blocks and inodes of a mask, with one read-modify-write of the
+ *  inode block of each shard that has any (under that block's
+ *  inode_block_lock; master_lock is not needed)
+ *
+ * @param mnt Mount of the virtual disk
+ * @param mask Blocks and inodes to be freed
+ * @return 0 if success
+ *         -x if error
+ */
+int oufs_free_marked(OUFS_MOUNT *mnt, ALLOC_MASK *mask)
+{
+    static const ALLOC_SHARD none;
+    int ret = 0;
+
+    for(int s = 0; s < N_ALLOC_SHARDS; ++s) {
+        ALLOC_SHARD *clear = &mask->shard[s];
+        if(memcmp(clear, &none, sizeof(ALLOC_SHARD)) == 0)
+            continue;
+
+        // Shard s is kept in inode block s + 1
+        BLOCK block;
+        pthread_mutex_lock(&mnt->inode_block_lock[s]);
+        if(virtual_disk_read_block(mnt->disk, s + 1, &block) != 0) {
+            ret = -1;
+        }else{
+            ALLOC_SHARD *shard = &block.content.inodes.shard;
+            for(int j = 0; j < sizeof(shard->block_allocated_flag); ++j)
+                shard->block_allocated_flag[j] &= ~clear->block_allocated_flag[j];
+            for(int j = 0; j < sizeof(shard->inode_allocated_flag); ++j)
+                shard->inode_allocated_flag[j] &= ~clear->inode_allocated_flag[j];
+            if(virtual_disk_write_block(mnt->disk, s + 1, &block) != 0)
+                ret = -1;
+        }
+        pthread_mutex_unlock(&mnt->inode_block_lock[s]);
     }
-    
-    //fprintf(stderr, "Writing block back to disk.\n");
-    return(0);
-};
+    return(ret);
+}
 
 
 /**
@@ -106,17 +210,21 @@ void oufs_init_directory_structures(INODE *inode, BLOCK *block,
     // set up Inode
     inode->type = DIRECTORY_TYPE;
     inode->n_references = 1;
+    inode->flags = 0;
     inode->size = 2;
     inode->content = self_block_reference;
+    inode->tail = self_block_reference;
     
     // Initialize directory block
     block->next_block = UNALLOCATED_BLOCK;
     // set up '.'
     strcpy(block->content.directory.entry[0].name, ".");
     block->content.directory.entry[0].inode_reference= self_inode_reference;
+    block->content.directory.entry[0].type = DIRECTORY_TYPE;
     // set up ".."
     strcpy(block->content.directory.entry[1].name, "..");
     block->content.directory.entry[1].inode_reference= parent_inode_reference;
+    block->content.directory.entry[1].type = DIRECTORY_TYPE;
     
     // set all other entries to UNALLOCATED_INODE
     for (int i=2; i<N_DIRECTORY_ENTRIES_PER_BLOCK; i++)
@@ -130,6 +238,7 @@ void oufs_init_directory_structures(INODE *inode, BLOCK *block,
 /**
  *  Given an inode reference, read the inode from the virtual disk.
  *
+ *  @param mnt Mount of the virtual disk
  *  @param i Inode reference (index into the inode list)
  *  @param inode Pointer to an inode memory structure.  This structure will be
  *                filled in before return)
@@ -137,18 +246,19 @@ void oufs_init_directory_structures(INODE *inode, BLOCK *block,
  *         -1 = an error has occurred
  *
  */
-int oufs_read_inode_by_reference(INODE_REFERENCE i, INODE *inode)
+int oufs_read_inode_by_reference(OUFS_MOUNT *mnt, INODE_REFERENCE i, INODE *inode)
 {
-    if(debug)
+    if(mnt->debug)
         fprintf(stderr, "\tDEBUG: Fetching inode %d\n", i);
     
     // Find the address of the inode block and the inode within the block
     BLOCK_REFERENCE block = i / N_INODES_PER_BLOCK + 1;
     int element = (i % N_INODES_PER_BLOCK);
     
-    // Load the block that contains the inode
+    // Load the block that contains the inode (no lock is needed: a block is
+    //  always read whole, never part-way through a write of it)
     BLOCK b;
-    if(virtual_disk_read_block(block, &b) == 0) {
+    if(virtual_disk_read_block(mnt->disk, block, &b) == 0) {
         // Successfully loaded the block: copy just this inode
         *inode = b.content.inodes.inode[element];
         return(0);
@@ -158,18 +268,86 @@ int oufs_read_inode_by_reference(INODE_REFERENCE i, INODE *inode)
 }
 
 
+/**
+ *  Read a whole block of inodes from the virtual disk
+ *
+ *  @param mnt Mount of the virtual disk
+ *  @param block_index Index of the inode block (0 ... N_INODE_BLOCKS-1)
+ *  @param block Filled in with the block
+ *  @return 0 = successfully loaded the block
+ *         -1 = an error has occurred
+ */
+int oufs_read_inode_block(OUFS_MOUNT *mnt, int block_index, BLOCK *block)
+{
+    if(block_index < 0 || block_index >= N_INODE_BLOCKS) {
+        return(-1);
+    }
+    if(mnt->debug)
+        fprintf(stderr, "\tDEBUG: Fetching inode block %d\n", block_index + 1);
+
+    // (Without the lock: see oufs_read_inode_by_reference())
+    if(virtual_disk_read_block(mnt->disk, block_index + 1, block) != 0) {
+        return(-1);
+    }
+    return(0);
+}
+
+/**
+ *  Read a set of inodes from the virtual disk.  The references are grouped
+ *  by the inode block that holds them, so each distinct inode block is read
+ *  only once, no matter how many of the inodes it contains.
+ *
+ *  @param mnt Mount of the virtual disk
+ *  @param refs Array of n inode references
+ *  @param inodes Array of n inode structures, filled in so that inodes[i]
+ *                corresponds to refs[i]
+ *  @param n Number of inodes to read
+ *  @return 0 = successfully loaded all of the inodes
+ *         -1 = an error has occurred
+ */
+int oufs_read_inodes_by_reference(OUFS_MOUNT *mnt, INODE_REFERENCE *refs, INODE *inodes, int n)
+{
+    // One flag per inode block: has it been handled yet?
+    unsigned char done[N_INODE_BLOCKS];
+    memset(done, 0, sizeof(done));
+
+    for(int i = 0; i < n; ++i) {
+        int block_index = refs[i] / N_INODES_PER_BLOCK;
+        if(block_index >= N_INODE_BLOCKS) {
+            return(-1);
+        }
+        if(done[block_index])
+            continue;
+
+        // Load the block and copy out every requested inode that it holds
+        BLOCK b;
+        if(oufs_read_inode_block(mnt, block_index, &b) != 0) {
+            return(-1);
+        }
+        for(int j = i; j < n; ++j) {
+            if(refs[j] / N_INODES_PER_BLOCK == block_index) {
+                inodes[j] = b.content.inodes.inode[refs[j] % N_INODES_PER_BLOCK];
+            }
+        }
+        done[block_index] = 1;
+    }
+    return(0);
+}
+
+
 /**
  * Write a single inode to the disk
  *
+ * @param mnt Mount of the virtual disk
  * @param i Inode reference index
  * @param inode Pointer to an inode structure
  * @return 0 if success
  *         -x if error
  *
  */
-int oufs_write_inode_by_reference(INODE_REFERENCE i, INODE *inode)
+int oufs_write_inode_by_reference(OUFS_MOUNT *mnt, INODE_REFERENCE i, INODE *inode)
 {
-    if(debug)
+    if(mnt->debug)
         fprintf(stderr, "\tDEBUG: Writing inode %d\n", i);
     
     // TODO:
@@ -178,8 +356,11 @@ int oufs_write_inode_by_reference(INODE_REFERENCE i, INODE *inode)
     
     BLOCK tempBlock;
     memset(&tempBlock, 0, BLOCK_SIZE);
+    // The block holds other inodes too: nobody else may update it meanwhile
+    pthread_mutex_lock(&mnt->inode_block_lock[b - 1]);
     // read the block from disk to tempBlock
-    if(virtual_disk_read_block(b, &tempBlock) != 0) {
+    if(virtual_disk_read_block(mnt->disk, b, &tempBlock) != 0) {
+        pthread_mutex_unlock(&mnt->inode_block_lock[b - 1]);
         fprintf(stderr, "deallocate_block: error reading inode block\n");
         return(-1);
     }
@@ -187,7 +368,9 @@ int oufs_write_inode_by_reference(INODE_REFERENCE i, INODE *inode)
     tempBlock.content.inodes.inode[element] = *inode;
     
     // Write the block back
-    if(virtual_disk_write_block(b, &tempBlock) != 0) {
+    int ret = virtual_disk_write_block(mnt->disk, b, &tempBlock);
+    pthread_mutex_unlock(&mnt->inode_block_lock[b - 1]);
+    if(ret != 0) {
         fprintf(stderr, "deallocate_block: error writing inode block\n");
         return(-1);
     }
@@ -204,6 +387,7 @@ int oufs_write_inode_by_reference(INODE_REFERENCE i, INODE *inode)
  * @param n_references Number of references to this inode
  *          (when first created, will always be 1)
  * @param content Block reference to the block that contains the information within this inode
+ *          (a single block or UNALLOCATED_BLOCK: it is also the tail)
  * @param size Size of the inode (# of directory entries or size of file in bytes)
  *
  */
@@ -213,40 +397,140 @@ void oufs_set_inode(INODE *inode, INODE_TYPE type, int n_references,
 {
     inode->type = type;
     inode->n_references = n_references;
+    inode->flags = 0;
     inode->content = content;
+    inode->tail = content;
     inode->size = size;
 }
 
 
+/**
+ * Binary search for a name within a directory block.
+ *
+ * Directory blocks are kept sorted: entries 0 ... n_entries-1 are valid and
+ *  in strcmp() order (so . and .. are normally first); all remaining entries
+ *  are UNALLOCATED_INODE.
+ *
+ * @param block Pointer to a loaded directory block
+ * @param n_entries Number of valid entries (the size of the directory inode)
+ * @param name Name to search for
+ * @param found Set to 1 if the name is present; 0 otherwise
+ * @return Index of the matching entry if found; otherwise, the index at
+ *          which the name would have to be inserted
+ */
+int oufs_directory_search(BLOCK *block, int n_entries, char *name, int *found)
+{
+    int low = 0;
+    int high = n_entries - 1;
+
+    *found = 0;
+    while(low <= high)
+    {
+        int mid = (low + high) / 2;
+        int cmp = strncmp(block->content.directory.entry[mid].name, name, FILE_NAME_SIZE);
+        if(cmp == 0)
+        {
+            *found = 1;
+            return(mid);
+        }
+        else if(cmp < 0)
+            low = mid + 1;
+        else
+            high = mid - 1;
+    }
+    // Not found: low is the insertion point
+    return(low);
+}
+
+/**
+ * Insert a new entry into a sorted directory block, shifting the later entries
+ *  up by one slot.  The block is only modified in memory.
+ *
+ * @param block Pointer to a loaded directory block
+ * @param n_entries Number of valid entries before the insertion
+ * @param name Name of the new entry
+ * @param inode_reference Inode that the new entry refers to
+ * @param type Type of that inode (cached in the entry)
+ * @return Index of the new entry if success
+ *         -1 if the directory is full
+ *         -2 if the name already exists
+ */
+int oufs_directory_insert(BLOCK *block, int n_entries, char *name,
+                          INODE_REFERENCE inode_reference, INODE_TYPE type)
+{
+    int found;
+
+    if(n_entries >= N_DIRECTORY_ENTRIES_PER_BLOCK)
+        return(-1);
+
+    int i = oufs_directory_search(block, n_entries, name, &found);
+    if(found)
+        return(-2);
+
+    // Open up slot i
+    DIRECTORY_ENTRY *entry = block->content.directory.entry;
+    memmove(&entry[i+1], &entry[i], (n_entries - i) * sizeof(DIRECTORY_ENTRY));
+
+    memset(&entry[i], 0, sizeof(DIRECTORY_ENTRY));
+    strncpy(entry[i].name, name, FILE_NAME_SIZE-1);
+    entry[i].type = type;
+    entry[i].inode_reference = inode_reference;
+    return(i);
+}
+
+/**
+ * Remove an entry from a sorted directory block, shifting the later entries
+ *  down by one slot.  The block is only modified in memory.
+ *
+ * @param block Pointer to a loaded directory block
+ * @param n_entries Number of valid entries before the removal
+ * @param name Name of the entry to remove
+ * @return Inode reference of the removed entry
+ *         UNALLOCATED_INODE if the name was not found
+ */
+INODE_REFERENCE oufs_directory_delete(BLOCK *block, int n_entries, char *name)
+{
+    int found;
+    int i = oufs_directory_search(block, n_entries, name, &found);
+    if(!found)
+        return(UNALLOCATED_INODE);
+
+    DIRECTORY_ENTRY *entry = block->content.directory.entry;
+    INODE_REFERENCE removed = entry[i].inode_reference;
+    memmove(&entry[i], &entry[i+1], (n_entries - i - 1) * sizeof(DIRECTORY_ENTRY));
+
+    // The last slot is now free
+    memset(&entry[n_entries-1], 0, sizeof(DIRECTORY_ENTRY));
+    entry[n_entries-1].inode_reference = UNALLOCATED_INODE;
+    return(removed);
+}
+
 /*
  * Given a valid directory inode, return the inode reference for the sub-item
  * that matches <element_name>
  *
+ * @param mnt Mount of the virtual disk
  * @param inode Pointer to a loaded inode structure.  Must be a directory inode
  * @param element_name Name of the directory element to look up
  *
  * @return = INODE_REFERENCE for the sub-item if found; UNALLOCATED_INODE if not found
  */
 
-int oufs_find_directory_element(INODE *inode, char *element_name)
+int oufs_find_directory_element(OUFS_MOUNT *mnt, INODE *inode, char *element_name)
 {
-    if(debug)
+    if(mnt->debug)
         fprintf(stderr,"\tDEBUG: oufs_find_directory_element: %s\n", element_name);
-    
-    // TODO
-    // TODO: should I return -1 for its "must be directory inode" if not directory inode??
+
     if (inode->type == DIRECTORY_TYPE)
     {
         BLOCK b;
-        memset(&b, 0, sizeof(BLOCK));
-        virtual_disk_read_block(inode->content, &b);
-        for (int i=0; i<N_DIRECTORY_ENTRIES_PER_BLOCK; i++)
-        {
-            if(strcmp(b.content.directory.entry[i].name, element_name) == 0)
-            {
-                return b.content.directory.entry[i].inode_reference;
-            }
-        }
+        int found;
+        if(virtual_disk_read_block(mnt->disk, inode->content, &b) != 0)
+            return UNALLOCATED_INODE;
+        // Entries are sorted: binary search over the valid ones
+        int i = oufs_directory_search(&b, inode->size, element_name, &found);
+        if(found)
+            return b.content.directory.entry[i].inode_reference;
         return UNALLOCATED_INODE;
     }
     // changed this from -1
@@ -261,6 +545,7 @@ int oufs_find_directory_element(INODE *inode, char *element_name)
  *  This implementation handles a variety of strange cases, such as consecutive /'s and /'s at the end of
  * of the path (we have to maintain some extra state to make this work properly).
  *
+ * @param mnt Mount of the virtual disk
  * @param cwd Absolute path for the current working directory
  * @param path Absolute or relative path of the file/directory to be found
  * @param parent Pointer to the found inode reference for the parent directory
@@ -272,7 +557,7 @@ int oufs_find_directory_element(INODE *inode, char *element_name)
  *         -x if an error
  *
  */
-int oufs_find_file(char *cwd, char * path, INODE_REFERENCE *parent, INODE_REFERENCE *child,
+int oufs_find_file(OUFS_MOUNT *mnt, char *cwd, char * path, INODE_REFERENCE *parent, INODE_REFERENCE *child,
                    char *local_name)
 {
     INODE_REFERENCE grandparent;
@@ -292,23 +577,24 @@ int oufs_find_file(char *cwd, char * path, INODE_REFERENCE *parent, INODE_REFERE
         }
     }
     
-    if(debug) {
+    if(mnt->debug) {
         fprintf(stderr, "\tDEBUG: Full path: %s\n", full_path);
     };
     
     // Start scanning from the root directory
     grandparent = *parent = *child = 0;
-    if(debug)
+    if(mnt->debug)
         fprintf(stderr, "\tDEBUG: Start search: %d\n", *parent);
     
-    // Parse the full path
+    // Parse the full path (strtok_r(): other threads may be parsing too)
     char *directory_name;
-    directory_name = strtok(full_path, "/");
+    char *save_pointer;
+    directory_name = strtok_r(full_path, "/", &save_pointer);
     while(directory_name != NULL) {
         if(strlen(directory_name) >= FILE_NAME_SIZE-1)
             // Truncate the name
             directory_name[FILE_NAME_SIZE - 1] = 0;
-        if(debug){
+        if(mnt->debug){
             fprintf(stderr, "\tDEBUG: Searching Directory: %s\n", directory_name);
         }
         // TODO: finish
@@ -316,8 +602,11 @@ int oufs_find_file(char *cwd, char * path, INODE_REFERENCE *parent, INODE_REFERE
         INODE start;
         BLOCK b;
         memset(&b, 0, sizeof(BLOCK));
-        oufs_read_inode_by_reference(*child, &start);
-        INODE_REFERENCE temp = (INODE_REFERENCE)oufs_find_directory_element(&start, directory_name);
+        // The directory may not change while it is searched
+        pthread_rwlock_rdlock(&mnt->inode_lock[*child]);
+        oufs_read_inode_by_reference(mnt, *child, &start);
+        INODE_REFERENCE temp = (INODE_REFERENCE)oufs_find_directory_element(mnt, &start, directory_name);
+        pthread_rwlock_unlock(&mnt->inode_lock[*child]);
         if ((int)temp == -1)
         {
             // inode is (possibly) a file
@@ -332,7 +621,7 @@ int oufs_find_file(char *cwd, char * path, INODE_REFERENCE *parent, INODE_REFERE
             
             if(local_name!=NULL)
                 strcpy(local_name, directory_name);
-            directory_name = strtok(NULL, "/");
+            directory_name = strtok_r(NULL, "/", &save_pointer);
             if(directory_name!=NULL)
                 *parent = temp;
         }
@@ -352,7 +641,7 @@ int oufs_find_file(char *cwd, char * path, INODE_REFERENCE *parent, INODE_REFERE
     
     // Item found.
     
-    if(debug) {
+    if(mnt->debug) {
         fprintf(stderr, "\tDEBUG: Found: parent %d, child %d\n", *parent, *child);
     }
     // Success!
@@ -401,80 +690,32 @@ int oufs_find_open_bit(unsigned char value)
  *  Allocate a new directory (an inode and block to contain the directory).  This
  *  includes initialization of the new directory.
  *
+ * @param mnt Mount of the virtual disk
  * @param parent_reference The inode of the parent directory
  * @return The inode reference of the new directory
  *         UNALLOCATED_INODE if we cannot allocate the directory
  */
-int oufs_allocate_new_directory(INODE_REFERENCE parent_reference)
+int oufs_allocate_new_directory(OUFS_MOUNT *mnt, INODE_REFERENCE parent_reference)
 {
     BLOCK block;
-    BLOCK block2;
-    // Read the master block
-    if(virtual_disk_read_block(MASTER_BLOCK_REFERENCE, &block) != 0) {
-        // Read error
-        return(UNALLOCATED_INODE);
-    }
-    // TODO
-    INODE_REFERENCE newdir = UNALLOCATED_INODE;
-    int byte = -1;
-    int bit = -1;
-    
-    //FIXME: this looping is wrong. uses already used inodes
-    for (int i=0; i<N_INODES; i++)
-    {
-        // TODO: double check all this
-        byte = i/8;
-        // TODO: must make sure find_open_bit works for this function to work
-        //fprintf(stderr, "before find_open_bit in allocate_new_dir line 403");
-        bit = oufs_find_open_bit(block.content.master.inode_allocated_flag[byte]);
-        //fprintf(stderr, "\n bit is %d \n", bit);
-        if (bit != -1)
-        {
-            // INODE REFERENCE may be j*8 + (7-i)
-            newdir = (INODE_REFERENCE)((7-bit) +(i));
-            //fprintf(stderr, "\n i is %d \n", i);
-            //fprintf(stderr, "\n newdir is %d \n", newdir);
-            // TODO: make sure this shift works correctly
-            
-            block.content.master.inode_allocated_flag[byte] = (block.content.master.inode_allocated_flag[byte] | (1<<bit) );
-            break;
-        }
-    }
-    // couldn't find an open bit
-    if (bit == -1)
-        return UNALLOCATED_INODE;
-    // change allocation table to mark new one being allocated
-    
     INODE inode;
-    // read the inode from virtual disk TODO: need this??
-    oufs_read_inode_by_reference(newdir, &inode);
-    
-    // using a temporary variable for the block at front of list
-    BLOCK_REFERENCE temp = block.content.master.unallocated_front;
-    if (temp == UNALLOCATED_BLOCK)
-    {
-        fprintf(stderr, "\n unallocated_front was an unallocated block. \n");
+    BLOCK_REFERENCE block_reference;
+
+    INODE_REFERENCE newdir = oufs_allocate_inode(mnt);
+    if (newdir == UNALLOCATED_INODE)
         return UNALLOCATED_INODE;
-    }
-    virtual_disk_read_block(temp, &block2);
-    
-    //TODO: set the end of the chain to UNALLOCATED IF NONE LEFT
-    if (block2.next_block == UNALLOCATED_BLOCK)
-    {
-        block.content.master.unallocated_front = UNALLOCATED_BLOCK;
-    }
-    else        // TODO: double check this logic
+    if (oufs_allocate_blocks(mnt, &block_reference, 1) != 1)
     {
-        block.content.master.unallocated_front = block2.next_block;
+        fprintf(stderr, "\n no free block for the new directory. \n");
+        oufs_deallocate_inode(mnt, newdir);
+        return UNALLOCATED_INODE;
     }
-    // TODO: double check this call that all parameters are correct
+
     fprintf(stderr, "\n about to init directory structures \n");
-    oufs_init_directory_structures(&inode, &block2, temp, newdir, parent_reference);
+    oufs_init_directory_structures(&inode, &block, block_reference, newdir, parent_reference);
     // write inode and block to virtual disk
-    oufs_write_inode_by_reference(newdir, &inode);
-    //  changed allocation table. write master block back to disk
-    virtual_disk_write_block(MASTER_BLOCK_REFERENCE, &block);
-    virtual_disk_write_block(temp, &block2); // TODO: changed to temp from inode.content. Check this
+    oufs_write_inode_by_reference(mnt, newdir, &inode);
+    virtual_disk_write_block(mnt->disk, block_reference, &block);
     return newdir;
     
 };
@@ -486,6 +727,7 @@ int oufs_allocate_new_directory(INODE_REFERENCE parent_reference)
 /**
  *  Create a zero-length file within a specified diretory
  *
+ *  @param mnt Mount of the virtual disk
  *  @param parent Inode reference for the parent directory
  *  @param local_name Name of the file within the parent directory
  *  @return Inode reference index for the newly created file
@@ -494,13 +736,18 @@ int oufs_allocate_new_directory(INODE_REFERENCE parent_reference)
  *  Errors include: virtual disk read/write errors, no available inodes,
  *    no available directory entrie
  */
-INODE_REFERENCE oufs_create_file(INODE_REFERENCE parent, char *local_name)
+INODE_REFERENCE oufs_create_file(OUFS_MOUNT *mnt, INODE_REFERENCE parent, char *local_name)
 {
   // Does the parent have a slot?
   INODE inode;
+  INODE_REFERENCE fileref = UNALLOCATED_INODE;
+
+  // Entries of the parent change: hold its directory lock throughout
+  pthread_rwlock_wrlock(&mnt->inode_lock[parent]);
 
   // Read the parent inode
-  if(oufs_read_inode_by_reference(parent, &inode) != 0) {
+  if(oufs_read_inode_by_reference(mnt, parent, &inode) != 0 || inode.type != DIRECTORY_TYPE) {
+    pthread_rwlock_unlock(&mnt->inode_lock[parent]);
     return UNALLOCATED_INODE;
   }
 
@@ -508,57 +755,43 @@ INODE_REFERENCE oufs_create_file(INODE_REFERENCE parent, char *local_name)
   if(inode.size == N_DIRECTORY_ENTRIES_PER_BLOCK) {
     // Directory is full
     fprintf(stderr, "Parent directory is full.\n");
+    pthread_rwlock_unlock(&mnt->inode_lock[parent]);
     return UNALLOCATED_INODE;
   }
 
   // TODO
     BLOCK dirblock;
-    virtual_disk_read_block(inode.content, &dirblock);
-    BLOCK masterblock;
-    virtual_disk_read_block(MASTER_BLOCK_REFERENCE, &masterblock);
-    // Get open bit in master block
-    INODE_REFERENCE fileref = UNALLOCATED_INODE;
-    int byte = -1;
-    int bit = -1;
-    for (int i=0; i<N_INODES; i++)
-    {
-        // TODO: double check all this
-        byte = i/8;
-        bit = oufs_find_open_bit(masterblock.content.master.inode_allocated_flag[byte]);
-        if (bit != -1)
-        {
-            // open bit found, set bit to 1 in inode allocation table
-            fileref = (INODE_REFERENCE)((7-bit) +(i));
-            masterblock.content.master.inode_allocated_flag[byte] = (masterblock.content.master.inode_allocated_flag[byte] | (1<<bit) );
-            break;
-        }
-    }
-    // error if no open bit was found above. return UNALLOCATED_INODE
+    int found;
+    virtual_disk_read_block(mnt->disk, inode.content, &dirblock);
+    // (Another thread may have created the name since it was looked up)
+    oufs_directory_search(&dirblock, inode.size, local_name, &found);
+    if (!found)
+        fileref = oufs_allocate_inode(mnt);
+    // error if no inode is available (or the name exists). return UNALLOCATED_INODE
     if (fileref == UNALLOCATED_INODE)
+    {
+        pthread_rwlock_unlock(&mnt->inode_lock[parent]);
         return fileref;
+    }
     INODE newFile;
-    oufs_read_inode_by_reference(fileref, &newFile);
-    
-    for (int i=2; i<N_DIRECTORY_ENTRIES_PER_BLOCK; i++)
+
+    // Insert the new name in sorted position within the parent
+    if(oufs_directory_insert(&dirblock, inode.size, local_name, fileref, FILE_TYPE) < 0)
     {
-        if (dirblock.content.directory.entry[i].inode_reference == UNALLOCATED_INODE)
-        {
-            oufs_set_inode(&newFile, FILE_TYPE, 1, UNALLOCATED_BLOCK, 0);
-            dirblock.content.directory.entry[i].inode_reference =  fileref;
-            // copy local name to parent directory block entry
-            strcpy(dirblock.content.directory.entry[i].name, local_name);
-            // write parent directory block and inode back to disk
-            inode.size++;
-            break;
-        }
+        fprintf(stderr, "Unable to add %s to parent directory.\n", local_name);
+        oufs_deallocate_inode(mnt, fileref);
+        pthread_rwlock_unlock(&mnt->inode_lock[parent]);
+        return UNALLOCATED_INODE;
     }
-    // TODO: not sure if i need to set up OUFILE or what mode would be seems like it would be lost without memset() call
+    oufs_set_inode(&newFile, FILE_TYPE, 1, UNALLOCATED_BLOCK, 0);
+    inode.size++;
     
-    // Write back to disk for all
-    oufs_write_inode_by_reference(parent, &inode);
-    virtual_disk_write_block(MASTER_BLOCK_REFERENCE, &masterblock);
-    virtual_disk_write_block(inode.content, &dirblock);
-    oufs_write_inode_by_reference(fileref, &newFile);
+    // Write back to disk for all (the new inode first, so that the entry
+    //  never refers to an uninitialized inode)
+    oufs_write_inode_by_reference(mnt, fileref, &newFile);
+    virtual_disk_write_block(mnt->disk, inode.content, &dirblock);
+    oufs_write_inode_by_reference(mnt, parent, &inode);
+    pthread_rwlock_unlock(&mnt->inode_lock[parent]);
     
 
   // Success
@@ -568,99 +801,262 @@ INODE_REFERENCE oufs_create_file(INODE_REFERENCE parent, char *local_name)
 /**
  * Deallocate all of the blocks that are being used by an inode
  *
- * - Modifies the inode to set content to UNALLOCATED_BLOCK
- * - Adds any content blocks to the end of the free block list
- *    (these are added in the same order as they are in the file)
+ * - Modifies the inode to set content (and tail) to UNALLOCATED_BLOCK
+ * - Frees the content blocks (see oufs_deallocate_chain()), with one
+ *    read-modify-write of each allocation shard that they belong to
+ * - Blocks that are shared with another file (INODE_FLAG_SHARED) only lose
+ *    a reference; see oufs_release_chain()
  * - If the file is using no blocks, then return success without
  *    modifications.
  * - Note: the inode is not written back to the disk (we will let
  *    the calling function handle this)
  *
+ * @param mnt Mount of the virtual disk
  * @param inode A pointer to an inode structure that is already in memory
  * @return 0 if success
  *         -x if error
  */
 
-int oufs_deallocate_blocks(INODE *inode)
+int oufs_deallocate_blocks(OUFS_MOUNT *mnt, INODE *inode)
 {
-  BLOCK master_block;
-  BLOCK block;
+  ALLOC_MASK mask;
 
   // Nothing to do if the inode has no content
   if(inode->content == UNALLOCATED_BLOCK)
     return(0);
 
-  // TODO
-    BLOCK_REFERENCE br;
-    BLOCK_REFERENCE next;
-    br = inode->content;
-    //virtual_disk_read_block(br, &block);
-    while (br != UNALLOCATED_BLOCK)
-    {
-        // read master block from disk to block mb
-        virtual_disk_read_block(MASTER_BLOCK_REFERENCE, &master_block);
-        
-        // read the block in the chain of blocks in the file
-        virtual_disk_read_block(br, &block);
-        
-        // get next block in chain before deallocating
-        next = block.next_block;
-        
-        // deallocate in memory master block and DISK copy of br
-        if (oufs_deallocate_block(&master_block, br) <0 )
-        {
-            fprintf(stderr, "error while deallocating and individual block in chain\n");
-            return -2;
-        }
-        
-        // write master block to disk
-        virtual_disk_write_block(MASTER_BLOCK_REFERENCE, &master_block);
-        
-        // change block reference to next one
-        br = next;
+  memset(&mask, 0, sizeof(mask));
+  if(inode->flags & INODE_FLAG_SHARED) {
+    if(oufs_release_chain(mnt, &mask, inode->content) < 0) {
+      fprintf(stderr, "error while releasing chain\n");
+      return(-2);
     }
-    inode->content = UNALLOCATED_BLOCK;
+  }else if(oufs_deallocate_chain(mnt, &mask, inode->content, inode->tail) < 0) {
+    fprintf(stderr, "error while deallocating chain\n");
+    return(-2);
+  }
+  if(oufs_free_marked(mnt, &mask) != 0)
+    return(-1);
+
+  inode->content = UNALLOCATED_BLOCK;
+  inode->tail = UNALLOCATED_BLOCK;
+  inode->flags &= ~INODE_FLAG_SHARED;
 
   // Success
   return(0);
 }
 
 /**
- * Allocate a new data block
- * - If one is found, then the free block linked list is updated
+ * Free a batch of inodes, their contents and loose blocks with a single
+ *  read-modify-write of each allocation shard that they belong to
+ * - Each inode's content chain is freed as by oufs_deallocate_blocks();
+ *     the inodes are not written back
+ * - Each inode's bit in its shard is cleared
+ * - Loose blocks (allocated but never linked into a file) are freed as
+ *     they are
  *
- * @param master_block A link to a buffer ALREADY containing the data from the master block.
- *    This buffer may be modified (but will not be written to the disk; we will let
- *    the calling function handle this).
- * @param new_block A link to a buffer into which the new block will be read.
+ * @param mnt Mount of the virtual disk
+ * @param inodes Array of n_inodes loaded inodes (NULL if none has content)
+ * @param inode_refs Array of n_inodes inode references
+ * @param n_inodes Number of inodes
+ * @param blocks Array of n_blocks loose block references
+ * @param n_blocks Number of loose blocks
+ * @return 0 if success
+ *         -x if error
+ */
+int oufs_deallocate_batch(OUFS_MOUNT *mnt, INODE *inodes, INODE_REFERENCE *inode_refs, int n_inodes,
+                          BLOCK_REFERENCE *blocks, int n_blocks)
+{
+  ALLOC_MASK mask;
+  int ret = 0;
+
+  memset(&mask, 0, sizeof(mask));
+  for(int i = 0; inodes != NULL && i < n_inodes; ++i) {
+    if(inodes[i].content == UNALLOCATED_BLOCK)
+      continue;
+    if(inodes[i].flags & INODE_FLAG_SHARED) {
+      if(oufs_release_chain(mnt, &mask, inodes[i].content) < 0)
+        ret = -2;
+    }else if(oufs_deallocate_chain(mnt, &mask, inodes[i].content, inodes[i].tail) < 0) {
+      ret = -2;
+    }
+  }
+  for(int i = 0; i < n_inodes; ++i)
+    oufs_mark_inode(&mask, inode_refs[i]);
+  for(int i = 0; i < n_blocks; ++i)
+    oufs_mark_block(&mask, blocks[i]);
+  if(oufs_free_marked(mnt, &mask) != 0)
+    ret = -1;
+  return(ret);
+}
+
+/************************************************************************/
+// Allocation (for any number of threads)
+
+// Shard in which the calling thread allocates first (see
+//  oufs_set_alloc_shard())
+static __thread int oufs_thread_shard = -1;
+static int oufs_next_shard = 0;
+
+/**
+ * Choose the shard in which the calling thread allocates first.  Threads
+ *  are otherwise spread over the shards in the order in which they first
+ *  allocate (so that threads that allocate at the same time tend to use
+ *  different shards)
  *
- * @return The index of the allocated data block.  If no blocks are available,
- *        then UNALLOCATED_BLOCK is returned
+ * @param shard 0 ... N_ALLOC_SHARDS-1; -1 to have one chosen again
+ */
+void oufs_set_alloc_shard(int shard)
+{
+  oufs_thread_shard = (shard < 0) ? -1 : shard % N_ALLOC_SHARDS;
+}
+
+/**
+ * Shard in which the calling thread allocates first
  *
+ * @return 0 ... N_ALLOC_SHARDS-1
  */
-BLOCK_REFERENCE oufs_allocate_new_block(BLOCK *master_block, BLOCK *new_block)
+static int oufs_home_shard()
 {
-  // Is there an available block?
-  if(master_block->content.master.unallocated_front == UNALLOCATED_BLOCK) {
-    // Did not find an available block
-    if(debug)
-      fprintf(stderr, "No blocks\n");
-    return(UNALLOCATED_BLOCK);
+  if(oufs_thread_shard < 0)
+    oufs_thread_shard = __sync_fetch_and_add(&oufs_next_shard, 1) % N_ALLOC_SHARDS;
+  return(oufs_thread_shard);
+}
+
+/**
+ * Allocate up to n blocks from one shard, with one read-modify-write of
+ *  its inode block (under that block's inode_block_lock)
+ * - The lowest free blocks of the shard are taken, in order
+ *
+ * @param mnt Mount of the virtual disk
+ * @param shard The shard
+ * @param refs Array in which to place the references of the allocated blocks
+ * @param n Number of blocks wanted
+ * @return The number of blocks allocated
+ */
+static int oufs_shard_allocate_blocks(OUFS_MOUNT *mnt, int shard, BLOCK_REFERENCE *refs, int n)
+{
+  BLOCK block;
+  int count = 0;
+
+  pthread_mutex_lock(&mnt->inode_block_lock[shard]);
+  if(virtual_disk_read_block(mnt->disk, shard + 1, &block) == 0) {
+    unsigned char *flags = block.content.inodes.shard.block_allocated_flag;
+    for(int i = 0; i < ALLOC_SHARD_BLOCKS && count < n; ++i) {
+      if(flags[i / 8] & (1 << (7 - i % 8)))
+        continue;
+      flags[i / 8] |= 1 << (7 - i % 8);
+      refs[count++] = shard * ALLOC_SHARD_BLOCKS + i;
+    }
+    if(count > 0 && virtual_disk_write_block(mnt->disk, shard + 1, &block) != 0)
+      count = 0;
   }
+  pthread_mutex_unlock(&mnt->inode_block_lock[shard]);
+  return(count);
+}
 
-  // TODO
-    BLOCK_REFERENCE front;
-    front = master_block->content.master.unallocated_front;
-    //fprintf(stderr, "inside allocate_new_block: master.unallocated front before shift = %d\n", front);
-    virtual_disk_read_block(front, new_block);
-    //fprintf(stderr, "inside allocate_new_b pointer &newblock is %d\n", new_block);
-    //fprintf(stderr, "inside allocate_new_b new_block->next_block == %d\n", new_block->next_block);
-    master_block->content.master.unallocated_front = new_block->next_block;
-    //fprintf(stderr, "inside allocate_new_block: master.unallocated front AFTER shift = %d\n", new_block->next_block);
-    //fprintf(stderr, "inside allocate_new_b new_block->next_block == %d\n", new_block->next_block);
-    new_block->next_block = UNALLOCATED_BLOCK;
-    //fprintf(stderr, "made it to the end of allocate_new_block");
-
-  return front;
+/**
+ * Allocate a batch of data blocks
+ * - Blocks are taken from the calling thread's shard first (lowest ones
+ *     first, so a single thread on a fresh disk gets adjacent blocks), then
+ *     from the following shards
+ * - Each shard is a read-modify-write of its own inode block, which
+ *     records the allocation at once: nothing is reserved ahead of time, and
+ *     master_lock is not taken
+ * - The block contents are not read or initialized
+ *
+ * @param mnt Mount of the virtual disk
+ * @param refs Array in which to place the references of the allocated blocks
+ * @param n Number of blocks wanted
+ * @return The number of blocks allocated (less than n if the disk is full)
+ */
+int oufs_allocate_blocks(OUFS_MOUNT *mnt, BLOCK_REFERENCE *refs, int n)
+{
+  int home = oufs_home_shard();
+  int count = 0;
+
+  for(int i = 0; i < N_ALLOC_SHARDS && count < n; ++i)
+    count += oufs_shard_allocate_blocks(mnt, (home + i) % N_ALLOC_SHARDS, refs + count, n - count);
+  return(count);
+}
+
+/**
+ * Allocate an inode: set its bit in its shard (a read-modify-write of the
+ *  inode block that holds it, under that block's inode_block_lock).  The
+ *  calling thread's shard is tried first, then the following ones; within
+ *  a shard, the lowest free inode is taken.  The inode itself is not
+ *  initialized.
+ *
+ * @param mnt Mount of the virtual disk
+ * @return The inode reference
+ *         UNALLOCATED_INODE if there are no free inodes
+ */
+INODE_REFERENCE oufs_allocate_inode(OUFS_MOUNT *mnt)
+{
+  BLOCK block;
+  INODE_REFERENCE ref = UNALLOCATED_INODE;
+  int home = oufs_home_shard();
+
+  for(int k = 0; k < N_ALLOC_SHARDS && ref == UNALLOCATED_INODE; ++k) {
+    int shard = (home + k) % N_ALLOC_SHARDS;
+    pthread_mutex_lock(&mnt->inode_block_lock[shard]);
+    if(virtual_disk_read_block(mnt->disk, shard + 1, &block) == 0) {
+      unsigned char *flags = block.content.inodes.shard.inode_allocated_flag;
+      for(int i = 0; i < N_INODES_PER_BLOCK; ++i) {
+        if(flags[i / 8] & (1 << (7 - i % 8)))
+          continue;
+        flags[i / 8] |= 1 << (7 - i % 8);
+        if(virtual_disk_write_block(mnt->disk, shard + 1, &block) == 0)
+          ref = shard * N_INODES_PER_BLOCK + i;
+        break;
+      }
+    }
+    pthread_mutex_unlock(&mnt->inode_block_lock[shard]);
+  }
+  return(ref);
 }
 
+/**
+ * Free an inode: clear its bit in its shard.  The inode itself is not
+ *  modified.
+ *
+ * @param mnt Mount of the virtual disk
+ * @param i Inode reference
+ * @return 0 if success
+ *         -x if error
+ */
+int oufs_deallocate_inode(OUFS_MOUNT *mnt, INODE_REFERENCE i)
+{
+  ALLOC_MASK mask;
+
+  memset(&mask, 0, sizeof(mask));
+  oufs_mark_inode(&mask, i);
+  return(oufs_free_marked(mnt, &mask));
+}
+
+/**
+ * Count the free blocks and inodes of the disk (over every shard)
+ *
+ * @param mnt Mount of the virtual disk
+ * @param blocks Filled in with the number of free blocks
+ * @param inodes Filled in with the number of free inodes
+ * @return 0 if success
+ *         -x if error
+ */
+int oufs_count_free(OUFS_MOUNT *mnt, int *blocks, int *inodes)
+{
+  BLOCK block;
+
+  *blocks = 0;
+  *inodes = 0;
+  for(int shard = 0; shard < N_ALLOC_SHARDS; ++shard) {
+    if(oufs_read_inode_block(mnt, shard, &block) != 0)
+      return(-1);
+    ALLOC_SHARD *state = &block.content.inodes.shard;
+    for(int i = 0; i < ALLOC_SHARD_BLOCKS; ++i)
+      *blocks += (state->block_allocated_flag[i / 8] & (1 << (7 - i % 8))) == 0;
+    for(int i = 0; i < N_INODES_PER_BLOCK; ++i)
+      *inodes += (state->inode_allocated_flag[i / 8] & (1 << (7 - i % 8))) == 0;
+  }
+  return(0);
+}
@@ -4,8 +4,10 @@
 #include "oufs_lib.h"
 
 // Implement these for project 3
-int oufs_read_inode_by_reference(INODE_REFERENCE i, INODE *inode);
-int oufs_write_inode_by_reference(INODE_REFERENCE i, INODE *inode);
+int oufs_read_inode_by_reference(OUFS_MOUNT *mnt, INODE_REFERENCE i, INODE *inode);
+int oufs_write_inode_by_reference(OUFS_MOUNT *mnt, INODE_REFERENCE i, INODE *inode);
+int oufs_read_inodes_by_reference(OUFS_MOUNT *mnt, INODE_REFERENCE *refs, INODE *inodes, int n);
+int oufs_read_inode_block(OUFS_MOUNT *mnt, int block_index, BLOCK *block);
 void oufs_set_inode(INODE *inode, INODE_TYPE type, int n_references,
 		    BLOCK_REFERENCE content, int size);
 void oufs_init_directory_structures(INODE *inode, BLOCK *block,
@@ -13,18 +15,49 @@ void oufs_init_directory_structures(INODE *inode, BLOCK *block,
 				    INODE_REFERENCE self_inode_reference,
 				    INODE_REFERENCE parent_inode_reference);
 
-int oufs_find_file(char *cwd, char * path, INODE_REFERENCE *parent,
+int oufs_find_file(OUFS_MOUNT *mnt, char *cwd, char * path, INODE_REFERENCE *parent,
 		   INODE_REFERENCE *child, char *local_name);
+int oufs_find_directory_element(OUFS_MOUNT *mnt, INODE *inode, char *element_name);
+
+// Sorted directory blocks
+int oufs_directory_search(BLOCK *block, int n_entries, char *name, int *found);
+int oufs_directory_insert(BLOCK *block, int n_entries, char *name,
+			  INODE_REFERENCE inode_reference, INODE_TYPE type);
+INODE_REFERENCE oufs_directory_delete(BLOCK *block, int n_entries, char *name);
  
-int oufs_deallocate_block(BLOCK *master_block, BLOCK_REFERENCE block_reference);
+// Blocks and inodes that are to be freed together, by shard (see
+//  oufs_free_marked())
+typedef struct alloc_mask_s
+{
+  ALLOC_SHARD shard[N_ALLOC_SHARDS];
+} ALLOC_MASK;
+
+void oufs_mark_block(ALLOC_MASK *mask, BLOCK_REFERENCE block_reference);
+void oufs_mark_inode(ALLOC_MASK *mask, INODE_REFERENCE i);
+int oufs_deallocate_chain(OUFS_MOUNT *mnt, ALLOC_MASK *mask, BLOCK_REFERENCE first,
+			  BLOCK_REFERENCE last);
+int oufs_release_chain(OUFS_MOUNT *mnt, ALLOC_MASK *mask, BLOCK_REFERENCE first);
+int oufs_free_marked(OUFS_MOUNT *mnt, ALLOC_MASK *mask);
 
-int oufs_allocate_new_directory(INODE_REFERENCE parent_reference);
+int oufs_allocate_new_directory(OUFS_MOUNT *mnt, INODE_REFERENCE parent_reference);
 int oufs_find_open_bit(unsigned char value);
 
 
 // Implement these for project 4
-INODE_REFERENCE oufs_create_file(INODE_REFERENCE parent, char *local_name);
-int oufs_deallocate_blocks(INODE *inode);
-BLOCK_REFERENCE oufs_allocate_new_block(BLOCK *master_block, BLOCK *new_block);
+INODE_REFERENCE oufs_create_file(OUFS_MOUNT *mnt, INODE_REFERENCE parent, char *local_name);
+int oufs_deallocate_blocks(OUFS_MOUNT *mnt, INODE *inode);
+
+// Allocation (for any number of threads)
+int oufs_allocate_blocks(OUFS_MOUNT *mnt, BLOCK_REFERENCE *refs, int n);
+INODE_REFERENCE oufs_allocate_inode(OUFS_MOUNT *mnt);
+int oufs_deallocate_inode(OUFS_MOUNT *mnt, INODE_REFERENCE i);
+int oufs_deallocate_batch(OUFS_MOUNT *mnt, INODE *inodes, INODE_REFERENCE *inode_refs, int n_inodes,
+			  BLOCK_REFERENCE *blocks, int n_blocks);
+int oufs_count_free(OUFS_MOUNT *mnt, int *blocks, int *inodes);
+void oufs_set_alloc_shard(int shard);
+
+// Locking
+int oufs_lock_entry(OUFS_MOUNT *mnt, INODE_REFERENCE parent, char *local_name,
+		    INODE_REFERENCE child);
 
 #endif
@@ -13,16 +13,18 @@ int main(int argc, char** argv) {
   oufs_get_environment(cwd, disk_name, pipe_name_base);
 
   // Open the virtual disk
-  virtual_disk_attach(disk_name, pipe_name_base);
+  OUFS_MOUNT *mnt = oufs_mount(disk_name, pipe_name_base);
+  if(mnt == NULL)
+    return(-1);
 
   if(argc == 1) {
-    oufs_list(cwd, "");
+    oufs_list(mnt, cwd, "");
   }else if(argc == 2){
-    oufs_list(cwd, argv[1]);
+    oufs_list(mnt, cwd, argv[1]);
   }else{
     fprintf(stderr, "Usage: oufs_ls [<name>]\n");
   }
 
   // Clean up
-  virtual_disk_detach();
+  oufs_unmount(mnt);
 }
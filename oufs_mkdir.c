@@ -22,16 +22,18 @@ int main(int argc, char** argv) {
   // Check arguments
   if(argc == 2) {
     // Open the virtual disk
-    virtual_disk_attach(disk_name, pipe_name_base);
+    OUFS_MOUNT *mnt = oufs_mount(disk_name, pipe_name_base);
+    if(mnt == NULL)
+      return(-1);
 
     // Make the specified directory
-    int ret = oufs_mkdir(cwd, argv[1]);
+    int ret = oufs_mkdir(mnt, cwd, argv[1]);
     if(ret != 0) {
       fprintf(stderr, "Error (%d)\n", ret);
     }
 
     // Clean up
-    virtual_disk_detach();
+    oufs_unmount(mnt);
     
   }else{
     // Wrong number of parameters
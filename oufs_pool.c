@@ -0,0 +1,252 @@
+/**
+ *  oufs_pool.c
+ *
+ *  Work-stealing thread pool (see oufs_pool.h).  The calling thread of
+ *  oufs_pool_run() is worker 0; the others are started for the run and
+ *  joined at its end.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "oufs_pool.h"
+
+// Initial capacity of each deque (grown as needed)
+#define OUFS_POOL_DEQUE_SIZE 64
+
+/**
+ * Take the newest task from a worker's own deque
+ *
+ * @param worker Worker
+ * @param task Filled in with the task
+ * @return 1 if a task was taken; 0 if the deque is empty
+ */
+static int oufs_pool_pop(OUFS_WORKER *worker, OUFS_TASK *task)
+{
+  int ret = 0;
+
+  pthread_mutex_lock(&worker->lock);
+  if(worker->bottom > worker->top) {
+    --worker->bottom;
+    *task = worker->task[worker->bottom % worker->capacity];
+    ret = 1;
+  }
+  pthread_mutex_unlock(&worker->lock);
+  return(ret);
+}
+
+/**
+ * Take the oldest task from another worker's deque
+ *
+ * @param victim Worker to steal from
+ * @param task Filled in with the task
+ * @return 1 if a task was taken; 0 if the deque is empty
+ */
+static int oufs_pool_steal(OUFS_WORKER *victim, OUFS_TASK *task)
+{
+  int ret = 0;
+
+  pthread_mutex_lock(&victim->lock);
+  if(victim->bottom > victim->top) {
+    *task = victim->task[victim->top % victim->capacity];
+    ++victim->top;
+    ret = 1;
+  }
+  pthread_mutex_unlock(&victim->lock);
+  return(ret);
+}
+
+/**
+ * Find a task for a worker: its own newest, else the oldest of the first
+ *  other worker (in turn from its right-hand neighbour) that has one
+ *
+ * @param worker Worker
+ * @param task Filled in with the task
+ * @return 1 if a task was found; 0 if every deque is empty
+ */
+static int oufs_pool_find(OUFS_WORKER *worker, OUFS_TASK *task)
+{
+  OUFS_POOL *pool = worker->pool;
+
+  if(oufs_pool_pop(worker, task))
+    return(1);
+  for(int i = 1; i < pool->n_workers; ++i) {
+    if(oufs_pool_steal(&pool->worker[(worker->index + i) % pool->n_workers], task))
+      return(1);
+  }
+  return(0);
+}
+
+/**
+ * Body of each worker: run tasks until every task of the run has finished
+ *
+ * @param arg The worker
+ * @return NULL
+ */
+static void *oufs_pool_work(void *arg)
+{
+  OUFS_WORKER *worker = arg;
+  OUFS_POOL *pool = worker->pool;
+  OUFS_TASK task;
+
+  while(1) {
+    int posted = __atomic_load_n(&pool->posted, __ATOMIC_SEQ_CST);
+    if(oufs_pool_find(worker, &task)) {
+      task.run(worker, task.arg);
+      if(__atomic_sub_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST) == 0) {
+        // The run is over: wake everyone up to leave
+        pthread_mutex_lock(&pool->lock);
+        pthread_cond_broadcast(&pool->wake);
+        pthread_mutex_unlock(&pool->lock);
+      }
+      continue;
+    }
+
+    // Nothing to do.  A spawner bumps posted before it looks for idle
+    //  workers, and we count ourselves idle before we look at posted: one
+    //  of us sees the other, so no task goes unnoticed
+    pthread_mutex_lock(&pool->lock);
+    __atomic_add_fetch(&pool->n_idle, 1, __ATOMIC_SEQ_CST);
+    while(__atomic_load_n(&pool->pending, __ATOMIC_SEQ_CST) > 0 &&
+          __atomic_load_n(&pool->posted, __ATOMIC_SEQ_CST) == posted)
+      pthread_cond_wait(&pool->wake, &pool->lock);
+    __atomic_sub_fetch(&pool->n_idle, 1, __ATOMIC_SEQ_CST);
+    int finished = (__atomic_load_n(&pool->pending, __ATOMIC_SEQ_CST) == 0);
+    pthread_mutex_unlock(&pool->lock);
+    if(finished)
+      return(NULL);
+  }
+}
+
+/**
+ * Queue a task on the calling worker (from within a running task)
+ *
+ * @param worker Worker that is running the calling task
+ * @param run Function of the new task
+ * @param arg Argument of the new task
+ * @return 0 if success
+ *         -1 if out of memory (the task is not queued)
+ */
+int oufs_pool_spawn(OUFS_WORKER *worker, OUFS_TASK_FUNCTION run, void *arg)
+{
+  OUFS_POOL *pool = worker->pool;
+
+  pthread_mutex_lock(&worker->lock);
+  if(worker->bottom - worker->top == worker->capacity) {
+    // Full: move the tasks into a deque twice the size
+    OUFS_TASK *task = malloc(2 * worker->capacity * sizeof(OUFS_TASK));
+    if(task == NULL) {
+      pthread_mutex_unlock(&worker->lock);
+      return(-1);
+    }
+    for(long i = worker->top; i < worker->bottom; ++i)
+      task[i - worker->top] = worker->task[i % worker->capacity];
+    free(worker->task);
+    worker->task = task;
+    worker->bottom -= worker->top;
+    worker->top = 0;
+    worker->capacity *= 2;
+  }
+  worker->task[worker->bottom % worker->capacity].run = run;
+  worker->task[worker->bottom % worker->capacity].arg = arg;
+  // (The spawning task is still pending, so the run cannot end before
+  //  the count includes this one)
+  __atomic_add_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST);
+  ++worker->bottom;
+  pthread_mutex_unlock(&worker->lock);
+
+  __atomic_add_fetch(&pool->posted, 1, __ATOMIC_SEQ_CST);
+  if(__atomic_load_n(&pool->n_idle, __ATOMIC_SEQ_CST) > 0) {
+    pthread_mutex_lock(&pool->lock);
+    pthread_cond_signal(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+  }
+  return(0);
+}
+
+/**
+ * Get the user pointer of the run that a worker belongs to
+ *
+ * @param worker Worker
+ * @return The user argument of oufs_pool_run()
+ */
+void *oufs_pool_user(OUFS_WORKER *worker)
+{
+  return(worker->pool->user);
+}
+
+/**
+ * Run a task, and every task that it (or they) spawn, on a pool of
+ *  threads.  Returns once all of them have finished.
+ *
+ * @param n_threads Number of threads, including the calling one (<= 0:
+ *          one per online processor)
+ * @param run Function of the first task
+ * @param arg Argument of the first task
+ * @param user Pointer that the tasks can get with oufs_pool_user()
+ * @return 0 if success
+ *         -1 if out of memory (nothing is run)
+ */
+int oufs_pool_run(int n_threads, OUFS_TASK_FUNCTION run, void *arg, void *user)
+{
+  if(n_threads <= 0)
+    n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if(n_threads <= 0)
+    n_threads = 1;
+
+  OUFS_POOL pool;
+  pool.n_workers = n_threads;
+  pool.worker = calloc(n_threads, sizeof(OUFS_WORKER));
+  if(pool.worker == NULL)
+    return(-1);
+  for(int i = 0; i < n_threads; ++i) {
+    pool.worker[i].task = malloc(OUFS_POOL_DEQUE_SIZE * sizeof(OUFS_TASK));
+    if(pool.worker[i].task == NULL) {
+      for(int j = 0; j < i; ++j)
+        free(pool.worker[j].task);
+      free(pool.worker);
+      return(-1);
+    }
+  }
+  pool.user = user;
+  pool.n_idle = 0;
+  pool.posted = 0;
+  pthread_mutex_init(&pool.lock, NULL);
+  pthread_cond_init(&pool.wake, NULL);
+  for(int i = 0; i < n_threads; ++i) {
+    OUFS_WORKER *worker = &pool.worker[i];
+    worker->pool = &pool;
+    worker->index = i;
+    pthread_mutex_init(&worker->lock, NULL);
+    worker->capacity = OUFS_POOL_DEQUE_SIZE;
+    worker->top = worker->bottom = 0;
+  }
+
+  // The first task starts out on the calling thread's deque
+  pool.worker[0].task[0].run = run;
+  pool.worker[0].task[0].arg = arg;
+  pool.worker[0].bottom = 1;
+  pool.pending = 1;
+
+  // Workers that fail to start simply keep an empty deque
+  int started[n_threads];
+  for(int i = 1; i < n_threads; ++i) {
+    started[i] = (pthread_create(&pool.worker[i].thread, NULL, oufs_pool_work, &pool.worker[i]) == 0);
+    if(!started[i])
+      fprintf(stderr, "oufs_pool_run(): unable to start worker %d\n", i);
+  }
+  oufs_pool_work(&pool.worker[0]);
+  for(int i = 1; i < n_threads; ++i) {
+    if(started[i])
+      pthread_join(pool.worker[i].thread, NULL);
+  }
+
+  for(int i = 0; i < n_threads; ++i) {
+    pthread_mutex_destroy(&pool.worker[i].lock);
+    free(pool.worker[i].task);
+  }
+  pthread_cond_destroy(&pool.wake);
+  pthread_mutex_destroy(&pool.lock);
+  free(pool.worker);
+  return(0);
+}
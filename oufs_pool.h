@@ -0,0 +1,64 @@
+#ifndef OUFS_POOL_H
+#define OUFS_POOL_H
+
+#include <pthread.h>
+
+// Work-stealing thread pool for operations that fan out over a tree.  A
+//  task may spawn more tasks; each worker keeps the tasks that it spawns
+//  in a deque of its own and runs them newest first (depth first, so few
+//  are pending at a time), while idle workers steal the oldest ones from
+//  the other deques (the biggest pieces of work left).  A run ends once
+//  every task has finished.
+
+typedef struct oufs_worker_s OUFS_WORKER;
+
+// A task is run on a worker, which it may use to spawn more tasks
+typedef void (*OUFS_TASK_FUNCTION)(OUFS_WORKER *worker, void *arg);
+
+typedef struct
+{
+  OUFS_TASK_FUNCTION run;
+  void *arg;
+} OUFS_TASK;
+
+typedef struct oufs_pool_s OUFS_POOL;
+
+struct oufs_worker_s
+{
+  OUFS_POOL *pool;
+  int index;
+  pthread_t thread;
+
+  // Deque: the worker pushes and pops at the bottom, thieves take from
+  //  the top.  task[top % capacity] ... task[(bottom - 1) % capacity]
+  pthread_mutex_t lock;
+  OUFS_TASK *task;
+  int capacity;
+  long top;
+  long bottom;
+};
+
+struct oufs_pool_s
+{
+  int n_workers;
+  OUFS_WORKER *worker;
+
+  // Passed through to the tasks (see oufs_pool_user())
+  void *user;
+
+  // Tasks spawned and not yet finished; the run ends when it drops to 0
+  int pending;
+
+  // Idle workers sleep on wake until a task is spawned (posted changes)
+  //  or the run ends
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  int n_idle;
+  int posted;
+};
+
+int oufs_pool_run(int n_threads, OUFS_TASK_FUNCTION run, void *arg, void *user);
+int oufs_pool_spawn(OUFS_WORKER *worker, OUFS_TASK_FUNCTION run, void *arg);
+void *oufs_pool_user(OUFS_WORKER *worker);
+
+#endif
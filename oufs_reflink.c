@@ -0,0 +1,38 @@
+/**
+Make a copy-on-write clone of a file in the OU File System.
+
+CS3113
+
+*/
+#include <stdio.h>
+#include <string.h>
+
+#include "oufs_lib.h"
+#include "virtual_disk.h"
+
+int main(int argc, char** argv) {
+  // Fetch the key environment vars
+  char cwd[MAX_PATH_LENGTH];
+  char disk_name[MAX_PATH_LENGTH];
+  char pipe_name_base[MAX_PATH_LENGTH];
+
+  oufs_get_environment(cwd, disk_name, pipe_name_base);
+
+  // Check arguments
+  if(argc == 3) {
+    // Open the virtual disk
+    OUFS_MOUNT *mnt = oufs_mount(disk_name, pipe_name_base);
+    if(mnt == NULL)
+      return(-1);
+
+    oufs_reflink(mnt, cwd, argv[1], argv[2]);
+    // Clean up
+    oufs_unmount(mnt);
+    
+  }else{
+    fprintf(stderr, "Usage: oufs_reflink <src> <dst>\n");
+    return(-1);
+  }
+
+  return(0);
+}
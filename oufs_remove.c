@@ -1,5 +1,6 @@
 /**
-Remove a file
+Remove a file.  With -r, a directory is removed together with everything
+in it (see oufs_remove_tree()).
 
 CS3113
 
@@ -9,6 +10,7 @@ CS3113
 #include <string.h>
 
 #include "oufs_lib.h"
+#include "oufs_tree.h"
 #include "virtual_disk.h"
 
 int main(int argc, char** argv) {
@@ -20,16 +22,22 @@ int main(int argc, char** argv) {
   oufs_get_environment(cwd, disk_name, pipe_name_base);
 
   // Check arguments
-  if(argc == 2) {
+  int recursive = (argc == 3 && strcmp(argv[1], "-r") == 0);
+  if(argc == 2 || recursive) {
     // Open the virtual disk
-    virtual_disk_attach(disk_name, pipe_name_base);
-
-    oufs_remove(cwd, argv[1]);
+    OUFS_MOUNT *mnt = oufs_mount(disk_name, pipe_name_base);
+    if(mnt == NULL)
+      return(-1);
+
+    if(recursive)
+      oufs_remove_tree(mnt, cwd, argv[2], 0);
+    else
+      oufs_remove(mnt, cwd, argv[1]);
     // Clean up
-    virtual_disk_detach();
+    oufs_unmount(mnt);
     
   }else{
-    fprintf(stderr, "Usage: oufs_remove <file name>\n");
+    fprintf(stderr, "Usage: oufs_remove [-r] <file name>\n");
   }
 
 }
@@ -21,11 +21,13 @@ int main(int argc, char** argv) {
   // Check arguments
   if(argc == 2) {
     // Open the virtual disk
-    virtual_disk_attach(disk_name, pipe_name_base);
+    OUFS_MOUNT *mnt = oufs_mount(disk_name, pipe_name_base);
+    if(mnt == NULL)
+      return(-1);
 
-    oufs_rmdir(cwd, argv[1]);
+    oufs_rmdir(mnt, cwd, argv[1]);
     // Clean up
-    virtual_disk_detach();
+    oufs_unmount(mnt);
     
   }else{
     fprintf(stderr, "Usage: oufs_rmdir <directory name>\n");
@@ -0,0 +1,239 @@
+/**
+Run a batch of commands in the OU File System, all in one session: the disk
+is mounted once, so its caches stay warm from one command to the next, and
+consecutive appends to a file share one open file (flushed once).
+
+Commands (one per line; blank lines and lines starting with # are skipped):
+  mkdir <dir>
+  rmdir <dir>
+  touch <file>
+  append <file> <text>     (appends the text and a newline)
+  cat <file>
+  cp <src> <dst>
+  ln <src> <dst>
+  rm <file>
+  ls [<name>]
+
+CS3113
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+
+#include "oufs_lib.h"
+#include "virtual_disk.h"
+
+#define MAX_LINE_LENGTH 1024
+
+// State of a session
+typedef struct
+{
+  OUFS_MOUNT *mnt;
+  char cwd[MAX_PATH_LENGTH];
+
+  // File opened for appending by the last command (if it was an append),
+  //  kept open in case the next command appends to it too
+  OUFILE *append_fp;
+  char append_path[MAX_PATH_LENGTH];
+} SHELL;
+
+/**
+ * Close the file kept open for appending, if any (flushing what has been
+ *  appended to it)
+ *
+ * @param sh Session
+ */
+static void shell_close_append(SHELL *sh)
+{
+  if(sh->append_fp != NULL) {
+    oufs_fclose(sh->append_fp);
+    sh->append_fp = NULL;
+  }
+}
+
+/**
+ * Append a line of text to a file
+ *
+ * @param sh Session
+ * @param path Name of the file
+ * @param text Text to append (a newline is added)
+ * @return 0 if success
+ *         -x if error
+ */
+static int shell_append(SHELL *sh, char *path, char *text)
+{
+  if(sh->append_fp == NULL || strcmp(sh->append_path, path) != 0) {
+    shell_close_append(sh);
+    sh->append_fp = oufs_fopen(sh->mnt, sh->cwd, path, "a");
+    if(sh->append_fp == NULL)
+      return(-1);
+    strncpy(sh->append_path, path, MAX_PATH_LENGTH - 1);
+    sh->append_path[MAX_PATH_LENGTH - 1] = 0;
+  }
+
+  FILE_OFFSET len = strlen(text);
+  if(oufs_fwrite(sh->append_fp, (unsigned char *) text, len) != len ||
+     oufs_fwrite(sh->append_fp, (unsigned char *) "\n", 1) != 1)
+    return(-2);
+  return(0);
+}
+
+/**
+ * Print the contents of a file to STDOUT
+ *
+ * @param sh Session
+ * @param path Name of the file
+ * @return 0 if success
+ *         -x if error
+ */
+static int shell_cat(SHELL *sh, char *path)
+{
+  OUFILE *fp = oufs_fopen(sh->mnt, sh->cwd, path, "r");
+  if(fp == NULL)
+    return(-1);
+
+  // The contents go straight to the descriptor: first write out whatever
+  //  earlier commands printed
+  fflush(stdout);
+  while(oufs_sendfile(fp, 1, INT_MAX) > 0)
+    ;
+  oufs_fclose(fp);
+  return(0);
+}
+
+/**
+ * Copy a file
+ *
+ * @param sh Session
+ * @param src Name of the source file
+ * @param dst Name of the destination file
+ * @return 0 if success
+ *         -x if error
+ */
+static int shell_copy(SHELL *sh, char *src, char *dst)
+{
+  OUFILE *fp_in = oufs_fopen(sh->mnt, sh->cwd, src, "r");
+  if(fp_in == NULL)
+    return(-1);
+  OUFILE *fp_out = oufs_fopen(sh->mnt, sh->cwd, dst, "w");
+  if(fp_out == NULL) {
+    oufs_fclose(fp_in);
+    return(-2);
+  }
+
+  // Copy block-to-block inside the image
+  while(oufs_copy_file_range(fp_in, fp_out, INT_MAX) > 0)
+    ;
+  oufs_fclose(fp_in);
+  oufs_fclose(fp_out);
+  return(0);
+}
+
+/**
+ * Run one command
+ *
+ * @param sh Session
+ * @param line Line of the script (changed by the call)
+ * @return 0 if success (or nothing to do)
+ *         1 if the command is not known or its arguments are wrong
+ *         -x if the command failed
+ */
+static int shell_run(SHELL *sh, char *line)
+{
+  char *save_pointer;
+  char *cmd = strtok_r(line, " \t\r\n", &save_pointer);
+  if(cmd == NULL || cmd[0] == '#')
+    return(0);
+
+  char *arg1 = strtok_r(NULL, " \t\r\n", &save_pointer);
+
+  if(strcmp(cmd, "append") == 0 && arg1 != NULL) {
+    // The text is the rest of the line
+    char *text = strtok_r(NULL, "\r\n", &save_pointer);
+    return(shell_append(sh, arg1, text == NULL ? "" : text));
+  }
+
+  // Anything else may use the file that is being appended to
+  shell_close_append(sh);
+
+  char *arg2 = (arg1 == NULL) ? NULL : strtok_r(NULL, " \t\r\n", &save_pointer);
+  if(arg2 != NULL && strtok_r(NULL, " \t\r\n", &save_pointer) != NULL)
+    return(1);
+
+  if(strcmp(cmd, "ls") == 0 && arg2 == NULL) {
+    return(oufs_list(sh->mnt, sh->cwd, arg1 == NULL ? "" : arg1));
+  }else if(arg1 == NULL) {
+    return(1);
+  }else if(strcmp(cmd, "mkdir") == 0 && arg2 == NULL) {
+    return(oufs_mkdir(sh->mnt, sh->cwd, arg1));
+  }else if(strcmp(cmd, "rmdir") == 0 && arg2 == NULL) {
+    return(oufs_rmdir(sh->mnt, sh->cwd, arg1));
+  }else if(strcmp(cmd, "touch") == 0 && arg2 == NULL) {
+    OUFILE *fp = oufs_fopen(sh->mnt, sh->cwd, arg1, "a");
+    if(fp == NULL)
+      return(-2);
+    oufs_fclose(fp);
+    return(0);
+  }else if(strcmp(cmd, "cat") == 0 && arg2 == NULL) {
+    return(shell_cat(sh, arg1));
+  }else if(strcmp(cmd, "rm") == 0 && arg2 == NULL) {
+    return(oufs_remove(sh->mnt, sh->cwd, arg1));
+  }else if(strcmp(cmd, "cp") == 0 && arg2 != NULL) {
+    return(shell_copy(sh, arg1, arg2));
+  }else if(strcmp(cmd, "ln") == 0 && arg2 != NULL) {
+    return(oufs_link(sh->mnt, sh->cwd, arg1, arg2));
+  }
+  return(1);
+}
+
+int main(int argc, char** argv) {
+  // Fetch the key environment vars
+  SHELL sh;
+  char disk_name[MAX_PATH_LENGTH];
+  char pipe_name_base[MAX_PATH_LENGTH];
+
+  oufs_get_environment(sh.cwd, disk_name, pipe_name_base);
+
+  // Check arguments
+  if(argc > 2) {
+    fprintf(stderr, "Usage: oufs_shell [<script>]\n");
+    return(-1);
+  }
+  FILE *script = stdin;
+  if(argc == 2 && (script = fopen(argv[1], "r")) == NULL) {
+    fprintf(stderr, "Unable to open %s\n", argv[1]);
+    return(-1);
+  }
+
+  // Open the virtual disk
+  sh.mnt = oufs_mount(disk_name, pipe_name_base);
+  if(sh.mnt == NULL)
+    return(-1);
+  sh.append_fp = NULL;
+
+  // Run the commands
+  char line[MAX_LINE_LENGTH];
+  int line_number = 0;
+  int n_errors = 0;
+  while(fgets(line, MAX_LINE_LENGTH, script) != NULL) {
+    ++line_number;
+    int ret = shell_run(&sh, line);
+    if(ret > 0) {
+      fprintf(stderr, "Line %d: unknown command or wrong arguments\n", line_number);
+      ++n_errors;
+    }else if(ret < 0) {
+      fprintf(stderr, "Line %d: error (%d)\n", line_number, ret);
+      ++n_errors;
+    }
+  }
+
+  // Clean up
+  shell_close_append(&sh);
+  oufs_unmount(sh.mnt);
+  if(script != stdin)
+    fclose(script);
+
+  return(n_errors == 0 ? 0 : -1);
+}
@@ -0,0 +1,479 @@
+/**
+Stress the OU File System with several threads at once, and report how the
+throughput scales with the number of threads:
+
+  oufs_stress [<max threads> [<rounds>]]
+
+The test is run with 1, 2, 4, ... threads, up to <max threads> (default: one
+per online processor, at most STRESS_MAX_THREADS).  Each thread works in a
+directory of its own.  In each round it creates STRESS_FILES files (contents
+that depend on the thread and the round), reads each one back and checks it,
+reads a file that all of the threads share and checks it too, and removes
+its files.  After each run, the numbers of free blocks and free inodes must
+be what they were before it.  Before the runs, a file of the largest size
+is checked, along with offsets and sizes past 4 GiB (which must be
+refused, not cut down to 32 bits), and a file is grown through an "r+" and
+an "a" handle in turn.
+
+Then the allocator alone is measured: each thread allocates
+STRESS_ALLOC_BLOCKS blocks and an inode and frees them again,
+STRESS_ALLOC_ROUNDS times per round; first with every thread allocating
+in the same shard (as if there were one lock for the whole disk), then
+with the threads spread over the shards.
+
+Exits with -1 if any check fails.
+
+CS3113
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "oufs_lib.h"
+#include "oufs_lib_support.h"
+#include "virtual_disk.h"
+
+// Limits that keep a run within the blocks and inodes of a fresh disk
+#define STRESS_MAX_THREADS 8
+#define STRESS_FILES 3
+#define STRESS_FILE_SIZE (2 * DATA_BLOCK_SIZE + 1)
+#define STRESS_SHARED_SIZE (3 * DATA_BLOCK_SIZE)
+#define STRESS_LARGE_SIZE ((FILE_OFFSET) MAX_BLOCKS_IN_FILE * DATA_BLOCK_SIZE)
+#define STRESS_ALLOC_BLOCKS 2
+#define STRESS_ALLOC_ROUNDS 20
+
+// Shards in which the threads of a run allocate
+#define STRESS_SHARD_AUTO 0     // as the library spreads them
+#define STRESS_SHARD_ONE 1      // all in shard 0
+#define STRESS_SHARD_SPREAD 2   // thread i in shard i % N_ALLOC_SHARDS
+
+// One run
+typedef struct
+{
+  OUFS_MOUNT *mnt;
+  int rounds;
+  void *(*work)(void *);
+  int shard_mode;
+  unsigned char shared[STRESS_SHARED_SIZE];
+  long n_ops;
+  int n_errors;
+} STRESS;
+
+// One thread of a run
+typedef struct
+{
+  STRESS *stress;
+  int index;
+  pthread_t thread;
+} STRESS_THREAD;
+
+/**
+ * Count a failed check (from any thread)
+ *
+ * @param stress Run
+ * @param what Description of the check
+ * @param path Path of the file or directory
+ */
+static void stress_error(STRESS *stress, char *what, char *path)
+{
+  fprintf(stderr, "oufs_stress: %s: %s\n", what, path);
+  __atomic_add_fetch(&stress->n_errors, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Read a whole file and compare it with what it should hold
+ *
+ * @param stress Run
+ * @param path Absolute path of the file
+ * @param expected Expected contents
+ * @param len Expected size
+ */
+static void stress_check(STRESS *stress, char *path, unsigned char *expected, FILE_OFFSET len)
+{
+  unsigned char buf[STRESS_LARGE_SIZE + 1];
+
+  OUFILE *fp = oufs_fopen(stress->mnt, "/", path, "r");
+  if(fp == NULL) {
+    stress_error(stress, "cannot open for reading", path);
+    return;
+  }
+  FILE_OFFSET n = oufs_fread(fp, buf, sizeof(buf));
+  oufs_fclose(fp);
+  if(n != len || memcmp(buf, expected, len) != 0)
+    stress_error(stress, "wrong contents", path);
+}
+
+/**
+ * Check a file of the largest size, and that offsets and sizes past 4 GiB
+ *  are refused rather than cut down to 32 bits (before any thread starts)
+ *
+ * @param stress Run
+ */
+static void stress_check_large(STRESS *stress)
+{
+  static unsigned char data[STRESS_LARGE_SIZE + DATA_BLOCK_SIZE];
+  unsigned char buf[DATA_BLOCK_SIZE];
+  FILE_OFFSET far = ((FILE_OFFSET) 1 << 32) + 1;
+
+  for(int j = 0; j < sizeof(data); ++j)
+    data[j] = j * 11 + (j >> 8);
+  OUFILE *fp = oufs_fopen(stress->mnt, "/", "/large", "w");
+  if(fp == NULL) {
+    stress_error(stress, "cannot create", "/large");
+    return;
+  }
+  if(oufs_fwrite(fp, data, sizeof(data)) != STRESS_LARGE_SIZE)
+    stress_error(stress, "wrong length written at the largest size", "/large");
+  oufs_fclose(fp);
+
+  fp = oufs_fopen(stress->mnt, "/", "/large", "r+");
+  if(fp == NULL) {
+    stress_error(stress, "cannot open for update", "/large");
+  }else{
+    if(oufs_ftruncate(fp, far) == 0)
+      stress_error(stress, "truncated beyond the largest size", "/large");
+    if(oufs_pwrite(fp, buf, 1, far) > 0)
+      stress_error(stress, "wrote beyond 4 GiB", "/large");
+    if(oufs_fseek(fp, far, SEEK_SET) == 0)
+      stress_error(stress, "seeked beyond 4 GiB", "/large");
+    if(oufs_pread(fp, buf, 1, far) != 0)
+      stress_error(stress, "read beyond 4 GiB", "/large");
+    if(oufs_fseek(fp, 0, SEEK_END) != 0 || oufs_ftell(fp) != STRESS_LARGE_SIZE)
+      stress_error(stress, "wrong size", "/large");
+    if(oufs_pread(fp, buf, sizeof(buf), STRESS_LARGE_SIZE - 10) != 10 ||
+       memcmp(buf, data + STRESS_LARGE_SIZE - 10, 10) != 0)
+      stress_error(stress, "wrong contents at the end", "/large");
+    oufs_fclose(fp);
+  }
+  stress_check(stress, "/large", data, STRESS_LARGE_SIZE);
+  if(oufs_remove(stress->mnt, "/", "/large") != 0)
+    stress_error(stress, "cannot remove", "/large");
+}
+
+/**
+ * Grow one file through two handles at once, an "r+" and an "a" handle,
+ *  so that each one appends after the other has moved the end of the file
+ *  (before any thread starts)
+ *
+ * @param stress Run
+ */
+static void stress_check_two_handles(STRESS *stress)
+{
+  static unsigned char data[8 * DATA_BLOCK_SIZE];
+  FILE_OFFSET size = DATA_BLOCK_SIZE + 10;
+
+  for(int j = 0; j < sizeof(data); ++j)
+    data[j] = j * 17 + 3;
+  OUFILE *fp = oufs_fopen(stress->mnt, "/", "/two", "w");
+  if(fp == NULL) {
+    stress_error(stress, "cannot create", "/two");
+    return;
+  }
+  if(oufs_fwrite(fp, data, size) != size)
+    stress_error(stress, "wrong length written", "/two");
+  oufs_fclose(fp);
+
+  OUFILE *update = oufs_fopen(stress->mnt, "/", "/two", "r+");
+  OUFILE *append = oufs_fopen(stress->mnt, "/", "/two", "a");
+  if(update == NULL || append == NULL) {
+    stress_error(stress, "cannot open twice", "/two");
+  }else{
+    // Append through "a", then past the new end through "r+"
+    if(oufs_fwrite(append, data + size, 300) != 300 || oufs_fflush(append) != 0)
+      stress_error(stress, "cannot append through the a handle", "/two");
+    size += 300;
+    if(oufs_pwrite(update, data + size, 200, size) != 200)
+      stress_error(stress, "cannot append through the r+ handle", "/two");
+    size += 200;
+    // Each handle again, after the other one has moved the tail
+    if(oufs_fwrite(append, data + size, 100) != 100 || oufs_fflush(append) != 0)
+      stress_error(stress, "cannot append through the a handle", "/two");
+    size += 100;
+    // Grow with zeros through "r+", then overwrite in the new blocks
+    memset(data + size, 0, 2 * DATA_BLOCK_SIZE);
+    memset(data + size + 7, 0x5a, 50);
+    if(oufs_ftruncate(update, size + 2 * DATA_BLOCK_SIZE) != 0)
+      stress_error(stress, "cannot grow through the r+ handle", "/two");
+    if(oufs_pwrite(update, data + size + 7, 50, size + 7) != 50)
+      stress_error(stress, "cannot overwrite through the r+ handle", "/two");
+    size += 2 * DATA_BLOCK_SIZE;
+    // Grow with zeros through "a", then append after that
+    memset(data + size, 0, DATA_BLOCK_SIZE);
+    if(oufs_ftruncate(append, size + DATA_BLOCK_SIZE) != 0)
+      stress_error(stress, "cannot grow through the a handle", "/two");
+    size += DATA_BLOCK_SIZE;
+    if(oufs_pwrite(update, data + size, 40, size) != 40)
+      stress_error(stress, "cannot append through the r+ handle", "/two");
+    size += 40;
+  }
+  if(update != NULL)
+    oufs_fclose(update);
+  if(append != NULL)
+    oufs_fclose(append);
+  stress_check(stress, "/two", data, size);
+  if(oufs_remove(stress->mnt, "/", "/two") != 0)
+    stress_error(stress, "cannot remove", "/two");
+}
+
+/**
+ * Body of each thread: the rounds of creates, reads and removes
+ *
+ * @param arg The STRESS_THREAD
+ * @return NULL
+ */
+static void *stress_work(void *arg)
+{
+  STRESS_THREAD *self = arg;
+  STRESS *stress = self->stress;
+  unsigned char data[STRESS_FILES][STRESS_FILE_SIZE];
+  int size[STRESS_FILES];
+  char dir[FILE_NAME_SIZE + 1];
+  char path[MAX_PATH_LENGTH];
+  long n_ops = 0;
+
+  sprintf(dir, "/stress%d", self->index);
+  if(oufs_mkdir(stress->mnt, "/", dir) != 0) {
+    stress_error(stress, "cannot create", dir);
+    return(NULL);
+  }
+  for(int round = 0; round < stress->rounds; ++round) {
+    for(int f = 0; f < STRESS_FILES; ++f) {
+      sprintf(path, "%s/f%d", dir, f);
+      size[f] = (self->index * 7 + round * 13 + f * 29) % STRESS_FILE_SIZE + 1;
+      for(int j = 0; j < size[f]; ++j)
+        data[f][j] = self->index * 31 + round * 7 + f * 3 + j;
+      OUFILE *fp = oufs_fopen(stress->mnt, "/", path, "w");
+      if(fp == NULL) {
+        stress_error(stress, "cannot create", path);
+        continue;
+      }
+      if(oufs_fwrite(fp, data[f], size[f]) != size[f])
+        stress_error(stress, "short write", path);
+      oufs_fclose(fp);
+      ++n_ops;
+    }
+    for(int f = 0; f < STRESS_FILES; ++f) {
+      sprintf(path, "%s/f%d", dir, f);
+      stress_check(stress, path, data[f], size[f]);
+      ++n_ops;
+    }
+    stress_check(stress, "/stress", stress->shared, STRESS_SHARED_SIZE);
+    ++n_ops;
+    for(int f = 0; f < STRESS_FILES; ++f) {
+      sprintf(path, "%s/f%d", dir, f);
+      if(oufs_remove(stress->mnt, "/", path) != 0)
+        stress_error(stress, "cannot remove", path);
+      ++n_ops;
+    }
+  }
+  if(oufs_rmdir(stress->mnt, "/", dir) != 0)
+    stress_error(stress, "cannot remove", dir);
+
+  __atomic_add_fetch(&stress->n_ops, n_ops, __ATOMIC_RELAXED);
+  return(NULL);
+}
+
+/**
+ * Body of each thread of the allocator benchmark: allocate blocks and an
+ *  inode, and free them again
+ *
+ * @param arg The STRESS_THREAD
+ * @return NULL
+ */
+static void *stress_alloc_work(void *arg)
+{
+  STRESS_THREAD *self = arg;
+  STRESS *stress = self->stress;
+  BLOCK_REFERENCE blocks[STRESS_ALLOC_BLOCKS];
+  long n_ops = 0;
+
+  for(int round = 0; round < stress->rounds * STRESS_ALLOC_ROUNDS; ++round) {
+    int n = oufs_allocate_blocks(stress->mnt, blocks, STRESS_ALLOC_BLOCKS);
+    INODE_REFERENCE inode = oufs_allocate_inode(stress->mnt);
+    if(n != STRESS_ALLOC_BLOCKS || inode == UNALLOCATED_INODE)
+      stress_error(stress, "cannot allocate", "");
+    if(oufs_deallocate_batch(stress->mnt, NULL, &inode, inode != UNALLOCATED_INODE, blocks, n) != 0)
+      stress_error(stress, "cannot free", "");
+    n_ops += 2;
+  }
+
+  __atomic_add_fetch(&stress->n_ops, n_ops, __ATOMIC_RELAXED);
+  return(NULL);
+}
+
+/**
+ * Start point of each thread: choose its shard, then do the work of the run
+ *
+ * @param arg The STRESS_THREAD
+ * @return NULL
+ */
+static void *stress_start(void *arg)
+{
+  STRESS_THREAD *self = arg;
+
+  switch(self->stress->shard_mode) {
+  case STRESS_SHARD_ONE:
+    oufs_set_alloc_shard(0);
+    break;
+  case STRESS_SHARD_SPREAD:
+    oufs_set_alloc_shard(self->index % N_ALLOC_SHARDS);
+    break;
+  }
+  return(self->stress->work(arg));
+}
+
+/**
+ * Run the test with some number of threads and report the throughput
+ *
+ * @param stress Run (mnt, rounds, work, shard_mode and shared filled in)
+ * @param n_threads Number of threads
+ * @return 0 if every check passed
+ *         -1 if not
+ */
+static int stress_run(STRESS *stress, int n_threads)
+{
+  STRESS_THREAD threads[STRESS_MAX_THREADS];
+  struct timespec start, end;
+  int blocks_before, inodes_before, blocks_after, inodes_after;
+
+  if(oufs_count_free(stress->mnt, &blocks_before, &inodes_before) != 0) {
+    fprintf(stderr, "oufs_stress: cannot count the free blocks\n");
+    return(-1);
+  }
+  stress->n_ops = 0;
+  stress->n_errors = 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  int n_started = 0;
+  for(int i = 0; i < n_threads; ++i) {
+    threads[i].stress = stress;
+    threads[i].index = i;
+    if(pthread_create(&threads[i].thread, NULL, stress_start, &threads[i]) != 0)
+      break;
+    ++n_started;
+  }
+  for(int i = 0; i < n_started; ++i)
+    pthread_join(threads[i].thread, NULL);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  if(n_started != n_threads)
+    stress_error(stress, "cannot start thread", "");
+  if(oufs_count_free(stress->mnt, &blocks_after, &inodes_after) != 0) {
+    stress_error(stress, "cannot count the free blocks", "");
+  }else if(blocks_after != blocks_before || inodes_after != inodes_before) {
+    fprintf(stderr, "oufs_stress: free blocks %d -> %d, free inodes %d -> %d\n",
+            blocks_before, blocks_after, inodes_before, inodes_after);
+    ++stress->n_errors;
+  }
+
+  double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  printf("%2d threads: %8ld ops %8.3f s %10.0f ops/s %s\n", n_threads, stress->n_ops,
+         seconds, seconds > 0 ? stress->n_ops / seconds : 0.0,
+         stress->n_errors == 0 ? "ok" : "FAILED");
+  return(stress->n_errors == 0 ? 0 : -1);
+}
+
+/**
+ * Run the test with 1, 2, 4, ... threads, up to max_threads
+ *
+ * @param stress Run (mnt, rounds and shared filled in)
+ * @param title Printed first
+ * @param work Body of each thread
+ * @param shard_mode STRESS_SHARD_*
+ * @param max_threads Largest number of threads
+ * @return 0 if every check passed
+ *         -1 if not
+ */
+static int stress_series(STRESS *stress, char *title, void *(*work)(void *), int shard_mode,
+                         int max_threads)
+{
+  int ret = 0;
+
+  printf("%s:\n", title);
+  stress->work = work;
+  stress->shard_mode = shard_mode;
+  for(int n_threads = 1; ; n_threads *= 2) {
+    if(n_threads > max_threads)
+      n_threads = max_threads;
+    if(stress_run(stress, n_threads) != 0)
+      ret = -1;
+    if(n_threads == max_threads)
+      break;
+  }
+  return(ret);
+}
+
+int main(int argc, char** argv) {
+  // Fetch the key environment vars
+  char cwd[MAX_PATH_LENGTH];
+  char disk_name[MAX_PATH_LENGTH];
+  char pipe_name_base[MAX_PATH_LENGTH];
+
+  oufs_get_environment(cwd, disk_name, pipe_name_base);
+
+  // Check arguments
+  int max_threads = (argc > 1) ? atoi(argv[1]) : sysconf(_SC_NPROCESSORS_ONLN);
+  int rounds = (argc > 2) ? atoi(argv[2]) : 100;
+  if(argc > 3 || max_threads <= 0 || rounds <= 0) {
+    fprintf(stderr, "Usage: oufs_stress [<max threads> [<rounds>]]\n");
+    return(-1);
+  }
+  if(max_threads > STRESS_MAX_THREADS)
+    max_threads = STRESS_MAX_THREADS;
+
+  // Open the virtual disk
+  OUFS_MOUNT *mnt = oufs_mount(disk_name, pipe_name_base);
+  if(mnt == NULL)
+    return(-1);
+  mnt->debug = 0;
+
+  static STRESS stress;
+  stress.mnt = mnt;
+  stress.rounds = rounds;
+  for(int j = 0; j < STRESS_SHARED_SIZE; ++j)
+    stress.shared[j] = j * 13 + 5;
+
+  // The file that every thread reads
+  int ret = -1;
+  OUFILE *fp = oufs_fopen(mnt, "/", "/stress", "w");
+  if(fp == NULL) {
+    fprintf(stderr, "oufs_stress: cannot create /stress\n");
+  }else{
+    int n = oufs_fwrite(fp, stress.shared, STRESS_SHARED_SIZE);
+    oufs_fclose(fp);
+    if(n == STRESS_SHARED_SIZE) {
+      ret = 0;
+      stress.n_errors = 0;
+      stress_check_large(&stress);
+      if(stress.n_errors != 0) {
+        printf("large file: FAILED\n");
+        ret = -1;
+      }
+      stress.n_errors = 0;
+      stress_check_two_handles(&stress);
+      if(stress.n_errors != 0) {
+        printf("two handles: FAILED\n");
+        ret = -1;
+      }
+      if(stress_series(&stress, "files", stress_work, STRESS_SHARD_AUTO, max_threads) != 0)
+        ret = -1;
+      if(stress_series(&stress, "allocator, one shard", stress_alloc_work, STRESS_SHARD_ONE,
+                       max_threads) != 0)
+        ret = -1;
+      if(stress_series(&stress, "allocator, spread over the shards", stress_alloc_work,
+                       STRESS_SHARD_SPREAD, max_threads) != 0)
+        ret = -1;
+    }
+    oufs_remove(mnt, "/", "/stress");
+  }
+
+  // Clean up
+  oufs_unmount(mnt);
+
+  return(ret);
+}
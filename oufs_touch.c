@@ -22,11 +22,14 @@ int main(int argc, char** argv) {
     fprintf(stderr, "Usage: oufs_touch <file name>\n");
   }else{
     // Open the virtual disk
-    virtual_disk_attach(disk_name, pipe_name_base);
-      // TODO: remove below print statement
-      fprintf(stderr, "INSIDE touch: before oufs_fopen \n");
+    OUFS_MOUNT *mnt = oufs_mount(disk_name, pipe_name_base);
+    if(mnt == NULL)
+      return(-1);
+
+    // TODO: remove below print statement
+    fprintf(stderr, "INSIDE touch: before oufs_fopen \n");
     // Open the file
-    OUFILE *fp = oufs_fopen(cwd, argv[1], "a");
+    OUFILE *fp = oufs_fopen(mnt, cwd, argv[1], "a");
 
     if(fp != NULL) {
       oufs_fclose(fp);
@@ -34,7 +37,7 @@ int main(int argc, char** argv) {
       fprintf(stderr, "Error opening file.\n");
     }
     // Clean up
-    virtual_disk_detach();
+    oufs_unmount(mnt);
   }
   return(0);
 }
@@ -0,0 +1,493 @@
+/**
+ *  oufs_tree.c
+ *
+ *  Recursive remove and copy.  Each directory is handled by a task of a
+ *  work-stealing pool (oufs_pool.h), which spawns a task for each of its
+ *  subdirectories.  A task frees, or allocates, everything that the
+ *  entries of its directory need in one batch.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "virtual_disk.h"
+#include "oufs_lib_support.h"
+#include "oufs_pool.h"
+#include "oufs_tree.h"
+
+// State shared by the tasks of one operation
+typedef struct
+{
+  OUFS_MOUNT *mount;
+  int n_errors;
+} OUFS_TREE_OP;
+
+// A directory to handle (and, for a copy, the new directory to fill in)
+typedef struct
+{
+  INODE_REFERENCE src;
+  INODE_REFERENCE dst;
+} OUFS_TREE_TASK;
+
+/**
+ * Count an error of an operation (from any task)
+ *
+ * @param op Operation
+ */
+static void oufs_tree_error(OUFS_TREE_OP *op)
+{
+  __atomic_add_fetch(&op->n_errors, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Queue a task for a directory.  If the task cannot be queued, it is run
+ *  at once by the calling task instead.
+ *
+ * @param worker Worker running the calling task
+ * @param run Task function
+ * @param src Directory to handle
+ * @param dst Directory to fill in (UNALLOCATED_INODE if none)
+ */
+static void oufs_tree_spawn(OUFS_WORKER *worker, OUFS_TASK_FUNCTION run,
+                            INODE_REFERENCE src, INODE_REFERENCE dst)
+{
+  OUFS_TREE_TASK *task = malloc(sizeof(OUFS_TREE_TASK));
+  if(task == NULL) {
+    oufs_tree_error(oufs_pool_user(worker));
+    return;
+  }
+  task->src = src;
+  task->dst = dst;
+  if(oufs_pool_spawn(worker, run, task) != 0)
+    run(worker, task);
+}
+
+/**
+ * Is a directory entry . or ..?
+ *
+ * @param entry Directory entry
+ * @return 1 if it is; 0 otherwise
+ */
+static int oufs_tree_is_dot(DIRECTORY_ENTRY *entry)
+{
+  return(strcmp(entry->name, ".") == 0 || strcmp(entry->name, "..") == 0);
+}
+
+/**
+ * Task: remove a directory that is no longer linked into the tree, along
+ *  with everything in it.  Subdirectories become tasks of their own; the
+ *  files that lose their last name and the directory itself are freed with
+ *  a single read-modify-write of each allocation shard that they use.
+ *
+ * @param worker Worker running the task
+ * @param arg OUFS_TREE_TASK (src: the directory); freed here
+ */
+static void oufs_tree_remove_task(OUFS_WORKER *worker, void *arg)
+{
+  OUFS_TREE_OP *op = oufs_pool_user(worker);
+  OUFS_MOUNT *mnt = op->mount;
+  INODE_REFERENCE dir = ((OUFS_TREE_TASK *) arg)->src;
+  free(arg);
+
+  INODE freed[N_DIRECTORY_ENTRIES_PER_BLOCK + 1];
+  INODE_REFERENCE freed_refs[N_DIRECTORY_ENTRIES_PER_BLOCK + 1];
+  int n_freed = 0;
+  INODE inode;
+  INODE dir_inode;
+  BLOCK block;
+
+  pthread_rwlock_wrlock(&mnt->inode_lock[dir]);
+  if(oufs_read_inode_by_reference(mnt, dir, &dir_inode) != 0 || dir_inode.type != DIRECTORY_TYPE ||
+     virtual_disk_read_block(mnt->disk, dir_inode.content, &block) != 0) {
+    pthread_rwlock_unlock(&mnt->inode_lock[dir]);
+    oufs_tree_error(op);
+    return;
+  }
+
+  // Nothing can be created in it from now on (anyone who still holds its
+  //  reference finds that it is no longer a directory)
+  oufs_set_inode(&inode, UNUSED_TYPE, 0, UNALLOCATED_BLOCK, 0);
+  oufs_write_inode_by_reference(mnt, dir, &inode);
+
+  for(int i = 0; i < dir_inode.size && i < N_DIRECTORY_ENTRIES_PER_BLOCK; ++i) {
+    DIRECTORY_ENTRY *entry = &block.content.directory.entry[i];
+    INODE_REFERENCE child = entry->inode_reference;
+    if(child == UNALLOCATED_INODE || oufs_tree_is_dot(entry))
+      continue;
+    if(entry->type == DIRECTORY_TYPE) {
+      oufs_tree_spawn(worker, oufs_tree_remove_task, child, UNALLOCATED_INODE);
+      continue;
+    }
+
+    // A file loses this name; other names (hard links) may keep it
+    pthread_rwlock_wrlock(&mnt->inode_lock[child]);
+    if(oufs_read_inode_by_reference(mnt, child, &inode) != 0 || inode.type != FILE_TYPE) {
+      oufs_tree_error(op);
+    }else if(--inode.n_references > 0) {
+      oufs_write_inode_by_reference(mnt, child, &inode);
+    }else{
+      freed[n_freed] = inode;
+      freed_refs[n_freed++] = child;
+      oufs_set_inode(&inode, UNUSED_TYPE, 0, UNALLOCATED_BLOCK, 0);
+      oufs_write_inode_by_reference(mnt, child, &inode);
+    }
+    pthread_rwlock_unlock(&mnt->inode_lock[child]);
+  }
+  pthread_rwlock_unlock(&mnt->inode_lock[dir]);
+
+  freed[n_freed] = dir_inode;
+  freed_refs[n_freed++] = dir;
+  if(oufs_deallocate_batch(mnt, freed, freed_refs, n_freed, NULL, 0) != 0)
+    oufs_tree_error(op);
+}
+
+/**
+ * Copy the first n blocks of a chain into new blocks, which are linked in
+ *  array order
+ *
+ * @param mnt Mount of the virtual disk
+ * @param first First block of the chain
+ * @param refs Array of n new blocks
+ * @param n Number of blocks to copy
+ * @return 0 if success
+ *         -x if error
+ */
+static int oufs_tree_copy_blocks(OUFS_MOUNT *mnt, BLOCK_REFERENCE first, BLOCK_REFERENCE *refs, int n)
+{
+  BLOCK blocks[WRITE_BUFFER_BLOCKS];
+  BLOCK_REFERENCE b = first;
+
+  for(int i = 0; i < n; i += WRITE_BUFFER_BLOCKS) {
+    int batch = MIN(n - i, WRITE_BUFFER_BLOCKS);
+    for(int j = 0; j < batch; ++j) {
+      if(b == UNALLOCATED_BLOCK || virtual_disk_read_block(mnt->disk, b, &blocks[j]) != 0)
+        return(-1);
+      b = blocks[j].next_block;
+      blocks[j].next_block = (i + j + 1 < n) ? refs[i + j + 1] : UNALLOCATED_BLOCK;
+    }
+    if(virtual_disk_write_blocks(mnt->disk, &refs[i], batch, blocks) != 0)
+      return(-2);
+  }
+  return(0);
+}
+
+/**
+ * Number of data blocks that a file or directory uses
+ *
+ * @param inode Loaded inode
+ * @return The number of blocks
+ */
+static int oufs_tree_n_blocks(INODE *inode)
+{
+  if(inode->type == DIRECTORY_TYPE)
+    return(1);
+  return((inode->size + DATA_BLOCK_SIZE - 1) / DATA_BLOCK_SIZE);
+}
+
+/**
+ * Task: copy the entries of a directory into a new, empty directory.  The
+ *  blocks and inodes of all of the copies are allocated in one batch, and
+ *  the copies are entered into the new directory with one write of its
+ *  block.  Subdirectories are created empty here and filled in by tasks of
+ *  their own.
+ *
+ * @param worker Worker running the task
+ * @param arg OUFS_TREE_TASK (src: the directory; dst: the new one); freed here
+ */
+static void oufs_tree_copy_task(OUFS_WORKER *worker, void *arg)
+{
+  OUFS_TREE_OP *op = oufs_pool_user(worker);
+  OUFS_MOUNT *mnt = op->mount;
+  INODE_REFERENCE src = ((OUFS_TREE_TASK *) arg)->src;
+  INODE_REFERENCE dst = ((OUFS_TREE_TASK *) arg)->dst;
+  free(arg);
+
+  // Entries to copy: the entry, its inode and the inode of its copy
+  int entry_index[N_DIRECTORY_ENTRIES_PER_BLOCK];
+  INODE_REFERENCE refs[N_DIRECTORY_ENTRIES_PER_BLOCK];
+  INODE inodes[N_DIRECTORY_ENTRIES_PER_BLOCK];
+  INODE_REFERENCE new_refs[N_DIRECTORY_ENTRIES_PER_BLOCK];
+  INODE new_inodes[N_DIRECTORY_ENTRIES_PER_BLOCK];
+  // The files, each once, in increasing inode order (the order to lock them in)
+  INODE_REFERENCE files[N_DIRECTORY_ENTRIES_PER_BLOCK];
+  int n = 0;
+  int n_files = 0;
+  INODE inode;
+  BLOCK src_block;
+  BLOCK block;
+
+  pthread_rwlock_rdlock(&mnt->inode_lock[src]);
+  if(oufs_read_inode_by_reference(mnt, src, &inode) != 0 || inode.type != DIRECTORY_TYPE ||
+     virtual_disk_read_block(mnt->disk, inode.content, &src_block) != 0) {
+    pthread_rwlock_unlock(&mnt->inode_lock[src]);
+    oufs_tree_error(op);
+    return;
+  }
+  for(int i = 0; i < inode.size && i < N_DIRECTORY_ENTRIES_PER_BLOCK; ++i) {
+    DIRECTORY_ENTRY *entry = &src_block.content.directory.entry[i];
+    if(entry->inode_reference == UNALLOCATED_INODE || oufs_tree_is_dot(entry))
+      continue;
+    entry_index[n] = i;
+    refs[n++] = entry->inode_reference;
+    if(entry->type == DIRECTORY_TYPE)
+      continue;
+    int j = n_files;
+    while(j > 0 && files[j - 1] > entry->inode_reference)
+      --j;
+    if(j > 0 && files[j - 1] == entry->inode_reference)
+      continue;
+    memmove(&files[j + 1], &files[j], (n_files - j) * sizeof(INODE_REFERENCE));
+    files[j] = entry->inode_reference;
+    ++n_files;
+  }
+
+  // The files stay as they are until they have been copied
+  for(int i = 0; i < n_files; ++i)
+    pthread_rwlock_rdlock(&mnt->inode_lock[files[i]]);
+  pthread_rwlock_unlock(&mnt->inode_lock[src]);
+
+  // Allocate for every copy at once
+  int n_blocks = 0;
+  int ret = oufs_read_inodes_by_reference(mnt, refs, inodes, n);
+  for(int k = 0; ret == 0 && k < n; ++k) {
+    if(inodes[k].type != DIRECTORY_TYPE && inodes[k].type != FILE_TYPE)
+      ret = -1;
+    n_blocks += oufs_tree_n_blocks(&inodes[k]);
+  }
+  BLOCK_REFERENCE *blocks = malloc((n_blocks + 1) * sizeof(BLOCK_REFERENCE));
+  int got_blocks = 0;
+  int got_inodes = 0;
+  if(ret == 0 && blocks != NULL) {
+    got_blocks = oufs_allocate_blocks(mnt, blocks, n_blocks);
+    while(got_inodes < n && (new_refs[got_inodes] = oufs_allocate_inode(mnt)) != UNALLOCATED_INODE)
+      ++got_inodes;
+  }
+  if(ret != 0 || blocks == NULL || got_blocks < n_blocks || got_inodes < n) {
+    if(ret == 0)
+      fprintf(stderr, "oufs_copy_tree(): no space\n");
+    for(int i = n_files - 1; i >= 0; --i)
+      pthread_rwlock_unlock(&mnt->inode_lock[files[i]]);
+    if(blocks != NULL)
+      oufs_deallocate_batch(mnt, NULL, new_refs, got_inodes, blocks, got_blocks);
+    free(blocks);
+    oufs_tree_error(op);
+    return;
+  }
+
+  // Make the copies
+  int next = 0;
+  for(int k = 0; k < n; ++k) {
+    int nb = oufs_tree_n_blocks(&inodes[k]);
+    if(inodes[k].type == DIRECTORY_TYPE) {
+      oufs_init_directory_structures(&new_inodes[k], &block, blocks[next], new_refs[k], dst);
+      if(virtual_disk_write_block(mnt->disk, blocks[next], &block) != 0)
+        oufs_tree_error(op);
+    }else if(nb > 0 && oufs_tree_copy_blocks(mnt, inodes[k].content, &blocks[next], nb) != 0) {
+      // Keep the name, without the contents
+      oufs_tree_error(op);
+      oufs_deallocate_batch(mnt, NULL, NULL, 0, &blocks[next], nb);
+      oufs_set_inode(&new_inodes[k], FILE_TYPE, 1, UNALLOCATED_BLOCK, 0);
+    }else{
+      oufs_set_inode(&new_inodes[k], FILE_TYPE, 1, nb > 0 ? blocks[next] : UNALLOCATED_BLOCK, 0);
+      new_inodes[k].tail = nb > 0 ? blocks[next + nb - 1] : UNALLOCATED_BLOCK;
+      new_inodes[k].size = inodes[k].size;
+    }
+    next += nb;
+    oufs_write_inode_by_reference(mnt, new_refs[k], &new_inodes[k]);
+  }
+  for(int i = n_files - 1; i >= 0; --i)
+    pthread_rwlock_unlock(&mnt->inode_lock[files[i]]);
+  free(blocks);
+
+  // Enter them all into the new directory
+  int inserted = 0;
+  pthread_rwlock_wrlock(&mnt->inode_lock[dst]);
+  if(oufs_read_inode_by_reference(mnt, dst, &inode) == 0 && inode.type == DIRECTORY_TYPE &&
+     virtual_disk_read_block(mnt->disk, inode.content, &block) == 0) {
+    for(; inserted < n; ++inserted) {
+      DIRECTORY_ENTRY *entry = &src_block.content.directory.entry[entry_index[inserted]];
+      if(oufs_directory_insert(&block, inode.size, entry->name, new_refs[inserted], new_inodes[inserted].type) < 0)
+        break;
+      ++inode.size;
+    }
+    virtual_disk_write_block(mnt->disk, inode.content, &block);
+    oufs_write_inode_by_reference(mnt, dst, &inode);
+  }
+  pthread_rwlock_unlock(&mnt->inode_lock[dst]);
+  if(inserted < n) {
+    // (dst has been removed in the meantime)
+    oufs_tree_error(op);
+    oufs_deallocate_batch(mnt, &new_inodes[inserted], &new_refs[inserted], n - inserted, NULL, 0);
+  }
+
+  for(int k = 0; k < inserted; ++k) {
+    if(new_inodes[k].type == DIRECTORY_TYPE)
+      oufs_tree_spawn(worker, oufs_tree_copy_task, refs[k], new_refs[k]);
+  }
+}
+
+/**
+ * Remove a file, or a directory together with everything in it
+ *
+ * The directory is unlinked from its parent first, so that the whole
+ *  subtree disappears from view at once; its contents are then freed by
+ *  a pool of threads, one task per directory.
+ *
+ * @param mnt Mount of the virtual disk
+ * @param cwd Absolute path for the current working directory
+ * @param path Absolute or relative path of the file or directory
+ * @param n_threads Number of threads (<= 0: one per online processor)
+ * @return 0 if success
+ *         -x if error
+ */
+int oufs_remove_tree(OUFS_MOUNT *mnt, char *cwd, char *path, int n_threads)
+{
+  INODE_REFERENCE parent;
+  INODE_REFERENCE child;
+  char local_name[MAX_PATH_LENGTH];
+  INODE inode;
+  BLOCK block;
+
+  int ret = oufs_find_file(mnt, cwd, path, &parent, &child, local_name);
+  if(ret < -1)
+    return(-4);
+  if(ret == -1 || child == UNALLOCATED_INODE) {
+    fprintf(stderr, "File not found\n");
+    return(-1);
+  }
+  if(oufs_read_inode_by_reference(mnt, child, &inode) != 0)
+    return(-4);
+  if(inode.type == FILE_TYPE)
+    return(oufs_remove(mnt, cwd, path));
+
+  // Not /, . or ..
+  if(inode.type != DIRECTORY_TYPE || child == ROOT_DIRECTORY_INODE || child == parent ||
+     strcmp(local_name, ".") == 0 || strcmp(local_name, "..") == 0)
+    return(-2);
+
+  if(oufs_lock_entry(mnt, parent, local_name, child) != 0)
+    return(-1);
+  if(oufs_read_inode_by_reference(mnt, parent, &inode) != 0 ||
+     virtual_disk_read_block(mnt->disk, inode.content, &block) != 0 ||
+     oufs_directory_delete(&block, inode.size, local_name) != child) {
+    pthread_rwlock_unlock(&mnt->inode_lock[child]);
+    pthread_rwlock_unlock(&mnt->inode_lock[parent]);
+    return(-4);
+  }
+  --inode.size;
+  virtual_disk_write_block(mnt->disk, inode.content, &block);
+  oufs_write_inode_by_reference(mnt, parent, &inode);
+  pthread_rwlock_unlock(&mnt->inode_lock[child]);
+  pthread_rwlock_unlock(&mnt->inode_lock[parent]);
+
+  OUFS_TREE_OP op;
+  op.mount = mnt;
+  op.n_errors = 0;
+  OUFS_TREE_TASK *task = malloc(sizeof(OUFS_TREE_TASK));
+  if(task == NULL)
+    return(-5);
+  task->src = child;
+  task->dst = UNALLOCATED_INODE;
+  if(oufs_pool_run(n_threads, oufs_tree_remove_task, task, &op) != 0) {
+    free(task);
+    return(-5);
+  }
+  return(op.n_errors == 0 ? 0 : -5);
+}
+
+/**
+ * Copy a file, or a directory together with everything in it.  The
+ *  destination must not exist yet; a directory may not be copied into
+ *  itself.  Files with several names become separate copies.
+ *
+ * @param mnt Mount of the virtual disk
+ * @param cwd Absolute path for the current working directory
+ * @param path_src Absolute or relative path of the file or directory to copy
+ * @param path_dst Absolute or relative path of the copy
+ * @param n_threads Number of threads (<= 0: one per online processor)
+ * @return 0 if success
+ *         -x if error
+ */
+int oufs_copy_tree(OUFS_MOUNT *mnt, char *cwd, char *path_src, char *path_dst, int n_threads)
+{
+  INODE_REFERENCE parent;
+  INODE_REFERENCE src;
+  INODE_REFERENCE dst;
+  char local_name[MAX_PATH_LENGTH];
+  INODE inode;
+
+  int ret = oufs_find_file(mnt, cwd, path_src, &parent, &src, local_name);
+  if(ret < -1)
+    return(-4);
+  if(ret == -1 || src == UNALLOCATED_INODE) {
+    fprintf(stderr, "File not found\n");
+    return(-1);
+  }
+  if(oufs_read_inode_by_reference(mnt, src, &inode) != 0)
+    return(-4);
+
+  if(inode.type == FILE_TYPE) {
+    // Block-to-block inside the image
+    OUFILE *fp_in = oufs_fopen(mnt, cwd, path_src, "r");
+    if(fp_in == NULL)
+      return(-2);
+    OUFILE *fp_out = oufs_fopen(mnt, cwd, path_dst, "w");
+    if(fp_out == NULL) {
+      oufs_fclose(fp_in);
+      return(-2);
+    }
+    FILE_OFFSET n;
+    while((n = oufs_copy_file_range(fp_in, fp_out, INT_MAX)) > 0)
+      ;
+    // 0 also means that the copy is full: a partial copy is an error, as
+    //  is a failure to write the rest out
+    int complete = (n == 0 && oufs_ftell(fp_in) == inode.size);
+    oufs_fclose(fp_in);
+    if(oufs_fclose(fp_out) != 0 || !complete) {
+      fprintf(stderr, "oufs_copy_tree(): cannot copy %s\n", path_src);
+      return(-5);
+    }
+    return(0);
+  }
+  if(inode.type != DIRECTORY_TYPE)
+    return(-2);
+
+  ret = oufs_find_file(mnt, cwd, path_dst, &parent, &dst, local_name);
+  if(ret < -1 || parent == UNALLOCATED_INODE)
+    return(-4);
+  if(dst != UNALLOCATED_INODE) {
+    fprintf(stderr, "oufs_copy_tree(): %s already exists\n", path_dst);
+    return(-3);
+  }
+
+  // The copy must not end up inside the directory being copied
+  INODE_REFERENCE cur = parent;
+  while(cur != src && cur != ROOT_DIRECTORY_INODE) {
+    if(oufs_read_inode_by_reference(mnt, cur, &inode) != 0)
+      return(-4);
+    cur = oufs_find_directory_element(mnt, &inode, "..");
+    if(cur == UNALLOCATED_INODE)
+      return(-4);
+  }
+  if(cur == src) {
+    fprintf(stderr, "oufs_copy_tree(): cannot copy a directory into itself\n");
+    return(-2);
+  }
+
+  if(oufs_mkdir(mnt, cwd, path_dst) != 0 ||
+     oufs_find_file(mnt, cwd, path_dst, &parent, &dst, local_name) != 0)
+    return(-4);
+
+  OUFS_TREE_OP op;
+  op.mount = mnt;
+  op.n_errors = 0;
+  OUFS_TREE_TASK *task = malloc(sizeof(OUFS_TREE_TASK));
+  if(task == NULL)
+    return(-5);
+  task->src = src;
+  task->dst = dst;
+  if(oufs_pool_run(n_threads, oufs_tree_copy_task, task, &op) != 0) {
+    free(task);
+    return(-5);
+  }
+  return(op.n_errors == 0 ? 0 : -5);
+}
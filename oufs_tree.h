@@ -0,0 +1,12 @@
+#ifndef OUFS_TREE_H
+#define OUFS_TREE_H
+
+#include "oufs_lib.h"
+
+// Recursive operations on whole subtrees.  Each directory is a task of a
+//  work-stealing pool (see oufs_pool.h); n_threads <= 0 uses one thread
+//  per online processor
+int oufs_remove_tree(OUFS_MOUNT *mnt, char *cwd, char *path, int n_threads);
+int oufs_copy_tree(OUFS_MOUNT *mnt, char *cwd, char *path_src, char *path_dst, int n_threads);
+
+#endif
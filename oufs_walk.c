@@ -0,0 +1,321 @@
+/**
+ *  oufs_walk.c
+ *
+ *  Breadth-first walk of a tree on several threads.  The threads share out
+ *  the directories of one level, collect the subdirectories that they find
+ *  for the next level, and meet at a barrier in between; the blocks of the
+ *  next level's directories are then prefetched all at once.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "virtual_disk.h"
+#include "oufs_lib_support.h"
+#include "oufs_walk.h"
+
+/**
+ * Count an error of a walk (from any thread)
+ *
+ * @param walk Walk
+ */
+static void oufs_walk_error(OUFS_WALK *walk)
+{
+  __atomic_add_fetch(&walk->n_errors, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Get inodes from the walk's copies of the inode blocks.  The blocks that
+ *  it does not have yet are prefetched together and then read.
+ *
+ * @param walk Walk
+ * @param refs Array of n inode references
+ * @param inodes Array of n inodes, filled in so that inodes[i] is refs[i]
+ * @param n Number of inodes
+ * @return 0 if success
+ *         -x if error
+ */
+static int oufs_walk_inodes(OUFS_WALK *walk, INODE_REFERENCE *refs, INODE *inodes, int n)
+{
+  BLOCK_REFERENCE missing[N_INODE_BLOCKS];
+  int wanted[N_INODE_BLOCKS];
+  int n_missing = 0;
+  int ret = 0;
+
+  memset(wanted, 0, sizeof(wanted));
+  pthread_mutex_lock(&walk->inode_block_lock);
+  for(int i = 0; i < n && ret == 0; ++i) {
+    int b = refs[i] / N_INODES_PER_BLOCK;
+    if(b >= N_INODE_BLOCKS)
+      ret = -1;
+    else if(!walk->inode_block_loaded[b] && !wanted[b]) {
+      wanted[b] = 1;
+      missing[n_missing++] = b + 1;
+    }
+  }
+  if(ret == 0 && n_missing > 0) {
+    virtual_disk_prefetch_blocks(walk->mount->disk, missing, n_missing);
+    for(int i = 0; i < n_missing; ++i) {
+      int b = missing[i] - 1;
+      if(oufs_read_inode_block(walk->mount, b, &walk->inode_block[b]) != 0)
+        ret = -2;
+      else
+        walk->inode_block_loaded[b] = 1;
+    }
+  }
+  pthread_mutex_unlock(&walk->inode_block_lock);
+  if(ret != 0)
+    return(ret);
+
+  // (Loaded blocks do not change for the rest of the walk)
+  for(int i = 0; i < n; ++i)
+    inodes[i] = walk->inode_block[refs[i] / N_INODES_PER_BLOCK].content.inodes.inode[refs[i] % N_INODES_PER_BLOCK];
+  return(0);
+}
+
+/**
+ * Build the path of a directory entry
+ *
+ * @param path Filled in with the path (MAX_PATH_LENGTH bytes)
+ * @param dir Path of the directory
+ * @param name Name of the entry
+ * @return 0 if success
+ *         -1 if the path is too long
+ */
+static int oufs_walk_join(char *path, char *dir, char *name)
+{
+  size_t len = strlen(dir);
+  char *separator = (len > 0 && dir[len - 1] == '/') ? "" : "/";
+
+  if(len + strlen(separator) + strnlen(name, FILE_NAME_SIZE) >= MAX_PATH_LENGTH)
+    return(-1);
+  sprintf(path, "%s%s%.*s", dir, separator, FILE_NAME_SIZE, name);
+  return(0);
+}
+
+/**
+ * Report an entry that the walk has reached; a directory that is reached
+ *  for the first time is numbered and queued for the next level
+ *
+ * @param walk Walk
+ * @param entry Entry, with all but id and first filled in
+ */
+static void oufs_walk_reach(OUFS_WALK *walk, OUFS_WALK_ENTRY *entry)
+{
+  entry->id = -1;
+  entry->first = (__atomic_exchange_n(&walk->seen[entry->inode_reference], 1, __ATOMIC_RELAXED) == 0);
+
+  if(entry->inode.type == DIRECTORY_TYPE && entry->first) {
+    pthread_mutex_lock(&walk->next_lock);
+    entry->id = walk->next_id++;
+    OUFS_WALK_DIRECTORY *dir = &walk->next[walk->n_next++];
+    strcpy(dir->path, entry->path);
+    dir->content = entry->inode.content;
+    dir->size = entry->inode.size;
+    dir->depth = entry->depth;
+    dir->id = entry->id;
+    pthread_mutex_unlock(&walk->next_lock);
+  }
+  walk->visit(entry, walk->user);
+}
+
+/**
+ * Read one directory and report its entries
+ *
+ * @param walk Walk
+ * @param dir Directory
+ */
+static void oufs_walk_directory(OUFS_WALK *walk, OUFS_WALK_DIRECTORY *dir)
+{
+  int entry_index[N_DIRECTORY_ENTRIES_PER_BLOCK];
+  INODE_REFERENCE refs[N_DIRECTORY_ENTRIES_PER_BLOCK];
+  INODE inodes[N_DIRECTORY_ENTRIES_PER_BLOCK];
+  OUFS_WALK_ENTRY entry;
+  BLOCK block;
+  int n = 0;
+
+  if(virtual_disk_read_block(walk->mount->disk, dir->content, &block) != 0) {
+    oufs_walk_error(walk);
+    return;
+  }
+  for(int i = 0; i < dir->size && i < N_DIRECTORY_ENTRIES_PER_BLOCK; ++i) {
+    DIRECTORY_ENTRY *e = &block.content.directory.entry[i];
+    if(e->inode_reference == UNALLOCATED_INODE || strcmp(e->name, ".") == 0 || strcmp(e->name, "..") == 0)
+      continue;
+    entry_index[n] = i;
+    refs[n++] = e->inode_reference;
+  }
+  if(oufs_walk_inodes(walk, refs, inodes, n) != 0) {
+    oufs_walk_error(walk);
+    return;
+  }
+
+  for(int k = 0; k < n; ++k) {
+    if(oufs_walk_join(entry.path, dir->path, block.content.directory.entry[entry_index[k]].name) != 0) {
+      oufs_walk_error(walk);
+      continue;
+    }
+    entry.inode_reference = refs[k];
+    entry.inode = inodes[k];
+    entry.depth = dir->depth + 1;
+    entry.parent_id = dir->id;
+    oufs_walk_reach(walk, &entry);
+  }
+}
+
+/**
+ * Sort comparison for block references
+ */
+static int oufs_walk_compare(const void *a, const void *b)
+{
+  return((int) *(const BLOCK_REFERENCE *) a - (int) *(const BLOCK_REFERENCE *) b);
+}
+
+/**
+ * Move on to the next level: the directories that have been found become
+ *  the ones to read, and their blocks are prefetched (in disk order)
+ *
+ * @param walk Walk (no thread is reading directories)
+ */
+static void oufs_walk_next_level(OUFS_WALK *walk)
+{
+  BLOCK_REFERENCE refs[N_INODES];
+  OUFS_WALK_DIRECTORY *done = walk->level;
+
+  walk->level = walk->next;
+  walk->n_level = walk->n_next;
+  walk->next_index = 0;
+  walk->next = done;
+  walk->n_next = 0;
+
+  for(int i = 0; i < walk->n_level; ++i)
+    refs[i] = walk->level[i].content;
+  qsort(refs, walk->n_level, sizeof(BLOCK_REFERENCE), oufs_walk_compare);
+  if(walk->n_level > 0)
+    virtual_disk_prefetch_blocks(walk->mount->disk, refs, walk->n_level);
+}
+
+/**
+ * Body of each thread of a walk: read directories, level by level, until a
+ *  level finds no more of them
+ *
+ * @param arg The walk
+ * @return NULL
+ */
+static void *oufs_walk_work(void *arg)
+{
+  OUFS_WALK *walk = arg;
+
+  // Wait until the barrier has been set up for the threads that started
+  pthread_mutex_lock(&walk->next_lock);
+  pthread_mutex_unlock(&walk->next_lock);
+
+  while(1) {
+    int i;
+    while((i = __atomic_fetch_add(&walk->next_index, 1, __ATOMIC_RELAXED)) < walk->n_level)
+      oufs_walk_directory(walk, &walk->level[i]);
+
+    // The level is done: one thread sets up the next one
+    if(pthread_barrier_wait(&walk->barrier) == PTHREAD_BARRIER_SERIAL_THREAD)
+      oufs_walk_next_level(walk);
+    pthread_barrier_wait(&walk->barrier);
+    if(walk->n_level == 0)
+      return(NULL);
+  }
+}
+
+/**
+ * Walk a tree breadth first, calling a function for every file and
+ *  directory in it (the starting point included).  The tree is not locked:
+ *  changes made during the walk may or may not be seen.
+ *
+ * @param mnt Mount of the virtual disk
+ * @param cwd Absolute path for the current working directory
+ * @param path Absolute or relative path of the starting point
+ * @param n_threads Number of threads, including the calling one (<= 0:
+ *          one per online processor)
+ * @param visit Function to call for each entry (on any of the threads)
+ * @param user Passed to visit
+ * @return 0 if success
+ *         -x if error (entries that could be read are still visited)
+ */
+int oufs_walk(OUFS_MOUNT *mnt, char *cwd, char *path, int n_threads,
+              OUFS_WALK_FUNCTION visit, void *user)
+{
+  INODE_REFERENCE parent;
+  INODE_REFERENCE child;
+  char local_name[MAX_PATH_LENGTH];
+  OUFS_WALK_ENTRY entry;
+
+  int ret = oufs_find_file(mnt, cwd, path, &parent, &child, local_name);
+  if(ret < -1)
+    return(-4);
+  if(ret == -1 || child == UNALLOCATED_INODE) {
+    fprintf(stderr, "File not found\n");
+    return(-1);
+  }
+  if(strlen(path) >= MAX_PATH_LENGTH)
+    return(-4);
+  if(n_threads <= 0)
+    n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if(n_threads <= 0)
+    n_threads = 1;
+
+  OUFS_WALK *walk = malloc(sizeof(OUFS_WALK));
+  OUFS_WALK_DIRECTORY *dirs = malloc(2 * N_INODES * sizeof(OUFS_WALK_DIRECTORY));
+  pthread_t *threads = malloc(n_threads * sizeof(pthread_t));
+  if(walk == NULL || dirs == NULL || threads == NULL) {
+    free(walk);
+    free(dirs);
+    free(threads);
+    return(-5);
+  }
+  walk->mount = mnt;
+  walk->visit = visit;
+  walk->user = user;
+  pthread_mutex_init(&walk->inode_block_lock, NULL);
+  memset(walk->inode_block_loaded, 0, sizeof(walk->inode_block_loaded));
+  memset(walk->seen, 0, sizeof(walk->seen));
+  walk->level = dirs;
+  walk->n_level = 0;
+  walk->next_index = 0;
+  walk->next = dirs + N_INODES;
+  walk->n_next = 0;
+  pthread_mutex_init(&walk->next_lock, NULL);
+  walk->next_id = 0;
+  walk->n_errors = 0;
+
+  // The starting point
+  if(oufs_walk_inodes(walk, &child, &entry.inode, 1) != 0) {
+    ret = -4;
+  }else{
+    strcpy(entry.path, path);
+    entry.inode_reference = child;
+    entry.depth = 0;
+    entry.parent_id = -1;
+    oufs_walk_reach(walk, &entry);
+    oufs_walk_next_level(walk);
+
+    // The calling thread takes part; threads that fail to start do not
+    pthread_mutex_lock(&walk->next_lock);
+    int n_started = 0;
+    for(int i = 1; i < n_threads; ++i) {
+      if(pthread_create(&threads[n_started], NULL, oufs_walk_work, walk) == 0)
+        ++n_started;
+    }
+    pthread_barrier_init(&walk->barrier, NULL, n_started + 1);
+    pthread_mutex_unlock(&walk->next_lock);
+    oufs_walk_work(walk);
+    for(int i = 0; i < n_started; ++i)
+      pthread_join(threads[i], NULL);
+    pthread_barrier_destroy(&walk->barrier);
+    ret = (walk->n_errors == 0) ? 0 : -5;
+  }
+
+  pthread_mutex_destroy(&walk->next_lock);
+  pthread_mutex_destroy(&walk->inode_block_lock);
+  free(threads);
+  free(dirs);
+  free(walk);
+  return(ret);
+}
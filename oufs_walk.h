@@ -0,0 +1,76 @@
+#ifndef OUFS_WALK_H
+#define OUFS_WALK_H
+
+#include <pthread.h>
+#include "oufs_lib.h"
+
+// One file or directory reached by a walk (see oufs_walk())
+typedef struct
+{
+  // Path from the starting point (which is given as the caller named it)
+  char path[MAX_PATH_LENGTH];
+  INODE_REFERENCE inode_reference;
+  INODE inode;
+
+  // 0 for the starting point, 1 for its entries, ...
+  int depth;
+
+  // Directories are numbered in the order in which the walk reaches them
+  //  (breadth first: a directory always has a higher id than the one that
+  //  holds it).  id is -1 for files; parent_id is -1 for the starting point
+  int id;
+  int parent_id;
+
+  // 1 the first time the walk reaches this inode; 0 for its other names
+  int first;
+} OUFS_WALK_ENTRY;
+
+// Called for every entry, on any of the walk's threads (possibly several
+//  at once)
+typedef void (*OUFS_WALK_FUNCTION)(OUFS_WALK_ENTRY *entry, void *user);
+
+// A directory that the walk has yet to read
+typedef struct
+{
+  char path[MAX_PATH_LENGTH];
+  BLOCK_REFERENCE content;
+  int size;
+  int depth;
+  int id;
+} OUFS_WALK_DIRECTORY;
+
+// State of a walk.  Each inode block is read at most once, the first time
+//  that one of its inodes is needed, and each directory block once: the
+//  walk sees every inode as it was when its block was read
+typedef struct
+{
+  OUFS_MOUNT *mount;
+  OUFS_WALK_FUNCTION visit;
+  void *user;
+
+  pthread_mutex_t inode_block_lock;
+  int inode_block_loaded[N_INODE_BLOCKS];
+  BLOCK inode_block[N_INODE_BLOCKS];
+
+  // Inodes reached so far
+  unsigned char seen[N_INODES];
+
+  // The directories of the current level (taken in turn by the threads,
+  //  through next_index) and those found for the next one.  A directory
+  //  is reached only once, so neither can hold more than N_INODES
+  OUFS_WALK_DIRECTORY *level;
+  int n_level;
+  int next_index;
+  OUFS_WALK_DIRECTORY *next;
+  int n_next;
+  pthread_mutex_t next_lock;
+  int next_id;
+
+  pthread_barrier_t barrier;
+  int n_errors;
+} OUFS_WALK;
+
+int oufs_walk(OUFS_MOUNT *mnt, char *cwd, char *path, int n_threads,
+              OUFS_WALK_FUNCTION visit, void *user);
+
+#endif
@@ -31,6 +31,14 @@ STORAGE * init_storage(char * name, char *pipe_name_base)
   // Allocate the STORAGE object and populate it
   STORAGE *s = malloc(sizeof(STORAGE));
   s->fd = fd;
+  s->map = NULL;
+  s->map_len = 0;
+  s->n_pins = 0;
+  pthread_mutex_init(&s->map_lock, NULL);
+  s->counter = NULL;
+  s->counter_map = NULL;
+  s->counter_map_len = 0;
+  s->cache = NULL;
 
   // Success
   return s;
@@ -46,6 +54,15 @@ STORAGE * init_storage(char * name, char *pipe_name_base)
  */
 int close_storage(STORAGE *storage)
 {
+  // Drop the mapping (any pointers into it are no longer valid)
+  if(storage->n_pins > 0)
+    fprintf(stderr, "close_storage(): %d mapped ranges still in use\n", storage->n_pins);
+  if(storage->map != NULL)
+    munmap(storage->map, storage->map_len);
+  pthread_mutex_destroy(&storage->map_lock);
+  if(storage->counter_map != NULL)
+    munmap(storage->counter_map, storage->counter_map_len);
+
   // Close the storage file
   int ret = close(storage->fd);
 
@@ -72,19 +89,12 @@ int close_storage(STORAGE *storage)
  * @return -1 if an error; 
  *         otherwise, the number of bytes read from the storage file
  */
-int get_bytes(STORAGE *storage, unsigned char *buf, int location, int len)
+int get_bytes(STORAGE *storage, unsigned char *buf, off_t location, int len)
 {
-  // Seek to the starting location
-  int ret = lseek(storage->fd, location, SEEK_SET);
-
-  // Was there an error?
-  if(ret < 0) {
-    fprintf(stderr, "Unable to seek\n");
-    return(-1);
-  };
-
-  // Read the bytes
-  if((ret = read(storage->fd, buf, len)) < 0){
+  // Positional read: the shared file position is not used, so any number of
+  //  threads may read (and write) at once
+  int ret;
+  if((ret = pread(storage->fd, buf, len, location)) < 0){
     // There was a reading error
     fprintf(stderr, "Error reading fd\n");
     return(-1);
@@ -104,19 +114,11 @@ int get_bytes(STORAGE *storage, unsigned char *buf, int location, int len)
  * @return -1 if an error; 
  *         otherwise, the number of bytes written to the storage file
  */
-int put_bytes(STORAGE *storage, unsigned char *buf, int location, int len)
+int put_bytes(STORAGE *storage, unsigned char *buf, off_t location, int len)
 {
-  // Seek to the point in the file
-  int ret = lseek(storage->fd, location, SEEK_SET);
-
-  // Was there an error?
-  if(ret < 0) {
-    fprintf(stderr, "Unable to seek\n");
-    return(-1);
-  };
-
-  // Write te  bytes to the  file
-  if((ret = write(storage->fd, buf, len)) < 0){
+  // Write the bytes to the file at the location
+  int ret;
+  if((ret = pwrite(storage->fd, buf, len, location)) < 0){
     // There was an error
     fprintf(stderr, "Error reading fd\n");
     return(-1);
@@ -126,3 +128,136 @@ int put_bytes(STORAGE *storage, unsigned char *buf, int location, int len)
   return(ret);
 };
 
+/**
+ *  Hint that a set of bytes will be read soon.  The backend may start
+ *  loading them in the background; the call itself does not wait for I/O.
+ *
+ * @param storage A pointer to an initialized storage object
+ * @param location The point in the file where the bytes start
+ * @param len The number of bytes
+ * @return -1 if an error; 0 on success (including if hints are not
+ *         supported by the backend)
+ */
+int prefetch_bytes(STORAGE *storage, off_t location, int len)
+{
+#ifdef POSIX_FADV_WILLNEED
+  // Asynchronous read-ahead by the kernel
+  if(posix_fadvise(storage->fd, location, len, POSIX_FADV_WILLNEED) != 0) {
+    return(-1);
+  }
+#endif
+  return(0);
+}
+
+/**
+ *  Make sure that the mapping covers a range of the storage file (the
+ *  caller holds map_lock)
+ *
+ * @param storage A pointer to an initialized storage object
+ * @param location The point in the file where the bytes start
+ * @param len The number of bytes
+ * @return -1 if the range cannot be mapped; 0 on success
+ */
+static int map_range(STORAGE *storage, off_t location, int len)
+{
+  if(storage->map != NULL && (size_t)(location + len) <= storage->map_len)
+    return(0);
+
+  // (Re)map: only possible while nobody holds a pointer into the old map
+  if(storage->n_pins > 0)
+    return(-1);
+
+  struct stat st;
+  if(fstat(storage->fd, &st) != 0 || st.st_size < location + len || st.st_size == 0)
+    return(-1);
+  if(storage->map != NULL)
+    munmap(storage->map, storage->map_len);
+  storage->map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, storage->fd, 0);
+  if(storage->map == MAP_FAILED) {
+    storage->map = NULL;
+    storage->map_len = 0;
+    return(-1);
+  }
+  storage->map_len = st.st_size;
+  return(0);
+}
+
+/**
+ *  Get direct, read-only access to a set of bytes of the storage file.
+ *  The whole file is mapped into memory on first use; bytes written later
+ *  with put_bytes() are visible through the mapping.  Each successful call
+ *  pins the mapping until a matching call to unmap_bytes().
+ *
+ * @param storage A pointer to an initialized storage object
+ * @param location The point in the file where the bytes start
+ * @param len The number of bytes
+ * @return A pointer to the bytes; NULL if the range is not in the file or
+ *         the file cannot be mapped (use get_bytes() instead)
+ */
+const unsigned char *map_bytes(STORAGE *storage, off_t location, int len)
+{
+  if(location < 0 || len < 0)
+    return(NULL);
+
+  const unsigned char *ret = NULL;
+  pthread_mutex_lock(&storage->map_lock);
+  if(map_range(storage, location, len) == 0) {
+    ++storage->n_pins;
+    ret = storage->map + location;
+  }
+  pthread_mutex_unlock(&storage->map_lock);
+  return(ret);
+}
+
+/**
+ *  Release a pointer returned by map_bytes().
+ *
+ * @param storage A pointer to an initialized storage object
+ * @return -1 if nothing is pinned; 0 on success
+ */
+int unmap_bytes(STORAGE *storage)
+{
+  int ret = -1;
+  pthread_mutex_lock(&storage->map_lock);
+  if(storage->n_pins > 0) {
+    --storage->n_pins;
+    ret = 0;
+  }
+  pthread_mutex_unlock(&storage->map_lock);
+  return(ret);
+}
+
+/**
+ *  Map an 8-byte counter that is kept in the storage file, so that it can
+ *  be updated atomically in place.  The file is grown to hold it if it is
+ *  too short.  Every process that maps the same counter sees the updates
+ *  of the others.
+ *
+ * @param storage A pointer to an initialized storage object
+ * @param location The point in the file where the counter is (a multiple
+ *          of 8, past the bytes that are read and written)
+ * @return A pointer to the counter (also kept in storage->counter); NULL
+ *         if it cannot be mapped
+ */
+uint64_t *map_counter(STORAGE *storage, off_t location)
+{
+  struct stat st;
+  if(fstat(storage->fd, &st) != 0)
+    return(NULL);
+  // (Growing the file only ever adds zeros past its end, so processes that
+  //  do this at the same time agree)
+  if(st.st_size < location + (off_t) sizeof(uint64_t) &&
+     ftruncate(storage->fd, location + sizeof(uint64_t)) != 0)
+    return(NULL);
+
+  // Mappings start on a page boundary
+  off_t start = location - location % sysconf(_SC_PAGESIZE);
+  size_t len = location - start + sizeof(uint64_t);
+  unsigned char *map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, storage->fd, start);
+  if(map == MAP_FAILED)
+    return(NULL);
+  storage->counter_map = map;
+  storage->counter_map_len = len;
+  storage->counter = (uint64_t *) (map + (location - start));
+  return(storage->counter);
+}
@@ -1,18 +1,49 @@
+#ifndef STORAGE_H
+#define STORAGE_H
+
 #include <sys/types.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
 
 typedef struct 
 {
   int fd;
+
+  // Read-only mapping of the whole file (created on first use by
+  //  map_bytes()); NULL if there is none
+  unsigned char *map;
+  size_t map_len;
+  // Number of map_bytes() pointers still in use: the mapping is not
+  //  replaced or removed while this is not zero
+  int n_pins;
+  // Protects map, map_len and n_pins (reads and writes need no lock: they
+  //  do not use the file position)
+  pthread_mutex_t map_lock;
+
+  // Counter kept in the file itself (see map_counter()); NULL if there is
+  //  none
+  uint64_t *counter;
+  unsigned char *counter_map;
+  size_t counter_map_len;
+
+  // Block cache of the disk (owned by virtual_disk.c); NULL if there is none
+  struct block_cache *cache;
 } STORAGE;
 
 
 STORAGE * init_storage(char * name, char *pipe_name_base);
 int close_storage(STORAGE *storage);
-int get_bytes(STORAGE *storage, unsigned char *buf, int location, int len);
-int put_bytes(STORAGE *storage, unsigned char *buf, int location, int len);
+int get_bytes(STORAGE *storage, unsigned char *buf, off_t location, int len);
+int put_bytes(STORAGE *storage, unsigned char *buf, off_t location, int len);
+int prefetch_bytes(STORAGE *storage, off_t location, int len);
+const unsigned char *map_bytes(STORAGE *storage, off_t location, int len);
+int unmap_bytes(STORAGE *storage);
+uint64_t *map_counter(STORAGE *storage, off_t location);
 
+#endif
@@ -8,92 +8,166 @@
  */
 
 
+#include <string.h>
 #include "oufs.h"
 #include "storage.h"
+#include "block_cache.h"
 #include "virtual_disk.h"
 
-// Yes, another global variable: this is how we achieve persistence in 
-//  this case.
-STORAGE *storage = NULL;
-
 /**
  *  Atttach to the specified virtual disk
  *
  *  @param virtual_disk_name Name of the virtual disk to open
  *  @param pipe_name_base  Base name of the input and outputs
  *    NOTE: NOT USED IN THIS IMPLEMENTATION
- *  @return 0 if success; -1 with an error
+ *  @return The storage object through which the disk is accessed;
+ *          NULL with an error
  */
-int virtual_disk_attach(char *virtual_disk_name, char *pipe_name_base)
+STORAGE *virtual_disk_attach(char *virtual_disk_name, char *pipe_name_base)
 {
   // Initialize the general storage system
-  storage = init_storage(virtual_disk_name, pipe_name_base);
+  STORAGE *storage = init_storage(virtual_disk_name, pipe_name_base);
+  if(storage == NULL)
+    return(NULL);
 
-  // Parse result
-  if(storage == NULL) 
-    return(-1);
-  else {
-    // Success
-    return(0);
-  }
+  // The count of block writes made by every process lives just past the
+  //  last block, where caches can check it (see block_cache.h)
+  if(map_counter(storage, (off_t) N_BLOCKS * BLOCK_SIZE) == NULL)
+    fprintf(stderr, "virtual_disk_attach(): writes by other processes will not be seen by the cache\n");
+
+  // Blocks are cached from here on (without a cache, all reads go to the
+  //  storage file).  With OUFS_SHARED_CACHE set, the cache is shared with
+  //  the other processes that use the disk, so it starts out warm
+  char *shared = getenv(BLOCK_CACHE_SHARED_ENV);
+  if(shared != NULL && shared[0] != 0 && strcmp(shared, "0") != 0)
+    storage->cache = block_cache_attach_shared(virtual_disk_name);
+  if(storage->cache == NULL)
+    storage->cache = block_cache_create();
+  return(storage);
 }
 
 /**
  *  Detach from the specified vitual disk.
  *
+ * @param storage Storage object returned by virtual_disk_attach()
  * @return Status after closing the connection to the server
  * @return 0 if closed succesfully; -1  if an error
  */
-int virtual_disk_detach()
+int virtual_disk_detach(STORAGE *storage)
 {
   if(storage == NULL)
     return(-1);
-  int ret = close_storage(storage);
+  if(storage->cache != NULL && storage->cache->shared)
+    block_cache_detach_shared(storage->cache);
+  else
+    block_cache_destroy(storage->cache);
+  return(close_storage(storage));
+}
 
-  storage = NULL;
-  return(ret);
+/**
+ *  Remove the cache that processes share for a virtual disk, if there is
+ *  one (when the disk is made anew, for instance)
+ *
+ * @param virtual_disk_name Name of the virtual disk
+ * @return -1 if an error has occurred; 0 if successful
+ */
+int virtual_disk_remove_shared_cache(char *virtual_disk_name)
+{
+  return(block_cache_remove_shared(virtual_disk_name));
+}
+
+/**
+ *  Count a write to the storage file (successful or not: either way, the
+ *  file may have changed), so that the caches of other processes notice it
+ *
+ * @param storage Storage object of the disk
+ */
+static void virtual_disk_count_write(STORAGE *storage)
+{
+  if(storage->cache != NULL)
+    block_cache_count_write(storage->cache, storage->counter);
+  else if(storage->counter != NULL)
+    __atomic_add_fetch(storage->counter, 1, __ATOMIC_ACQ_REL);
 }
 
 /**
  *  Read the specified block from the storage file
+ *  - Through the block cache, the block is read whole: never partly from
+ *      before and partly from after a virtual_disk_write_block() of it that
+ *      runs at the same time, so callers need no lock of their own
  *
+ * @param storage Storage object of the disk
  * @param block_ref Integer index of the block to read
  * @param block Buffer in which to store the read block
  * @return -1 if an error has occurred; 0 if successful
  */
 
-int virtual_disk_read_block(BLOCK_REFERENCE block_ref, void *block)
+int virtual_disk_read_block(STORAGE *storage, BLOCK_REFERENCE block_ref, void *block)
 {
   if(block_ref >= N_BLOCKS) {
     // Improper ref
     return(-1);
   };
 
-  // Read the bytes
-  int ret = get_bytes(storage, block, block_ref * BLOCK_SIZE, BLOCK_SIZE);
-  if(ret > 0)
-    // Success
+  if(storage->cache == NULL) {
+    // Read the bytes
+    int ret = get_bytes(storage, block, (off_t) block_ref * BLOCK_SIZE, BLOCK_SIZE);
+    return(ret > 0 ? 0 : -1);
+  }
+
+  // Clean hit: no lock at all
+  block_cache_check(storage->cache, storage->counter);
+  if(block_cache_read(storage->cache, block_ref, block) == 0)
     return(0);
-  else
-    // Error
-    return(-1);
+
+  // Miss (or the block is being written): load it under the slot lock,
+  //  unless another thread has done so in the meantime
+  int ret = 0;
+  block_cache_lock(storage->cache, block_ref);
+  if(block_cache_get_locked(storage->cache, block_ref, block) != 0) {
+    uint64_t generation = block_cache_generation(storage->cache);
+    int n = get_bytes(storage, block, (off_t) block_ref * BLOCK_SIZE, BLOCK_SIZE);
+    if(n == BLOCK_SIZE)
+      block_cache_put_locked(storage->cache, block_ref, block, generation);
+    else if(n <= 0)
+      // Error
+      ret = -1;
+    // (A short read is not cached: the disk may not be formatted yet)
+  }
+  block_cache_unlock(storage->cache, block_ref);
+  return(ret);
 }
 /**
  * Write the specified block to the storage file
  *
+ * @param storage Storage object of the disk
  * @param block_ref Integer index of the block to write
  * @param block Buffer containing the block to write
  * @return -1 if an error has occurred; 0 if successful
  */
 
-int virtual_disk_write_block(BLOCK_REFERENCE block_ref, void *block)
+int virtual_disk_write_block(STORAGE *storage, BLOCK_REFERENCE block_ref, void *block)
 {
   if(block_ref >= N_BLOCKS) {
     return(-1);
   };
 
-  // Write the bytes
-  int ret = put_bytes(storage, block, block_ref * BLOCK_SIZE, BLOCK_SIZE);
+  // Write the bytes (through the cache: the storage file is always up to
+  //  date)
+  uint64_t generation = 0;
+  if(storage->cache != NULL) {
+    block_cache_lock(storage->cache, block_ref);
+    generation = block_cache_generation(storage->cache);
+  }
+  int ret = put_bytes(storage, block, (off_t) block_ref * BLOCK_SIZE, BLOCK_SIZE);
+  virtual_disk_count_write(storage);
+  if(storage->cache != NULL) {
+    if(ret == BLOCK_SIZE)
+      block_cache_put_locked(storage->cache, block_ref, block, generation);
+    else
+      block_cache_invalidate_locked(storage->cache, block_ref);
+    block_cache_unlock(storage->cache, block_ref);
+  }
   
   if(ret > 0)
     // SUccess
@@ -103,3 +177,147 @@ int virtual_disk_write_block(BLOCK_REFERENCE block_ref, void *block)
     return(-1);
 
 }
+
+/**
+ * Length of the run of consecutive block references at the start of an array
+ *
+ * @param block_refs Array of block references
+ * @param n Number of references in the array
+ * @return The number of references r[0], r[0]+1, r[0]+2, ... (at least 1)
+ */
+static int virtual_disk_run_length(BLOCK_REFERENCE *block_refs, int n)
+{
+  int run = 1;
+  while(run < n && block_refs[run] == block_refs[0] + run)
+    ++run;
+  return(run);
+}
+
+/**
+ * Read a set of blocks from the storage file.  Runs of consecutive block
+ *  references are read with a single request.  (This is the bulk path for
+ *  file contents: it does not go through the block cache, which is write-
+ *  through, so the storage file is never behind it.)
+ *
+ * @param storage Storage object of the disk
+ * @param block_refs Array of n block references
+ * @param n Number of blocks to read
+ * @param blocks Buffer of n * BLOCK_SIZE bytes; block i is placed at
+ *          offset i * BLOCK_SIZE
+ * @return -1 if an error has occurred; 0 if successful
+ */
+int virtual_disk_read_blocks(STORAGE *storage, BLOCK_REFERENCE *block_refs, int n, void *blocks)
+{
+  unsigned char *buf = blocks;
+
+  for(int i = 0; i < n; ) {
+    int run = virtual_disk_run_length(&block_refs[i], n - i);
+    if(block_refs[i] + run > N_BLOCKS) {
+      // Improper ref
+      return(-1);
+    }
+    if(get_bytes(storage, buf + i * BLOCK_SIZE, (off_t) block_refs[i] * BLOCK_SIZE,
+                 run * BLOCK_SIZE) <= 0) {
+      return(-1);
+    }
+    i += run;
+  }
+  // Success
+  return(0);
+}
+
+/**
+ * Write a set of blocks to the storage file.  Runs of consecutive block
+ *  references are written with a single request.
+ *
+ * @param storage Storage object of the disk
+ * @param block_refs Array of n block references
+ * @param n Number of blocks to write
+ * @param blocks Buffer of n * BLOCK_SIZE bytes; block i is taken from
+ *          offset i * BLOCK_SIZE
+ * @return -1 if an error has occurred; 0 if successful
+ */
+int virtual_disk_write_blocks(STORAGE *storage, BLOCK_REFERENCE *block_refs, int n, void *blocks)
+{
+  unsigned char *buf = blocks;
+
+  for(int i = 0; i < n; ) {
+    int run = virtual_disk_run_length(&block_refs[i], n - i);
+    if(block_refs[i] + run > N_BLOCKS) {
+      return(-1);
+    }
+    // Through the cache, as in virtual_disk_write_block() (the slots of a
+    //  run are locked in increasing order)
+    uint64_t generation = 0;
+    if(storage->cache != NULL) {
+      for(int j = 0; j < run; ++j)
+        block_cache_lock(storage->cache, block_refs[i] + j);
+      generation = block_cache_generation(storage->cache);
+    }
+    int ret = put_bytes(storage, buf + i * BLOCK_SIZE, (off_t) block_refs[i] * BLOCK_SIZE,
+                        run * BLOCK_SIZE);
+    virtual_disk_count_write(storage);
+    if(storage->cache != NULL) {
+      for(int j = 0; j < run; ++j) {
+        if(ret == run * BLOCK_SIZE)
+          block_cache_put_locked(storage->cache, block_refs[i] + j, buf + (i + j) * BLOCK_SIZE,
+                                 generation);
+        else
+          block_cache_invalidate_locked(storage->cache, block_refs[i] + j);
+        block_cache_unlock(storage->cache, block_refs[i] + j);
+      }
+    }
+    if(ret <= 0) {
+      return(-1);
+    }
+    i += run;
+  }
+  // Success
+  return(0);
+}
+
+/**
+ * Tell the storage backend that a set of blocks is about to be read, so that
+ *  it can begin loading them asynchronously.
+ *
+ * @param storage Storage object of the disk
+ * @param block_refs Array of n block references
+ * @param n Number of blocks
+ * @return -1 if an error has occurred; 0 if successful
+ */
+int virtual_disk_prefetch_blocks(STORAGE *storage, BLOCK_REFERENCE *block_refs, int n)
+{
+  for(int i = 0; i < n; ) {
+    int run = virtual_disk_run_length(&block_refs[i], n - i);
+    if(prefetch_bytes(storage, (off_t) block_refs[i] * BLOCK_SIZE, run * BLOCK_SIZE) != 0) {
+      return(-1);
+    }
+    i += run;
+  }
+  return(0);
+}
+
+/**
+ * Get direct, read-only access to all of the blocks of the disk, if the
+ *  storage backend supports it.  The blocks stay accessible (and reflect
+ *  later writes) until the matching call to virtual_disk_unmap().
+ *
+ * @param storage Storage object of the disk
+ * @return Pointer to block 0 (block i is at index i); NULL if the disk
+ *         cannot be mapped
+ */
+const BLOCK *virtual_disk_map(STORAGE *storage)
+{
+  return((const BLOCK *) map_bytes(storage, 0, N_BLOCKS * BLOCK_SIZE));
+}
+
+/**
+ * Release the access granted by virtual_disk_map()
+ *
+ * @param storage Storage object of the disk
+ * @return -1 if an error has occurred; 0 if successful
+ */
+int virtual_disk_unmap(STORAGE *storage)
+{
+  return(unmap_bytes(storage));
+}
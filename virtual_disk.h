@@ -1,4 +1,5 @@
 #ifndef VDISK_H
+#define VDISK_H
 
 #include <sys/types.h>
 #include <unistd.h>
@@ -7,10 +8,17 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include "oufs.h"
+#include "storage.h"
 
-int virtual_disk_attach(char *virtual_disk_name, char *pipe_name_base);
-int virtual_disk_detach();
-int virtual_disk_read_block(BLOCK_REFERENCE block_ref, void *block);
-int virtual_disk_write_block(BLOCK_REFERENCE block_ref, void *block);
+STORAGE *virtual_disk_attach(char *virtual_disk_name, char *pipe_name_base);
+int virtual_disk_detach(STORAGE *storage);
+int virtual_disk_remove_shared_cache(char *virtual_disk_name);
+int virtual_disk_read_block(STORAGE *storage, BLOCK_REFERENCE block_ref, void *block);
+int virtual_disk_write_block(STORAGE *storage, BLOCK_REFERENCE block_ref, void *block);
+int virtual_disk_read_blocks(STORAGE *storage, BLOCK_REFERENCE *block_refs, int n, void *blocks);
+int virtual_disk_write_blocks(STORAGE *storage, BLOCK_REFERENCE *block_refs, int n, void *blocks);
+int virtual_disk_prefetch_blocks(STORAGE *storage, BLOCK_REFERENCE *block_refs, int n);
+const BLOCK *virtual_disk_map(STORAGE *storage);
+int virtual_disk_unmap(STORAGE *storage);
 
 #endif